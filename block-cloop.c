@@ -23,7 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block_int.h"
-#include <zlib.h>
+#include "chunk-cache.h"
 
 typedef struct BDRVCloopState {
     int fd;
@@ -31,10 +31,7 @@ typedef struct BDRVCloopState {
     uint32_t n_blocks;
     uint64_t* offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVCloopState;
 
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -50,6 +47,19 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+static int cloop_decode(void *opaque, ChunkContext *ctx, uint32_t block_num,
+                        uint8_t *buf)
+{
+    BDRVCloopState *s = opaque;
+    uint32_t bytes = s->offsets[block_num+1]-s->offsets[block_num];
+    const uint8_t *src;
+
+    src = chunk_cache_source(ctx, s->offsets[block_num], bytes);
+    if(!src)
+	return -1;
+    return chunk_cache_inflate(ctx, src, bytes, buf, s->block_size);
+}
+
 static int cloop_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCloopState *s = bs->opaque;
@@ -73,13 +83,13 @@ cloop_close:
 	goto cloop_close;
     s->n_blocks=be32_to_cpu(s->n_blocks);
 
-    /* read offsets */
-    offsets_size=s->n_blocks*sizeof(uint64_t);
+    /* read offsets, the last one marks the end of the last block */
+    offsets_size=(s->n_blocks+1)*sizeof(uint64_t);
     if(!(s->offsets=(uint64_t*)malloc(offsets_size)))
 	goto cloop_close;
     if(read(s->fd,s->offsets,offsets_size)<offsets_size)
 	goto cloop_close;
-    for(i=0;i<s->n_blocks;i++) {
+    for(i=0;i<=s->n_blocks;i++) {
 	s->offsets[i]=be64_to_cpu(s->offsets[i]);
 	if(i>0) {
 	    uint32_t size=s->offsets[i]-s->offsets[i-1];
@@ -88,45 +98,14 @@ cloop_close:
 	}
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = qemu_malloc(max_compressed_block_size+1);
-    s->uncompressed_block = qemu_malloc(s->block_size);
-    if(inflateInit(&s->zstream) != Z_OK)
-	goto cloop_close;
-    s->current_block=s->n_blocks;
+    s->cache = chunk_cache_new(s->fd, s->n_blocks, s->block_size,
+                               max_compressed_block_size, cloop_decode, s);
 
     s->sectors_per_block = s->block_size/512;
     bs->total_sectors = s->n_blocks*s->sectors_per_block;
     return 0;
 }
 
-static inline int cloop_read_block(BDRVCloopState *s,int block_num)
-{
-    if(s->current_block != block_num) {
-	int ret;
-        uint32_t bytes = s->offsets[block_num+1]-s->offsets[block_num];
-
-	lseek(s->fd, s->offsets[block_num], SEEK_SET);
-        ret = qemu_read_ok(s->fd, s->compressed_block, bytes);
-        if (ret < 0)
-            return -1;
-
-	s->zstream.next_in = s->compressed_block;
-	s->zstream.avail_in = bytes;
-	s->zstream.next_out = s->uncompressed_block;
-	s->zstream.avail_out = s->block_size;
-	ret = inflateReset(&s->zstream);
-	if(ret != Z_OK)
-	    return -1;
-	ret = inflate(&s->zstream, Z_FINISH);
-	if(ret != Z_STREAM_END || s->zstream.total_out != s->block_size)
-	    return -1;
-
-	s->current_block = block_num;
-    }
-    return 0;
-}
-
 static int cloop_read(BlockDriverState *bs, int64_t sector_num,
                     uint8_t *buf, int nb_sectors)
 {
@@ -136,22 +115,26 @@ static int cloop_read(BlockDriverState *bs, int64_t sector_num,
     for(i=0;i<nb_sectors;i++) {
 	uint32_t sector_offset_in_block=((sector_num+i)%s->sectors_per_block),
 	    block_num=(sector_num+i)/s->sectors_per_block;
-	if(cloop_read_block(s, block_num) != 0)
+	const uint8_t *block = chunk_cache_get(s->cache, block_num);
+	if(!block)
 	    return -1;
-	memcpy(buf+i*512,s->uncompressed_block+sector_offset_in_block*512,512);
+	memcpy(buf+i*512,block+sector_offset_in_block*512,512);
     }
     return 0;
 }
 
+static int cloop_set_chunk_cache(BlockDriverState *bs, int size_kb)
+{
+    BDRVCloopState *s = bs->opaque;
+    return chunk_cache_resize(s->cache, size_kb);
+}
+
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
+    chunk_cache_delete(s->cache);
     close(s->fd);
-    if(s->n_blocks>0)
-	free(s->offsets);
-    free(s->compressed_block);
-    free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
+    free(s->offsets);
 }
 
 BlockDriver bdrv_cloop = {
@@ -162,4 +145,5 @@ BlockDriver bdrv_cloop = {
     cloop_read,
     NULL,
     cloop_close,
+    .bdrv_set_chunk_cache = cloop_set_chunk_cache,
 };
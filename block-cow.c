@@ -165,7 +165,7 @@ static int cow_read(BlockDriverState *bs, int64_t sector_num,
         } else {
             if (bs->backing_hd) {
                 /* read from the base image */
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                ret = bdrv_read_chain(bs->backing_hd, sector_num, buf, n);
                 if (ret < 0)
                     return -1;
             } else {
@@ -265,5 +265,6 @@ BlockDriver bdrv_cow = {
     cow_create,
     cow_flush,
     cow_is_allocated,
+    .bdrv_flags = BLOCK_DRIVER_FLAG_BACKING,
 };
 #endif
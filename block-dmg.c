@@ -24,7 +24,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "bswap.h"
-#include <zlib.h>
+#include "chunk-cache.h"
 
 typedef struct BDRVDMGState {
     int fd;
@@ -44,9 +44,7 @@ typedef struct BDRVDMGState {
     uint64_t* sectors;
     uint64_t* sectorcounts;
     uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -73,6 +71,32 @@ static off_t read_uint32(int fd)
 	return be32_to_cpu(buffer);
 }
 
+static int dmg_decode(void *opaque, ChunkContext *ctx, uint32_t chunk,
+                      uint8_t *buf)
+{
+    BDRVDMGState *s = opaque;
+    const uint8_t *src;
+
+    switch(s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+	src = chunk_cache_source(ctx, s->offsets[chunk], s->lengths[chunk]);
+	if(!src)
+	    return -1;
+	return chunk_cache_inflate(ctx, src, s->lengths[chunk], buf,
+				   512*s->sectorcounts[chunk]);
+    case 1: /* copy */
+	src = chunk_cache_source(ctx, s->offsets[chunk], s->lengths[chunk]);
+	if(!src)
+	    return -1;
+	memcpy(buf, src, MIN(s->lengths[chunk], 512*s->sectorcounts[chunk]));
+	return 0;
+    case 2: /* zero */
+	memset(buf, 0, 512*s->sectorcounts[chunk]);
+	return 0;
+    }
+    return -1;
+}
+
 static int dmg_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVDMGState *s = bs->opaque;
@@ -158,11 +182,8 @@ dmg_close:
 	}
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = qemu_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = qemu_malloc(512*max_sectors_per_chunk);
-    if(inflateInit(&s->zstream) != Z_OK)
-	goto dmg_close;
+    s->cache = chunk_cache_new(s->fd, s->n_chunks, 512*max_sectors_per_chunk,
+                               max_compressed_size, dmg_decode, s);
 
     s->current_chunk = s->n_chunks;
 
@@ -195,51 +216,16 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BDRVDMGState *s,int sector_num)
+static inline const uint8_t *dmg_read_chunk(BDRVDMGState *s,int sector_num)
 {
     if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
 	uint32_t chunk = search_chunk(s,sector_num);
 
 	if(chunk>=s->n_chunks)
-	    return -1;
-
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    ret = lseek(s->fd, s->offsets[chunk], SEEK_SET);
-	    if(ret<0)
-		return -1;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    ret = qemu_read_ok(s->fd, s->compressed_chunk, s->lengths[chunk]);
-	    if (ret < 0)
-	        return -1;
-
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = qemu_read_ok(s->fd, s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret < 0)
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
-	    break;
-	}
+	    return NULL;
 	s->current_chunk = chunk;
     }
-    return 0;
+    return chunk_cache_get(s->cache, s->current_chunk);
 }
 
 static int dmg_read(BlockDriverState *bs, int64_t sector_num,
@@ -250,17 +236,25 @@ static int dmg_read(BlockDriverState *bs, int64_t sector_num,
 
     for(i=0;i<nb_sectors;i++) {
 	uint32_t sector_offset_in_chunk;
-	if(dmg_read_chunk(s, sector_num+i) != 0)
+	const uint8_t *chunk = dmg_read_chunk(s, sector_num+i);
+	if(!chunk)
 	    return -1;
 	sector_offset_in_chunk = sector_num+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512,s->uncompressed_chunk+sector_offset_in_chunk*512,512);
+	memcpy(buf+i*512,chunk+sector_offset_in_chunk*512,512);
     }
     return 0;
 }
 
+static int dmg_set_chunk_cache(BlockDriverState *bs, int size_kb)
+{
+    BDRVDMGState *s = bs->opaque;
+    return chunk_cache_resize(s->cache, size_kb);
+}
+
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
+    chunk_cache_delete(s->cache);
     close(s->fd);
     if(s->n_chunks>0) {
 	free(s->types);
@@ -269,9 +263,6 @@ static void dmg_close(BlockDriverState *bs)
 	free(s->sectors);
 	free(s->sectorcounts);
     }
-    free(s->compressed_chunk);
-    free(s->uncompressed_chunk);
-    inflateEnd(&s->zstream);
 }
 
 BlockDriver bdrv_dmg = {
@@ -282,4 +273,5 @@ BlockDriver bdrv_dmg = {
     dmg_read,
     NULL,
     dmg_close,
+    .bdrv_set_chunk_cache = dmg_set_chunk_cache,
 };
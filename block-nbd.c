@@ -32,38 +32,139 @@
 #ifndef CONFIG_STUBDOM
 
 #include <sys/types.h>
+#include <sys/select.h>
 #include <unistd.h>
 
+#include "qemu_socket.h"
+#include "qemu-aio.h"
+#include "qemu-timer.h"
+
+#ifdef CONFIG_AIO
+#include <pthread.h>
+#include <signal.h>
+#define NBD_WAKER_THREAD
+#endif
+
+/*
+ * Requests are pipelined: each one is tagged with a handle and written to
+ * the socket as soon as it is submitted, and replies are matched back to
+ * their request by handle in whatever order the server sends them.  The
+ * socket is non-blocking and both directions are driven from the aio fd
+ * handlers, so partially sent requests and partially received replies
+ * are carried over in the driver state.
+ *
+ * Losing the connection never blocks either.  The driver goes back to
+ * CONNECTING with a non-blocking connect(), reads the server's greeting
+ * in NEGOTIATING and then replays whatever was outstanding.  Between
+ * failed attempts it sits in WAITING until an rt_clock timer fires.
+ * Synchronous waiters (qemu_aio_wait() and the tools, which have no
+ * timers) never run that timer.  For them a pipe is registered with the
+ * aio layer while WAITING, and a waker thread writes to it when the
+ * delay is over.  The thread is armed by nbd_aio_fd_flush(), which only
+ * synchronous waiters call.  Without threads they retry at once.
+ */
+
+/* qemu-nbd drops the connection on anything larger than its buffer */
+#define NBD_MAX_REQUEST         (1024 * 1024)
+/* connection attempts (and replays without progress) before giving up */
+#define NBD_RECONNECT_TRIES     5
+#define NBD_RECONNECT_DELAY     100 /* ms, doubled on every attempt */
+
+enum {
+    NBD_IDLE,                   /* no connection and nothing outstanding */
+    NBD_WAITING,                /* for the next connection attempt */
+    NBD_CONNECTING,
+    NBD_NEGOTIATING,
+    NBD_CONNECTED,
+};
+
+#ifdef MSG_NOSIGNAL
+#define NBD_SEND_FLAGS          MSG_NOSIGNAL
+#else
+#define NBD_SEND_FLAGS          0
+#endif
+
+typedef struct NBDAIOCB {
+    BlockDriverAIOCB common;
+    struct iovec *iov;
+    int niov;
+    struct iovec single;        /* used by the non vectored entry points */
+    int pending;                /* requests still outstanding */
+    int ret;
+    int canceled;               /* released by nbd_aio_cancel instead */
+} NBDAIOCB;
+
+/* One request on the wire, an AIOCB is split into several if it is large */
+typedef struct NBDRequest {
+    struct NBDRequest *next;
+    NBDAIOCB *acb;
+    struct nbd_request request;
+    uint8_t hdr[NBD_REQUEST_SIZE];
+    size_t offset;              /* of the payload within acb->iov */
+    size_t sent;                /* header and payload bytes written */
+} NBDRequest;
+
 typedef struct BDRVNBDState {
     int sock;
+    int state;
     off_t size;
     size_t blocksize;
+    char *filename;
+    /* resolved once, reconnecting must not block on a name lookup */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int want_read;
+    int want_write;
+    int tries;                  /* failed connection attempts in a row */
+    int replays;                /* reconnects since the last reply */
+    uint64_t next_handle;
+
+    QEMUTimer *retry_timer;
+    int64_t retry_time;         /* rt_clock time of the next attempt */
+    int wakeup[2];              /* pipe for synchronous waiters */
+#ifdef NBD_WAKER_THREAD
+    pthread_mutex_t waker_lock;
+    pthread_cond_t waker_cond;
+    pthread_t waker;
+    int waker_started;
+    int waker_armed;            /* write to the pipe at waker_time */
+    int waker_quit;
+    struct timespec waker_time;
+#endif
+    uint8_t greeting[NBD_NEGOTIATE_SIZE];
+    size_t greeting_len;
+
+    NBDRequest *reqs;           /* outstanding requests, oldest first */
+    NBDRequest *send_req;       /* first request not completely sent */
+    NBDRequest *free_reqs;
+
+    uint8_t reply_buf[NBD_REPLY_SIZE];
+    size_t reply_len;
+    NBDRequest *reply_req;      /* read whose data is being received */
+    size_t reply_data;
 } BDRVNBDState;
 
-static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
+static int nbd_parse_address(BDRVNBDState *s, const char *filename)
 {
-    BDRVNBDState *s = bs->opaque;
     const char *host;
     const char *unixpath;
-    int sock;
-    off_t size;
-    size_t blocksize;
-    int ret;
-
-    if ((flags & BDRV_O_CREAT))
-        return -EINVAL;
 
     if (!strstart(filename, "nbd:", &host))
         return -EINVAL;
 
     if (strstart(host, "unix:", &unixpath)) {
+        struct sockaddr_un *addr = (struct sockaddr_un *)&s->addr;
 
-        if (unixpath[0] != '/')
+        if (unixpath[0] != '/' || strlen(unixpath) >= sizeof(addr->sun_path))
             return -EINVAL;
 
-        sock = unix_socket_outgoing(unixpath);
+        addr->sun_family = AF_UNIX;
+        pstrcpy(addr->sun_path, sizeof(addr->sun_path), unixpath);
+        s->addrlen = sizeof(*addr);
 
     } else {
+        struct sockaddr_in *addr = (struct sockaddr_in *)&s->addr;
+        struct hostent *ent;
         uint16_t port;
         char *p, *r;
         char hostname[128];
@@ -80,79 +181,742 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
         port = strtol(p, &r, 0);
         if (r == p)
             return -EINVAL;
-        sock = tcp_socket_outgoing(hostname, port);
+
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        if (inet_aton(hostname, &addr->sin_addr) == 0) {
+            ent = gethostbyname(hostname);
+            if (ent == NULL)
+                return -ENOENT;
+            memcpy(&addr->sin_addr, ent->h_addr, sizeof(addr->sin_addr));
+        }
+        s->addrlen = sizeof(*addr);
     }
 
-    if (sock == -1)
-        return -errno;
+    return 0;
+}
 
-    ret = nbd_receive_negotiate(sock, &size, &blocksize);
-    if (ret == -1)
-        return -errno;
+static void nbd_aio_fd_read(void *opaque);
+static void nbd_aio_fd_write(void *opaque);
+static void nbd_aio_retry(BDRVNBDState *s);
+
+static void nbd_waker_kick(BDRVNBDState *s)
+{
+    char byte = 0;
+
+    write(s->wakeup[1], &byte, 1);
+}
+
+#ifdef NBD_WAKER_THREAD
+static void *nbd_waker(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    sigset_t set;
+
+    /* signals are for the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&s->waker_lock);
+    while (!s->waker_quit) {
+        if (!s->waker_armed) {
+            pthread_cond_wait(&s->waker_cond, &s->waker_lock);
+            continue;
+        }
+        if (pthread_cond_timedwait(&s->waker_cond, &s->waker_lock,
+                                   &s->waker_time) == ETIMEDOUT &&
+            s->waker_armed) {
+            s->waker_armed = 0;
+            nbd_waker_kick(s);
+        }
+    }
+    pthread_mutex_unlock(&s->waker_lock);
+    return NULL;
+}
+
+/* Have the pipe written to once retry_time has come */
+static void nbd_waker_arm(BDRVNBDState *s)
+{
+    int64_t delay = s->retry_time - qemu_get_clock(rt_clock);
+    struct timeval tv;
+
+    if (!s->waker_started) {
+        if (pthread_create(&s->waker, NULL, nbd_waker, s)) {
+            nbd_waker_kick(s);
+            return;
+        }
+        s->waker_started = 1;
+    }
+
+    pthread_mutex_lock(&s->waker_lock);
+    if (!s->waker_armed) {
+        gettimeofday(&tv, NULL);
+        delay = MAX(delay, 0) * 1000 + tv.tv_usec;
+        s->waker_time.tv_sec = tv.tv_sec + delay / 1000000;
+        s->waker_time.tv_nsec = (delay % 1000000) * 1000;
+        s->waker_armed = 1;
+        pthread_cond_signal(&s->waker_cond);
+    }
+    pthread_mutex_unlock(&s->waker_lock);
+}
+
+static void nbd_waker_disarm(BDRVNBDState *s)
+{
+    if (!s->waker_started)
+        return;
+    pthread_mutex_lock(&s->waker_lock);
+    s->waker_armed = 0;
+    pthread_cond_signal(&s->waker_cond);
+    pthread_mutex_unlock(&s->waker_lock);
+}
+
+static void nbd_waker_init(BDRVNBDState *s)
+{
+    pthread_mutex_init(&s->waker_lock, NULL);
+    pthread_cond_init(&s->waker_cond, NULL);
+}
+
+static void nbd_waker_cleanup(BDRVNBDState *s)
+{
+    if (s->waker_started) {
+        pthread_mutex_lock(&s->waker_lock);
+        s->waker_quit = 1;
+        pthread_cond_signal(&s->waker_cond);
+        pthread_mutex_unlock(&s->waker_lock);
+        pthread_join(s->waker, NULL);
+    }
+    pthread_cond_destroy(&s->waker_cond);
+    pthread_mutex_destroy(&s->waker_lock);
+}
+#else
+static void nbd_waker_arm(BDRVNBDState *s)
+{
+    nbd_waker_kick(s);
+}
+
+static void nbd_waker_disarm(BDRVNBDState *s)
+{
+}
+
+static void nbd_waker_init(BDRVNBDState *s)
+{
+}
+
+static void nbd_waker_cleanup(BDRVNBDState *s)
+{
+}
+#endif
+
+static int nbd_aio_fd_flush(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    /* Only synchronous waiters get here, the retry timer does not run
+       for them */
+    if (s->state == NBD_WAITING)
+        nbd_waker_arm(s);
+    return s->reqs != NULL;
+}
+
+static void nbd_aio_update(BDRVNBDState *s)
+{
+    int want_read, want_write;
+
+    if (s->sock < 0)
+        return;
+    want_read = s->state != NBD_CONNECTING;
+    want_write = s->state == NBD_CONNECTING ||
+                 (s->state == NBD_CONNECTED && s->send_req != NULL);
+    if (want_read == s->want_read && want_write == s->want_write)
+        return;
+    qemu_aio_set_fd_handler(s->sock, want_read ? nbd_aio_fd_read : NULL,
+                            want_write ? nbd_aio_fd_write : NULL,
+                            nbd_aio_fd_flush, s);
+    s->want_read = want_read;
+    s->want_write = want_write;
+}
+
+/* The socket is connected and the server has introduced itself */
+static void nbd_aio_connected(BDRVNBDState *s)
+{
+    NBDRequest *req;
+
+    s->state = NBD_CONNECTED;
+    s->tries = 0;
+    s->reply_len = 0;
+    s->reply_req = NULL;
+    /* the server has forgotten everything, replay what is outstanding.
+       Requests are only completed on a reply, so nothing was lost. */
+    for (req = s->reqs; req; req = req->next)
+        req->sent = 0;
+    s->send_req = s->reqs;
+    nbd_aio_update(s);
+}
+
+static void nbd_aio_disconnect(BDRVNBDState *s)
+{
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
+    closesocket(s->sock);
+    s->sock = -1;
+    s->state = NBD_IDLE;
+}
+
+static NBDRequest *nbd_aio_req_alloc(BDRVNBDState *s)
+{
+    NBDRequest *req = s->free_reqs;
+
+    if (req)
+        s->free_reqs = req->next;
+    else
+        req = qemu_malloc(sizeof(NBDRequest));
+    return req;
+}
+
+static void nbd_aio_req_done(BDRVNBDState *s, NBDRequest *req, int ret)
+{
+    NBDAIOCB *acb = req->acb;
+
+    req->next = s->free_reqs;
+    s->free_reqs = req;
+
+    if (ret < 0 && acb->ret == 0)
+        acb->ret = ret;
+    if (--acb->pending > 0 || acb->canceled)
+        return;
+
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
+
+static void nbd_aio_unlink(BDRVNBDState *s, NBDRequest *req)
+{
+    NBDRequest **preq;
+
+    for (preq = &s->reqs; *preq != req; preq = &(*preq)->next)
+        ;
+    *preq = req->next;
+    if (s->send_req == req)
+        s->send_req = req->next;
+}
+
+/* Gives up on the server, the next request starts over */
+static void nbd_aio_fail(BDRVNBDState *s)
+{
+    NBDRequest *req, *reqs;
+
+    fprintf(stderr, "nbd: lost connection to %s\n", s->filename);
+    s->tries = 0;
+    s->replays = 0;
+    /* completions may submit new requests, detach the old ones first */
+    reqs = s->reqs;
+    s->reqs = NULL;
+    s->send_req = NULL;
+    while ((req = reqs) != NULL) {
+        reqs = req->next;
+        nbd_aio_req_done(s, req, -EIO);
+    }
+}
 
+/* Starts a connection attempt, any outcome is reported asynchronously */
+static void nbd_aio_connect(BDRVNBDState *s)
+{
+    int sock, ret;
+
+    sock = socket(s->addr.ss_family, SOCK_STREAM, 0);
+    if (sock < 0) {
+        nbd_aio_retry(s);
+        return;
+    }
+    socket_set_nonblock(sock);
     s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
+    s->state = NBD_NEGOTIATING;
+    s->greeting_len = 0;
+    s->want_read = -1;
+    s->want_write = -1;
+
+    do {
+        ret = connect(sock, (struct sockaddr *)&s->addr, s->addrlen);
+    } while (ret < 0 && socket_error() == EINTR);
+    if (ret < 0) {
+        ret = socket_error();
+        if (ret != EINPROGRESS && ret != EWOULDBLOCK) {
+            closesocket(sock);
+            s->sock = -1;
+            nbd_aio_retry(s);
+            return;
+        }
+        s->state = NBD_CONNECTING;
+    }
+    nbd_aio_update(s);
+}
 
-    return 0;
+static void nbd_aio_wakeup(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    char buf[16];
+
+    while (read(s->wakeup[0], buf, sizeof(buf)) > 0)
+        ;
+    if (s->state != NBD_WAITING)
+        return;
+
+    qemu_del_timer(s->retry_timer);
+    nbd_waker_disarm(s);
+    qemu_aio_set_fd_handler(s->wakeup[0], NULL, NULL, NULL, NULL);
+    s->state = NBD_IDLE;
+    if (s->reqs)
+        nbd_aio_connect(s);
+    else
+        s->tries = 0;
 }
 
-static int nbd_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static void nbd_aio_retry_timer(void *opaque)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
+    nbd_aio_wakeup(opaque);
+}
 
-    request.type = NBD_CMD_READ;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+/* A connection attempt failed, try again later or give up */
+static void nbd_aio_retry(BDRVNBDState *s)
+{
+    char buf[16];
+
+    if (s->sock >= 0)
+        nbd_aio_disconnect(s);
+    if (++s->tries >= NBD_RECONNECT_TRIES || !s->reqs) {
+        s->state = NBD_IDLE;
+        if (s->reqs)
+            nbd_aio_fail(s);
+        s->tries = 0;
+        return;
+    }
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+    /* a late wakeup from the previous wait must not cut this one short */
+    while (read(s->wakeup[0], buf, sizeof(buf)) > 0)
+        ;
+    s->state = NBD_WAITING;
+    s->retry_time = qemu_get_clock(rt_clock) +
+                    (NBD_RECONNECT_DELAY << (s->tries - 1));
+    qemu_mod_timer(s->retry_timer, s->retry_time);
+    qemu_aio_set_fd_handler(s->wakeup[0], nbd_aio_wakeup, NULL,
+                            nbd_aio_fd_flush, s);
+}
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+/* Called when the connection is lost, with requests possibly in flight */
+static void nbd_aio_reconnect(BDRVNBDState *s)
+{
+    NBDRequest *req;
+
+    nbd_aio_disconnect(s);
+    /* nothing that was sent can be answered any more, so cancelling
+       may drop it from now on */
+    for (req = s->reqs; req; req = req->next)
+        req->sent = 0;
+    s->send_req = s->reqs;
+    s->reply_req = NULL;
+    if (!s->reqs) {
+        /* idle, the next request will reconnect */
+        return;
+    }
 
-    if (reply.error !=0)
-        return -reply.error;
+    if (++s->replays > NBD_RECONNECT_TRIES) {
+        nbd_aio_fail(s);
+        return;
+    }
+    s->tries = 0;
+    nbd_aio_connect(s);
+}
 
-    if (reply.handle != request.handle)
-        return -EIO;
+/* The non-blocking connect() has finished, one way or the other */
+static void nbd_aio_connect_done(BDRVNBDState *s)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, (void *)&err, &len) < 0)
+        err = socket_error();
+    if (err == EINPROGRESS)
+        return;
+    if (err) {
+        nbd_aio_retry(s);
+        return;
+    }
+    s->state = NBD_NEGOTIATING;
+    nbd_aio_update(s);
+}
 
-    if (nbd_wr_sync(s->sock, buf, request.len, 1) != request.len)
-        return -EIO;
+static void nbd_aio_negotiate(BDRVNBDState *s)
+{
+    off_t size;
+    size_t blocksize;
+    ssize_t len;
+
+    do {
+        len = recv(s->sock, s->greeting + s->greeting_len,
+                   NBD_NEGOTIATE_SIZE - s->greeting_len, 0);
+    } while (len < 0 && socket_error() == EINTR);
+    if (len < 0 && (socket_error() == EAGAIN ||
+                    socket_error() == EWOULDBLOCK))
+        return;
+    if (len <= 0) {
+        nbd_aio_retry(s);
+        return;
+    }
+
+    s->greeting_len += len;
+    if (s->greeting_len < NBD_NEGOTIATE_SIZE)
+        return;
+
+    if (nbd_decode_negotiate(s->greeting, &size, &blocksize) < 0) {
+        nbd_aio_retry(s);
+        return;
+    }
+    if (size != s->size) {
+        /* not the same disk any more */
+        nbd_aio_disconnect(s);
+        nbd_aio_fail(s);
+        return;
+    }
+    nbd_aio_connected(s);
+}
+
+/* Transfer at most len bytes starting at offset within an I/O vector */
+static ssize_t nbd_iov_xfer(int sock, struct iovec *iov, int niov,
+                            size_t offset, size_t len, int do_read)
+{
+    size_t chunk;
+    uint8_t *p;
+    int i;
+
+    for (i = 0; offset >= iov[i].iov_len; i++)
+        offset -= iov[i].iov_len;
+    p = (uint8_t *)iov[i].iov_base + offset;
+    chunk = MIN(len, iov[i].iov_len - offset);
+
+    if (do_read)
+        return recv(sock, p, chunk, 0);
+    return send(sock, p, chunk, NBD_SEND_FLAGS);
+}
 
+static int nbd_aio_send(BDRVNBDState *s)
+{
+    NBDRequest *req;
+    ssize_t len;
+    size_t total;
+
+    while ((req = s->send_req) != NULL) {
+        total = NBD_REQUEST_SIZE;
+        if (req->request.type == NBD_CMD_WRITE)
+            total += req->request.len;
+
+        if (req->sent < NBD_REQUEST_SIZE)
+            len = send(s->sock, req->hdr + req->sent,
+                       NBD_REQUEST_SIZE - req->sent, NBD_SEND_FLAGS);
+        else
+            len = nbd_iov_xfer(s->sock, req->acb->iov, req->acb->niov,
+                               req->offset + req->sent - NBD_REQUEST_SIZE,
+                               total - req->sent, 0);
+        if (len < 0) {
+            errno = socket_error();
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        req->sent += len;
+        if (req->sent == total)
+            s->send_req = req->next;
+    }
     return 0;
 }
 
-static int nbd_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static void nbd_aio_fd_write(void *opaque)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
+    BDRVNBDState *s = opaque;
+
+    if (s->state == NBD_CONNECTING)
+        nbd_aio_connect_done(s);
+    else if (nbd_aio_send(s) < 0)
+        nbd_aio_reconnect(s);
+    else
+        nbd_aio_update(s);
+}
+
+/* Returns the request a complete reply header belongs to, NULL if none */
+static NBDRequest *nbd_aio_reply(BDRVNBDState *s, struct nbd_reply *reply)
+{
+    NBDRequest *req;
+
+    if (nbd_decode_reply(s->reply_buf, reply) == -1)
+        return NULL;
+
+    for (req = s->reqs; req != s->send_req; req = req->next) {
+        if (req->request.handle == reply->handle)
+            return req;
+    }
+    /* the server cannot have seen the rest yet */
+    return NULL;
+}
+
+static void nbd_aio_fd_read(void *opaque)
+{
+    BDRVNBDState *s = opaque;
     struct nbd_reply reply;
+    NBDRequest *req;
+    ssize_t len;
+
+    if (s->state == NBD_NEGOTIATING) {
+        nbd_aio_negotiate(s);
+        return;
+    }
 
-    request.type = NBD_CMD_WRITE;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    for (;;) {
+        req = s->reply_req;
+        if (req)
+            len = nbd_iov_xfer(s->sock, req->acb->iov, req->acb->niov,
+                               req->offset + s->reply_data,
+                               req->request.len - s->reply_data, 1);
+        else
+            len = recv(s->sock, s->reply_buf + s->reply_len,
+                       NBD_REPLY_SIZE - s->reply_len, 0);
+
+        if (len < 0) {
+            errno = socket_error();
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+        }
+        if (len <= 0) {
+            nbd_aio_reconnect(s);
+            return;
+        }
+
+        if (req) {
+            s->reply_data += len;
+            if (s->reply_data == req->request.len) {
+                s->reply_req = NULL;
+                nbd_aio_unlink(s, req);
+                nbd_aio_req_done(s, req, 0);
+            }
+            continue;
+        }
+
+        s->reply_len += len;
+        if (s->reply_len < NBD_REPLY_SIZE)
+            continue;
+        s->reply_len = 0;
+
+        req = nbd_aio_reply(s, &reply);
+        if (req == NULL) {
+            /* out of sync with the server, start over */
+            nbd_aio_reconnect(s);
+            return;
+        }
+        s->replays = 0;
+
+        if (reply.error == 0 && req->request.type == NBD_CMD_READ &&
+            req->request.len > 0) {
+            s->reply_req = req;
+            s->reply_data = 0;
+        } else {
+            nbd_aio_unlink(s, req);
+            nbd_aio_req_done(s, req, -reply.error);
+        }
+    }
+}
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+/* Wait for the socket outside of the main loop */
+static void nbd_aio_poll(BDRVNBDState *s)
+{
+    fd_set rfds, wfds;
+    int sock = s->sock;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if (s->state == NBD_WAITING) {
+        nbd_waker_arm(s);
+        FD_SET(s->wakeup[0], &rfds);
+        if (select(s->wakeup[0] + 1, &rfds, NULL, NULL, NULL) > 0)
+            nbd_aio_wakeup(s);
+        return;
+    }
+    if (sock < 0)
+        return;
+    if (s->want_read)
+        FD_SET(sock, &rfds);
+    if (s->want_write)
+        FD_SET(sock, &wfds);
+    if (select(sock + 1, &rfds, &wfds, NULL, NULL) <= 0)
+        return;
+
+    if (FD_ISSET(sock, &wfds))
+        nbd_aio_fd_write(s);
+    if (s->sock == sock && FD_ISSET(sock, &rfds))
+        nbd_aio_fd_read(s);
+}
 
-    if (nbd_wr_sync(s->sock, (uint8_t*)buf, request.len, 0) != request.len)
-        return -EIO;
+static BlockDriverAIOCB *nbd_aio_submit(BlockDriverState *bs, int type,
+        int64_t sector_num, QEMUIOVector *qiov, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDRequest *req, **preq;
+    NBDAIOCB *acb;
+    size_t offset, size = nb_sectors * 512;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    if (qiov) {
+        acb->iov = qiov->iov;
+        acb->niov = qiov->niov;
+    } else {
+        acb->single.iov_base = buf;
+        acb->single.iov_len = size;
+        acb->iov = &acb->single;
+        acb->niov = 1;
+    }
+    acb->pending = 0;
+    acb->ret = 0;
+    acb->canceled = 0;
+
+    for (preq = &s->reqs; *preq; preq = &(*preq)->next)
+        ;
+    offset = 0;
+    do {
+        req = nbd_aio_req_alloc(s);
+        req->next = NULL;
+        req->acb = acb;
+        req->offset = offset;
+        req->sent = 0;
+        req->request.type = type;
+        req->request.handle = s->next_handle++;
+        req->request.from = sector_num * 512 + offset;
+        req->request.len = MIN(size - offset, NBD_MAX_REQUEST);
+        nbd_encode_request(req->hdr, &req->request);
+
+        *preq = req;
+        preq = &req->next;
+        if (!s->send_req)
+            s->send_req = req;
+        acb->pending++;
+        offset += req->request.len;
+    } while (offset < size);
+
+    /* errors are picked up by the fd handlers, so that completions are
+       never called from here */
+    if (s->state == NBD_CONNECTED) {
+        nbd_aio_send(s);
+        nbd_aio_update(s);
+    } else if (s->state == NBD_IDLE) {
+        /* the connection was dropped while idle */
+        nbd_aio_connect(s);
+    }
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *nbd_aio_read(BlockDriverState *bs,
+        int64_t sector_num, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_submit(bs, NBD_CMD_READ, sector_num, NULL, buf,
+                          nb_sectors, cb, opaque);
+}
+
+static BlockDriverAIOCB *nbd_aio_write(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_submit(bs, NBD_CMD_WRITE, sector_num, NULL, (uint8_t *)buf,
+                          nb_sectors, cb, opaque);
+}
 
-    if (reply.error !=0)
-        return -reply.error;
+static BlockDriverAIOCB *nbd_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_submit(bs, NBD_CMD_READ, sector_num, qiov, NULL,
+                          nb_sectors, cb, opaque);
+}
 
-    if (reply.handle != request.handle)
-        return -EIO;
+static BlockDriverAIOCB *nbd_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_submit(bs, NBD_CMD_WRITE, sector_num, qiov, NULL,
+                          nb_sectors, cb, opaque);
+}
+
+static void nbd_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    NBDAIOCB *acb = (NBDAIOCB *)blockacb;
+    BDRVNBDState *s = acb->common.bs->opaque;
+    NBDRequest *req, **preq;
+
+    /* whatever has not reached the server yet can simply be dropped */
+    preq = &s->reqs;
+    while ((req = *preq) != NULL) {
+        if (req->acb == acb && req->sent == 0) {
+            *preq = req->next;
+            if (s->send_req == req)
+                s->send_req = req->next;
+            req->next = s->free_reqs;
+            s->free_reqs = req;
+            acb->pending--;
+        } else {
+            preq = &req->next;
+        }
+    }
+    nbd_aio_update(s);
+
+    /* the rest still refers to the caller's buffer, wait for it */
+    acb->canceled = 1;
+    while (acb->pending > 0)
+        nbd_aio_poll(s);
+    qemu_aio_release(acb);
+}
+
+static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
+{
+    BDRVNBDState *s = bs->opaque;
+    int sock, ret;
+
+    if ((flags & BDRV_O_CREAT))
+        return -EINVAL;
+
+    ret = nbd_parse_address(s, filename);
+    if (ret < 0)
+        return ret;
+
+    /* the first connection is synchronous, it provides the size */
+    sock = socket(s->addr.ss_family, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -errno;
+    if (connect(sock, (struct sockaddr *)&s->addr, s->addrlen) < 0 ||
+        nbd_receive_negotiate(sock, &s->size, &s->blocksize) < 0) {
+        ret = -errno;
+        closesocket(sock);
+        return ret;
+    }
+    if (pipe(s->wakeup) < 0) {
+        ret = -errno;
+        closesocket(sock);
+        return ret;
+    }
+    fcntl(s->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(s->wakeup[1], F_SETFL, O_NONBLOCK);
+    nbd_waker_init(s);
+
+    s->filename = qemu_strdup(filename);
+    s->retry_timer = qemu_new_timer(rt_clock, nbd_aio_retry_timer, s);
+    socket_set_nonblock(sock);
+    s->sock = sock;
+    s->want_read = -1;
+    s->want_write = -1;
+    nbd_aio_connected(s);
 
     return 0;
 }
@@ -161,14 +925,37 @@ static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
+    NBDRequest *req;
 
-    request.type = NBD_CMD_DISC;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = 0;
-    request.len = 0;
-    nbd_send_request(s->sock, &request);
+    while (s->reqs)
+        nbd_aio_poll(s);
 
-    close(s->sock);
+    if (s->sock >= 0) {
+        qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
+
+        if (s->state == NBD_CONNECTED) {
+            request.type = NBD_CMD_DISC;
+            request.handle = s->next_handle;
+            request.from = 0;
+            request.len = 0;
+            nbd_send_request(s->sock, &request);
+        }
+
+        closesocket(s->sock);
+    }
+
+    qemu_aio_set_fd_handler(s->wakeup[0], NULL, NULL, NULL, NULL);
+    nbd_waker_cleanup(s);
+    close(s->wakeup[0]);
+    close(s->wakeup[1]);
+    qemu_del_timer(s->retry_timer);
+    qemu_free_timer(s->retry_timer);
+
+    while ((req = s->free_reqs) != NULL) {
+        s->free_reqs = req->next;
+        qemu_free(req);
+    }
+    qemu_free(s->filename);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
@@ -183,11 +970,17 @@ BlockDriver bdrv_nbd = {
     sizeof(BDRVNBDState),
     NULL, /* no probe for protocols */
     nbd_open,
-    nbd_read,
-    nbd_write,
+    NULL,
+    NULL,
     nbd_close,
     .bdrv_getlength = nbd_getlength,
     .protocol_name = "nbd",
+    .bdrv_aio_read = nbd_aio_read,
+    .bdrv_aio_write = nbd_aio_write,
+    .bdrv_aio_cancel = nbd_aio_cancel,
+    .bdrv_aio_readv = nbd_aio_readv,
+    .bdrv_aio_writev = nbd_aio_writev,
+    .aiocb_size = sizeof(NBDAIOCB),
 };
 
 #endif
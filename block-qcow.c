@@ -111,6 +111,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     ret = bdrv_file_open(&s->hd, filename, flags);
     if (ret < 0)
         return ret;
+    bs->file = s->hd;
     if (bdrv_pread(s->hd, 0, &header, sizeof(header)) != sizeof(header))
         goto fail;
     be32_to_cpus(&header.magic);
@@ -506,7 +507,7 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
                      uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, index_in_cluster, n;
+    int ret, index_in_cluster, n, n1;
     uint64_t cluster_offset;
 
     while (nb_sectors > 0) {
@@ -517,8 +518,11 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
             n = nb_sectors;
         if (!cluster_offset) {
             if (bs->backing_hd) {
-                /* read from the base image */
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                /* read from the base image, the whole unallocated run */
+                if (!bdrv_is_allocated(bs, sector_num, nb_sectors, &n1) &&
+                    n1 > n)
+                    n = n1;
+                ret = bdrv_read_chain(bs->backing_hd, sector_num, buf, n);
                 if (ret < 0)
                     return -1;
             } else {
@@ -595,8 +599,9 @@ static void qcow_aio_read_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
+    BlockDriverState *owner;
     BDRVQcowState *s = bs->opaque;
-    int index_in_cluster;
+    int index_in_cluster, n;
 
     acb->hd_aiocb = NULL;
     if (ret < 0) {
@@ -641,8 +646,18 @@ static void qcow_aio_read_cb(void *opaque, int ret)
 
     if (!acb->cluster_offset) {
         if (bs->backing_hd) {
-            /* read from the base image */
-            acb->hd_aiocb = bdrv_aio_read(bs->backing_hd,
+            /* read the whole unallocated run from the image in the chain
+               that has it */
+            if (!bdrv_is_allocated(bs, acb->sector_num, acb->nb_sectors, &n) &&
+                n > acb->n)
+                acb->n = n;
+            owner = bdrv_chain_owner(bs->backing_hd, acb->sector_num, acb->n,
+                                     &acb->n);
+            if (!owner) {
+                memset(acb->buf, 0, 512 * acb->n);
+                goto redo;
+            }
+            acb->hd_aiocb = bdrv_aio_read(owner,
                 acb->sector_num, acb->buf, acb->n, qcow_aio_read_cb, acb);
             if (acb->hd_aiocb == NULL)
                 goto fail;
@@ -975,6 +990,7 @@ BlockDriver bdrv_qcow = {
     qcow_set_key,
     qcow_make_empty,
 
+    .bdrv_flags = BLOCK_DRIVER_FLAG_BACKING,
     .bdrv_aio_read = qcow_aio_read,
     .bdrv_aio_write = qcow_aio_write,
     .bdrv_aio_cancel = qcow_aio_cancel,
@@ -200,6 +200,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     ret = bdrv_file_open(&s->hd, filename, flags);
     if (ret < 0)
         return ret;
+    bs->file = s->hd;
     if (bdrv_pread(s->hd, 0, &header, sizeof(header)) != sizeof(header))
         goto fail;
     be32_to_cpus(&header.magic);
@@ -1087,6 +1088,20 @@ static int backing_read1(BlockDriverState *bs,
     return n1;
 }
 
+static int backing_readv1(BlockDriverState *bs, int64_t sector_num,
+                          QEMUIOVector *qiov, int nb_sectors)
+{
+    int n1;
+    if ((sector_num + nb_sectors) <= bs->total_sectors)
+        return nb_sectors;
+    if (sector_num >= bs->total_sectors)
+        n1 = 0;
+    else
+        n1 = bs->total_sectors - sector_num;
+    qemu_iovec_memset(qiov, n1 * 512, 0, 512 * (nb_sectors - n1));
+    return n1;
+}
+
 static int qcow_read(BlockDriverState *bs, int64_t sector_num,
                      uint8_t *buf, int nb_sectors)
 {
@@ -1103,7 +1118,7 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
                 /* read from the base image */
                 n1 = backing_read1(bs->backing_hd, sector_num, buf, n);
                 if (n1 > 0) {
-                    ret = bdrv_read(bs->backing_hd, sector_num, buf, n1);
+                    ret = bdrv_read_chain(bs->backing_hd, sector_num, buf, n1);
                     if (ret < 0)
                         return -1;
                 }
@@ -1181,8 +1196,55 @@ typedef struct QCowAIOCB {
     BlockDriverAIOCB *hd_aiocb;
     QEMUBH *bh;
     QCowL2Meta l2meta;
+    /*
+     * Vectored requests pass a slice of qiov (hd_qiov) down for each
+     * cluster instead of buf.  Encrypted images need the data in one
+     * piece, so they still go through buf, which is then a bounce buffer.
+     */
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    QEMUIOVector hd_qiov;
+    uint8_t *bounce;
+    int is_write;
 } QCowAIOCB;
 
+static void qcow_aio_release(QCowAIOCB *acb)
+{
+    if (acb->qiov) {
+        qemu_iovec_destroy(&acb->hd_qiov);
+        qemu_vfree(acb->bounce);
+        acb->qiov = NULL;
+        acb->bounce = NULL;
+    }
+    qemu_aio_release(acb);
+}
+
+static void qcow_aio_complete(QCowAIOCB *acb, int ret)
+{
+    if (acb->bounce && !acb->is_write && ret >= 0)
+        qemu_iovec_from_buffer(acb->qiov, acb->bounce, acb->qiov->size);
+    acb->common.cb(acb->common.opaque, ret);
+    qcow_aio_release(acb);
+}
+
+/* Point hd_qiov at the next n sectors of a vectored request */
+static QEMUIOVector *qcow_aio_slice(QCowAIOCB *acb, int n)
+{
+    qemu_iovec_reset(&acb->hd_qiov);
+    qemu_iovec_concat(&acb->hd_qiov, acb->qiov, acb->qiov_offset, n * 512);
+    return &acb->hd_qiov;
+}
+
+static void qcow_aio_advance(QCowAIOCB *acb)
+{
+    acb->nb_sectors -= acb->n;
+    acb->sector_num += acb->n;
+    if (acb->buf)
+        acb->buf += acb->n * 512;
+    else
+        acb->qiov_offset += acb->n * 512;
+}
+
 static void qcow_aio_read_cb(void *opaque, int ret);
 static void qcow_aio_read_bh(void *opaque)
 {
@@ -1210,14 +1272,14 @@ static void qcow_aio_read_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
+    BlockDriverState *owner = NULL;
     BDRVQcowState *s = bs->opaque;
-    int index_in_cluster, n1;
+    int index_in_cluster, n1, n2;
 
     acb->hd_aiocb = NULL;
     if (ret < 0) {
 fail:
-        acb->common.cb(acb->common.opaque, ret);
-        qemu_aio_release(acb);
+        qcow_aio_complete(acb, ret);
         return;
     }
 
@@ -1234,14 +1296,11 @@ fail:
         }
     }
 
-    acb->nb_sectors -= acb->n;
-    acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+    qcow_aio_advance(acb);
 
     if (acb->nb_sectors == 0) {
         /* request completed */
-        acb->common.cb(acb->common.opaque, 0);
-        qemu_aio_release(acb);
+        qcow_aio_complete(acb, 0);
         return;
     }
 
@@ -1253,21 +1312,50 @@ fail:
     if (!acb->cluster_offset) {
         if (bs->backing_hd) {
             /* read from the base image */
-            n1 = backing_read1(bs->backing_hd, acb->sector_num,
-                               acb->buf, acb->n);
+            if (acb->buf) {
+                n1 = backing_read1(bs->backing_hd, acb->sector_num,
+                                   acb->buf, acb->n);
+            } else {
+                n1 = backing_readv1(bs->backing_hd, acb->sector_num,
+                                    qcow_aio_slice(acb, acb->n), acb->n);
+            }
             if (n1 > 0) {
-                acb->hd_aiocb = bdrv_aio_read(bs->backing_hd, acb->sector_num,
-                                    acb->buf, acb->n, qcow_aio_read_cb, acb);
+                /* go straight to the image in the chain that has the data */
+                owner = bdrv_chain_owner(bs->backing_hd, acb->sector_num,
+                                         n1, &n2);
+                if (n2 < n1)
+                    acb->n = n1 = n2;
+            }
+            if (n1 > 0 && owner) {
+                if (acb->buf)
+                    acb->hd_aiocb = bdrv_aio_read(owner,
+                                    acb->sector_num, acb->buf, n1,
+                                    qcow_aio_read_cb, acb);
+                else
+                    acb->hd_aiocb = bdrv_aio_readv(owner,
+                                    acb->sector_num, qcow_aio_slice(acb, n1),
+                                    n1, qcow_aio_read_cb, acb);
                 if (acb->hd_aiocb == NULL)
                     goto fail;
             } else {
+                if (n1 > 0) {
+                    if (acb->buf)
+                        memset(acb->buf, 0, 512 * n1);
+                    else
+                        qemu_iovec_memset(qcow_aio_slice(acb, n1), 0, 0,
+                                          512 * n1);
+                }
                 ret = qcow_schedule_bh(qcow_aio_read_bh, acb);
                 if (ret < 0)
                     goto fail;
             }
         } else {
             /* Note: in this case, no need to wait */
-            memset(acb->buf, 0, 512 * acb->n);
+            if (acb->buf)
+                memset(acb->buf, 0, 512 * acb->n);
+            else
+                qemu_iovec_memset(qcow_aio_slice(acb, acb->n), 0, 0,
+                                  512 * acb->n);
             ret = qcow_schedule_bh(qcow_aio_read_bh, acb);
             if (ret < 0)
                 goto fail;
@@ -1276,8 +1364,13 @@ fail:
         /* add AIO support for compressed blocks ? */
         if (decompress_cluster(s, acb->cluster_offset) < 0)
             goto fail;
-        memcpy(acb->buf,
-               s->cluster_cache + index_in_cluster * 512, 512 * acb->n);
+        if (acb->buf)
+            memcpy(acb->buf,
+                   s->cluster_cache + index_in_cluster * 512, 512 * acb->n);
+        else
+            qemu_iovec_from_buffer(qcow_aio_slice(acb, acb->n),
+                                   s->cluster_cache + index_in_cluster * 512,
+                                   512 * acb->n);
         ret = qcow_schedule_bh(qcow_aio_read_bh, acb);
         if (ret < 0)
             goto fail;
@@ -1286,9 +1379,15 @@ fail:
             ret = -EIO;
             goto fail;
         }
-        acb->hd_aiocb = bdrv_aio_read(s->hd,
+        if (acb->buf)
+            acb->hd_aiocb = bdrv_aio_read(s->hd,
                             (acb->cluster_offset >> 9) + index_in_cluster,
                             acb->buf, acb->n, qcow_aio_read_cb, acb);
+        else
+            acb->hd_aiocb = bdrv_aio_readv(s->hd,
+                            (acb->cluster_offset >> 9) + index_in_cluster,
+                            qcow_aio_slice(acb, acb->n), acb->n,
+                            qcow_aio_read_cb, acb);
         if (acb->hd_aiocb == NULL)
             goto fail;
     }
@@ -1310,6 +1409,32 @@ static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
     acb->n = 0;
     acb->cluster_offset = 0;
     acb->l2meta.nb_clusters = 0;
+    acb->qiov = NULL;
+    acb->bounce = NULL;
+    return acb;
+}
+
+static QCowAIOCB *qcow_aio_setupv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowAIOCB *acb;
+
+    acb = qcow_aio_setup(bs, sector_num, NULL, nb_sectors, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->qiov = qiov;
+    acb->qiov_offset = 0;
+    acb->is_write = is_write;
+    qemu_iovec_init(&acb->hd_qiov, qiov->niov);
+    if (s->crypt_method) {
+        acb->bounce = qemu_memalign(512, MAX(qiov->size, nb_sectors * 512));
+        acb->buf = acb->bounce;
+        if (is_write)
+            qemu_iovec_to_buffer(qiov, acb->bounce);
+        bs->bounced_bytes += (unsigned) nb_sectors * 512;
+    }
     return acb;
 }
 
@@ -1327,6 +1452,20 @@ static BlockDriverAIOCB *qcow_aio_read(BlockDriverState *bs,
     return &acb->common;
 }
 
+static BlockDriverAIOCB *qcow_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    QCowAIOCB *acb;
+
+    acb = qcow_aio_setupv(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+    if (!acb)
+        return NULL;
+
+    qcow_aio_read_cb(acb, 0);
+    return &acb->common;
+}
+
 static void qcow_aio_write_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
@@ -1340,8 +1479,7 @@ static void qcow_aio_write_cb(void *opaque, int ret)
 
     if (ret < 0) {
     fail:
-        acb->common.cb(acb->common.opaque, ret);
-        qemu_aio_release(acb);
+        qcow_aio_complete(acb, ret);
         return;
     }
 
@@ -1350,14 +1488,11 @@ static void qcow_aio_write_cb(void *opaque, int ret)
         goto fail;
     }
 
-    acb->nb_sectors -= acb->n;
-    acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+    qcow_aio_advance(acb);
 
     if (acb->nb_sectors == 0) {
         /* request completed */
-        acb->common.cb(acb->common.opaque, 0);
-        qemu_aio_release(acb);
+        qcow_aio_complete(acb, 0);
         return;
     }
 
@@ -1385,10 +1520,16 @@ static void qcow_aio_write_cb(void *opaque, int ret)
     } else {
         src_buf = acb->buf;
     }
-    acb->hd_aiocb = bdrv_aio_write(s->hd,
+    if (src_buf)
+        acb->hd_aiocb = bdrv_aio_write(s->hd,
                                    (acb->cluster_offset >> 9) + index_in_cluster,
                                    src_buf, acb->n,
                                    qcow_aio_write_cb, acb);
+    else
+        acb->hd_aiocb = bdrv_aio_writev(s->hd,
+                                   (acb->cluster_offset >> 9) + index_in_cluster,
+                                   qcow_aio_slice(acb, acb->n), acb->n,
+                                   qcow_aio_write_cb, acb);
     if (acb->hd_aiocb == NULL)
         goto fail;
 }
@@ -1410,12 +1551,29 @@ static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
     return &acb->common;
 }
 
+static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowAIOCB *acb;
+
+    s->cluster_cache_offset = -1; /* disable compressed cache */
+
+    acb = qcow_aio_setupv(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
+    if (!acb)
+        return NULL;
+
+    qcow_aio_write_cb(acb, 0);
+    return &acb->common;
+}
+
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = (QCowAIOCB *)blockacb;
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
-    qemu_aio_release(acb);
+    qcow_aio_release(acb);
 }
 
 static BlockDriverAIOCB *qcow_aio_flush(BlockDriverState *bs,
@@ -2647,9 +2805,12 @@ BlockDriver bdrv_qcow2 = {
     qcow_set_key,
     qcow_make_empty,
 
+    .bdrv_flags = BLOCK_DRIVER_FLAG_BACKING,
     .bdrv_aio_read = qcow_aio_read,
     .bdrv_aio_write = qcow_aio_write,
     .bdrv_aio_cancel = qcow_aio_cancel,
+    .bdrv_aio_readv = qcow_aio_readv,
+    .bdrv_aio_writev = qcow_aio_writev,
     .bdrv_aio_flush = qcow_aio_flush,
     .aiocb_size = sizeof(QCowAIOCB),
     .bdrv_write_compressed = qcow_write_compressed,
@@ -31,6 +31,10 @@
 
 #ifdef CONFIG_AIO
 #include "posix-aio-compat.h"
+#include <limits.h>
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 #endif
 
 #ifdef CONFIG_COCOA
@@ -444,6 +448,9 @@ typedef struct RawAIOCB {
     struct qemu_paiocb aiocb;
     struct RawAIOCB *next;
     int ret;
+    /* O_DIRECT vectored requests with misaligned elements */
+    QEMUIOVector *qiov;
+    uint8_t *bounce;
 } RawAIOCB;
 
 typedef struct PosixAioState
@@ -495,6 +502,16 @@ static void posix_aio_read(void *opaque)
                 }
                 /* remove the request */
                 *pacb = acb->next;
+                bdrv_latency_add(&acb->common.bs->aio_wait,
+                                 acb->aiocb.wait_us);
+                if (acb->bounce) {
+                    /* qiov is only set for reads */
+                    if (ret == 0 && acb->qiov)
+                        qemu_iovec_from_buffer(acb->qiov, acb->bounce,
+                                               acb->aiocb.aio_nbytes);
+                    qemu_vfree(acb->bounce);
+                    acb->bounce = NULL;
+                }
                 /* call the callback */
                 acb->common.cb(acb->common.opaque, ret);
                 qemu_aio_release(acb);
@@ -590,6 +607,9 @@ static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
     acb->aiocb.aio_fildes = s->fd;
     acb->aiocb.ev_signo = SIGUSR2;
     acb->aiocb.aio_buf = buf;
+    acb->aiocb.aio_iov = NULL;
+    acb->qiov = NULL;
+    acb->bounce = NULL;
     if (nb_sectors < 0)
         acb->aiocb.aio_nbytes = -nb_sectors;
     else
@@ -619,6 +639,8 @@ static void raw_aio_remove(RawAIOCB *acb)
             break;
         } else if (*pacb == acb) {
             *pacb = acb->next;
+            qemu_vfree(acb->bounce);
+            acb->bounce = NULL;
             qemu_aio_release(acb);
             break;
         }
@@ -688,6 +710,86 @@ static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
     return &acb->common;
 }
 
+/*
+ * With O_DIRECT every element has to be sector aligned, and preadv cannot
+ * take more than IOV_MAX of them.  Anything else is bounced.
+ */
+static int raw_qiov_needs_bounce(BlockDriverState *bs, QEMUIOVector *qiov,
+                                 int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    int i;
+
+    if (qiov->niov > IOV_MAX || qiov->size != nb_sectors * 512)
+        return 1;
+    if (s->aligned_buf == NULL)
+        return 0;
+    for (i = 0; i < qiov->niov; i++) {
+        if ((uintptr_t) qiov->iov[i].iov_base % 512 ||
+            qiov->iov[i].iov_len % 512)
+            return 1;
+    }
+    return 0;
+}
+
+static BlockDriverAIOCB *raw_aio_rw_vector(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    RawAIOCB *acb;
+    int ret;
+
+    if (raw_qiov_needs_bounce(bs, qiov, nb_sectors)) {
+        uint8_t *bounce = qemu_memalign(512, MAX(qiov->size, nb_sectors * 512));
+
+        acb = raw_aio_setup(bs, sector_num, bounce, nb_sectors, cb, opaque);
+        if (!acb) {
+            qemu_vfree(bounce);
+            return NULL;
+        }
+        acb->bounce = bounce;
+        bs->bounced_bytes += (unsigned) nb_sectors * 512;
+        if (is_write) {
+            qemu_iovec_to_buffer(qiov, bounce);
+            ret = qemu_paio_write(&acb->aiocb);
+        } else {
+            acb->qiov = qiov;
+            ret = qemu_paio_read(&acb->aiocb);
+        }
+    } else {
+        acb = raw_aio_setup(bs, sector_num, NULL, nb_sectors, cb, opaque);
+        if (!acb)
+            return NULL;
+        acb->aiocb.aio_iov = qiov->iov;
+        acb->aiocb.aio_niov = qiov->niov;
+        if (is_write)
+            ret = qemu_paio_writev(&acb->aiocb);
+        else
+            ret = qemu_paio_readv(&acb->aiocb);
+    }
+    if (ret < 0) {
+        raw_aio_remove(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return raw_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                             cb, opaque, 0);
+}
+
+static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return raw_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                             cb, opaque, 1);
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -858,6 +960,8 @@ BlockDriver bdrv_raw = {
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
     .aiocb_size = sizeof(RawAIOCB),
 #endif
 
@@ -1215,6 +1319,8 @@ BlockDriver bdrv_host_device = {
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
     .aiocb_size = sizeof(RawAIOCB),
 #endif
 
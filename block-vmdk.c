@@ -57,7 +57,9 @@ typedef struct {
     char check_bytes[4];
 } __attribute__((packed)) VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+#define L2_CACHE_SIZE 64
+
+struct VmdkAIOCB;
 
 typedef struct BDRVVmdkState {
     BlockDriverState *hd;
@@ -75,7 +77,12 @@ typedef struct BDRVVmdkState {
 
     unsigned int cluster_sectors;
     uint32_t parent_cid;
+    int parent_cid_valid;
     int is_parent;
+    int cid_updated;
+
+    /* aio writes that are filling a newly allocated grain */
+    struct VmdkAIOCB *allocating;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -172,11 +179,13 @@ static int vmdk_is_cid_valid(BlockDriverState *bs)
     BlockDriverState *p_bs = s->hd->backing_hd;
     uint32_t cur_pcid;
 
-    if (p_bs) {
+    /* the parent is opened read only, so its CID cannot change under us */
+    if (p_bs && !s->parent_cid_valid) {
         cur_pcid = vmdk_read_cid(p_bs,0);
         if (s->parent_cid != cur_pcid)
             // CID not valid
             return 0;
+        s->parent_cid_valid = 1;
     }
 #endif
     // CID valid
@@ -377,6 +386,7 @@ static int vmdk_open(BlockDriverState *bs, const char *filename, int flags)
     ret = bdrv_file_open(&s->hd, filename, flags);
     if (ret < 0)
         return ret;
+    bs->file = s->hd;
     if (bdrv_pread(s->hd, 0, &magic, sizeof(magic)) != sizeof(magic))
         goto fail;
 
@@ -504,24 +514,13 @@ static int vmdk_L2update(BlockDriverState *bs, VmdkMetaData *m_data)
     return 0;
 }
 
-static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
-                                   uint64_t offset, int allocate)
+/* Return the grain table at l2_offset, loading it into the cache if needed */
+static uint32_t *vmdk_l2_table(BlockDriverState *bs, unsigned int l2_offset)
 {
     BDRVVmdkState *s = bs->opaque;
-    unsigned int l1_index, l2_offset, l2_index;
     int min_index, i, j;
-    uint32_t min_count, *l2_table, tmp = 0;
-    uint64_t cluster_offset;
+    uint32_t min_count, *l2_table;
 
-    if (m_data)
-        m_data->valid = 0;
-
-    l1_index = (offset >> 9) / s->l1_entry_sectors;
-    if (l1_index >= s->l1_size)
-        return 0;
-    l2_offset = s->l1_table[l1_index];
-    if (!l2_offset)
-        return 0;
     for(i = 0; i < L2_CACHE_SIZE; i++) {
         if (l2_offset == s->l2_cache_offsets[i]) {
             /* increment the hit count */
@@ -530,8 +529,7 @@ static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
                     s->l2_cache_counts[j] >>= 1;
                 }
             }
-            l2_table = s->l2_cache + (i * s->l2_size);
-            goto found;
+            return s->l2_cache + (i * s->l2_size);
         }
     }
     /* not found: load a new entry in the least used one */
@@ -544,13 +542,38 @@ static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
         }
     }
     l2_table = s->l2_cache + (min_index * s->l2_size);
+    /* don't leave a half loaded table behind if the read fails */
+    s->l2_cache_offsets[min_index] = 0;
     if (bdrv_pread(s->hd, (int64_t)l2_offset * 512, l2_table, s->l2_size * sizeof(uint32_t)) !=
                                                                         s->l2_size * sizeof(uint32_t))
-        return 0;
+        return NULL;
 
     s->l2_cache_offsets[min_index] = l2_offset;
     s->l2_cache_counts[min_index] = 1;
- found:
+    return l2_table;
+}
+
+static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
+                                   uint64_t offset, int allocate)
+{
+    BDRVVmdkState *s = bs->opaque;
+    unsigned int l1_index, l2_offset, l2_index;
+    uint32_t *l2_table, tmp = 0;
+    uint64_t cluster_offset;
+
+    if (m_data)
+        m_data->valid = 0;
+
+    l1_index = (offset >> 9) / s->l1_entry_sectors;
+    if (l1_index >= s->l1_size)
+        return 0;
+    l2_offset = s->l1_table[l1_index];
+    if (!l2_offset)
+        return 0;
+    l2_table = vmdk_l2_table(bs, l2_offset);
+    if (!l2_table)
+        return 0;
+
     l2_index = ((offset >> 9) / s->cluster_sectors) % s->l2_size;
     cluster_offset = le32_to_cpu(l2_table[l2_index]);
 
@@ -605,6 +628,20 @@ static int vmdk_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+/* Sectors from sector_num, which is in an unallocated grain, up to the
+   next allocated grain so that the parent can be read in one go */
+static int vmdk_unallocated_run(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int n = s->cluster_sectors - sector_num % s->cluster_sectors;
+
+    while (n < nb_sectors &&
+           !get_cluster_offset(bs, NULL, (sector_num + n) << 9, 0))
+        n += s->cluster_sectors;
+    return MIN(n, nb_sectors);
+}
+
 static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                     uint8_t *buf, int nb_sectors)
 {
@@ -623,7 +660,8 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
             if (s->hd->backing_hd) {
                 if (!vmdk_is_cid_valid(bs))
                     return -1;
-                ret = bdrv_read(s->hd->backing_hd, sector_num, buf, n);
+                n = vmdk_unallocated_run(bs, sector_num, nb_sectors);
+                ret = bdrv_read_chain(s->hd->backing_hd, sector_num, buf, n);
                 if (ret < 0)
                     return -1;
             } else {
@@ -647,7 +685,6 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
     VmdkMetaData m_data;
     int index_in_cluster, n;
     uint64_t cluster_offset;
-    static int cid_update = 0;
 
     if (sector_num > bs->total_sectors) {
         fprintf(stderr,
@@ -678,14 +715,454 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         buf += n * 512;
 
         // update CID on the first write every time the virtual disk is opened
-        if (!cid_update) {
+        if (!s->cid_updated) {
             vmdk_write_cid(bs, time(NULL));
-            cid_update++;
+            s->cid_updated = 1;
         }
     }
     return 0;
 }
 
+/*
+ * Asynchronous I/O.  Grain table lookups stay synchronous and are served
+ * from the L2 cache; only the data transfers go through aio.
+ *
+ * A write to an unallocated grain reserves space at the end of the file,
+ * fills the grain (copying the rest of it from the parent image, if any)
+ * and only then publishes it in the grain table.  Until then readers keep
+ * seeing the old contents, and other writes to the same grain wait for it.
+ */
+
+enum {
+    VMDK_AIO_DATA,          /* plain transfer to or from an allocated grain */
+    VMDK_AIO_COW_READ,      /* reading the parent's copy of a new grain */
+    VMDK_AIO_COW_WRITE,     /* writing a new grain before publishing it */
+};
+
+typedef struct VmdkAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+    int n;
+    int state;
+    BlockDriverAIOCB *hd_aiocb;
+    QEMUBH *bh;                     /* see vmdk_aio_schedule() */
+    BlockDriverCompletionFunc *bh_cb;
+    int bh_ret;
+
+    /* grain allocation */
+    VmdkMetaData m_data;
+    uint64_t cluster_offset;
+    uint8_t *cluster_data;
+    int cluster_data_size;
+    struct VmdkAIOCB *alloc_next;   /* in s->allocating */
+    struct VmdkAIOCB *waiters;      /* writes to the grain we allocate */
+    struct VmdkAIOCB *wait_next;
+    struct VmdkAIOCB *waiting_on;
+} VmdkAIOCB;
+
+static void vmdk_aio_write_cb(void *opaque, int ret);
+
+/* the AIOCB goes back on the driver's free list, the grain buffer does not */
+static void vmdk_aio_release(VmdkAIOCB *acb)
+{
+    qemu_free(acb->cluster_data);
+    acb->cluster_data = NULL;
+    acb->cluster_data_size = 0;
+    qemu_aio_release(acb);
+}
+
+static void vmdk_aio_complete(VmdkAIOCB *acb, int ret)
+{
+    acb->common.cb(acb->common.opaque, ret);
+    vmdk_aio_release(acb);
+}
+
+static void vmdk_aio_bh(void *opaque)
+{
+    VmdkAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    acb->bh_cb(acb, acb->bh_ret);
+}
+
+/* Carry on with cb(acb, ret) from a bottom half.  Used when there is no
+   I/O to wait for, so the request cannot complete before vmdk_aio_read()
+   or vmdk_aio_write() has returned it. */
+static void vmdk_aio_schedule(VmdkAIOCB *acb, BlockDriverCompletionFunc *cb,
+                              int ret)
+{
+    acb->bh_cb = cb;
+    acb->bh_ret = ret;
+    acb->bh = qemu_bh_new(vmdk_aio_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+static void vmdk_aio_read_cb(void *opaque, int ret)
+{
+    VmdkAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BlockDriverState *owner;
+    BDRVVmdkState *s = bs->opaque;
+    int index_in_cluster;
+    uint64_t cluster_offset;
+
+    acb->hd_aiocb = NULL;
+    if (ret < 0) {
+        vmdk_aio_complete(acb, ret);
+        return;
+    }
+
+    acb->nb_sectors -= acb->n;
+    acb->sector_num += acb->n;
+    acb->buf += acb->n * 512;
+
+    if (acb->nb_sectors == 0) {
+        /* request completed */
+        vmdk_aio_complete(acb, 0);
+        return;
+    }
+
+    cluster_offset = get_cluster_offset(bs, NULL, acb->sector_num << 9, 0);
+    index_in_cluster = acb->sector_num % s->cluster_sectors;
+    acb->n = s->cluster_sectors - index_in_cluster;
+    if (acb->n > acb->nb_sectors)
+        acb->n = acb->nb_sectors;
+
+    if (!cluster_offset) {
+        if (s->hd->backing_hd) {
+            if (!vmdk_is_cid_valid(bs))
+                goto fail;
+            acb->n = vmdk_unallocated_run(bs, acb->sector_num,
+                                          acb->nb_sectors);
+            owner = bdrv_chain_owner(s->hd->backing_hd, acb->sector_num,
+                                     acb->n, &acb->n);
+            if (!owner) {
+                memset(acb->buf, 0, 512 * acb->n);
+                vmdk_aio_schedule(acb, vmdk_aio_read_cb, 0);
+                return;
+            }
+            acb->hd_aiocb = bdrv_aio_read(owner, acb->sector_num,
+                                          acb->buf, acb->n,
+                                          vmdk_aio_read_cb, acb);
+        } else {
+            memset(acb->buf, 0, 512 * acb->n);
+            vmdk_aio_schedule(acb, vmdk_aio_read_cb, 0);
+            return;
+        }
+    } else {
+        acb->hd_aiocb = bdrv_aio_read(s->hd,
+                                      (cluster_offset >> 9) + index_in_cluster,
+                                      acb->buf, acb->n,
+                                      vmdk_aio_read_cb, acb);
+    }
+    if (acb->hd_aiocb == NULL) {
+    fail:
+        vmdk_aio_schedule(acb, vmdk_aio_read_cb, -EIO);
+    }
+}
+
+static BlockDriverAIOCB *vmdk_aio_read(BlockDriverState *bs,
+        int64_t sector_num, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    VmdkAIOCB *acb;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->hd_aiocb = NULL;
+    acb->bh = NULL;
+    acb->sector_num = sector_num;
+    acb->buf = buf;
+    acb->nb_sectors = nb_sectors;
+    acb->n = 0;
+
+    vmdk_aio_read_cb(acb, 0);
+    return &acb->common;
+}
+
+static VmdkAIOCB *vmdk_find_allocating(BDRVVmdkState *s, int64_t sector_num)
+{
+    VmdkAIOCB *acb;
+    int64_t grain = sector_num / s->cluster_sectors;
+
+    for (acb = s->allocating; acb != NULL; acb = acb->alloc_next) {
+        if (acb->sector_num / s->cluster_sectors == grain)
+            return acb;
+    }
+    return NULL;
+}
+
+/* Forget about our grain allocation and let the writes waiting for it go */
+static void vmdk_aio_alloc_done(VmdkAIOCB *acb)
+{
+    BDRVVmdkState *s = acb->common.bs->opaque;
+    VmdkAIOCB **pacb, *waiter, *next;
+
+    for (pacb = &s->allocating; *pacb != NULL; pacb = &(*pacb)->alloc_next) {
+        if (*pacb == acb) {
+            *pacb = acb->alloc_next;
+            break;
+        }
+    }
+
+    waiter = acb->waiters;
+    acb->waiters = NULL;
+    for (; waiter != NULL; waiter = next) {
+        next = waiter->wait_next;
+        waiter->waiting_on = NULL;
+        vmdk_aio_write_cb(waiter, 0);
+    }
+}
+
+/* Reserve a grain at the end of the image file, without publishing it */
+static uint64_t vmdk_aio_alloc_cluster(VmdkAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVVmdkState *s = bs->opaque;
+    VmdkMetaData *m_data = &acb->m_data;
+    int64_t cluster_offset;
+
+    m_data->valid = 0;
+    m_data->l1_index = acb->sector_num / s->l1_entry_sectors;
+    if (m_data->l1_index >= s->l1_size)
+        return 0;
+    m_data->l2_offset = s->l1_table[m_data->l1_index];
+    if (!m_data->l2_offset)
+        return 0;
+    m_data->l2_index = (acb->sector_num / s->cluster_sectors) % s->l2_size;
+
+    cluster_offset = bdrv_getlength(s->hd);
+    if (cluster_offset < 0 ||
+        bdrv_truncate(s->hd, cluster_offset + (s->cluster_sectors << 9)) < 0)
+        return 0;
+    m_data->offset = cpu_to_le32(cluster_offset >> 9);
+    m_data->valid = 1;
+
+    return cluster_offset;
+}
+
+/* The new grain is on disk, make it visible */
+static int vmdk_aio_publish(VmdkAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    uint32_t *l2_table;
+
+    l2_table = vmdk_l2_table(bs, acb->m_data.l2_offset);
+    if (!l2_table)
+        return -1;
+    l2_table[acb->m_data.l2_index] = acb->m_data.offset;
+    return vmdk_L2update(bs, &acb->m_data);
+}
+
+/* Copy the parent's grain into cluster_data and merge the new data in */
+static int vmdk_aio_cow(VmdkAIOCB *acb, int index_in_cluster)
+{
+    BDRVVmdkState *s = acb->common.bs->opaque;
+    BlockDriverState *parent = s->hd->backing_hd;
+    int64_t grain_start = acb->sector_num - index_in_cluster;
+    int size = s->cluster_sectors * 512;
+    int n;
+
+    if (acb->cluster_data_size < size) {
+        qemu_free(acb->cluster_data);
+        acb->cluster_data = qemu_malloc(size);
+        acb->cluster_data_size = size;
+    }
+
+    /* the parent may be smaller than we are */
+    n = s->cluster_sectors;
+    if (grain_start + n > parent->total_sectors)
+        n = MAX(parent->total_sectors - grain_start, 0);
+    if (n < s->cluster_sectors)
+        memset(acb->cluster_data + n * 512, 0,
+               (s->cluster_sectors - n) * 512);
+    if (n == 0)
+        return 0;
+
+    if (!vmdk_is_cid_valid(acb->common.bs))
+        return -1;
+    acb->state = VMDK_AIO_COW_READ;
+    acb->hd_aiocb = bdrv_aio_read(parent, grain_start, acb->cluster_data, n,
+                                  vmdk_aio_write_cb, acb);
+    return acb->hd_aiocb ? 1 : -1;
+}
+
+static void vmdk_aio_write_cb(void *opaque, int ret)
+{
+    VmdkAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BDRVVmdkState *s = bs->opaque;
+    int index_in_cluster;
+    uint64_t cluster_offset;
+    VmdkAIOCB *owner;
+
+    acb->hd_aiocb = NULL;
+    if (ret < 0)
+        goto fail;
+
+    index_in_cluster = acb->sector_num % s->cluster_sectors;
+
+    switch (acb->state) {
+    case VMDK_AIO_COW_READ:
+        memcpy(acb->cluster_data + index_in_cluster * 512, acb->buf,
+               acb->n * 512);
+        goto write_grain;
+    case VMDK_AIO_COW_WRITE:
+        if (vmdk_aio_publish(acb) < 0)
+            goto fail_later;
+        vmdk_aio_alloc_done(acb);
+        break;
+    }
+    acb->state = VMDK_AIO_DATA;
+
+    acb->nb_sectors -= acb->n;
+    acb->sector_num += acb->n;
+    acb->buf += acb->n * 512;
+
+    if (acb->nb_sectors == 0) {
+        /* request completed */
+        vmdk_aio_complete(acb, 0);
+        return;
+    }
+
+    // update CID on the first write every time the virtual disk is opened
+    if (!s->cid_updated) {
+        vmdk_write_cid(bs, time(NULL));
+        s->cid_updated = 1;
+    }
+
+    index_in_cluster = acb->sector_num % s->cluster_sectors;
+    acb->n = s->cluster_sectors - index_in_cluster;
+    if (acb->n > acb->nb_sectors)
+        acb->n = acb->nb_sectors;
+
+    cluster_offset = get_cluster_offset(bs, NULL, acb->sector_num << 9, 0);
+    if (cluster_offset) {
+        acb->hd_aiocb = bdrv_aio_write(s->hd,
+                                       (cluster_offset >> 9) + index_in_cluster,
+                                       acb->buf, acb->n,
+                                       vmdk_aio_write_cb, acb);
+        if (acb->hd_aiocb == NULL)
+            goto fail_later;
+        return;
+    }
+
+    owner = vmdk_find_allocating(s, acb->sector_num);
+    if (owner) {
+        /* retry once the grain has been published */
+        acb->n = 0;
+        acb->waiting_on = owner;
+        acb->wait_next = owner->waiters;
+        owner->waiters = acb;
+        return;
+    }
+
+    /* Parent images are never written */
+    if (s->is_parent)
+        goto fail_later;
+    acb->cluster_offset = vmdk_aio_alloc_cluster(acb);
+    if (!acb->cluster_offset)
+        goto fail_later;
+    acb->alloc_next = s->allocating;
+    s->allocating = acb;
+
+    if (s->hd->backing_hd) {
+        ret = vmdk_aio_cow(acb, index_in_cluster);
+        if (ret < 0)
+            goto fail_later;
+        else if (ret > 0)
+            return;
+        memcpy(acb->cluster_data + index_in_cluster * 512, acb->buf,
+               acb->n * 512);
+        goto write_grain;
+    }
+
+    /* the file was extended with zeroes, only our part needs writing */
+    acb->state = VMDK_AIO_COW_WRITE;
+    acb->hd_aiocb = bdrv_aio_write(s->hd,
+                                   (acb->cluster_offset >> 9) + index_in_cluster,
+                                   acb->buf, acb->n, vmdk_aio_write_cb, acb);
+    if (acb->hd_aiocb == NULL)
+        goto fail_later;
+    return;
+
+ write_grain:
+    acb->state = VMDK_AIO_COW_WRITE;
+    acb->hd_aiocb = bdrv_aio_write(s->hd, acb->cluster_offset >> 9,
+                                   acb->cluster_data, s->cluster_sectors,
+                                   vmdk_aio_write_cb, acb);
+    if (acb->hd_aiocb != NULL)
+        return;
+
+ fail_later:
+    /* this may be the first step, called from vmdk_aio_write() */
+    vmdk_aio_schedule(acb, vmdk_aio_write_cb, -EIO);
+    return;
+
+ fail:
+    vmdk_aio_alloc_done(acb);
+    acb->state = VMDK_AIO_DATA;
+    vmdk_aio_complete(acb, ret);
+}
+
+static BlockDriverAIOCB *vmdk_aio_write(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    VmdkAIOCB *acb;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->hd_aiocb = NULL;
+    acb->bh = NULL;
+    acb->sector_num = sector_num;
+    acb->buf = (uint8_t *)buf;
+    acb->nb_sectors = nb_sectors;
+    acb->n = 0;
+    acb->state = VMDK_AIO_DATA;
+    acb->alloc_next = NULL;
+    acb->waiters = NULL;
+    acb->wait_next = NULL;
+    acb->waiting_on = NULL;
+
+    vmdk_aio_write_cb(acb, 0);
+    return &acb->common;
+}
+
+static void vmdk_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    VmdkAIOCB *acb = (VmdkAIOCB *)blockacb;
+    VmdkAIOCB **pacb;
+
+    if (acb->hd_aiocb)
+        bdrv_aio_cancel(acb->hd_aiocb);
+    if (acb->bh)
+        qemu_bh_delete(acb->bh);
+    if (acb->waiting_on) {
+        pacb = &acb->waiting_on->waiters;
+        while (*pacb != acb)
+            pacb = &(*pacb)->wait_next;
+        *pacb = acb->wait_next;
+        acb->waiting_on = NULL;
+    }
+    /* a half written grain is leaked, but never becomes visible */
+    vmdk_aio_alloc_done(acb);
+    acb->state = VMDK_AIO_DATA;
+    vmdk_aio_release(acb);
+}
+
+static BlockDriverAIOCB *vmdk_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVVmdkState *s = bs->opaque;
+    return bdrv_aio_flush(s->hd, cb, opaque);
+}
+
 static int vmdk_create(const char *filename, int64_t total_size,
                        const char *backing_file, int flags)
 {
@@ -824,4 +1301,10 @@ BlockDriver bdrv_vmdk = {
     vmdk_create,
     vmdk_flush,
     vmdk_is_allocated,
+
+    .bdrv_aio_read = vmdk_aio_read,
+    .bdrv_aio_write = vmdk_aio_write,
+    .bdrv_aio_cancel = vmdk_aio_cancel,
+    .bdrv_aio_flush = vmdk_aio_flush,
+    .aiocb_size = sizeof(VmdkAIOCB),
 };
@@ -116,7 +116,8 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+    /* one bit per BAT entry: block bitmap already set to all ones */
+    uint8_t *bitmap_done;
 
     uint32_t block_size;
     uint32_t bitmap_size;
@@ -161,6 +162,7 @@ static int vpc_open(BlockDriverState *bs, const char *filename, int flags)
     ret = bdrv_file_open(&s->hd, filename, flags);
     if (ret < 0)
         return ret;
+    bs->file = s->hd;
 
     if (bdrv_pread(s->hd, 0, s->footer_buf, HEADER_SIZE) != HEADER_SIZE)
         goto fail;
@@ -216,7 +218,7 @@ static int vpc_open(BlockDriverState *bs, const char *filename, int flags)
         }
     }
 
-    s->last_bitmap_offset = (int64_t) -1;
+    s->bitmap_done = qemu_mallocz((s->max_table_entries + 7) / 8);
 
 #ifdef CACHE
     s->pageentry_u8 = qemu_malloc(512);
@@ -233,7 +235,8 @@ static int vpc_open(BlockDriverState *bs, const char *filename, int flags)
 
 /*
  * Returns the absolute byte offset of the given sector in the image file.
- * If the sector is not allocated, -1 is returned instead.
+ * If the sector is not allocated, -1 is returned instead, and -2 if the
+ * block bitmap could not be written.
  *
  * The parameter write must be 1 if the offset will be used for a write
  * operation (the block bitmaps is updated then), 0 otherwise.
@@ -260,12 +263,17 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
     // bitmap each time we write to a new block. This might cause Virtual PC to
     // miss sparse read optimization, but it's not a problem in terms of
     // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
+    // Remember which bitmaps were written so that this is done only once
+    // per block instead of whenever writes move to another block.
+    if (write && !(s->bitmap_done[pagetable_index / 8] &
+                   (1 << (pagetable_index % 8)))) {
         uint8_t bitmap[s->bitmap_size];
 
-        s->last_bitmap_offset = bitmap_offset;
         memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite(s->hd, bitmap_offset, bitmap, s->bitmap_size);
+        if (bdrv_pwrite(s->hd, bitmap_offset, bitmap, s->bitmap_size) !=
+                s->bitmap_size)
+            return -2;
+        s->bitmap_done[pagetable_index / 8] |= 1 << (pagetable_index % 8);
     }
 
 //    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
@@ -351,6 +359,7 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
     // Initialize the block's bitmap
     memset(bitmap, 0xff, s->bitmap_size);
     bdrv_pwrite(s->hd, s->free_data_block_offset, bitmap, s->bitmap_size);
+    s->bitmap_done[index / 8] |= 1 << (index % 8);
 
     // Write new footer (the old one will be overwritten)
     s->free_data_block_offset += s->block_size + s->bitmap_size;
@@ -372,27 +381,41 @@ fail:
     return -1;
 }
 
+/*
+ * Returns the number of sectors, at most nb_sectors, that can be
+ * transferred from sector_num on without leaving its block.
+ */
+static int vpc_block_sectors(BDRVVPCState *s, int64_t sector_num,
+                             int nb_sectors)
+{
+    int block_sectors = s->block_size / 512;
+    int n = block_sectors - (sector_num % block_sectors);
+
+    return n < nb_sectors ? n : nb_sectors;
+}
+
 static int vpc_read(BlockDriverState *bs, int64_t sector_num,
                     uint8_t *buf, int nb_sectors)
 {
     BDRVVPCState *s = bs->opaque;
-    int ret;
+    int ret, n;
     int64_t offset;
 
     while (nb_sectors > 0) {
         offset = get_sector_offset(bs, sector_num, 0);
+        n = vpc_block_sectors(s, sector_num, nb_sectors);
 
         if (offset == -1) {
-            memset(buf, 0, 512);
+            memset(buf, 0, 512 * n);
         } else {
-            ret = bdrv_pread(s->hd, offset, buf, 512);
-            if (ret != 512)
+            ret = bdrv_pread(s->hd, offset, buf, 512 * n);
+            if (ret != 512 * n)
                 return -1;
         }
 
-        nb_sectors--;
-        sector_num++;
-        buf += 512;
+        nb_sectors -= n;
+        sector_num += n;
+        buf += 512 * n;
     }
     return 0;
 }
@@ -402,29 +425,205 @@ static int vpc_write(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
-    int ret;
+    int ret, n;
 
     while (nb_sectors > 0) {
         offset = get_sector_offset(bs, sector_num, 1);
+        n = vpc_block_sectors(s, sector_num, nb_sectors);
 
         if (offset == -1) {
             offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
         }
+        if (offset < 0)
+            return -1;
 
-        ret = bdrv_pwrite(s->hd, offset, buf, 512);
-        if (ret != 512)
+        ret = bdrv_pwrite(s->hd, offset, buf, 512 * n);
+        if (ret != 512 * n)
             return -1;
 
-        nb_sectors--;
-        sector_num++;
-        buf += 512;
+        nb_sectors -= n;
+        sector_num += n;
+        buf += 512 * n;
     }
 
     return 0;
 }
 
+/*
+ * Asynchronous I/O.  The BAT is kept in memory, so only the data transfers
+ * and the rare block allocations touch the image file; allocations are
+ * done synchronously.
+ */
+
+typedef struct VpcAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+    int n;
+    BlockDriverAIOCB *hd_aiocb;
+    QEMUBH *bh;                 /* see vpc_aio_schedule() */
+    BlockDriverCompletionFunc *bh_cb;
+    int bh_ret;
+} VpcAIOCB;
+
+static void vpc_aio_bh(void *opaque)
+{
+    VpcAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    acb->bh_cb(acb, acb->bh_ret);
+}
+
+/* Carry on with cb(acb, ret) from a bottom half.  Used when there is no
+   I/O to wait for, so the request cannot complete before vpc_aio_read()
+   or vpc_aio_write() has returned it. */
+static void vpc_aio_schedule(VpcAIOCB *acb, BlockDriverCompletionFunc *cb,
+                             int ret)
+{
+    acb->bh_cb = cb;
+    acb->bh_ret = ret;
+    acb->bh = qemu_bh_new(vpc_aio_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+static void vpc_aio_read_cb(void *opaque, int ret)
+{
+    VpcAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BDRVVPCState *s = bs->opaque;
+    int64_t offset;
+
+    acb->hd_aiocb = NULL;
+    if (ret < 0) {
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    acb->nb_sectors -= acb->n;
+    acb->sector_num += acb->n;
+    acb->buf += acb->n * 512;
+
+    if (acb->nb_sectors == 0) {
+        /* request completed */
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    offset = get_sector_offset(bs, acb->sector_num, 0);
+    acb->n = vpc_block_sectors(s, acb->sector_num, acb->nb_sectors);
+    if (offset == -1) {
+        memset(acb->buf, 0, 512 * acb->n);
+        vpc_aio_schedule(acb, vpc_aio_read_cb, 0);
+        return;
+    }
+
+    acb->hd_aiocb = bdrv_aio_read(s->hd, offset >> 9, acb->buf, acb->n,
+                                  vpc_aio_read_cb, acb);
+    if (acb->hd_aiocb == NULL)
+        vpc_aio_schedule(acb, vpc_aio_read_cb, -EIO);
+}
+
+static BlockDriverAIOCB *vpc_aio_read(BlockDriverState *bs,
+        int64_t sector_num, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    VpcAIOCB *acb;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->hd_aiocb = NULL;
+    acb->bh = NULL;
+    acb->sector_num = sector_num;
+    acb->buf = buf;
+    acb->nb_sectors = nb_sectors;
+    acb->n = 0;
+
+    vpc_aio_read_cb(acb, 0);
+    return &acb->common;
+}
+
+static void vpc_aio_write_cb(void *opaque, int ret)
+{
+    VpcAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    BDRVVPCState *s = bs->opaque;
+    int64_t offset;
+
+    acb->hd_aiocb = NULL;
+    if (ret < 0) {
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    acb->nb_sectors -= acb->n;
+    acb->sector_num += acb->n;
+    acb->buf += acb->n * 512;
+
+    if (acb->nb_sectors == 0) {
+        /* request completed */
+        acb->common.cb(acb->common.opaque, 0);
+        qemu_aio_release(acb);
+        return;
+    }
+
+    offset = get_sector_offset(bs, acb->sector_num, 1);
+    acb->n = vpc_block_sectors(s, acb->sector_num, acb->nb_sectors);
+    if (offset == -1)
+        offset = alloc_block(bs, acb->sector_num);
+    if (offset < 0) {
+        vpc_aio_schedule(acb, vpc_aio_write_cb, -EIO);
+        return;
+    }
+
+    acb->hd_aiocb = bdrv_aio_write(s->hd, offset >> 9, acb->buf, acb->n,
+                                   vpc_aio_write_cb, acb);
+    if (acb->hd_aiocb == NULL)
+        vpc_aio_schedule(acb, vpc_aio_write_cb, -EIO);
+}
+
+static BlockDriverAIOCB *vpc_aio_write(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    VpcAIOCB *acb;
+
+    acb = qemu_aio_get(bs, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->hd_aiocb = NULL;
+    acb->bh = NULL;
+    acb->sector_num = sector_num;
+    acb->buf = (uint8_t *)buf;
+    acb->nb_sectors = nb_sectors;
+    acb->n = 0;
+
+    vpc_aio_write_cb(acb, 0);
+    return &acb->common;
+}
+
+static void vpc_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    VpcAIOCB *acb = (VpcAIOCB *)blockacb;
+    if (acb->hd_aiocb)
+        bdrv_aio_cancel(acb->hd_aiocb);
+    if (acb->bh)
+        qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
+}
+
+static BlockDriverAIOCB *vpc_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVVPCState *s = bs->opaque;
+    return bdrv_aio_flush(s->hd, cb, opaque);
+}
+
 
 /*
  * Calculates the number of cylinders, heads and sectors per cylinder
@@ -575,6 +774,7 @@ static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
     qemu_free(s->pagetable);
+    qemu_free(s->bitmap_done);
 #ifdef CACHE
     qemu_free(s->pageentry_u8);
 #endif
@@ -590,4 +790,10 @@ BlockDriver bdrv_vpc = {
     vpc_write,
     vpc_close,
     vpc_create,
+
+    .bdrv_aio_read = vpc_aio_read,
+    .bdrv_aio_write = vpc_aio_write,
+    .bdrv_aio_cancel = vpc_aio_cancel,
+    .bdrv_aio_flush = vpc_aio_flush,
+    .aiocb_size = sizeof(VpcAIOCB),
 };
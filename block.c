@@ -29,6 +29,7 @@
 
 #include "qemu-common.h"
 #include "console.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 
 #ifdef _BSD
@@ -47,6 +48,196 @@ typedef struct BlockDriverAIOCBSync {
     int ret;
 } BlockDriverAIOCBSync;
 
+/* read-ahead, see bdrv_set_readahead() */
+
+#define BDRV_RA_SLOTS    8  /* prefetch windows cached per drive */
+#define BDRV_RA_STREAMS  4  /* sequential streams tracked per drive */
+#define BDRV_RA_TRIGGER  2  /* sequential reads before prefetching starts */
+#define BDRV_RA_DEPTH    2  /* windows kept in flight ahead of a stream */
+
+enum {
+    BDRV_RA_EMPTY,
+    BDRV_RA_LOADING,
+    BDRV_RA_VALID,
+};
+
+typedef struct BlockRASlot {
+    BlockReadAhead *ra;
+    int state;
+    int stale;                  /* written to while loading */
+    int used;                   /* served at least one read */
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    BlockDriverAIOCB *aiocb;
+    uint64_t last_use;
+} BlockRASlot;
+
+typedef struct BlockRAStream {
+    int64_t next_sector;        /* where the stream should continue */
+    int64_t ra_sector;          /* first sector not prefetched yet */
+    int seq;                    /* sequential reads seen so far */
+    uint64_t last_use;
+} BlockRAStream;
+
+/* A read served from the cache */
+typedef struct BlockRARequest {
+    BlockDriverAIOCB *aiocb;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    QEMUIOVector *qiov;
+    unsigned int wait;          /* slots still loading, one bit per slot */
+    int ret;
+    struct BlockRARequest *next;
+} BlockRARequest;
+
+struct BlockReadAhead {
+    BlockDriverState *bs;
+    int window;                 /* sectors per slot */
+    uint64_t clock;
+    BlockRASlot slots[BDRV_RA_SLOTS];
+    BlockRAStream streams[BDRV_RA_STREAMS];
+    BlockRARequest *waiting;    /* hits on slots that are still loading */
+    BlockRARequest *done;       /* hits to complete from the bottom half */
+    QEMUBH *bh;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t prefetched;        /* sectors */
+    uint64_t unused;            /* sectors dropped without serving a read */
+};
+
+/* write-back cache, see bdrv_set_writecache() */
+
+#define BDRV_WC_MAX_RUN       2048     /* sectors per write-back request */
+#define BDRV_WC_MAX_WRITEBACK 4        /* write-back requests in flight */
+#define BDRV_WC_EXPIRE        5000000  /* us before dirty data is written */
+
+enum {
+    BDRV_WC_READ,
+    BDRV_WC_WRITE,
+    BDRV_WC_FLUSH,
+};
+
+/* what bdrv_wc_check() decided to do with a request */
+enum {
+    BDRV_WC_PASS,               /* send it to the driver */
+    BDRV_WC_TAKE,               /* serve it from the cache */
+    BDRV_WC_WAIT,               /* wait for write-back */
+};
+
+/* Dirty data that has not been handed to the driver yet */
+typedef struct BlockWCExtent {
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    uint64_t gen;               /* oldest write held by the extent */
+    int writing;                /* part of a write-back request in flight */
+    int urgent;                 /* a waiting request overlaps it */
+    int redirty;                /* written to while writing */
+    uint64_t redirty_gen;
+    struct BlockWCExtent *next;
+} BlockWCExtent;
+
+typedef struct BlockWCRequest {
+    BlockWriteCache *wc;
+    BlockDriverAIOCB *aiocb;
+    int type;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    QEMUIOVector *qiov;
+    uint64_t gen;               /* flushes: last write they cover */
+    BlockDriverAIOCB *inner;    /* the request passed to the driver */
+    int ret;
+    struct BlockWCRequest *next;
+} BlockWCRequest;
+
+typedef struct BlockWCWriteback {
+    BlockWriteCache *wc;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+} BlockWCWriteback;
+
+struct BlockWriteCache {
+    BlockDriverState *bs;
+    int limit;                  /* sectors of dirty data */
+    int dirty;
+    uint64_t gen;               /* last write taken */
+    uint64_t wb_gen;            /* write back everything up to here */
+    uint64_t epoch_gen;         /* last write before epoch_start */
+    int64_t epoch_start;
+    int writeback;              /* write-back requests in flight */
+    int error;                  /* failed write-back, cleared by flushes */
+    BlockWCExtent *extents;     /* sorted, never overlapping */
+    BlockWCRequest *queue;      /* reads and writes waiting for write-back */
+    BlockWCRequest *flushes;    /* flushes waiting for write-back */
+    BlockWCRequest *inner;      /* requests passed to the driver */
+    BlockWCRequest *submitting; /* the one being passed right now */
+    BlockWCRequest *done;       /* to complete from the bottom half */
+    QEMUBH *bh;
+    QEMUTimer *timer;           /* ends epochs, NULL in the tools */
+    int timer_armed;
+
+    uint64_t read_hits;
+    uint64_t absorbed;          /* sectors overwritten while still dirty */
+    uint64_t wb_ops;
+    uint64_t wb_sectors;
+    uint64_t flushes_done;
+};
+
+/* commit, see bdrv_commit_start() */
+
+#define BDRV_COMMIT_CHUNK_BITS 7        /* 64 KB chunks for dirty tracking */
+#define BDRV_COMMIT_CHUNK (1 << BDRV_COMMIT_CHUNK_BITS)
+#define BDRV_COMMIT_MAX_RUN    1024     /* sectors per copy request */
+#define BDRV_COMMIT_PARALLEL   8        /* copy requests in flight */
+#define BDRV_COMMIT_SCAN       4096     /* lookups per step of a live job */
+#define BDRV_COMMIT_FINAL      256      /* dirty chunks left for the last step */
+#define BDRV_COMMIT_SLICE      100      /* ms, rate limit accounting period */
+
+enum {
+    BDRV_COMMIT_ACTIVE,
+    BDRV_COMMIT_COMPLETED,
+    BDRV_COMMIT_FAILED,
+    BDRV_COMMIT_CANCELLED,
+};
+
+typedef struct BlockCommitRequest {
+    BlockCommitJob *job;
+    int busy;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+} BlockCommitRequest;
+
+struct BlockCommitJob {
+    BlockDriverState *bs;
+    int state;
+    int ret;
+    int sync;                   /* bdrv_commit() is waiting for it */
+    int cancelled;
+    int running;                /* in bdrv_commit_run() */
+    int final_ready;            /* waiting for bdrv_commit_complete() */
+    int64_t total;              /* sectors */
+    int pass;
+    int64_t pos;                /* scan position in the current pass */
+    int64_t chunk_end;          /* end of the dirty chunk being copied */
+    int64_t nb_chunks;
+    unsigned long *dirty;       /* chunks written to behind the scan */
+    int64_t nb_dirty;
+    int in_flight;
+    BlockCommitRequest reqs[BDRV_COMMIT_PARALLEL];
+    QEMUTimer *timer;           /* live jobs only */
+    int64_t slice_end;
+    int64_t slice_bytes;
+    int64_t start_time;         /* ms */
+    int64_t end_time;
+    uint64_t copied;            /* sectors */
+};
+
 static BlockDriverAIOCB *bdrv_aio_read_em(BlockDriverState *bs,
         int64_t sector_num, uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -60,6 +251,19 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors);
 static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors);
+static void bdrv_ra_invalidate(BlockReadAhead *ra, int64_t sector_num,
+                               int nb_sectors);
+static void bdrv_ra_reset(BlockReadAhead *ra);
+static void bdrv_ra_free(BlockReadAhead *ra);
+static int bdrv_wc_drain(BlockDriverState *bs);
+static void bdrv_wc_free(BlockWriteCache *wc);
+static int bdrv_flush_driver(BlockDriverState *bs);
+static void bdrv_am_invalidate(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors);
+static void bdrv_am_free(BlockDriverState *bs);
+static void bdrv_commit_dirty(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors);
+static void bdrv_commit_stop(BlockDriverState *bs);
 
 BlockDriverState *bdrv_first;
 
@@ -431,6 +635,7 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
         qemu_free(bs->opaque);
         bs->opaque = NULL;
         bs->drv = NULL;
+        bs->file = NULL;
     unlink_and_fail:
         if (bs->is_temporary)
             unlink(filename);
@@ -467,6 +672,12 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
 void bdrv_close(BlockDriverState *bs)
 {
     if (bs->drv) {
+        bdrv_commit_stop(bs);
+        if (bs->wcache)
+            bdrv_wc_free(bs->wcache);
+        if (bs->readahead)
+            bdrv_ra_reset(bs->readahead);
+        bdrv_am_free(bs);
         if (bs->backing_hd)
             bdrv_delete(bs->backing_hd);
         bs->drv->bdrv_close(bs);
@@ -478,6 +689,8 @@ void bdrv_close(BlockDriverState *bs)
 #endif
         bs->opaque = NULL;
         bs->drv = NULL;
+        bs->backing_hd = NULL;
+        bs->file = NULL;
 
         /* call the change callback */
         bs->media_changed = 1;
@@ -497,50 +710,116 @@ void bdrv_delete(BlockDriverState *bs)
         *pbs = bs->next;
 
     bdrv_close(bs);
+    if (bs->readahead)
+        bdrv_ra_free(bs->readahead);
     qemu_free(bs);
 }
 
-/* commit COW file into the raw image */
-int bdrv_commit(BlockDriverState *bs)
+/**************************************************************/
+/* latency accounting */
+
+/* Every request is accounted once, at the interface the driver implements
+   natively: emulated aio is timed through the sync call it makes and
+   emulated sync I/O through the aio request it waits for. */
+
+typedef struct BlockLatencyState {
+    BlockDriverState *bs;
+    int type;
+    int64_t sector_num;
+    int nb_sectors;
+    int64_t start;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    struct BlockLatencyState *next;
+} BlockLatencyState;
+
+static BlockLatencyState *bdrv_lat_free_list;
+
+static int64_t bdrv_lat_now(void)
 {
-    BlockDriver *drv = bs->drv;
-    int64_t i, total_sectors;
-    int n, j;
-    unsigned char sector[512];
+    qemu_timeval tv;
 
-    if (!drv)
-        return -ENOMEDIUM;
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
 
-    if (bs->read_only) {
-	return -EACCES;
-    }
+void bdrv_latency_add(BlockLatencyStats *st, uint64_t us)
+{
+    int n = 0;
 
-    if (!bs->backing_hd) {
-	return -ENOTSUP;
-    }
+    while (n < BDRV_LAT_BUCKETS - 1 && (us >> n) != 0)
+        n++;
+    st->hist[n]++;
+    st->count++;
+    st->total_us += us;
+    if (us > st->max_us)
+        st->max_us = us;
+}
 
-    total_sectors = bdrv_getlength(bs) >> SECTOR_BITS;
-    for (i = 0; i < total_sectors;) {
-        if (drv->bdrv_is_allocated(bs, i, 65536, &n)) {
-            for(j = 0; j < n; j++) {
-                if (bdrv_read(bs, i, sector, 1) != 0) {
-                    return -EIO;
-                }
+static int64_t bdrv_lat_begin(BlockDriverState *bs)
+{
+    if (++bs->in_flight > bs->in_flight_peak)
+        bs->in_flight_peak = bs->in_flight;
+    return bdrv_lat_now();
+}
 
-                if (bdrv_write(bs->backing_hd, i, sector, 1) != 0) {
-                    return -EIO;
-                }
-                i++;
-	    }
-	} else {
-            i += n;
-        }
+static void bdrv_lat_end(BlockDriverState *bs, int type, int64_t start)
+{
+    int64_t now = bdrv_lat_now();
+
+    bs->in_flight--;
+    /* the wall clock may have been stepped backwards */
+    bdrv_latency_add(&bs->latency[type], now > start ? now - start : 0);
+}
+
+static void bdrv_lat_cb(void *opaque, int ret)
+{
+    BlockLatencyState *lat = opaque;
+
+    bdrv_lat_end(lat->bs, lat->type, lat->start);
+    if (lat->type == BDRV_LAT_WRITE) {
+        lat->bs->wr_in_flight--;
+        bdrv_commit_dirty(lat->bs, lat->sector_num, lat->nb_sectors);
     }
+    lat->cb(lat->opaque, ret);
+    lat->next = bdrv_lat_free_list;
+    bdrv_lat_free_list = lat;
+}
 
-    if (drv->bdrv_make_empty)
-	return drv->bdrv_make_empty(bs);
+/* Interpose bdrv_lat_cb between the driver and the caller's callback */
+static BlockLatencyState *bdrv_lat_submit(BlockDriverState *bs, int type,
+                                          int64_t sector_num, int nb_sectors,
+                                          BlockDriverCompletionFunc **cb,
+                                          void **opaque)
+{
+    BlockLatencyState *lat = bdrv_lat_free_list;
 
-    return 0;
+    if (lat)
+        bdrv_lat_free_list = lat->next;
+    else
+        lat = qemu_malloc(sizeof(*lat));
+    lat->bs = bs;
+    lat->type = type;
+    lat->sector_num = sector_num;
+    lat->nb_sectors = nb_sectors;
+    lat->cb = *cb;
+    lat->opaque = *opaque;
+    lat->start = bdrv_lat_begin(bs);
+    if (type == BDRV_LAT_WRITE)
+        bs->wr_in_flight++;
+    *cb = bdrv_lat_cb;
+    *opaque = lat;
+    return lat;
+}
+
+/* The request failed to submit or was cancelled, so it never completes */
+static void bdrv_lat_abort(BlockLatencyState *lat)
+{
+    lat->bs->in_flight--;
+    if (lat->type == BDRV_LAT_WRITE)
+        lat->bs->wr_in_flight--;
+    lat->next = bdrv_lat_free_list;
+    bdrv_lat_free_list = lat;
 }
 
 static int bdrv_check_byte_request(BlockDriverState *bs, int64_t offset,
@@ -589,10 +868,15 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
 
     if (bdrv_check_request(bs, sector_num, nb_sectors))
 	return -EIO;
+    if (bs->wcache)
+        return bdrv_read_em(bs, sector_num, buf, nb_sectors);
     if (drv->bdrv_pread) {
         int ret, len;
+        int64_t start;
         len = nb_sectors * 512;
+        start = bdrv_lat_begin(bs);
         ret = drv->bdrv_pread(bs, sector_num * 512, buf, len);
+        bdrv_lat_end(bs, BDRV_LAT_READ, start);
         if (ret < 0)
             return ret;
         else if (ret != len)
@@ -602,8 +886,14 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
 	    bs->rd_ops ++;
             return 0;
 	}
-    } else {
+    } else if (drv->bdrv_read == bdrv_read_em) {
         return drv->bdrv_read(bs, sector_num, buf, nb_sectors);
+    } else {
+        int ret;
+        int64_t start = bdrv_lat_begin(bs);
+        ret = drv->bdrv_read(bs, sector_num, buf, nb_sectors);
+        bdrv_lat_end(bs, BDRV_LAT_READ, start);
+        return ret;
     }
 }
 
@@ -623,23 +913,40 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
         return -EACCES;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
+    if (bs->readahead)
+        bdrv_ra_invalidate(bs->readahead, sector_num, nb_sectors);
+    bdrv_am_invalidate(bs, sector_num, nb_sectors);
+    if (bs->wcache)
+        return bdrv_write_em(bs, sector_num, buf, nb_sectors);
+    bdrv_commit_dirty(bs, sector_num, nb_sectors);
 
     if (drv->bdrv_pwrite) {
         int ret, len, count = 0;
+        int64_t start;
         len = nb_sectors * 512;
+        start = bdrv_lat_begin(bs);
         do {
             ret = drv->bdrv_pwrite(bs, sector_num * 512, buf, len - count);
             if (ret < 0) {
+                bdrv_lat_end(bs, BDRV_LAT_WRITE, start);
                 printf("bdrv_write ret=%d\n", ret);
                 return ret;
             }
             count += ret;
             buf += ret;
         } while (count != len);
+        bdrv_lat_end(bs, BDRV_LAT_WRITE, start);
         bs->wr_bytes += (unsigned) len;
         bs->wr_ops ++;
         return 0;
     }
+    if (drv->bdrv_write != bdrv_write_em) {
+        int ret;
+        int64_t start = bdrv_lat_begin(bs);
+        ret = drv->bdrv_write(bs, sector_num, buf, nb_sectors);
+        bdrv_lat_end(bs, BDRV_LAT_WRITE, start);
+        return ret;
+    }
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
@@ -742,15 +1049,20 @@ int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf1, int count1)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start;
+    int ret;
 
     if (!drv)
         return -ENOMEDIUM;
     if (bdrv_check_byte_request(bs, offset, count1))
         return -EIO;
 
-    if (!drv->bdrv_pread)
+    if (!drv->bdrv_pread || bs->wcache)
         return bdrv_pread_em(bs, offset, buf1, count1);
-    return drv->bdrv_pread(bs, offset, buf1, count1);
+    start = bdrv_lat_begin(bs);
+    ret = drv->bdrv_pread(bs, offset, buf1, count1);
+    bdrv_lat_end(bs, BDRV_LAT_READ, start);
+    return ret;
 }
 
 /**
@@ -760,15 +1072,30 @@ int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
                 const void *buf1, int count1)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start;
+    int ret;
 
     if (!drv)
         return -ENOMEDIUM;
     if (bdrv_check_byte_request(bs, offset, count1))
         return -EIO;
 
-    if (!drv->bdrv_pwrite)
+    if (!drv->bdrv_pwrite || bs->wcache)
         return bdrv_pwrite_em(bs, offset, buf1, count1);
-    return drv->bdrv_pwrite(bs, offset, buf1, count1);
+    if (bs->readahead)
+        bdrv_ra_invalidate(bs->readahead, offset >> SECTOR_BITS,
+                           ((offset & (SECTOR_SIZE - 1)) + count1 +
+                            SECTOR_SIZE - 1) >> SECTOR_BITS);
+    bdrv_am_invalidate(bs, offset >> SECTOR_BITS,
+                       ((offset & (SECTOR_SIZE - 1)) + count1 +
+                        SECTOR_SIZE - 1) >> SECTOR_BITS);
+    bdrv_commit_dirty(bs, offset >> SECTOR_BITS,
+                      ((offset & (SECTOR_SIZE - 1)) + count1 +
+                       SECTOR_SIZE - 1) >> SECTOR_BITS);
+    start = bdrv_lat_begin(bs);
+    ret = drv->bdrv_pwrite(bs, offset, buf1, count1);
+    bdrv_lat_end(bs, BDRV_LAT_WRITE, start);
+    return ret;
 }
 
 /**
@@ -777,10 +1104,19 @@ int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
 int bdrv_truncate(BlockDriverState *bs, int64_t offset)
 {
     BlockDriver *drv = bs->drv;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_truncate)
         return -ENOTSUP;
+    bdrv_commit_stop(bs);
+    ret = bdrv_wc_drain(bs);
+    if (ret < 0)
+        return ret;
+    if (bs->readahead)
+        bdrv_ra_reset(bs->readahead);
+    bdrv_am_free(bs);
     return drv->bdrv_truncate(bs, offset);
 }
 
@@ -1065,16 +1401,27 @@ const char *bdrv_get_device_name(BlockDriverState *bs)
     return bs->device_name;
 }
 
-int bdrv_flush(BlockDriverState *bs)
+static int bdrv_flush_driver(BlockDriverState *bs)
 {
     int ret = 0;
-    if (bs->drv->bdrv_flush)
+    if (bs->drv->bdrv_flush) {
+        int64_t start = bdrv_lat_begin(bs);
         ret = bs->drv->bdrv_flush(bs);
+        bdrv_lat_end(bs, BDRV_LAT_FLUSH, start);
+    }
     if (!ret && bs->backing_hd)
         ret = bdrv_flush(bs->backing_hd);
     return ret;
 }
 
+int bdrv_flush(BlockDriverState *bs)
+{
+    int ret = bdrv_wc_drain(bs);
+    if (ret < 0)
+        return ret;
+    return bdrv_flush_driver(bs);
+}
+
 int bdrv_flush_all(void)
 {
     BlockDriverState *bs;
@@ -1090,6 +1437,128 @@ int bdrv_flush_all(void)
     return ret;
 }
 
+/**************************************************************/
+/* allocation maps */
+
+/*
+ * Each chunk of the image is either unknown, or known to be allocated or
+ * unallocated as a whole.  A chunk is the cluster size the driver reports
+ * through bdrv_get_info(), or BDRV_AM_DEFAULT_BITS.  Chunks that are only
+ * partly allocated stay unknown and are always asked from the driver.
+ *
+ * Writes make the chunks they touch unknown again.  Nothing is cached
+ * while AIO writes are in flight, as the driver may be allocating.
+ */
+
+#define BDRV_AM_DEFAULT_BITS 7          /* 64 KB */
+#define BDRV_AM_FILL (1 << 20)          /* sectors per driver query */
+#define BDRV_AM_WORD_BITS (sizeof(unsigned long) * 8)
+
+struct BlockAllocMap {
+    int chunk_bits;                     /* log2 of sectors per chunk */
+    int64_t nb_chunks;
+    unsigned long *known;
+    unsigned long *allocated;
+};
+
+static inline int bdrv_am_test(unsigned long *map, int64_t i)
+{
+    return (map[i / BDRV_AM_WORD_BITS] >> (i % BDRV_AM_WORD_BITS)) & 1;
+}
+
+static inline void bdrv_am_set(unsigned long *map, int64_t i, int val)
+{
+    unsigned long mask = 1UL << (i % BDRV_AM_WORD_BITS);
+
+    if (val)
+        map[i / BDRV_AM_WORD_BITS] |= mask;
+    else
+        map[i / BDRV_AM_WORD_BITS] &= ~mask;
+}
+
+static BlockAllocMap *bdrv_am_get(BlockDriverState *bs)
+{
+    BlockAllocMap *am = bs->allocmap;
+    BlockDriverInfo bdi;
+    size_t size;
+
+    if (am)
+        return am;
+    if (!(bs->drv->bdrv_flags & BLOCK_DRIVER_FLAG_BACKING) ||
+        bs->total_sectors <= 0)
+        return NULL;
+
+    am = qemu_mallocz(sizeof(*am));
+    am->chunk_bits = BDRV_AM_DEFAULT_BITS;
+    if (bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size >= SECTOR_SIZE &&
+        !(bdi.cluster_size & (bdi.cluster_size - 1)))
+        am->chunk_bits = ffs(bdi.cluster_size) - 1 - SECTOR_BITS;
+    am->nb_chunks = ((bs->total_sectors - 1) >> am->chunk_bits) + 1;
+    size = (am->nb_chunks + BDRV_AM_WORD_BITS - 1) / BDRV_AM_WORD_BITS *
+           sizeof(unsigned long);
+    am->known = qemu_mallocz(size);
+    am->allocated = qemu_mallocz(size);
+    bs->allocmap = am;
+    return am;
+}
+
+static void bdrv_am_free(BlockDriverState *bs)
+{
+    BlockAllocMap *am = bs->allocmap;
+
+    if (!am)
+        return;
+    qemu_free(am->known);
+    qemu_free(am->allocated);
+    qemu_free(am);
+    bs->allocmap = NULL;
+}
+
+static void bdrv_am_invalidate(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors)
+{
+    BlockAllocMap *am = bs->allocmap;
+    int64_t i, last;
+
+    if (!am || nb_sectors <= 0 || sector_num < 0)
+        return;
+    i = sector_num >> am->chunk_bits;
+    last = MIN((sector_num + nb_sectors - 1) >> am->chunk_bits,
+               am->nb_chunks - 1);
+    for (; i <= last; i++)
+        bdrv_am_set(am->known, i, 0);
+}
+
+/* Whether chunk has a known state, asking the driver if necessary.  The
+   answer is used for every chunk it covers completely. */
+static int bdrv_am_known(BlockDriverState *bs, BlockAllocMap *am,
+                         int64_t chunk)
+{
+    int64_t start, end;
+    int ret, n;
+
+    if (bdrv_am_test(am->known, chunk))
+        return 1;
+    if (bs->wr_in_flight)
+        return 0;
+
+    start = chunk << am->chunk_bits;
+    ret = bs->drv->bdrv_is_allocated(bs, start,
+                                     MIN(bs->total_sectors - start,
+                                         BDRV_AM_FILL), &n);
+    if (n <= 0)
+        return 0;
+    end = start + n;
+    if (end < bs->total_sectors)
+        end = (end >> am->chunk_bits) << am->chunk_bits;
+    for (; start < end; start += 1 << am->chunk_bits) {
+        int64_t i = start >> am->chunk_bits;
+        bdrv_am_set(am->allocated, i, ret > 0);
+        bdrv_am_set(am->known, i, 1);
+    }
+    return bdrv_am_test(am->known, chunk);
+}
+
 /*
  * Returns true iff the specified sector is present in the disk image. Drivers
  * not implementing the functionality are assumed to not support backing files,
@@ -1104,7 +1573,10 @@ int bdrv_flush_all(void)
 int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 	int *pnum)
 {
-    int64_t n;
+    BlockAllocMap *am;
+    int64_t n, chunk, end;
+    int ret;
+
     if (!bs->drv->bdrv_is_allocated) {
         if (sector_num >= bs->total_sectors) {
             *pnum = 0;
@@ -1114,247 +1586,1963 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
         *pnum = (n < nb_sectors) ? (n) : (nb_sectors);
         return 1;
     }
-    return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+
+    am = bdrv_am_get(bs);
+    if (!am || sector_num < 0 || sector_num >= bs->total_sectors)
+        return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+
+    chunk = sector_num >> am->chunk_bits;
+    if (!bdrv_am_known(bs, am, chunk))
+        return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+    ret = bdrv_am_test(am->allocated, chunk);
+
+    end = MIN(sector_num + nb_sectors, bs->total_sectors);
+    for (chunk++; chunk < am->nb_chunks &&
+                  (chunk << am->chunk_bits) < end; chunk++) {
+        if (!bdrv_am_known(bs, am, chunk) ||
+            bdrv_am_test(am->allocated, chunk) != ret)
+            break;
+    }
+    *pnum = MIN(chunk << am->chunk_bits, end) - sector_num;
+    return ret;
 }
 
-void bdrv_info(void)
+/*
+ * Find the image that provides sector_num when reading bs: bs itself or
+ * one of its backing files, going down through BLOCK_DRIVER_FLAG_BACKING
+ * formats with their allocation maps rather than through each driver's
+ * read path.  Returns NULL if the sector is allocated nowhere and reads
+ * as zeroes.  *pnum is set to the number of sectors, at most nb_sectors,
+ * that come from the same place.
+ */
+BlockDriverState *bdrv_chain_owner(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors, int *pnum)
 {
-    BlockDriverState *bs;
+    BlockDriverState *top = bs;
+    int depth = 0, n;
 
-    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
-        term_printf("%s:", bs->device_name);
-        term_printf(" type=");
-        switch(bs->type) {
-        case BDRV_TYPE_HD:
-            term_printf("hd");
+    while (bs && bs->drv) {
+        if (sector_num >= bs->total_sectors) {
+            /* reads past the end of a backing file return zeroes */
+            bs = NULL;
             break;
-        case BDRV_TYPE_CDROM:
-            term_printf("cdrom");
+        }
+        if (sector_num + nb_sectors > bs->total_sectors)
+            nb_sectors = bs->total_sectors - sector_num;
+        if (!(bs->drv->bdrv_flags & BLOCK_DRIVER_FLAG_BACKING))
             break;
-        case BDRV_TYPE_FLOPPY:
-            term_printf("floppy");
+        if (bdrv_is_allocated(bs, sector_num, nb_sectors, &n)) {
+            nb_sectors = n;
             break;
         }
-        term_printf(" removable=%d", bs->removable);
-        if (bs->removable) {
-            term_printf(" locked=%d", bs->locked);
+        if (n <= 0) {
+            /* let the driver sort it out */
+            break;
         }
-        if (bs->drv) {
-            term_printf(" file=");
-	    term_print_filename(bs->filename);
-            if (bs->backing_file[0] != '\0') {
-                term_printf(" backing_file=");
-		term_print_filename(bs->backing_file);
-	    }
-            term_printf(" ro=%d", bs->read_only);
-            term_printf(" drv=%s", bs->drv->format_name);
-            term_printf(" encrypted=%d", bdrv_is_encrypted(bs));
+        nb_sectors = n;
+        bs = bs->backing_hd;
+        depth++;
+    }
+
+    if (bs)
+        top->chain_hits[MIN(depth, BDRV_CHAIN_DEPTHS - 1)]++;
+    else
+        top->chain_zero_hits++;
+    *pnum = nb_sectors;
+    return bs;
+}
+
+/* Synchronous read through bdrv_chain_owner() */
+int bdrv_read_chain(BlockDriverState *bs, int64_t sector_num,
+                    uint8_t *buf, int nb_sectors)
+{
+    BlockDriverState *owner;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        owner = bdrv_chain_owner(bs, sector_num, nb_sectors, &n);
+        if (owner) {
+            ret = bdrv_read(owner, sector_num, buf, n);
+            if (ret < 0)
+                return ret;
         } else {
-            term_printf(" [not inserted]");
+            memset(buf, 0, n * SECTOR_SIZE);
         }
-        term_printf("\n");
+        sector_num += n;
+        buf += n * SECTOR_SIZE;
+        nb_sectors -= n;
     }
+    return 0;
 }
 
-/* The "info blockstats" command. */
-void bdrv_info_stats (void)
+/**************************************************************/
+/* commit */
+
+/*
+ * Commit copies what is allocated in an image into its backing file and
+ * then empties the image.  The image is scanned with bdrv_is_allocated()
+ * and each allocated run of up to BDRV_COMMIT_MAX_RUN sectors is read
+ * through the image and written to the backing file, with up to
+ * BDRV_COMMIT_PARALLEL runs in flight.
+ *
+ * A job started with bdrv_commit_start() runs while the image stays in
+ * use.  Writes to the image mark the chunks they touch dirty when they
+ * complete, unless the scan has not got there yet, and further passes
+ * copy the dirty chunks again.  Once a pass ends with no more than
+ * BDRV_COMMIT_FINAL dirty chunks, bdrv_commit_complete() waits for all
+ * requests on the image, copies the rest synchronously, flushes the
+ * backing file and empties the image before the guest can write again.
+ * bdrv_commit() runs the same job and waits for it.
+ *
+ * Live jobs copy at most bdrv_commit_speed bytes per second, accounted
+ * over BDRV_COMMIT_SLICE, and look up at most BDRV_COMMIT_SCAN runs
+ * before going back to the main loop.  A failed copy stops the job and
+ * leaves the image as it was.
+ */
+
+static int64_t bdrv_commit_speed = 32 << 20;
+
+static void bdrv_commit_run(BlockCommitJob *job);
+
+static void bdrv_commit_dirty(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors)
 {
-    BlockDriverState *bs;
+    BlockCommitJob *job = bs->commit;
+    int64_t i, last;
 
-    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
-	term_printf ("%s:"
-		     " rd_bytes=%" PRIu64
-		     " wr_bytes=%" PRIu64
-		     " rd_operations=%" PRIu64
-		     " wr_operations=%" PRIu64
-                     "\n",
-		     bs->device_name,
-		     bs->rd_bytes, bs->wr_bytes,
-		     bs->rd_ops, bs->wr_ops);
+    if (!job || job->state != BDRV_COMMIT_ACTIVE || nb_sectors <= 0 ||
+        sector_num < 0)
+        return;
+    i = sector_num >> BDRV_COMMIT_CHUNK_BITS;
+    last = MIN((sector_num + nb_sectors - 1) >> BDRV_COMMIT_CHUNK_BITS,
+               job->nb_chunks - 1);
+    if (job->pass == 1) {
+        /* the first pass has yet to copy anything from the cursor on */
+        if (job->pos == 0)
+            return;
+        last = MIN(last, (job->pos - 1) >> BDRV_COMMIT_CHUNK_BITS);
+    }
+    for (; i <= last; i++) {
+        if (!bdrv_am_test(job->dirty, i)) {
+            bdrv_am_set(job->dirty, i, 1);
+            job->nb_dirty++;
+        }
     }
 }
 
-const char *bdrv_get_encrypted_filename(BlockDriverState *bs)
+static void bdrv_commit_finish(BlockCommitJob *job, int ret)
 {
-    if (bs->backing_hd && bs->backing_hd->encrypted)
-        return bs->backing_file;
-    else if (bs->encrypted)
-        return bs->filename;
+    int i;
+
+    if (ret == 0)
+        job->state = BDRV_COMMIT_COMPLETED;
+    else if (ret == -ECANCELED)
+        job->state = BDRV_COMMIT_CANCELLED;
     else
-        return NULL;
+        job->state = BDRV_COMMIT_FAILED;
+    job->ret = ret;
+    job->final_ready = 0;
+    job->end_time = qemu_get_clock(rt_clock);
+    if (job->timer) {
+        qemu_del_timer(job->timer);
+        qemu_free_timer(job->timer);
+        job->timer = NULL;
+    }
+    for (i = 0; i < BDRV_COMMIT_PARALLEL; i++) {
+        qemu_free(job->reqs[i].buf);
+        job->reqs[i].buf = NULL;
+    }
+    qemu_free(job->dirty);
+    job->dirty = NULL;
 }
 
-void bdrv_get_backing_filename(BlockDriverState *bs,
-                               char *filename, int filename_size)
+static void bdrv_commit_write_cb(void *opaque, int ret)
 {
-    if (!bs->backing_hd) {
-        pstrcpy(filename, filename_size, "");
+    BlockCommitRequest *req = opaque;
+    BlockCommitJob *job = req->job;
+
+    if (ret < 0) {
+        if (!job->ret)
+            job->ret = ret;
     } else {
-        pstrcpy(filename, filename_size, bs->backing_file);
+        job->copied += req->nb_sectors;
     }
+    req->busy = 0;
+    job->in_flight--;
+    bdrv_commit_run(job);
 }
 
-int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                          const uint8_t *buf, int nb_sectors)
+static void bdrv_commit_read_cb(void *opaque, int ret)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
-	return -EIO;
-    if (!drv->bdrv_write_compressed)
-        return -ENOTSUP;
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
-}
+    BlockCommitRequest *req = opaque;
+    BlockCommitJob *job = req->job;
 
-int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
-{
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (!drv->bdrv_get_info)
-        return -ENOTSUP;
-    memset(bdi, 0, sizeof(*bdi));
-    return drv->bdrv_get_info(bs, bdi);
+    if (ret < 0) {
+        bdrv_commit_write_cb(req, ret);
+        return;
+    }
+    if (job->ret || job->cancelled) {
+        req->busy = 0;
+        job->in_flight--;
+        bdrv_commit_run(job);
+        return;
+    }
+    if (!bdrv_aio_write(job->bs->backing_hd, req->sector_num, req->buf,
+                        req->nb_sectors, bdrv_commit_write_cb, req))
+        bdrv_commit_write_cb(req, -EIO);
 }
 
-int bdrv_put_buffer(BlockDriverState *bs, const uint8_t *buf, int64_t pos, int size)
+/* Whether a copy of nb_sectors has to wait for the next slice */
+static int bdrv_commit_throttled(BlockCommitJob *job, int nb_sectors)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
+    int64_t budget, now;
+
+    if (job->sync || !bdrv_commit_speed)
+        return 0;
+    budget = MAX(bdrv_commit_speed * BDRV_COMMIT_SLICE / 1000, 1);
+    now = qemu_get_clock(rt_clock);
+    if (now >= job->slice_end) {
+        /* carry over what the last slice overran, but not idle time */
+        if (now >= job->slice_end + BDRV_COMMIT_SLICE)
+            job->slice_bytes = 0;
+        else
+            job->slice_bytes = MAX(job->slice_bytes - budget, 0);
+        job->slice_end = now + BDRV_COMMIT_SLICE;
+    }
+    if (job->slice_bytes >= budget) {
+        qemu_mod_timer(job->timer, job->slice_end);
+        return 1;
+    }
+    job->slice_bytes += (int64_t)nb_sectors * SECTOR_SIZE;
+    return 0;
+}
+
+/* Start as many copies as the job may have in flight */
+static void bdrv_commit_run(BlockCommitJob *job)
+{
+    BlockDriverState *bs = job->bs;
+    BlockCommitRequest *req;
+    int64_t chunk, end;
+    int i, n, lookups = 0;
+
+    /* completions of requests submitted below call back in here */
+    if (job->running)
+        return;
+    job->running = 1;
+    while (job->state == BDRV_COMMIT_ACTIVE && !job->final_ready) {
+        if (job->ret || job->cancelled) {
+            if (!job->in_flight)
+                bdrv_commit_finish(job, job->ret ? job->ret : -ECANCELED);
+            break;
+        }
+        if (job->pos >= job->total) {
+            if (job->nb_dirty <= BDRV_COMMIT_FINAL) {
+                job->final_ready = 1;
+                if (job->timer)
+                    qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+                break;
+            }
+            job->pass++;
+            job->pos = 0;
+            job->chunk_end = 0;
+        }
+        if (!job->sync && ++lookups > BDRV_COMMIT_SCAN) {
+            qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+            break;
+        }
+
+        /* later passes only copy the chunks that are dirty */
+        if (job->pass > 1 && job->pos >= job->chunk_end) {
+            chunk = job->pos >> BDRV_COMMIT_CHUNK_BITS;
+            if (!job->dirty[chunk / BDRV_AM_WORD_BITS])
+                chunk |= BDRV_AM_WORD_BITS - 1;
+            job->chunk_end = MIN((chunk + 1) << BDRV_COMMIT_CHUNK_BITS,
+                                 job->total);
+            if (!bdrv_am_test(job->dirty, chunk)) {
+                job->pos = job->chunk_end;
+                continue;
+            }
+            bdrv_am_set(job->dirty, chunk, 0);
+            job->nb_dirty--;
+        }
+
+        for (i = 0; i < BDRV_COMMIT_PARALLEL; i++) {
+            if (!job->reqs[i].busy)
+                break;
+        }
+        if (i == BDRV_COMMIT_PARALLEL)
+            break;
+        req = &job->reqs[i];
+
+        end = job->pass > 1 ? job->chunk_end : job->total;
+        n = MIN(end - job->pos, BDRV_COMMIT_MAX_RUN);
+        if (!bdrv_is_allocated(bs, job->pos, n, &n) && n > 0) {
+            job->pos += n;
+            continue;
+        }
+        if (n <= 0)
+            n = MIN(end - job->pos, BDRV_COMMIT_MAX_RUN);
+        if (bdrv_commit_throttled(job, n))
+            break;
+
+        req->busy = 1;
+        req->sector_num = job->pos;
+        req->nb_sectors = n;
+        job->pos += n;
+        job->in_flight++;
+        if (!bdrv_aio_read(bs, req->sector_num, req->buf, n,
+                           bdrv_commit_read_cb, req))
+            bdrv_commit_write_cb(req, -EIO);
+    }
+    job->running = 0;
+}
+
+static int bdrv_commit_wc_idle(BlockDriverState *bs)
+{
+    return !bs->wcache || (!bs->wcache->extents && !bs->wcache->queue);
+}
+
+/* Copy what is still dirty with the guest stopped and empty the image.
+   Only called from the main loop, never from a completion. */
+static void bdrv_commit_complete(BlockCommitJob *job)
+{
+    BlockDriverState *bs = job->bs;
+    BlockCommitRequest *req = &job->reqs[0];
+    int64_t chunk, sector, end;
+    int n, ret = 0;
+
+    for (;;) {
+        while (job->in_flight || bs->in_flight || !bdrv_commit_wc_idle(bs)) {
+            ret = bdrv_wc_drain(bs);
+            if (ret < 0)
+                break;
+            if (job->in_flight || bs->in_flight)
+                qemu_aio_wait();
+        }
+        if (!ret)
+            ret = job->ret;
+        if (!ret && job->cancelled)
+            ret = -ECANCELED;
+        if (ret < 0)
+            break;
+
+        if (!job->nb_dirty) {
+            ret = bdrv_flush(bs->backing_hd);
+            if (ret < 0)
+                break;
+            /* anything submitted while flushing has to be copied too */
+            if (!job->nb_dirty && !bs->in_flight && bdrv_commit_wc_idle(bs))
+                break;
+            continue;
+        }
+
+        /* sync reads may complete guest requests that write again, so
+           look for dirty chunks until there are none left */
+        for (chunk = 0; !ret && chunk < job->nb_chunks; chunk++) {
+            if (!job->dirty[chunk / BDRV_AM_WORD_BITS]) {
+                chunk |= BDRV_AM_WORD_BITS - 1;
+                continue;
+            }
+            if (!bdrv_am_test(job->dirty, chunk))
+                continue;
+            bdrv_am_set(job->dirty, chunk, 0);
+            job->nb_dirty--;
+            sector = chunk << BDRV_COMMIT_CHUNK_BITS;
+            end = MIN(sector + BDRV_COMMIT_CHUNK, job->total);
+            for (; sector < end; sector += n) {
+                n = MIN(end - sector, BDRV_COMMIT_MAX_RUN);
+                if (!bdrv_is_allocated(bs, sector, n, &n) && n > 0)
+                    continue;
+                if (n <= 0)
+                    n = MIN(end - sector, BDRV_COMMIT_MAX_RUN);
+                ret = bdrv_read(bs, sector, req->buf, n);
+                if (ret == 0)
+                    ret = bdrv_write(bs->backing_hd, sector, req->buf, n);
+                if (ret < 0)
+                    break;
+                job->copied += n;
+            }
+        }
+        if (ret < 0)
+            break;
+    }
+
+    while (job->in_flight)
+        qemu_aio_wait();
+    if (ret == 0 && bs->drv->bdrv_make_empty) {
+        bdrv_am_free(bs);
+        ret = bs->drv->bdrv_make_empty(bs);
+    }
+    bdrv_commit_finish(job, ret);
+}
+
+static void bdrv_commit_timer(void *opaque)
+{
+    BlockCommitJob *job = opaque;
+
+    if (job->final_ready)
+        bdrv_commit_complete(job);
+    else
+        bdrv_commit_run(job);
+}
+
+/* Wait for an active job to stop and forget about it */
+static void bdrv_commit_stop(BlockDriverState *bs)
+{
+    BlockCommitJob *job = bs->commit;
+
+    if (!job)
+        return;
+    if (job->state == BDRV_COMMIT_ACTIVE) {
+        job->cancelled = 1;
+        while (job->in_flight)
+            qemu_aio_wait();
+        if (job->state == BDRV_COMMIT_ACTIVE)
+            bdrv_commit_finish(job, -ECANCELED);
+    }
+    qemu_free(job);
+    bs->commit = NULL;
+}
+
+static int bdrv_commit_new(BlockDriverState *bs, int sync)
+{
+    BlockCommitJob *job;
+    int64_t length;
+    size_t size;
+    int i;
+
+    if (!bs->drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (!bs->backing_hd)
+        return -ENOTSUP;
+    if (bs->commit && bs->commit->state == BDRV_COMMIT_ACTIVE)
+        return -EBUSY;
+    length = bdrv_getlength(bs);
+    if (length < 0)
+        return length;
+    bdrv_commit_stop(bs);
+
+    job = qemu_mallocz(sizeof(*job));
+    job->bs = bs;
+    job->state = BDRV_COMMIT_ACTIVE;
+    job->sync = sync;
+    job->pass = 1;
+    job->total = length >> SECTOR_BITS;
+    job->nb_chunks = (job->total + BDRV_COMMIT_CHUNK - 1) >>
+                     BDRV_COMMIT_CHUNK_BITS;
+    size = (job->nb_chunks + BDRV_AM_WORD_BITS - 1) / BDRV_AM_WORD_BITS;
+    job->dirty = qemu_mallocz(MAX(size, 1) * sizeof(unsigned long));
+    for (i = 0; i < BDRV_COMMIT_PARALLEL; i++) {
+        job->reqs[i].job = job;
+        job->reqs[i].buf = qemu_memalign(512, BDRV_COMMIT_MAX_RUN *
+                                              SECTOR_SIZE);
+    }
+    if (!sync)
+        job->timer = qemu_new_timer(rt_clock, bdrv_commit_timer, job);
+    job->start_time = qemu_get_clock(rt_clock);
+    bs->commit = job;
+    return 0;
+}
+
+/**
+ * Start committing bs into its backing file in the background.  The job
+ * runs from the main loop at the speed set with bdrv_commit_set_speed();
+ * "info commit" shows its progress.
+ */
+int bdrv_commit_start(BlockDriverState *bs)
+{
+    int ret;
+
+    ret = bdrv_commit_new(bs, 0);
+    if (ret < 0)
+        return ret;
+    bdrv_commit_run(bs->commit);
+    return 0;
+}
+
+int bdrv_commit_cancel(BlockDriverState *bs)
+{
+    BlockCommitJob *job = bs->commit;
+
+    if (!job || job->state != BDRV_COMMIT_ACTIVE)
+        return -ENOENT;
+    job->cancelled = 1;
+    if (job->final_ready)
+        qemu_mod_timer(job->timer, qemu_get_clock(rt_clock));
+    else
+        bdrv_commit_run(job);
+    return 0;
+}
+
+/**
+ * -EINPROGRESS while the last commit of bs runs, then 0 or the error it
+ * stopped with (-ECANCELED if cancelled).  -ENOENT if there was none.
+ */
+int bdrv_commit_status(BlockDriverState *bs)
+{
+    BlockCommitJob *job = bs->commit;
+
+    if (!job)
+        return -ENOENT;
+    if (job->state == BDRV_COMMIT_ACTIVE)
+        return -EINPROGRESS;
+    return job->ret;
+}
+
+/* bytes per second for live jobs, 0 for no limit */
+void bdrv_commit_set_speed(int64_t speed)
+{
+    bdrv_commit_speed = MAX(speed, 0);
+}
+
+/* commit COW file into the raw image */
+int bdrv_commit(BlockDriverState *bs)
+{
+    BlockCommitJob *job;
+    int ret;
+
+    ret = bdrv_commit_new(bs, 1);
+    if (ret < 0)
+        return ret;
+    job = bs->commit;
+    bdrv_commit_run(job);
+    while (job->state == BDRV_COMMIT_ACTIVE) {
+        if (job->final_ready)
+            bdrv_commit_complete(job);
+        else
+            qemu_aio_wait();
+    }
+    return job->ret;
+}
+
+void bdrv_info_commit(void)
+{
+    static const char *states[] = {
+        [BDRV_COMMIT_ACTIVE] = "active",
+        [BDRV_COMMIT_COMPLETED] = "completed",
+        [BDRV_COMMIT_FAILED] = "failed",
+        [BDRV_COMMIT_CANCELLED] = "cancelled",
+    };
+    BlockDriverState *bs;
+    BlockCommitJob *job;
+    int64_t elapsed;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        job = bs->commit;
+        if (!job)
+            continue;
+        elapsed = (job->state == BDRV_COMMIT_ACTIVE ?
+                   qemu_get_clock(rt_clock) : job->end_time) -
+                  job->start_time;
+        term_printf("%s: status=%s", bs->device_name, states[job->state]);
+        if (job->state == BDRV_COMMIT_FAILED)
+            term_printf(" error=%d", job->ret);
+        term_printf(" pass=%d"
+                    " scanned_bytes=%" PRId64
+                    " total_bytes=%" PRId64
+                    " copied_bytes=%" PRIu64
+                    " dirty_bytes=%" PRId64
+                    " elapsed_ms=%" PRId64,
+                    job->pass,
+                    job->pos * SECTOR_SIZE,
+                    job->total * SECTOR_SIZE,
+                    job->copied * SECTOR_SIZE,
+                    job->nb_dirty * BDRV_COMMIT_CHUNK * SECTOR_SIZE,
+                    elapsed);
+        if (job->state == BDRV_COMMIT_ACTIVE)
+            term_printf(" speed=%" PRId64, job->sync ? 0 : bdrv_commit_speed);
+        term_printf("\n");
+    }
+}
+
+void bdrv_info(void)
+{
+    BlockDriverState *bs;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        term_printf("%s:", bs->device_name);
+        term_printf(" type=");
+        switch(bs->type) {
+        case BDRV_TYPE_HD:
+            term_printf("hd");
+            break;
+        case BDRV_TYPE_CDROM:
+            term_printf("cdrom");
+            break;
+        case BDRV_TYPE_FLOPPY:
+            term_printf("floppy");
+            break;
+        }
+        term_printf(" removable=%d", bs->removable);
+        if (bs->removable) {
+            term_printf(" locked=%d", bs->locked);
+        }
+        if (bs->drv) {
+            term_printf(" file=");
+	    term_print_filename(bs->filename);
+            if (bs->backing_file[0] != '\0') {
+                term_printf(" backing_file=");
+		term_print_filename(bs->backing_file);
+	    }
+            term_printf(" ro=%d", bs->read_only);
+            term_printf(" drv=%s", bs->drv->format_name);
+            term_printf(" encrypted=%d", bdrv_is_encrypted(bs));
+        } else {
+            term_printf(" [not inserted]");
+        }
+        term_printf("\n");
+    }
+}
+
+/* The "info blockstats" command. */
+/* Where reads of unallocated sectors were served from: chain_depth_hits
+   counts lookups by the backing file level that held the data, the first
+   entry being the immediate backing file */
+static void bdrv_print_chain_stats(BlockDriverState *bs)
+{
+    int i, last;
+
+    for (last = BDRV_CHAIN_DEPTHS - 1; last > 0 && !bs->chain_hits[last];
+         last--)
+        ;
+    term_printf(" chain_depth_hits=");
+    for (i = 0; i <= last; i++)
+        term_printf("%s%" PRIu64, i ? "," : "", bs->chain_hits[i]);
+    term_printf(" chain_zero_hits=%" PRIu64, bs->chain_zero_hits);
+}
+
+void bdrv_info_stats (void)
+{
+    BlockDriverState *bs;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+	term_printf ("%s:"
+		     " rd_bytes=%" PRIu64
+		     " wr_bytes=%" PRIu64
+		     " rd_operations=%" PRIu64
+		     " wr_operations=%" PRIu64
+		     " bounced_bytes=%" PRIu64,
+		     bs->device_name,
+		     bs->rd_bytes, bs->wr_bytes,
+		     bs->rd_ops, bs->wr_ops,
+		     bs->bounced_bytes);
+        if (bs->readahead) {
+            BlockReadAhead *ra = bs->readahead;
+            uint64_t total = ra->hits + ra->misses;
+
+            term_printf(" ra_hits=%" PRIu64
+                        " ra_misses=%" PRIu64
+                        " ra_hit_pct=%" PRIu64
+                        " ra_prefetch_bytes=%" PRIu64
+                        " ra_unused_bytes=%" PRIu64,
+                        ra->hits, ra->misses,
+                        total ? ra->hits * 100 / total : 0,
+                        ra->prefetched * SECTOR_SIZE,
+                        ra->unused * SECTOR_SIZE);
+        }
+        if (bs->wcache) {
+            BlockWriteCache *wc = bs->wcache;
+
+            term_printf(" wc_dirty_bytes=%" PRIu64
+                        " wc_read_hits=%" PRIu64
+                        " wc_absorbed_bytes=%" PRIu64
+                        " wc_writeback_operations=%" PRIu64
+                        " wc_writeback_bytes=%" PRIu64
+                        " wc_flushes=%" PRIu64,
+                        (uint64_t)wc->dirty * SECTOR_SIZE, wc->read_hits,
+                        wc->absorbed * SECTOR_SIZE, wc->wb_ops,
+                        wc->wb_sectors * SECTOR_SIZE, wc->flushes_done);
+        }
+        if (bs->backing_hd)
+            bdrv_print_chain_stats(bs->backing_hd);
+        else if (bs->file && bs->file->backing_hd)
+            /* vmdk keeps its parent image below the image file */
+            bdrv_print_chain_stats(bs->file->backing_hd);
+        term_printf("\n");
+    }
+}
+
+static void bdrv_print_latency(const char *name, const char *op,
+                               BlockLatencyStats *st)
+{
+    int i, last;
+
+    for (last = BDRV_LAT_BUCKETS - 1; last > 0 && !st->hist[last]; last--)
+        ;
+    term_printf("%s: %s count=%" PRIu64 " avg_us=%" PRIu64
+                " max_us=%" PRIu64 " log2_us=",
+                name, op, st->count,
+                st->count ? st->total_us / st->count : 0, st->max_us);
+    for (i = 0; i <= last; i++)
+        term_printf("%s%" PRIu64, i ? "," : "", st->hist[i]);
+    term_printf("\n");
+}
+
+static void bdrv_info_latency_layer(BlockDriverState *bs, const char *name)
+{
+    static const char *ops[BDRV_LAT_MAX] = { "read", "write", "flush" };
+    char layer[64];
+    int i;
+
+    term_printf("%s: drv=%s in_flight=%d in_flight_peak=%d\n",
+                name, bs->drv ? bs->drv->format_name : "none",
+                bs->in_flight, bs->in_flight_peak);
+    for (i = 0; i < BDRV_LAT_MAX; i++)
+        bdrv_print_latency(name, ops[i], &bs->latency[i]);
+    if (bs->aio_wait.count)
+        bdrv_print_latency(name, "aio_wait", &bs->aio_wait);
+
+    if (bs->file) {
+        snprintf(layer, sizeof(layer), "%s.file", name);
+        bdrv_info_latency_layer(bs->file, layer);
+    }
+    if (bs->backing_hd) {
+        snprintf(layer, sizeof(layer), "%s.backing", name);
+        bdrv_info_latency_layer(bs->backing_hd, layer);
+    }
+}
+
+/*
+ * The "info blocklatency" command.  Every line starts with the layer it
+ * describes: the device, then ".file" for the image file under a format
+ * driver and ".backing" for each backing file.  log2_us lists the
+ * histogram buckets, bucket n counting requests that took less than 2^n
+ * microseconds; trailing empty buckets are omitted.
+ */
+void bdrv_info_latency(void)
+{
+    BlockDriverState *bs;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        if (bs->drv)
+            bdrv_info_latency_layer(bs, bs->device_name);
+    }
+}
+
+const char *bdrv_get_encrypted_filename(BlockDriverState *bs)
+{
+    if (bs->backing_hd && bs->backing_hd->encrypted)
+        return bs->backing_file;
+    else if (bs->encrypted)
+        return bs->filename;
+    else
+        return NULL;
+}
+
+void bdrv_get_backing_filename(BlockDriverState *bs,
+                               char *filename, int filename_size)
+{
+    if (!bs->backing_hd) {
+        pstrcpy(filename, filename_size, "");
+    } else {
+        pstrcpy(filename, filename_size, bs->backing_file);
+    }
+}
+
+int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                          const uint8_t *buf, int nb_sectors)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+	return -EIO;
+    if (!drv->bdrv_write_compressed)
+        return -ENOTSUP;
+    ret = bdrv_wc_drain(bs);
+    if (ret < 0)
+        return ret;
+    bdrv_am_invalidate(bs, sector_num, nb_sectors);
+    bdrv_commit_dirty(bs, sector_num, nb_sectors);
+    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+}
+
+int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_get_info)
+        return -ENOTSUP;
+    memset(bdi, 0, sizeof(*bdi));
+    return drv->bdrv_get_info(bs, bdi);
+}
+
+/* 0 restores the driver's default size */
+int bdrv_set_chunk_cache(BlockDriverState *bs, int size_kb)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_set_chunk_cache)
+        return -ENOTSUP;
+    if (size_kb < 0)
+        return -EINVAL;
+    return drv->bdrv_set_chunk_cache(bs, size_kb);
+}
+
+int bdrv_put_buffer(BlockDriverState *bs, const uint8_t *buf, int64_t pos, int size)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_put_buffer)
+        return -ENOTSUP;
+    return drv->bdrv_put_buffer(bs, buf, pos, size);
+}
+
+int bdrv_get_buffer(BlockDriverState *bs, uint8_t *buf, int64_t pos, int size)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_get_buffer)
+        return -ENOTSUP;
+    return drv->bdrv_get_buffer(bs, buf, pos, size);
+}
+
+/**************************************************************/
+/* handling of snapshots */
+
+int bdrv_snapshot_create(BlockDriverState *bs,
+                         QEMUSnapshotInfo *sn_info)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_snapshot_create)
+        return -ENOTSUP;
+    ret = bdrv_wc_drain(bs);
+    if (ret < 0)
+        return ret;
+    return drv->bdrv_snapshot_create(bs, sn_info);
+}
+
+int bdrv_snapshot_goto(BlockDriverState *bs,
+                       const char *snapshot_id)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_snapshot_goto)
+        return -ENOTSUP;
+    bdrv_commit_stop(bs);
+    ret = bdrv_wc_drain(bs);
+    if (ret < 0)
+        return ret;
+    bdrv_am_free(bs);
+    return drv->bdrv_snapshot_goto(bs, snapshot_id);
+}
+
+int bdrv_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_snapshot_delete)
+        return -ENOTSUP;
+    return drv->bdrv_snapshot_delete(bs, snapshot_id);
+}
+
+int bdrv_snapshot_list(BlockDriverState *bs,
+                       QEMUSnapshotInfo **psn_info)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_put_buffer)
+    if (!drv->bdrv_snapshot_list)
         return -ENOTSUP;
-    return drv->bdrv_put_buffer(bs, buf, pos, size);
+    return drv->bdrv_snapshot_list(bs, psn_info);
+}
+
+#define NB_SUFFIXES 4
+
+char *get_human_readable_size(char *buf, int buf_size, int64_t size)
+{
+    static const char suffixes[NB_SUFFIXES] = "KMGT";
+    int64_t base;
+    int i;
+
+    if (size <= 999) {
+        snprintf(buf, buf_size, "%" PRId64, size);
+    } else {
+        base = 1024;
+        for(i = 0; i < NB_SUFFIXES; i++) {
+            if (size < (10 * base)) {
+                snprintf(buf, buf_size, "%0.1f%c",
+                         (double)size / base,
+                         suffixes[i]);
+                break;
+            } else if (size < (1000 * base) || i == (NB_SUFFIXES - 1)) {
+                snprintf(buf, buf_size, "%" PRId64 "%c",
+                         ((size + (base >> 1)) / base),
+                         suffixes[i]);
+                break;
+            }
+            base = base * 1024;
+        }
+    }
+    return buf;
+}
+
+char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
+{
+    char buf1[128], date_buf[128], clock_buf[128];
+#ifdef _WIN32
+    struct tm *ptm;
+#else
+    struct tm tm;
+#endif
+    time_t ti;
+    int64_t secs;
+
+    if (!sn) {
+        snprintf(buf, buf_size,
+                 "%-10s%-20s%7s%20s%15s",
+                 "ID", "TAG", "VM SIZE", "DATE", "VM CLOCK");
+    } else {
+        ti = sn->date_sec;
+#ifdef _WIN32
+        ptm = localtime(&ti);
+        strftime(date_buf, sizeof(date_buf),
+                 "%Y-%m-%d %H:%M:%S", ptm);
+#else
+        localtime_r(&ti, &tm);
+        strftime(date_buf, sizeof(date_buf),
+                 "%Y-%m-%d %H:%M:%S", &tm);
+#endif
+        secs = sn->vm_clock_nsec / 1000000000;
+        snprintf(clock_buf, sizeof(clock_buf),
+                 "%02d:%02d:%02d.%03d",
+                 (int)(secs / 3600),
+                 (int)((secs / 60) % 60),
+                 (int)(secs % 60),
+                 (int)((sn->vm_clock_nsec / 1000000) % 1000));
+        snprintf(buf, buf_size,
+                 "%-10s%-20s%7s%20s%15s",
+                 sn->id_str, sn->name,
+                 get_human_readable_size(buf1, sizeof(buf1), sn->vm_state_size),
+                 date_buf,
+                 clock_buf);
+    }
+    return buf;
+}
+
+/**************************************************************/
+/* read-ahead */
+
+/*
+ * Reads are matched against a few sequential streams.  Once a stream has
+ * been seen BDRV_RA_TRIGGER times in a row, the next BDRV_RA_DEPTH windows
+ * after it are read into a small cache of BDRV_RA_SLOTS buffers and later
+ * aio reads that fall entirely inside cached or loading windows are served
+ * from there.  Writes invalidate overlapping windows.  Nothing is prefetched
+ * while aio writes are in flight, so a window never predates a write that
+ * was submitted before it.
+ */
+
+static void bdrv_ra_copy(BlockRARequest *req, BlockRASlot *slot)
+{
+    int64_t start = MAX(req->sector_num, slot->sector_num);
+    int64_t end = MIN(req->sector_num + req->nb_sectors,
+                      slot->sector_num + slot->nb_sectors);
+    size_t offset = (start - req->sector_num) * SECTOR_SIZE;
+    size_t count = (end - start) * SECTOR_SIZE;
+    const uint8_t *src = slot->buf + (start - slot->sector_num) * SECTOR_SIZE;
+    int i;
+
+    slot->used = 1;
+    if (!req->qiov) {
+        memcpy(req->buf + offset, src, count);
+        return;
+    }
+    for (i = 0; i < req->qiov->niov && count; i++) {
+        size_t len = req->qiov->iov[i].iov_len;
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+        len = MIN(len - offset, count);
+        memcpy((uint8_t *)req->qiov->iov[i].iov_base + offset, src, len);
+        src += len;
+        count -= len;
+        offset = 0;
+    }
+}
+
+static void bdrv_ra_complete(BlockRARequest *req)
+{
+    req->aiocb->cb(req->aiocb->opaque, req->ret);
+    qemu_aio_release(req->aiocb);
+    qemu_free(req);
+}
+
+static void bdrv_ra_bh(void *opaque)
+{
+    BlockReadAhead *ra = opaque;
+    BlockRARequest *req;
+
+    while ((req = ra->done) != NULL) {
+        ra->done = req->next;
+        bdrv_ra_complete(req);
+    }
+}
+
+static void bdrv_ra_drop(BlockRASlot *slot)
+{
+    if (!slot->used)
+        slot->ra->unused += slot->nb_sectors;
+    slot->state = BDRV_RA_EMPTY;
+}
+
+static void bdrv_ra_load_cb(void *opaque, int ret)
+{
+    BlockRASlot *slot = opaque;
+    BlockReadAhead *ra = slot->ra;
+    BlockRARequest *req, **preq, *done = NULL;
+    unsigned int bit = 1 << (slot - ra->slots);
+
+    slot->aiocb = NULL;
+    preq = &ra->waiting;
+    while ((req = *preq) != NULL) {
+        if (!(req->wait & bit)) {
+            preq = &req->next;
+            continue;
+        }
+        if (ret < 0)
+            req->ret = ret;
+        else
+            bdrv_ra_copy(req, slot);
+        req->wait &= ~bit;
+        if (req->wait) {
+            preq = &req->next;
+            continue;
+        }
+        *preq = req->next;
+        req->next = done;
+        done = req;
+    }
+
+    if (ret < 0 || slot->stale)
+        bdrv_ra_drop(slot);
+    else
+        slot->state = BDRV_RA_VALID;
+
+    /* the callbacks may well submit more reads */
+    while ((req = done) != NULL) {
+        done = req->next;
+        bdrv_ra_complete(req);
+    }
+}
+
+static BlockRASlot *bdrv_ra_find(BlockReadAhead *ra, int64_t sector_num)
+{
+    BlockRASlot *slot;
+    int i;
+
+    for (i = 0; i < BDRV_RA_SLOTS; i++) {
+        slot = &ra->slots[i];
+        if (slot->state != BDRV_RA_EMPTY && !slot->stale &&
+            sector_num >= slot->sector_num &&
+            sector_num < slot->sector_num + slot->nb_sectors)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Serve a read from the cache, NULL if it is not entirely covered */
+static BlockDriverAIOCB *bdrv_ra_read(BlockDriverState *bs,
+                                      int64_t sector_num, uint8_t *buf,
+                                      QEMUIOVector *qiov, int nb_sectors,
+                                      BlockDriverCompletionFunc *cb,
+                                      void *opaque)
+{
+    BlockReadAhead *ra = bs->readahead;
+    BlockRASlot *slot;
+    BlockRARequest *req, **preq;
+    unsigned int slots = 0;
+    int64_t sector;
+    int i;
+
+    for (sector = sector_num; sector < sector_num + nb_sectors;
+         sector = slot->sector_num + slot->nb_sectors) {
+        slot = bdrv_ra_find(ra, sector);
+        if (!slot) {
+            ra->misses++;
+            return NULL;
+        }
+        slots |= 1 << (slot - ra->slots);
+    }
+    ra->hits++;
+
+    req = qemu_malloc(sizeof(*req));
+    req->aiocb = qemu_aio_get(bs, cb, opaque);
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+    req->buf = buf;
+    req->qiov = qiov;
+    req->wait = 0;
+    req->ret = 0;
+    for (i = 0; i < BDRV_RA_SLOTS; i++) {
+        slot = &ra->slots[i];
+        if (!(slots & (1 << i)))
+            continue;
+        slot->last_use = ++ra->clock;
+        if (slot->state == BDRV_RA_LOADING)
+            req->wait |= 1 << i;
+        else
+            bdrv_ra_copy(req, slot);
+    }
+
+    preq = req->wait ? &ra->waiting : &ra->done;
+    while (*preq)
+        preq = &(*preq)->next;
+    req->next = NULL;
+    *preq = req;
+    if (!req->wait)
+        qemu_bh_schedule(ra->bh);
+
+    return req->aiocb;
+}
+
+static BlockRASlot *bdrv_ra_evict(BlockReadAhead *ra)
+{
+    BlockRASlot *slot, *victim = NULL;
+    int i;
+
+    for (i = 0; i < BDRV_RA_SLOTS; i++) {
+        slot = &ra->slots[i];
+        if (slot->state == BDRV_RA_EMPTY)
+            return slot;
+        if (slot->state == BDRV_RA_VALID &&
+            (!victim || slot->last_use < victim->last_use))
+            victim = slot;
+    }
+    if (victim)
+        bdrv_ra_drop(victim);
+    return victim;
+}
+
+/* Track sequential streams and prefetch ahead of them */
+static void bdrv_ra_prefetch(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors)
+{
+    BlockReadAhead *ra = bs->readahead;
+    BlockRAStream *st = NULL;
+    BlockRASlot *slot;
+    int i, n;
+
+    /* the aio emulation reads synchronously, a prefetch would only hold
+       up the guest read that triggered it */
+    if (bs->drv->bdrv_aio_read == bdrv_aio_read_em)
+        return;
+
+    for (i = 0; i < BDRV_RA_STREAMS; i++) {
+        if (ra->streams[i].next_sector == sector_num) {
+            st = &ra->streams[i];
+            st->seq++;
+            break;
+        }
+        if (!st || ra->streams[i].last_use < st->last_use)
+            st = &ra->streams[i];
+    }
+    if (i == BDRV_RA_STREAMS) {
+        /* not part of a known stream, start tracking a new one */
+        st->seq = 0;
+        st->ra_sector = 0;
+    }
+    st->next_sector = sector_num + nb_sectors;
+    st->last_use = ++ra->clock;
+
+    if (st->seq < BDRV_RA_TRIGGER || bs->wr_in_flight)
+        return;
+
+    if (st->ra_sector < st->next_sector)
+        st->ra_sector = st->next_sector;
+    while (st->ra_sector < st->next_sector + BDRV_RA_DEPTH * ra->window &&
+           st->ra_sector < bs->total_sectors) {
+        slot = bdrv_ra_find(ra, st->ra_sector);
+        if (slot) {
+            st->ra_sector = slot->sector_num + slot->nb_sectors;
+            continue;
+        }
+        slot = bdrv_ra_evict(ra);
+        if (!slot)
+            break;
+        n = MIN(ra->window, bs->total_sectors - st->ra_sector);
+        slot->state = BDRV_RA_LOADING;
+        slot->stale = 0;
+        slot->used = 0;
+        slot->sector_num = st->ra_sector;
+        slot->nb_sectors = n;
+        slot->last_use = ra->clock;
+        slot->aiocb = bs->drv->bdrv_aio_read(bs, st->ra_sector, slot->buf, n,
+                                             bdrv_ra_load_cb, slot);
+        if (!slot->aiocb) {
+            slot->state = BDRV_RA_EMPTY;
+            break;
+        }
+        ra->prefetched += n;
+        st->ra_sector += n;
+    }
+}
+
+static void bdrv_ra_invalidate(BlockReadAhead *ra, int64_t sector_num,
+                               int nb_sectors)
+{
+    BlockRASlot *slot;
+    int i;
+
+    for (i = 0; i < BDRV_RA_SLOTS; i++) {
+        slot = &ra->slots[i];
+        if (slot->state == BDRV_RA_EMPTY ||
+            sector_num >= slot->sector_num + slot->nb_sectors ||
+            sector_num + nb_sectors <= slot->sector_num)
+            continue;
+        if (slot->state == BDRV_RA_LOADING)
+            slot->stale = 1;
+        else
+            bdrv_ra_drop(slot);
+    }
+    /* let the streams refill what was dropped */
+    for (i = 0; i < BDRV_RA_STREAMS; i++) {
+        if (ra->streams[i].ra_sector > sector_num)
+            ra->streams[i].ra_sector = ra->streams[i].next_sector;
+    }
+}
+
+static int bdrv_ra_cancel(BlockReadAhead *ra, BlockDriverAIOCB *acb)
+{
+    BlockRARequest *req, **preq;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        for (preq = i ? &ra->done : &ra->waiting; (req = *preq) != NULL;
+             preq = &req->next) {
+            if (req->aiocb == acb) {
+                *preq = req->next;
+                qemu_aio_release(acb);
+                qemu_free(req);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Wait for prefetches, complete the reads served by them and drop all
+   cached data */
+static void bdrv_ra_reset(BlockReadAhead *ra)
+{
+    int i;
+
+    for (i = 0; i < BDRV_RA_SLOTS; i++) {
+        while (ra->slots[i].state == BDRV_RA_LOADING)
+            qemu_aio_wait();
+        if (ra->slots[i].state == BDRV_RA_VALID)
+            bdrv_ra_drop(&ra->slots[i]);
+    }
+    qemu_bh_cancel(ra->bh);
+    bdrv_ra_bh(ra);
+
+    for (i = 0; i < BDRV_RA_STREAMS; i++) {
+        ra->streams[i].next_sector = -1;
+        ra->streams[i].ra_sector = 0;
+        ra->streams[i].seq = 0;
+        ra->streams[i].last_use = 0;
+    }
+}
+
+static void bdrv_ra_free(BlockReadAhead *ra)
+{
+    int i;
+
+    bdrv_ra_reset(ra);
+    for (i = 0; i < BDRV_RA_SLOTS; i++)
+        qemu_vfree(ra->slots[i].buf);
+    qemu_bh_delete(ra->bh);
+    ra->bs->readahead = NULL;
+    qemu_free(ra);
+}
+
+/**
+ * Cache up to size_kb of data read ahead of sequential streams, 0 turns
+ * read-ahead off.
+ */
+int bdrv_set_readahead(BlockDriverState *bs, int size_kb)
+{
+    BlockReadAhead *ra;
+    int i, window;
+
+    window = size_kb * 2 / BDRV_RA_SLOTS;
+    if (size_kb < 0 || (size_kb && window < 8))
+        return -EINVAL;
+
+    if (bs->readahead)
+        bdrv_ra_free(bs->readahead);
+    if (!size_kb)
+        return 0;
+
+    ra = qemu_mallocz(sizeof(*ra));
+    ra->bs = bs;
+    ra->window = window;
+    ra->bh = qemu_bh_new(bdrv_ra_bh, ra);
+    for (i = 0; i < BDRV_RA_SLOTS; i++) {
+        ra->slots[i].ra = ra;
+        ra->slots[i].buf = qemu_memalign(512, window * SECTOR_SIZE);
+    }
+    for (i = 0; i < BDRV_RA_STREAMS; i++)
+        ra->streams[i].next_sector = -1;
+    bs->readahead = ra;
+    return 0;
+}
+
+/**************************************************************/
+/* write-back cache */
+
+/*
+ * Small writes are copied into a list of dirty extents and completed at
+ * once.  Every write gets a generation number and each extent remembers
+ * the oldest write it holds, so a flush only has to wait for the extents
+ * that were dirty when it was submitted.  Write-back gathers runs of
+ * adjacent extents into requests of up to BDRV_WC_MAX_RUN sectors.  It
+ * starts when a flush or a waiting request needs it, when half the cache
+ * is dirty, and for data that has been dirty for BDRV_WC_EXPIRE.  An
+ * rt_clock timer ends each epoch while anything is dirty; the tools have
+ * no timers, so there the age is checked whenever the drive is used.
+ *
+ * Extents being written back are copied to a bounce buffer first, so they
+ * can still take writes; those are written back again afterwards.  Reads
+ * that are entirely cached are served from the extents, other reads that
+ * overlap dirty data wait until it has been written back.  Writes larger
+ * than a quarter of the cache go to the driver, once overlapping dirty
+ * data is gone.  Requests that have to wait are queued in order.
+ *
+ * A failed write-back keeps the data dirty and fails the pending flushes.
+ * Nothing more is written back until the next flush retries.
+ */
+
+static void bdrv_wc_complete(BlockWCRequest *req)
+{
+    req->aiocb->cb(req->aiocb->opaque, req->ret);
+    qemu_aio_release(req->aiocb);
+    qemu_free(req);
+}
+
+static void bdrv_wc_bh(void *opaque)
+{
+    BlockWriteCache *wc = opaque;
+    BlockWCRequest *req;
+
+    while ((req = wc->done) != NULL) {
+        wc->done = req->next;
+        bdrv_wc_complete(req);
+    }
+}
+
+static void bdrv_wc_finish(BlockWriteCache *wc, BlockWCRequest *req, int ret)
+{
+    BlockWCRequest **preq;
+
+    req->ret = ret;
+    req->next = NULL;
+    for (preq = &wc->done; *preq; preq = &(*preq)->next)
+        ;
+    *preq = req;
+    qemu_bh_schedule(wc->bh);
+}
+
+static void bdrv_wc_inner_cb(void *opaque, int ret)
+{
+    BlockWCRequest *req = opaque, **preq;
+    BlockWriteCache *wc = req->wc;
+
+    if (wc->submitting == req)
+        wc->submitting = NULL;
+    for (preq = &wc->inner; *preq != req; preq = &(*preq)->next)
+        ;
+    *preq = req->next;
+    req->ret = ret;
+    bdrv_wc_complete(req);
+}
+
+/* Hand a request to the driver, going around the cache */
+static void bdrv_wc_pass(BlockWriteCache *wc, BlockWCRequest *req)
+{
+    BlockDriverState *bs = wc->bs;
+    BlockWCRequest *submitting = wc->submitting;
+    BlockDriverAIOCB *acb;
+
+    req->next = wc->inner;
+    wc->inner = req;
+    wc->submitting = req;
+    if (req->type == BDRV_WC_FLUSH)
+        acb = bdrv_aio_flush(bs, bdrv_wc_inner_cb, req);
+    else if (req->type == BDRV_WC_READ && req->qiov)
+        acb = bdrv_aio_readv(bs, req->sector_num, req->qiov,
+                             req->nb_sectors, bdrv_wc_inner_cb, req);
+    else if (req->type == BDRV_WC_READ)
+        acb = bdrv_aio_read(bs, req->sector_num, req->buf,
+                            req->nb_sectors, bdrv_wc_inner_cb, req);
+    else if (req->qiov)
+        acb = bdrv_aio_writev(bs, req->sector_num, req->qiov,
+                              req->nb_sectors, bdrv_wc_inner_cb, req);
+    else
+        acb = bdrv_aio_write(bs, req->sector_num, req->buf,
+                             req->nb_sectors, bdrv_wc_inner_cb, req);
+
+    /* unless it has completed already */
+    if (wc->submitting == req) {
+        if (acb) {
+            req->inner = acb;
+        } else {
+            wc->inner = req->next;
+            bdrv_wc_finish(wc, req, -EIO);
+        }
+    }
+    wc->submitting = submitting;
+}
+
+/* Copy between the data of a request, from offset on, and buf */
+static void bdrv_wc_copy(BlockWCRequest *req, size_t offset, uint8_t *buf,
+                         size_t count, int to_req)
+{
+    int i;
+
+    if (!req->qiov) {
+        if (to_req)
+            memcpy(req->buf + offset, buf, count);
+        else
+            memcpy(buf, req->buf + offset, count);
+        return;
+    }
+    for (i = 0; i < req->qiov->niov && count; i++) {
+        uint8_t *base = req->qiov->iov[i].iov_base;
+        size_t len = req->qiov->iov[i].iov_len;
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+        len = MIN(len - offset, count);
+        if (to_req)
+            memcpy(base + offset, buf, len);
+        else
+            memcpy(buf, base + offset, len);
+        buf += len;
+        count -= len;
+        offset = 0;
+    }
+}
+
+/* Sectors of the range held by the cache.  If mark is set, the extents
+   involved are written back as soon as possible. */
+static int bdrv_wc_overlap(BlockWriteCache *wc, int64_t sector_num,
+                           int nb_sectors, int mark)
+{
+    BlockWCExtent *e;
+    int64_t end = sector_num + nb_sectors;
+    int n = 0;
+
+    for (e = wc->extents; e && e->sector_num < end; e = e->next) {
+        if (e->sector_num + e->nb_sectors <= sector_num)
+            continue;
+        n += MIN(end, e->sector_num + e->nb_sectors) -
+             MAX(sector_num, e->sector_num);
+        if (mark && !e->writing)
+            e->urgent = 1;
+    }
+    return n;
+}
+
+static uint64_t bdrv_wc_oldest(BlockWriteCache *wc)
+{
+    BlockWCExtent *e;
+    uint64_t gen = UINT64_MAX;
+
+    for (e = wc->extents; e; e = e->next)
+        gen = MIN(gen, e->gen);
+    return gen;
 }
 
-int bdrv_get_buffer(BlockDriverState *bs, uint8_t *buf, int64_t pos, int size)
+static int bdrv_wc_check(BlockWriteCache *wc, int type, int64_t sector_num,
+                         int nb_sectors)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (!drv->bdrv_get_buffer)
-        return -ENOTSUP;
-    return drv->bdrv_get_buffer(bs, buf, pos, size);
+    int n;
+
+    if (type == BDRV_WC_READ) {
+        n = bdrv_wc_overlap(wc, sector_num, nb_sectors, 0);
+        if (n == 0)
+            return BDRV_WC_PASS;
+        if (n == nb_sectors)
+            return BDRV_WC_TAKE;
+    } else if (nb_sectors > wc->limit / 4) {
+        if (!bdrv_wc_overlap(wc, sector_num, nb_sectors, 0))
+            return BDRV_WC_PASS;
+    } else {
+        if (wc->dirty + nb_sectors <= wc->limit)
+            return BDRV_WC_TAKE;
+        wc->wb_gen = wc->gen;
+        return BDRV_WC_WAIT;
+    }
+    bdrv_wc_overlap(wc, sector_num, nb_sectors, 1);
+    return BDRV_WC_WAIT;
 }
 
-/**************************************************************/
-/* handling of snapshots */
+static void bdrv_wc_insert(BlockWriteCache *wc, BlockWCRequest *req)
+{
+    BlockWCExtent *e, **pe;
+    int64_t sector = req->sector_num;
+    int64_t end = sector + req->nb_sectors;
+    uint64_t gen = ++wc->gen;
+    int n;
 
-int bdrv_snapshot_create(BlockDriverState *bs,
-                         QEMUSnapshotInfo *sn_info)
+    pe = &wc->extents;
+    while (sector < end) {
+        e = *pe;
+        if (e && e->sector_num + e->nb_sectors <= sector) {
+            pe = &e->next;
+            continue;
+        }
+        if (e && e->sector_num <= sector) {
+            /* overwrite dirty data in place */
+            n = MIN(end, e->sector_num + e->nb_sectors) - sector;
+            if (e->writing && !e->redirty) {
+                e->redirty = 1;
+                e->redirty_gen = gen;
+            }
+            wc->absorbed += n;
+        } else {
+            n = (e ? MIN(end, e->sector_num) : end) - sector;
+            e = qemu_mallocz(sizeof(*e));
+            e->sector_num = sector;
+            e->nb_sectors = n;
+            e->buf = qemu_malloc(n * SECTOR_SIZE);
+            e->gen = gen;
+            e->next = *pe;
+            *pe = e;
+            wc->dirty += n;
+        }
+        bdrv_wc_copy(req, (sector - req->sector_num) * SECTOR_SIZE,
+                     e->buf + (sector - e->sector_num) * SECTOR_SIZE,
+                     n * SECTOR_SIZE, 0);
+        sector += n;
+        pe = &e->next;
+    }
+}
+
+static void bdrv_wc_take(BlockWriteCache *wc, BlockWCRequest *req)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (!drv->bdrv_snapshot_create)
-        return -ENOTSUP;
-    return drv->bdrv_snapshot_create(bs, sn_info);
+    BlockDriverState *bs = wc->bs;
+    BlockWCExtent *e;
+    int64_t start, end = req->sector_num + req->nb_sectors;
+
+    if (req->type == BDRV_WC_WRITE) {
+        bdrv_wc_insert(wc, req);
+        if (wc->dirty > wc->limit / 2)
+            wc->wb_gen = wc->gen;
+        bs->wr_bytes += (unsigned) req->nb_sectors * SECTOR_SIZE;
+        bs->wr_ops ++;
+    } else {
+        for (e = wc->extents; e && e->sector_num < end; e = e->next) {
+            if (e->sector_num + e->nb_sectors <= req->sector_num)
+                continue;
+            start = MAX(req->sector_num, e->sector_num);
+            bdrv_wc_copy(req, (start - req->sector_num) * SECTOR_SIZE,
+                         e->buf + (start - e->sector_num) * SECTOR_SIZE,
+                         (MIN(end, e->sector_num + e->nb_sectors) - start) *
+                         SECTOR_SIZE, 1);
+        }
+        wc->read_hits++;
+        bs->rd_bytes += (unsigned) req->nb_sectors * SECTOR_SIZE;
+        bs->rd_ops ++;
+    }
+    bdrv_wc_finish(wc, req, 0);
 }
 
-int bdrv_snapshot_goto(BlockDriverState *bs,
-                       const char *snapshot_id)
+static void bdrv_wc_run(BlockWriteCache *wc);
+
+static void bdrv_wc_writeback_cb(void *opaque, int ret)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (!drv->bdrv_snapshot_goto)
-        return -ENOTSUP;
-    return drv->bdrv_snapshot_goto(bs, snapshot_id);
+    BlockWCWriteback *wb = opaque;
+    BlockWriteCache *wc = wb->wc;
+    BlockWCExtent *e, **pe;
+    BlockWCRequest *req, *flushes;
+    int64_t end = wb->sector_num + wb->nb_sectors;
+
+    wc->writeback--;
+    pe = &wc->extents;
+    while ((e = *pe) != NULL && e->sector_num < end) {
+        if (e->sector_num < wb->sector_num) {
+            pe = &e->next;
+            continue;
+        }
+        e->writing = 0;
+        if (ret < 0 || e->redirty) {
+            if (ret >= 0)
+                e->gen = e->redirty_gen;
+            e->redirty = 0;
+            pe = &e->next;
+            continue;
+        }
+        *pe = e->next;
+        wc->dirty -= e->nb_sectors;
+        qemu_free(e->buf);
+        qemu_free(e);
+    }
+    qemu_vfree(wb->buf);
+
+    if (ret < 0) {
+        wc->error = ret;
+        flushes = wc->flushes;
+        wc->flushes = NULL;
+        while ((req = flushes) != NULL) {
+            flushes = req->next;
+            bdrv_wc_finish(wc, req, ret);
+        }
+    } else {
+        wc->wb_ops++;
+        wc->wb_sectors += wb->nb_sectors;
+    }
+    qemu_free(wb);
+    bdrv_wc_run(wc);
 }
 
-int bdrv_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
+/* Write back nb_sectors worth of adjacent extents, starting with first */
+static void bdrv_wc_writeback(BlockWriteCache *wc, BlockWCExtent *first,
+                              int nb_sectors)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (!drv->bdrv_snapshot_delete)
-        return -ENOTSUP;
-    return drv->bdrv_snapshot_delete(bs, snapshot_id);
+    BlockDriverState *bs = wc->bs;
+    BlockDriverCompletionFunc *cb = bdrv_wc_writeback_cb;
+    BlockLatencyState *lat;
+    BlockWCWriteback *wb;
+    BlockWCExtent *e;
+    void *opaque;
+    uint8_t *p;
+
+    wb = qemu_malloc(sizeof(*wb));
+    wb->wc = wc;
+    wb->sector_num = first->sector_num;
+    wb->nb_sectors = nb_sectors;
+    wb->buf = qemu_memalign(512, nb_sectors * SECTOR_SIZE);
+    p = wb->buf;
+    for (e = first; p < wb->buf + nb_sectors * SECTOR_SIZE; e = e->next) {
+        memcpy(p, e->buf, e->nb_sectors * SECTOR_SIZE);
+        p += e->nb_sectors * SECTOR_SIZE;
+        e->writing = 1;
+        e->urgent = 0;
+    }
+    wc->writeback++;
+
+    if (bs->readahead)
+        bdrv_ra_invalidate(bs->readahead, wb->sector_num, nb_sectors);
+    bdrv_am_invalidate(bs, wb->sector_num, nb_sectors);
+    opaque = wb;
+    lat = bdrv_lat_submit(bs, BDRV_LAT_WRITE, wb->sector_num, nb_sectors,
+                          &cb, &opaque);
+    if (!bs->drv->bdrv_aio_write(bs, wb->sector_num, wb->buf, nb_sectors,
+                                 cb, opaque)) {
+        bdrv_lat_abort(lat);
+        bdrv_wc_writeback_cb(wb, -EIO);
+    }
 }
 
-int bdrv_snapshot_list(BlockDriverState *bs,
-                       QEMUSnapshotInfo **psn_info)
+/* Start writing back the first run of extents that is due, returns 0 if
+   there is none or no more write-back can be started */
+static int bdrv_wc_kick(BlockWriteCache *wc)
 {
-    BlockDriver *drv = bs->drv;
-    if (!drv)
-        return -ENOMEDIUM;
-    if (!drv->bdrv_snapshot_list)
-        return -ENOTSUP;
-    return drv->bdrv_snapshot_list(bs, psn_info);
+    BlockWCExtent *e, *first, *last;
+    BlockWCRequest *req;
+    uint64_t due = wc->wb_gen;
+    int n, want;
+
+    if (wc->error || wc->writeback >= BDRV_WC_MAX_WRITEBACK)
+        return 0;
+    for (req = wc->flushes; req; req = req->next)
+        due = MAX(due, req->gen);
+
+    e = wc->extents;
+    while (e) {
+        if (e->writing) {
+            e = e->next;
+            continue;
+        }
+        first = e;
+        n = 0;
+        want = 0;
+        do {
+            want |= e->urgent || e->gen <= due;
+            n += e->nb_sectors;
+            last = e;
+            e = e->next;
+        } while (e && !e->writing &&
+                 e->sector_num == last->sector_num + last->nb_sectors &&
+                 n + e->nb_sectors <= BDRV_WC_MAX_RUN);
+        if (want) {
+            bdrv_wc_writeback(wc, first, n);
+            return 1;
+        }
+    }
+    return 0;
 }
 
-#define NB_SUFFIXES 4
+/* Start whatever can go now: waiting requests, flushes and write-back */
+static void bdrv_wc_run(BlockWriteCache *wc)
+{
+    BlockWCRequest *req;
+    int action;
 
-char *get_human_readable_size(char *buf, int buf_size, int64_t size)
+    while ((req = wc->queue) != NULL) {
+        action = bdrv_wc_check(wc, req->type, req->sector_num,
+                               req->nb_sectors);
+        if (action == BDRV_WC_WAIT && !wc->error)
+            break;
+        wc->queue = req->next;
+        if (action == BDRV_WC_PASS)
+            bdrv_wc_pass(wc, req);
+        else if (action == BDRV_WC_TAKE)
+            bdrv_wc_take(wc, req);
+        else
+            bdrv_wc_finish(wc, req, wc->error);
+    }
+
+    while ((req = wc->flushes) != NULL && bdrv_wc_oldest(wc) > req->gen) {
+        wc->flushes = req->next;
+        wc->flushes_done++;
+        bdrv_wc_pass(wc, req);
+    }
+
+    while (bdrv_wc_kick(wc))
+        ;
+}
+
+static BlockWCRequest *bdrv_wc_new_request(BlockWriteCache *wc, int type,
+                                           int64_t sector_num, uint8_t *buf,
+                                           QEMUIOVector *qiov, int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque)
 {
-    static const char suffixes[NB_SUFFIXES] = "KMGT";
-    int64_t base;
-    int i;
+    BlockWCRequest *req = qemu_mallocz(sizeof(*req));
 
-    if (size <= 999) {
-        snprintf(buf, buf_size, "%" PRId64, size);
-    } else {
-        base = 1024;
-        for(i = 0; i < NB_SUFFIXES; i++) {
-            if (size < (10 * base)) {
-                snprintf(buf, buf_size, "%0.1f%c",
-                         (double)size / base,
-                         suffixes[i]);
-                break;
-            } else if (size < (1000 * base) || i == (NB_SUFFIXES - 1)) {
-                snprintf(buf, buf_size, "%" PRId64 "%c",
-                         ((size + (base >> 1)) / base),
-                         suffixes[i]);
+    req->wc = wc;
+    req->aiocb = qemu_aio_get(wc->bs, cb, opaque);
+    req->type = type;
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+    req->buf = buf;
+    req->qiov = qiov;
+    return req;
+}
+
+/* Write back what was written before the previous epoch, if it is over */
+static void bdrv_wc_age(BlockWriteCache *wc)
+{
+    int64_t now = bdrv_lat_now();
+
+    if (now - wc->epoch_start >= BDRV_WC_EXPIRE) {
+        wc->wb_gen = MAX(wc->wb_gen, wc->epoch_gen);
+        wc->epoch_gen = wc->gen;
+        wc->epoch_start = now;
+        bdrv_wc_run(wc);
+    }
+}
+
+/* Make sure the current epoch ends on time while anything is dirty */
+static void bdrv_wc_arm(BlockWriteCache *wc)
+{
+    int64_t left;
+
+    if (!wc->timer || wc->timer_armed || !wc->extents)
+        return;
+    left = wc->epoch_start + BDRV_WC_EXPIRE - bdrv_lat_now();
+    wc->timer_armed = 1;
+    qemu_mod_timer(wc->timer, qemu_get_clock(rt_clock) +
+                              MAX(left, 0) / 1000 + 1);
+}
+
+static void bdrv_wc_timer(void *opaque)
+{
+    BlockWriteCache *wc = opaque;
+
+    wc->timer_armed = 0;
+    bdrv_wc_age(wc);
+    bdrv_wc_arm(wc);
+}
+
+/* Take a read or write, NULL if it should go to the driver directly */
+static BlockDriverAIOCB *bdrv_wc_submit(BlockDriverState *bs, int type,
+                                        int64_t sector_num, uint8_t *buf,
+                                        QEMUIOVector *qiov, int nb_sectors,
+                                        BlockDriverCompletionFunc *cb,
+                                        void *opaque)
+{
+    BlockWriteCache *wc = bs->wcache;
+    BlockWCRequest *req, **preq;
+    BlockDriverAIOCB *acb;
+    int action;
+
+    if (!wc->timer)
+        bdrv_wc_age(wc);
+
+    action = bdrv_wc_check(wc, type, sector_num, nb_sectors);
+    if (wc->queue && action != BDRV_WC_WAIT) {
+        /* only reads of data nobody waits to write can overtake */
+        for (req = wc->queue; req; req = req->next) {
+            if (type != BDRV_WC_READ ||
+                (req->type == BDRV_WC_WRITE &&
+                 sector_num < req->sector_num + req->nb_sectors &&
+                 req->sector_num < sector_num + nb_sectors)) {
+                action = BDRV_WC_WAIT;
                 break;
             }
-            base = base * 1024;
         }
     }
-    return buf;
+    if (action == BDRV_WC_PASS)
+        return NULL;
+
+    req = bdrv_wc_new_request(wc, type, sector_num, buf, qiov, nb_sectors,
+                              cb, opaque);
+    acb = req->aiocb;
+    if (action == BDRV_WC_TAKE) {
+        bdrv_wc_take(wc, req);
+    } else {
+        for (preq = &wc->queue; *preq; preq = &(*preq)->next)
+            ;
+        *preq = req;
+    }
+    bdrv_wc_run(wc);
+    bdrv_wc_arm(wc);
+    return acb;
 }
 
-char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
+static BlockDriverAIOCB *bdrv_wc_flush(BlockDriverState *bs,
+                                       BlockDriverCompletionFunc *cb,
+                                       void *opaque)
 {
-    char buf1[128], date_buf[128], clock_buf[128];
-#ifdef _WIN32
-    struct tm *ptm;
-#else
-    struct tm tm;
-#endif
-    time_t ti;
-    int64_t secs;
+    BlockWriteCache *wc = bs->wcache;
+    BlockWCRequest *req, **preq;
+    BlockDriverAIOCB *acb;
 
-    if (!sn) {
-        snprintf(buf, buf_size,
-                 "%-10s%-20s%7s%20s%15s",
-                 "ID", "TAG", "VM SIZE", "DATE", "VM CLOCK");
-    } else {
-        ti = sn->date_sec;
-#ifdef _WIN32
-        ptm = localtime(&ti);
-        strftime(date_buf, sizeof(date_buf),
-                 "%Y-%m-%d %H:%M:%S", ptm);
-#else
-        localtime_r(&ti, &tm);
-        strftime(date_buf, sizeof(date_buf),
-                 "%Y-%m-%d %H:%M:%S", &tm);
-#endif
-        secs = sn->vm_clock_nsec / 1000000000;
-        snprintf(clock_buf, sizeof(clock_buf),
-                 "%02d:%02d:%02d.%03d",
-                 (int)(secs / 3600),
-                 (int)((secs / 60) % 60),
-                 (int)(secs % 60),
-                 (int)((sn->vm_clock_nsec / 1000000) % 1000));
-        snprintf(buf, buf_size,
-                 "%-10s%-20s%7s%20s%15s",
-                 sn->id_str, sn->name,
-                 get_human_readable_size(buf1, sizeof(buf1), sn->vm_state_size),
-                 date_buf,
-                 clock_buf);
+    req = bdrv_wc_new_request(wc, BDRV_WC_FLUSH, 0, NULL, NULL, 0,
+                              cb, opaque);
+    req->gen = wc->gen;
+    acb = req->aiocb;
+    for (preq = &wc->flushes; *preq; preq = &(*preq)->next)
+        ;
+    *preq = req;
+
+    /* retry whatever failed before */
+    wc->error = 0;
+    bdrv_wc_run(wc);
+    return acb;
+}
+
+static int bdrv_wc_cancel(BlockWriteCache *wc, BlockDriverAIOCB *acb)
+{
+    BlockWCRequest **lists[] = { &wc->queue, &wc->flushes, &wc->done,
+                                 &wc->inner };
+    BlockWCRequest *req, **preq;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(lists); i++) {
+        for (preq = lists[i]; (req = *preq) != NULL; preq = &req->next) {
+            if (req->aiocb == acb) {
+                *preq = req->next;
+                if (req->inner)
+                    bdrv_aio_cancel(req->inner);
+                qemu_aio_release(acb);
+                qemu_free(req);
+                return 1;
+            }
+        }
     }
-    return buf;
+    return 0;
+}
+
+/* Write back all dirty data, returns the write-back error if any */
+static int bdrv_wc_drain(BlockDriverState *bs)
+{
+    BlockWriteCache *wc = bs->wcache;
+
+    if (!wc)
+        return 0;
+    wc->error = 0;
+    for (;;) {
+        wc->wb_gen = wc->gen;
+        bdrv_wc_run(wc);
+        if (!wc->extents && !wc->queue)
+            return 0;
+        if (wc->error && !wc->writeback)
+            return wc->error;
+        qemu_aio_wait();
+    }
+}
+
+static void bdrv_wc_free(BlockWriteCache *wc)
+{
+    BlockWCExtent *e;
+
+    if (bdrv_wc_drain(wc->bs) < 0)
+        fprintf(stderr, "%s: write-back failed, %d cached sectors lost\n",
+                wc->bs->filename, wc->dirty);
+    while (wc->inner)
+        qemu_aio_wait();
+    qemu_bh_cancel(wc->bh);
+    bdrv_wc_bh(wc);
+
+    while ((e = wc->extents) != NULL) {
+        wc->extents = e->next;
+        qemu_free(e->buf);
+        qemu_free(e);
+    }
+    qemu_bh_delete(wc->bh);
+    if (wc->timer) {
+        qemu_del_timer(wc->timer);
+        qemu_free_timer(wc->timer);
+    }
+    wc->bs->wcache = NULL;
+    qemu_free(wc);
+}
+
+/**
+ * Keep up to size_kb of written data in memory and write it back in the
+ * background, 0 turns the cache off.  Guest flushes write back what they
+ * cover.  Needs a driver with native aio; the cache is dropped, after
+ * writing it back, when the image is closed.
+ */
+int bdrv_set_writecache(BlockDriverState *bs, int size_kb)
+{
+    BlockWriteCache *wc;
+
+    if (size_kb < 0 || (size_kb && size_kb < 64))
+        return -EINVAL;
+    if (size_kb && !bs->drv)
+        return -ENOMEDIUM;
+    if (size_kb && bs->drv->bdrv_aio_write == bdrv_aio_write_em)
+        return -ENOTSUP;
+
+    if (bs->wcache)
+        bdrv_wc_free(bs->wcache);
+    if (!size_kb)
+        return 0;
+
+    wc = qemu_mallocz(sizeof(*wc));
+    wc->bs = bs;
+    wc->limit = size_kb * 2;
+    wc->epoch_start = bdrv_lat_now();
+    wc->bh = qemu_bh_new(bdrv_wc_bh, wc);
+    wc->timer = qemu_new_timer(rt_clock, bdrv_wc_timer, wc);
+    bs->wcache = wc;
+    return 0;
 }
 
 /**************************************************************/
@@ -1378,6 +3566,7 @@ static void bdrv_aio_rw_vector_cb(void *opaque, int ret)
     qemu_vfree(s->bounce);
     s->this_aiocb->cb(s->this_aiocb->opaque, ret);
     qemu_aio_release(s->this_aiocb);
+    qemu_free(s);
 }
 
 static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
@@ -1394,7 +3583,8 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
 
     s->this_aiocb = aiocb;
     s->iov = iov;
-    s->bounce = qemu_memalign(512, nb_sectors * 512);
+    /* the guest's vector need not be a whole number of sectors */
+    s->bounce = qemu_memalign(512, MAX(iov->size, nb_sectors * 512));
     s->is_write = is_write;
     if (is_write) {
         qemu_iovec_to_buffer(s->iov, s->bounce);
@@ -1404,29 +3594,107 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
         s->aiocb = bdrv_aio_read(bs, sector_num, s->bounce, nb_sectors,
                                  bdrv_aio_rw_vector_cb, s);
     }
+    if (!s->aiocb) {
+        qemu_vfree(s->bounce);
+        qemu_free(s);
+        qemu_aio_release(aiocb);
+        return NULL;
+    }
+    bs->bounced_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
     return aiocb;
 }
 
+/*
+ * Drivers that implement bdrv_aio_readv/writev get the vector as is,
+ * everything else goes through a bounce buffer.
+ */
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *iov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockLatencyState *lat = NULL;
+
+    if (!drv)
+        return NULL;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
-                              cb, opaque, 0);
+    if (!drv->bdrv_aio_readv)
+        return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
+                                  cb, opaque, 0);
+    if (bs->wcache && cb != bdrv_wc_inner_cb) {
+        ret = bdrv_wc_submit(bs, BDRV_WC_READ, sector_num, NULL, iov,
+                             nb_sectors, cb, opaque);
+        if (ret)
+            return ret;
+    }
+
+    ret = NULL;
+    if (bs->readahead)
+        ret = bdrv_ra_read(bs, sector_num, NULL, iov, nb_sectors, cb, opaque);
+    if (!ret) {
+        lat = bdrv_lat_submit(bs, BDRV_LAT_READ, sector_num, nb_sectors,
+                              &cb, &opaque);
+        ret = drv->bdrv_aio_readv(bs, sector_num, iov, nb_sectors,
+                                  cb, opaque);
+    }
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->rd_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
+	bs->rd_ops ++;
+        if (bs->readahead)
+            bdrv_ra_prefetch(bs, sector_num, nb_sectors);
+    } else if (lat) {
+        bdrv_lat_abort(lat);
+    }
+
+    return ret;
 }
 
 BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                   QEMUIOVector *iov, int nb_sectors,
                                   BlockDriverCompletionFunc *cb, void *opaque)
 {
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockLatencyState *lat = NULL;
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
-                              cb, opaque, 1);
+    if (!drv->bdrv_aio_writev)
+        return bdrv_aio_rw_vector(bs, sector_num, iov, nb_sectors,
+                                  cb, opaque, 1);
+    if (bs->readahead)
+        bdrv_ra_invalidate(bs->readahead, sector_num, nb_sectors);
+    bdrv_am_invalidate(bs, sector_num, nb_sectors);
+    if (bs->wcache && cb != bdrv_wc_inner_cb) {
+        ret = bdrv_wc_submit(bs, BDRV_WC_WRITE, sector_num, NULL, iov,
+                             nb_sectors, cb, opaque);
+        if (ret)
+            return ret;
+    }
+
+    lat = bdrv_lat_submit(bs, BDRV_LAT_WRITE, sector_num, nb_sectors,
+                          &cb, &opaque);
+    ret = drv->bdrv_aio_writev(bs, sector_num, iov, nb_sectors, cb, opaque);
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->wr_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
+	bs->wr_ops ++;
+    } else if (lat) {
+        bdrv_lat_abort(lat);
+    }
+
+    return ret;
 }
 
 BlockDriverAIOCB *bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
@@ -1435,18 +3703,38 @@ BlockDriverAIOCB *bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
 {
     BlockDriver *drv = bs->drv;
     BlockDriverAIOCB *ret;
+    BlockLatencyState *lat = NULL;
 
     if (!drv)
         return NULL;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
+    if (bs->wcache && cb != bdrv_wc_inner_cb) {
+        ret = bdrv_wc_submit(bs, BDRV_WC_READ, sector_num, buf, NULL,
+                             nb_sectors, cb, opaque);
+        if (ret)
+            return ret;
+    }
 
-    ret = drv->bdrv_aio_read(bs, sector_num, buf, nb_sectors, cb, opaque);
+    ret = NULL;
+    if (bs->readahead)
+        ret = bdrv_ra_read(bs, sector_num, buf, NULL, nb_sectors, cb, opaque);
+    if (!ret) {
+        if (drv->bdrv_aio_read != bdrv_aio_read_em)
+            lat = bdrv_lat_submit(bs, BDRV_LAT_READ, sector_num,
+                                  nb_sectors, &cb, &opaque);
+        ret = drv->bdrv_aio_read(bs, sector_num, buf, nb_sectors,
+                                 cb, opaque);
+    }
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
 	bs->rd_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
 	bs->rd_ops ++;
+        if (bs->readahead)
+            bdrv_ra_prefetch(bs, sector_num, nb_sectors);
+    } else if (lat) {
+        bdrv_lat_abort(lat);
     }
 
     return ret;
@@ -1458,6 +3746,7 @@ BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
 {
     BlockDriver *drv = bs->drv;
     BlockDriverAIOCB *ret;
+    BlockLatencyState *lat = NULL;
 
     if (!drv)
         return NULL;
@@ -1466,12 +3755,26 @@ BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
+    if (bs->readahead)
+        bdrv_ra_invalidate(bs->readahead, sector_num, nb_sectors);
+    bdrv_am_invalidate(bs, sector_num, nb_sectors);
+    if (bs->wcache && cb != bdrv_wc_inner_cb) {
+        ret = bdrv_wc_submit(bs, BDRV_WC_WRITE, sector_num, (uint8_t *)buf,
+                             NULL, nb_sectors, cb, opaque);
+        if (ret)
+            return ret;
+    }
+    if (drv->bdrv_aio_write != bdrv_aio_write_em)
+        lat = bdrv_lat_submit(bs, BDRV_LAT_WRITE, sector_num, nb_sectors,
+                              &cb, &opaque);
     ret = drv->bdrv_aio_write(bs, sector_num, buf, nb_sectors, cb, opaque);
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
 	bs->wr_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
 	bs->wr_ops ++;
+    } else if (lat) {
+        bdrv_lat_abort(lat);
     }
 
     return ret;
@@ -1480,24 +3783,43 @@ BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
     BlockDriver *drv = acb->bs->drv;
+    BlockLatencyState *lat = NULL;
 
     if (acb->cb == bdrv_aio_rw_vector_cb) {
         VectorTranslationState *s = acb->opaque;
         acb = s->aiocb;
     }
+    if (acb->bs->wcache && bdrv_wc_cancel(acb->bs->wcache, acb))
+        return;
+    if (acb->bs->readahead && bdrv_ra_cancel(acb->bs->readahead, acb))
+        return;
+    if (acb->cb == bdrv_lat_cb)
+        lat = acb->opaque;
 
     drv->bdrv_aio_cancel(acb);
+    if (lat)
+        bdrv_lat_abort(lat);
 }
 
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs, 
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockLatencyState *lat = NULL;
 
     if (!drv)
         return NULL;
+    if (bs->wcache && cb != bdrv_wc_inner_cb)
+        return bdrv_wc_flush(bs, cb, opaque);
 
-    return drv->bdrv_aio_flush(bs, cb, opaque);
+    if (drv->bdrv_aio_flush != bdrv_aio_flush_em)
+        lat = bdrv_lat_submit(bs, BDRV_LAT_FLUSH, 0, 0, &cb, &opaque);
+    ret = drv->bdrv_aio_flush(bs, cb, opaque);
+    if (!ret && lat)
+        bdrv_lat_abort(lat);
+
+    return ret;
 }
 
 /**************************************************************/
@@ -1604,7 +3926,7 @@ static BlockDriverAIOCB *bdrv_aio_flush_em(BlockDriverState *bs,
     acb = qemu_aio_get(bs, cb, opaque);
     if (!acb->bh)
         acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
-    ret = bdrv_flush(bs);
+    ret = bdrv_flush_driver(bs);
     acb->ret = ret;
     qemu_bh_schedule(acb->bh);
     return &acb->common;
@@ -56,6 +56,8 @@ typedef struct QEMUSnapshotInfo {
 
 void bdrv_info(void);
 void bdrv_info_stats(void);
+void bdrv_info_latency(void);
+void bdrv_info_commit(void);
 
 void bdrv_init(void);
 BlockDriver *bdrv_find_format(const char *format_name);
@@ -82,6 +84,10 @@ int64_t bdrv_getlength(BlockDriverState *bs);
 void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr);
 void bdrv_guess_geometry(BlockDriverState *bs, int *pcyls, int *pheads, int *psecs);
 int bdrv_commit(BlockDriverState *bs);
+int bdrv_commit_start(BlockDriverState *bs);
+int bdrv_commit_cancel(BlockDriverState *bs);
+int bdrv_commit_status(BlockDriverState *bs);
+void bdrv_commit_set_speed(int64_t speed);
 /* async block I/O */
 typedef struct BlockDriverAIOCB BlockDriverAIOCB;
 typedef void BlockDriverCompletionFunc(void *opaque, int ret);
@@ -137,6 +143,9 @@ void bdrv_set_locked(BlockDriverState *bs, int locked);
 void bdrv_eject(BlockDriverState *bs, int eject_flag);
 void bdrv_set_change_cb(BlockDriverState *bs,
                         void (*change_cb)(void *opaque), void *opaque);
+int bdrv_set_readahead(BlockDriverState *bs, int size_kb);
+int bdrv_set_writecache(BlockDriverState *bs, int size_kb);
+int bdrv_set_chunk_cache(BlockDriverState *bs, int size_kb);
 void bdrv_get_format(BlockDriverState *bs, char *buf, int buf_size);
 BlockDriverState *bdrv_find(const char *name);
 void bdrv_iterate(void (*it)(void *opaque, BlockDriverState *bs),
@@ -31,6 +31,37 @@
 #define BLOCK_FLAG_COMPAT6	4
 
 #define BLOCK_DRIVER_FLAG_EXTENDABLE  0x0001u
+/* Sectors that bdrv_is_allocated() reports as unallocated read from
+   backing_hd, or as zeroes without one, and allocation only changes
+   through writes to the image */
+#define BLOCK_DRIVER_FLAG_BACKING     0x0002u
+
+/* Backing chain lookups resolved at depth 0, 1, ... below the image,
+   deeper ones are counted in the last entry */
+#define BDRV_CHAIN_DEPTHS 8
+
+/* Latency histograms: bucket n counts requests that took less than
+   2^n microseconds (and at least 2^(n-1)), the last bucket is open ended */
+#define BDRV_LAT_BUCKETS 24
+
+enum {
+    BDRV_LAT_READ,
+    BDRV_LAT_WRITE,
+    BDRV_LAT_FLUSH,
+    BDRV_LAT_MAX,
+};
+
+typedef struct BlockLatencyStats {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t hist[BDRV_LAT_BUCKETS];
+} BlockLatencyStats;
+
+typedef struct BlockReadAhead BlockReadAhead;
+typedef struct BlockWriteCache BlockWriteCache;
+typedef struct BlockAllocMap BlockAllocMap;
+typedef struct BlockCommitJob BlockCommitJob;
 
 struct BlockDriver {
     const char *format_name;
@@ -59,6 +90,13 @@ struct BlockDriver {
     void (*bdrv_aio_cancel)(BlockDriverAIOCB *acb);
     BlockDriverAIOCB *(*bdrv_aio_flush)(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque);
+    /* optional, requests are linearized into a bounce buffer without them */
+    BlockDriverAIOCB *(*bdrv_aio_readv)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+    BlockDriverAIOCB *(*bdrv_aio_writev)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
     int aiocb_size;
 
     const char *protocol_name;
@@ -94,6 +132,9 @@ struct BlockDriver {
     /* to control generic scsi devices */
     int (*bdrv_ioctl)(BlockDriverState *bs, unsigned long int req, void *buf);
 
+    /* size of the decompressed chunk cache of compressed formats */
+    int (*bdrv_set_chunk_cache)(BlockDriverState *bs, int size_kb);
+
     unsigned bdrv_flags;
     BlockDriverAIOCB *free_aiocb;
     struct BlockDriver *next;
@@ -123,6 +164,8 @@ struct BlockDriverState {
     int media_changed;
 
     BlockDriverState *backing_hd;
+    /* image file below a format driver, only used to report statistics */
+    BlockDriverState *file;
     /* async read/write emulation */
 
     void *sync_aiocb;
@@ -132,6 +175,31 @@ struct BlockDriverState {
     uint64_t wr_bytes;
     uint64_t rd_ops;
     uint64_t wr_ops;
+    uint64_t bounced_bytes; /* vectored I/O copied through a bounce buffer */
+
+    /* Latency from submission to completion (display with
+       "info blocklatency"). */
+    BlockLatencyStats latency[BDRV_LAT_MAX];
+    BlockLatencyStats aio_wait; /* time spent queued for an AIO thread */
+    int in_flight;
+    int in_flight_peak;
+    int wr_in_flight; /* aio writes only */
+
+    /* read-ahead cache, NULL unless enabled with bdrv_set_readahead() */
+    BlockReadAhead *readahead;
+
+    /* write-back cache, NULL unless enabled with bdrv_set_writecache() */
+    BlockWriteCache *wcache;
+
+    /* cached bdrv_is_allocated() results, built on demand for
+       BLOCK_DRIVER_FLAG_BACKING formats */
+    BlockAllocMap *allocmap;
+    /* bdrv_chain_owner() lookups starting at this image */
+    uint64_t chain_hits[BDRV_CHAIN_DEPTHS];
+    uint64_t chain_zero_hits;
+
+    /* last commit into backing_hd (display with "info commit") */
+    BlockCommitJob *commit;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -158,6 +226,13 @@ void *qemu_aio_get(BlockDriverState *bs, BlockDriverCompletionFunc *cb,
                    void *opaque);
 void qemu_aio_release(void *p);
 
+BlockDriverState *bdrv_chain_owner(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors, int *pnum);
+int bdrv_read_chain(BlockDriverState *bs, int64_t sector_num,
+                    uint8_t *buf, int nb_sectors);
+
+void bdrv_latency_add(BlockLatencyStats *st, uint64_t us);
+
 extern BlockDriverState *bdrv_first;
 
 #endif /* BLOCK_INT_H */
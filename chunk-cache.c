@@ -0,0 +1,492 @@
+/*
+ * Cache of decompressed chunks for compressed read-only images
+ *
+ * Formats like cloop and dmg store the image as independently compressed
+ * chunks.  This keeps the most recently used chunks decompressed, reads
+ * the compressed data through a read-only mapping of the image file when
+ * the host allows it, and decompresses the chunks following a sequential
+ * reader on a few worker threads.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "chunk-cache.h"
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef CONFIG_AIO
+#include <pthread.h>
+#include <signal.h>
+#define CHUNK_CACHE_THREADS
+#endif
+
+#define CHUNK_CACHE_MAX_WORKERS 4
+
+enum {
+    CHUNK_EMPTY,
+    CHUNK_QUEUED,       /* waiting for a worker */
+    CHUNK_LOADING,      /* being decompressed */
+    CHUNK_VALID,
+};
+
+typedef struct ChunkSlot {
+    uint32_t chunk;
+    int state;
+    uint8_t *buf;
+    uint64_t last_use;
+    struct ChunkSlot *next_job;
+} ChunkSlot;
+
+struct ChunkCache {
+    int fd;
+    uint8_t *map;
+    uint64_t map_size;
+    uint32_t nb_chunks;
+    size_t chunk_size;
+    size_t max_compressed;
+    ChunkDecodeFunc *decode;
+    void *opaque;
+
+    ChunkSlot *slots;
+    int nb_slots;
+    int32_t *slot_of;           /* chunk -> index in slots[], or -1 */
+    uint64_t clock;
+    ChunkSlot *last;            /* returned by the previous lookup */
+    uint32_t last_chunk;
+    ChunkContext ctx;           /* for the caller of chunk_cache_get() */
+
+    ChunkSlot *jobs;
+    ChunkSlot **jobs_tail;
+    int nb_workers;
+#ifdef CHUNK_CACHE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a job was queued */
+    pthread_cond_t done;        /* a job finished */
+    pthread_t workers[CHUNK_CACHE_MAX_WORKERS];
+    int quit;
+#endif
+};
+
+#ifdef CHUNK_CACHE_THREADS
+static void chunk_lock(ChunkCache *c)
+{
+    pthread_mutex_lock(&c->lock);
+}
+
+static void chunk_unlock(ChunkCache *c)
+{
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void chunk_wait(ChunkCache *c)
+{
+    pthread_cond_wait(&c->done, &c->lock);
+}
+#else
+static inline void chunk_lock(ChunkCache *c)
+{
+}
+
+static inline void chunk_unlock(ChunkCache *c)
+{
+}
+
+static inline void chunk_wait(ChunkCache *c)
+{
+}
+#endif
+
+static void chunk_context_init(ChunkCache *c, ChunkContext *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->cache = c;
+    /* a failure here shows up as a decode error later */
+    inflateInit(&ctx->zstream);
+}
+
+static void chunk_context_cleanup(ChunkContext *ctx)
+{
+    inflateEnd(&ctx->zstream);
+    qemu_free(ctx->scratch);
+}
+
+const uint8_t *chunk_cache_source(ChunkContext *ctx, uint64_t offset,
+                                  size_t len)
+{
+    ChunkCache *c = ctx->cache;
+    size_t done = 0;
+    ssize_t ret;
+
+    if (c->map && offset <= c->map_size && len <= c->map_size - offset)
+        return c->map + offset;
+
+    if (len > c->max_compressed)
+        return NULL;
+    if (!ctx->scratch)
+        ctx->scratch = qemu_malloc(c->max_compressed);
+    while (done < len) {
+        ret = pread(c->fd, ctx->scratch + done, len - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return NULL;
+        done += ret;
+    }
+    return ctx->scratch;
+}
+
+int chunk_cache_inflate(ChunkContext *ctx, const uint8_t *src, size_t len,
+                        uint8_t *buf, size_t size)
+{
+    z_stream *zs = &ctx->zstream;
+
+    if (inflateReset(zs) != Z_OK)
+        return -1;
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = len;
+    zs->next_out = buf;
+    zs->avail_out = size;
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->total_out != size)
+        return -1;
+    return 0;
+}
+
+/* All of the following run with the lock held */
+
+static void chunk_slot_free(ChunkCache *c, ChunkSlot *slot)
+{
+    if (slot->state != CHUNK_EMPTY)
+        c->slot_of[slot->chunk] = -1;
+    slot->state = CHUNK_EMPTY;
+    if (slot == c->last)
+        c->last = NULL;
+}
+
+static void chunk_job_remove(ChunkCache *c, ChunkSlot *slot)
+{
+    ChunkSlot **pjob;
+
+    for (pjob = &c->jobs; *pjob; pjob = &(*pjob)->next_job) {
+        if (*pjob == slot) {
+            *pjob = slot->next_job;
+            if (!*pjob)
+                c->jobs_tail = pjob;
+            return;
+        }
+    }
+}
+
+/* The least recently used idle slot, other than keep */
+static ChunkSlot *chunk_slot_victim(ChunkCache *c, ChunkSlot *keep)
+{
+    ChunkSlot *victim = NULL;
+    int i;
+
+    for (i = 0; i < c->nb_slots; i++) {
+        ChunkSlot *slot = &c->slots[i];
+        if (slot->state == CHUNK_EMPTY)
+            return slot;
+        if (slot->state == CHUNK_VALID && slot != keep &&
+            (!victim || slot->last_use < victim->last_use))
+            victim = slot;
+    }
+    return victim;
+}
+
+static void chunk_slot_assign(ChunkCache *c, ChunkSlot *slot, uint32_t n)
+{
+    chunk_slot_free(c, slot);
+    if (!slot->buf)
+        slot->buf = qemu_malloc(c->chunk_size);
+    slot->chunk = n;
+    slot->last_use = ++c->clock;
+    c->slot_of[n] = slot - c->slots;
+}
+
+/* Drop queued read-ahead and wait until no worker is busy */
+static void chunk_cache_quiesce(ChunkCache *c)
+{
+    int i, busy;
+
+    while (c->jobs) {
+        ChunkSlot *slot = c->jobs;
+        c->jobs = slot->next_job;
+        chunk_slot_free(c, slot);
+    }
+    c->jobs_tail = &c->jobs;
+
+    do {
+        busy = 0;
+        for (i = 0; i < c->nb_slots; i++) {
+            if (c->slots[i].state == CHUNK_LOADING)
+                busy = 1;
+        }
+        if (busy)
+            chunk_wait(c);
+    } while (busy);
+}
+
+#ifdef CHUNK_CACHE_THREADS
+static void *chunk_cache_worker(void *opaque)
+{
+    ChunkCache *c = opaque;
+    ChunkContext ctx;
+    ChunkSlot *slot;
+    sigset_t set;
+    int ret;
+
+    /* signals are for the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    chunk_context_init(c, &ctx);
+
+    chunk_lock(c);
+    for (;;) {
+        while (!c->jobs && !c->quit)
+            pthread_cond_wait(&c->work, &c->lock);
+        if (c->quit)
+            break;
+        slot = c->jobs;
+        c->jobs = slot->next_job;
+        if (!c->jobs)
+            c->jobs_tail = &c->jobs;
+        slot->state = CHUNK_LOADING;
+        chunk_unlock(c);
+
+        ret = c->decode(c->opaque, &ctx, slot->chunk, slot->buf);
+
+        chunk_lock(c);
+        if (ret < 0) {
+            /* the reader will try again and report the error */
+            c->slot_of[slot->chunk] = -1;
+            slot->state = CHUNK_EMPTY;
+        } else {
+            slot->state = CHUNK_VALID;
+        }
+        pthread_cond_broadcast(&c->done);
+    }
+    chunk_unlock(c);
+
+    chunk_context_cleanup(&ctx);
+    return NULL;
+}
+
+static void chunk_cache_start(ChunkCache *c)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    n = MIN(MAX(n, 1), CHUNK_CACHE_MAX_WORKERS);
+    while (c->nb_workers < n) {
+        if (pthread_create(&c->workers[c->nb_workers], NULL,
+                           chunk_cache_worker, c))
+            break;
+        c->nb_workers++;
+    }
+}
+#endif
+
+/* Queue the chunks following a sequential reader for the workers */
+static void chunk_cache_prefetch(ChunkCache *c, ChunkSlot *cur, uint32_t n)
+{
+#ifdef CHUNK_CACHE_THREADS
+    ChunkSlot *slot;
+    uint32_t end;
+
+    if (!c->nb_workers)
+        chunk_cache_start(c);
+    end = n + MIN(c->nb_workers * 2, c->nb_slots / 2);
+    if (end > c->nb_chunks)
+        end = c->nb_chunks;
+
+    for (; n < end; n++) {
+        if (c->slot_of[n] >= 0)
+            continue;
+        slot = chunk_slot_victim(c, cur);
+        if (!slot)
+            break;
+        chunk_slot_assign(c, slot, n);
+        slot->state = CHUNK_QUEUED;
+        slot->next_job = NULL;
+        *c->jobs_tail = slot;
+        c->jobs_tail = &slot->next_job;
+        pthread_cond_signal(&c->work);
+    }
+#endif
+}
+
+/* A slot for chunk n that is ours to fill, or one that holds it already */
+static ChunkSlot *chunk_cache_lookup(ChunkCache *c, uint32_t n)
+{
+    ChunkSlot *slot;
+
+    for (;;) {
+        if (c->slot_of[n] >= 0) {
+            slot = &c->slots[c->slot_of[n]];
+            if (slot->state == CHUNK_VALID)
+                return slot;
+            if (slot->state == CHUNK_QUEUED) {
+                /* no point in waiting for a worker to pick it up */
+                chunk_job_remove(c, slot);
+                slot->state = CHUNK_LOADING;
+                return slot;
+            }
+        } else {
+            slot = chunk_slot_victim(c, NULL);
+            if (slot) {
+                chunk_slot_assign(c, slot, n);
+                slot->state = CHUNK_LOADING;
+                return slot;
+            }
+            if (c->jobs) {
+                /* everything is queued for read-ahead, cancel some */
+                slot = c->jobs;
+                chunk_job_remove(c, slot);
+                chunk_slot_free(c, slot);
+                continue;
+            }
+        }
+        /* chunk n, or every other slot, is being decompressed */
+        chunk_wait(c);
+    }
+}
+
+const uint8_t *chunk_cache_get(ChunkCache *c, uint32_t n)
+{
+    ChunkSlot *slot;
+    int ret;
+
+    /* a VALID slot is never touched by the workers */
+    if (c->last && c->last_chunk == n)
+        return c->last->buf;
+    if (n >= c->nb_chunks)
+        return NULL;
+
+    chunk_lock(c);
+    slot = chunk_cache_lookup(c, n);
+    if (slot->state == CHUNK_LOADING) {
+        chunk_unlock(c);
+        ret = c->decode(c->opaque, &c->ctx, n, slot->buf);
+        chunk_lock(c);
+        if (ret < 0) {
+            chunk_slot_free(c, slot);
+            chunk_unlock(c);
+            return NULL;
+        }
+        slot->state = CHUNK_VALID;
+    }
+    slot->last_use = ++c->clock;
+
+    if (c->last && n == c->last_chunk + 1)
+        chunk_cache_prefetch(c, slot, n + 1);
+    c->last = slot;
+    c->last_chunk = n;
+    chunk_unlock(c);
+
+    return slot->buf;
+}
+
+int chunk_cache_resize(ChunkCache *c, int size_kb)
+{
+    int64_t nb_slots;
+    uint32_t i;
+
+    if (size_kb < 0)
+        return -EINVAL;
+    if (!size_kb)
+        size_kb = CHUNK_CACHE_DEFAULT_KB;
+
+    /* read-ahead needs room for at least one chunk besides the current */
+    nb_slots = (int64_t)size_kb * 1024 / MAX(c->chunk_size, 1);
+    nb_slots = MIN(MAX(nb_slots, 2), MAX(c->nb_chunks, 2));
+
+    chunk_lock(c);
+    chunk_cache_quiesce(c);
+    for (i = 0; i < c->nb_slots; i++)
+        qemu_free(c->slots[i].buf);
+    qemu_free(c->slots);
+    c->slots = qemu_mallocz(nb_slots * sizeof(ChunkSlot));
+    c->nb_slots = nb_slots;
+    for (i = 0; i < c->nb_chunks; i++)
+        c->slot_of[i] = -1;
+    c->last = NULL;
+    chunk_unlock(c);
+
+    return 0;
+}
+
+ChunkCache *chunk_cache_new(int fd, uint32_t nb_chunks, size_t chunk_size,
+                            size_t max_compressed, ChunkDecodeFunc *decode,
+                            void *opaque)
+{
+    ChunkCache *c;
+#ifndef _WIN32
+    struct stat st;
+    void *map;
+#endif
+
+    c = qemu_mallocz(sizeof(*c));
+    c->fd = fd;
+    c->nb_chunks = nb_chunks;
+    c->chunk_size = chunk_size;
+    c->max_compressed = max_compressed;
+    c->decode = decode;
+    c->opaque = opaque;
+    c->slot_of = qemu_malloc(nb_chunks * sizeof(int32_t));
+    c->jobs_tail = &c->jobs;
+
+#ifndef _WIN32
+    /* fall back to pread() if the image cannot be mapped, e.g. on
+       32-bit hosts */
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+        (size_t)st.st_size == st.st_size) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            c->map = map;
+            c->map_size = st.st_size;
+        }
+    }
+#endif
+
+#ifdef CHUNK_CACHE_THREADS
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->work, NULL);
+    pthread_cond_init(&c->done, NULL);
+#endif
+    chunk_context_init(c, &c->ctx);
+    chunk_cache_resize(c, 0);
+    return c;
+}
+
+void chunk_cache_delete(ChunkCache *c)
+{
+    int i;
+
+#ifdef CHUNK_CACHE_THREADS
+    chunk_lock(c);
+    c->quit = 1;
+    pthread_cond_broadcast(&c->work);
+    chunk_unlock(c);
+    for (i = 0; i < c->nb_workers; i++)
+        pthread_join(c->workers[i], NULL);
+    pthread_cond_destroy(&c->done);
+    pthread_cond_destroy(&c->work);
+    pthread_mutex_destroy(&c->lock);
+#endif
+
+    for (i = 0; i < c->nb_slots; i++)
+        qemu_free(c->slots[i].buf);
+    qemu_free(c->slots);
+    qemu_free(c->slot_of);
+    chunk_context_cleanup(&c->ctx);
+#ifndef _WIN32
+    if (c->map)
+        munmap(c->map, c->map_size);
+#endif
+    qemu_free(c);
+}
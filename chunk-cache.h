@@ -0,0 +1,48 @@
+/*
+ * Cache of decompressed chunks for compressed read-only images
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <zlib.h>
+
+#define CHUNK_CACHE_DEFAULT_KB 4096
+
+typedef struct ChunkCache ChunkCache;
+
+/* Decoder state, one per thread that decompresses chunks */
+typedef struct ChunkContext {
+    ChunkCache *cache;
+    z_stream zstream;
+    uint8_t *scratch;   /* compressed data read with pread() */
+} ChunkContext;
+
+/*
+ * Fill buf with the uncompressed contents of chunk n and return 0, or
+ * return -1.  Read-ahead runs this from worker threads, so it may only
+ * look at driver state that does not change after open.
+ */
+typedef int ChunkDecodeFunc(void *opaque, ChunkContext *ctx, uint32_t n,
+                            uint8_t *buf);
+
+ChunkCache *chunk_cache_new(int fd, uint32_t nb_chunks, size_t chunk_size,
+                            size_t max_compressed, ChunkDecodeFunc *decode,
+                            void *opaque);
+void chunk_cache_delete(ChunkCache *c);
+int chunk_cache_resize(ChunkCache *c, int size_kb);
+
+/* The returned buffer stays valid until the next call */
+const uint8_t *chunk_cache_get(ChunkCache *c, uint32_t n);
+
+/* Helpers for decoders */
+const uint8_t *chunk_cache_source(ChunkContext *ctx, uint64_t offset,
+                                  size_t len);
+int chunk_cache_inflate(ChunkContext *ctx, const uint8_t *src, size_t len,
+                        uint8_t *buf, size_t size);
+
+#endif
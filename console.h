@@ -316,6 +316,9 @@ void do_info_vnc(void);
 /* curses.c */
 void curses_display_init(DisplayState *ds, int full_screen);
 
+/* shmdisplay.c */
+int shm_display_init(DisplayState *ds, const char *name);
+
 /* FIXME: term_printf et al should probably go elsewhere so everything
    does not need to include console.h  */
 /* monitor.c */
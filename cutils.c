@@ -168,3 +168,48 @@ void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count)
         count -= copy;
     }
 }
+
+/*
+ * Append the part of src that starts at byte soffset and is sbytes long
+ * to dst.  The data is not copied, dst points into the same buffers.
+ */
+void qemu_iovec_concat(QEMUIOVector *dst, QEMUIOVector *src,
+                       size_t soffset, size_t sbytes)
+{
+    int i;
+
+    for (i = 0; i < src->niov && sbytes; i++) {
+        size_t len = src->iov[i].iov_len;
+
+        if (soffset >= len) {
+            soffset -= len;
+            continue;
+        }
+        len -= soffset;
+        if (len > sbytes)
+            len = sbytes;
+        qemu_iovec_add(dst, (uint8_t *)src->iov[i].iov_base + soffset, len);
+        sbytes -= len;
+        soffset = 0;
+    }
+}
+
+void qemu_iovec_memset(QEMUIOVector *qiov, size_t offset, int c, size_t count)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov && count; i++) {
+        size_t len = qiov->iov[i].iov_len;
+
+        if (offset >= len) {
+            offset -= len;
+            continue;
+        }
+        len -= offset;
+        if (len > count)
+            len = count;
+        memset((uint8_t *)qiov->iov[i].iov_base + offset, c, len);
+        count -= len;
+        offset = 0;
+    }
+}
@@ -34,6 +34,58 @@
 
 #define m(x) ((x) & s->cirrus_addr_mask)
 
+/* unmasked line kernels, only used once cirrus_blt_fast_ok() agreed */
+static inline void
+glue(cirrus_rop_line_fwd_, ROP_NAME)(uint8_t *d, const uint8_t *s, int n)
+{
+#ifdef ROP_COPY
+    memmove(d, s, n);
+#else
+    unsigned long dw, sw;
+
+    for (; n >= (int)sizeof(unsigned long); n -= sizeof(unsigned long)) {
+        memcpy(&dw, d, sizeof(dw));
+        memcpy(&sw, s, sizeof(sw));
+        ROP_OP(dw, sw);
+        memcpy(d, &dw, sizeof(dw));
+        d += sizeof(unsigned long);
+        s += sizeof(unsigned long);
+    }
+    for (; n > 0; n--) {
+        ROP_OP(*d, *s);
+        d++;
+        s++;
+    }
+#endif
+}
+
+/* d and s point to the last byte of the line */
+static inline void
+glue(cirrus_rop_line_bkwd_, ROP_NAME)(uint8_t *d, const uint8_t *s, int n)
+{
+#ifdef ROP_COPY
+    memmove(d - n + 1, s - n + 1, n);
+#else
+    unsigned long dw, sw;
+
+    d++;
+    s++;
+    for (; n >= (int)sizeof(unsigned long); n -= sizeof(unsigned long)) {
+        d -= sizeof(unsigned long);
+        s -= sizeof(unsigned long);
+        memcpy(&dw, d, sizeof(dw));
+        memcpy(&sw, s, sizeof(sw));
+        ROP_OP(dw, sw);
+        memcpy(d, &dw, sizeof(dw));
+    }
+    for (; n > 0; n--) {
+        d--;
+        s--;
+        ROP_OP(*d, *s);
+    }
+#endif
+}
+
 static void
 glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
                              uint8_t *dst_,const uint8_t *src_,
@@ -47,6 +99,18 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
     get_base(src_, s, src_base);
     dst = dst_ - dst_base;
     src = src_ - src_base;
+
+    if (cirrus_blt_fast_ok(s, dst_base, dst, dstpitch, src_base, src, srcpitch,
+                           bltwidth, bltheight, 0)) {
+        for (y = 0; y < bltheight; y++) {
+            glue(cirrus_rop_line_fwd_, ROP_NAME)(dst_base + dst,
+                                                 src_base + src, bltwidth);
+            dst += dstpitch;
+            src += srcpitch;
+        }
+        return;
+    }
+
     dstpitch -= bltwidth;
     srcpitch -= bltwidth;
 
@@ -79,6 +143,18 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
     get_base(src_, s, src_base);
     dst = dst_ - dst_base;
     src = src_ - src_base;
+
+    if (cirrus_blt_fast_ok(s, dst_base, dst, dstpitch, src_base, src, srcpitch,
+                           bltwidth, bltheight, 1)) {
+        for (y = 0; y < bltheight; y++) {
+            glue(cirrus_rop_line_bkwd_, ROP_NAME)(dst_base + dst,
+                                                  src_base + src, bltwidth);
+            dst += dstpitch;
+            src += srcpitch;
+        }
+        return;
+    }
+
     dstpitch += bltwidth;
     srcpitch += bltwidth;
     for (y = 0; y < bltheight; y++) {
@@ -232,6 +308,7 @@ glue(glue(cirrus_bitblt_rop_bkwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 
 #undef ROP_NAME
 #undef ROP_OP
+#undef ROP_COPY
 
 #undef get_base
 #undef m
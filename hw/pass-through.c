@@ -88,6 +88,7 @@
 #include "pci/pci.h"
 #include "pt-msi.h"
 #include "qemu-xen.h"
+#include "console.h"
 #include <unistd.h>
 
 struct php_dev {
@@ -229,6 +230,7 @@ static int pt_bar_reg_restore(struct pt_dev *ptdev,
 static int pt_exp_rom_bar_reg_restore(struct pt_dev *ptdev,
     struct pt_reg_tbl *cfg_entry,
     uint32_t real_offset, uint32_t dev_value, uint32_t *value);
+static void pt_bar_probe_expire(void *opaque);
 
 /* pt_reg_info_tbl declaration
  * - only for emulated register (either a part or whole bit).
@@ -1142,6 +1144,39 @@ out:
     return reg_entry;
 }
 
+/* find emulate register group entry by lookup table */
+static inline struct pt_reg_grp_tbl* pt_lookup_reg_grp(struct pt_dev *ptdev,
+                                                       uint32_t address)
+{
+    if (address >= PT_CONFIG_SIZE)
+        return NULL;
+    return ptdev->grp_map[address];
+}
+
+/* find emulate register entry of a group by lookup table */
+static inline struct pt_reg_tbl* pt_lookup_reg(struct pt_dev *ptdev,
+                                               struct pt_reg_grp_tbl *reg_grp,
+                                               uint32_t address)
+{
+    if (address >= PT_CONFIG_SIZE || ptdev->grp_map[address] != reg_grp)
+        return NULL;
+    return ptdev->reg_map[address];
+}
+
+/* check whether no bit of the access has to be read from the device */
+static inline int pt_config_emulated(struct pt_dev *ptdev,
+                                     struct pt_reg_grp_tbl *reg_grp,
+                                     uint32_t address, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        if (ptdev->grp_map[address + i] != reg_grp ||
+            ptdev->emu_map[address + i] != 0xFF)
+            return 0;
+    return 1;
+}
+
 /* get BAR index */
 static int pt_bar_offset_to_index(uint32_t offset)
 {
@@ -1237,7 +1272,7 @@ static void pt_pci_write_config(PCIDevice *d, uint32_t address, uint32_t val,
         qemu_run_one_timer(pm_state->pm_timer);
 
     /* find register group entry */
-    reg_grp_entry = pt_find_reg_grp(assigned_device, address);
+    reg_grp_entry = pt_lookup_reg_grp(assigned_device, address);
     if (reg_grp_entry)
     {
         reg_grp = reg_grp_entry->reg_grp;
@@ -1275,7 +1310,7 @@ static void pt_pci_write_config(PCIDevice *d, uint32_t address, uint32_t val,
     while (0 < emul_len)
     {
         /* find register entry to be emulated */
-        reg_entry = pt_find_reg(reg_grp_entry, find_addr);
+        reg_entry = pt_lookup_reg(assigned_device, reg_grp_entry, find_addr);
         if (reg_entry)
         {
             reg = reg_entry->reg;
@@ -1340,6 +1375,7 @@ static void pt_pci_write_config(PCIDevice *d, uint32_t address, uint32_t val,
     val >>= ((address & 3) << 3);
 
 out:
+    assigned_device->cfg_dev_writes++;
     ret = pci_write_block(pci_dev, address, (uint8_t *)&val, len);
 
     if (!ret)
@@ -1409,7 +1445,7 @@ static uint32_t pt_pci_read_config(PCIDevice *d, uint32_t address, int len)
         qemu_run_one_timer(pm_state->pm_timer);
 
     /* find register group entry */
-    reg_grp_entry = pt_find_reg_grp(assigned_device, address);
+    reg_grp_entry = pt_lookup_reg_grp(assigned_device, address);
     if (reg_grp_entry)
     {
         reg_grp = reg_grp_entry->reg_grp;
@@ -1417,12 +1453,22 @@ static uint32_t pt_pci_read_config(PCIDevice *d, uint32_t address, int len)
         if (reg_grp->grp_type == GRP_TYPE_HARDWIRED)
         {
             /* no need to emulate, just return 0 */
+            assigned_device->cfg_emu_reads++;
             val = 0;
             goto exit;
         }
     }
 
+    /* only go to the device if some bits are passed through */
+    if (reg_grp_entry &&
+        pt_config_emulated(assigned_device, reg_grp_entry, address, len))
+    {
+        assigned_device->cfg_emu_reads++;
+        goto emulate;
+    }
+
     /* read I/O device register value */
+    assigned_device->cfg_dev_reads++;
     ret = pci_read_block(pci_dev, address, (uint8_t *)&val, len);
 
     if (!ret)
@@ -1437,6 +1483,7 @@ static uint32_t pt_pci_read_config(PCIDevice *d, uint32_t address, int len)
     if (reg_grp_entry == NULL)
         goto exit;
 
+emulate:
     /* adjust the read value to appropriate CFC-CFF window */
     val <<= ((address & 3) << 3);
     emul_len = len;
@@ -1445,7 +1492,7 @@ static uint32_t pt_pci_read_config(PCIDevice *d, uint32_t address, int len)
     while (0 < emul_len)
     {
         /* find register entry to be emulated */
-        reg_entry = pt_find_reg(reg_grp_entry, find_addr);
+        reg_entry = pt_lookup_reg(assigned_device, reg_grp_entry, find_addr);
         if (reg_entry)
         {
             reg = reg_entry->reg;
@@ -1632,6 +1679,9 @@ static int pt_register_regions(struct pt_dev *assigned_device)
             (uint32_t)(pci_dev->rom_size), (uint32_t)(pci_dev->rom_base_addr));
     }
 
+    assigned_device->probe_timer =
+        qemu_new_timer(rt_clock, pt_bar_probe_expire, assigned_device);
+
     return 0;
 }
 
@@ -1641,6 +1691,13 @@ static void pt_unregister_regions(struct pt_dev *assigned_device)
     uint32_t e_size;
     PCIDevice *d = (PCIDevice*)assigned_device;
 
+    /* mappings left by pending probes are removed below */
+    qemu_del_timer(assigned_device->probe_timer);
+    qemu_free_timer(assigned_device->probe_timer);
+    assigned_device->probe_timer = NULL;
+    for (i = 0; i < PCI_NUM_REGIONS; i++)
+        assigned_device->bases[i].probe_pending = 0;
+
     for ( i = 0; i < PCI_NUM_REGIONS; i++ )
     {
         e_size = assigned_device->bases[i].e_size;
@@ -1852,9 +1909,18 @@ static void pt_bar_mapping_one(struct pt_dev *ptdev, int bar, int io_enable,
     /* check whether we need to update the mapping or not */
     if (r_addr != ptdev->bases[bar].e_physbase)
     {
+        int64_t start = qemu_get_clock(vm_clock);
+        int64_t us;
+
         /* mapping BAR */
         r->map_func((PCIDevice *)ptdev, bar, r_addr,
                      r_size, r->type);
+
+        us = (qemu_get_clock(vm_clock) - start) / 1000;
+        base->remaps++;
+        base->remap_us += us;
+        PT_LOG("Region %d [Address:%08xh][Size:%08xh] remapped in %"
+               PRId64 "us\n", bar, r_addr, r_size, us);
     }
 }
 
@@ -1866,6 +1932,56 @@ static void pt_bar_mapping(struct pt_dev *ptdev, int io_enable, int mem_enable)
         pt_bar_mapping_one(ptdev, i, io_enable, mem_enable);
 }
 
+/* current decode bits of the Command register */
+static uint16_t pt_bar_decode(struct pt_dev *ptdev)
+{
+    struct pt_reg_grp_tbl *reg_grp_entry = NULL;
+    struct pt_reg_tbl *reg_entry = NULL;
+    uint16_t cmd = 0;
+
+    reg_grp_entry = pt_find_reg_grp(ptdev, PCI_COMMAND);
+    if (reg_grp_entry)
+    {
+        reg_entry = pt_find_reg(reg_grp_entry, PCI_COMMAND);
+        if (reg_entry)
+            cmd = reg_entry->data;
+    }
+
+    return cmd & (PCI_COMMAND_IO | PCI_COMMAND_MEMORY);
+}
+
+/* A sizing probe that is not followed by a real address leaves the BAR
+ * unassigned.  Once the guest moves on (decode change or probe timer), drop
+ * the mapping of the address that was there before the probe.
+ */
+static void pt_bar_probe_commit(struct pt_dev *ptdev)
+{
+    PCIDevice *d = (PCIDevice *)&ptdev->dev;
+    uint16_t decode = pt_bar_decode(ptdev);
+    int i, bar;
+
+    for (i = 0; i < PCI_NUM_REGIONS; i++)
+    {
+        if (!ptdev->bases[i].probe_pending)
+            continue;
+        ptdev->bases[i].probe_pending = 0;
+
+        /* an upper 64bit BAR is mapped through its lower half */
+        bar = i;
+        if (ptdev->bases[i].bar_flag == PT_BAR_FLAG_UPPER)
+            bar = i - 1;
+        d->io_regions[bar].addr = -1;
+        pt_bar_mapping_one(ptdev, bar, decode & PCI_COMMAND_IO,
+                           decode & PCI_COMMAND_MEMORY);
+    }
+}
+
+/* give up on sizing probes that were never completed */
+static void pt_bar_probe_expire(void *opaque)
+{
+    pt_bar_probe_commit(opaque);
+}
+
 /* check power state transition */
 static int check_power_state(struct pt_dev *ptdev)
 {
@@ -1972,6 +2088,9 @@ static void pt_reset_interrupt_and_io_mapping(struct pt_dev *ptdev)
     }
 
     /* unmapping BAR */
+    qemu_del_timer(ptdev->probe_timer);
+    for (i = 0; i < PCI_NUM_REGIONS; i++)
+        ptdev->bases[i].probe_pending = 0;
     pt_bar_mapping(ptdev, 0, 0);
 }
 
@@ -2201,6 +2320,61 @@ out:
     return err;
 }
 
+/* build per offset lookup tables of the emulate registers */
+static void pt_config_map_init(struct pt_dev *ptdev)
+{
+    struct pt_reg_grp_tbl *reg_grp_entry = NULL;
+    struct pt_reg_tbl *reg_entry = NULL;
+    struct pt_reg_info_tbl *reg = NULL;
+    uint32_t emu_mask;
+    uint32_t offset;
+    int i;
+
+    memset(ptdev->grp_map, 0, sizeof(ptdev->grp_map));
+    memset(ptdev->reg_map, 0, sizeof(ptdev->reg_map));
+    memset(ptdev->emu_map, 0, sizeof(ptdev->emu_map));
+
+    /* keep the first match, as pt_find_reg_grp() and pt_find_reg() do */
+    LIST_FOREACH(reg_grp_entry, &ptdev->reg_grp_tbl_head, entries)
+    {
+        for (i = 0; i < reg_grp_entry->size; i++)
+        {
+            offset = reg_grp_entry->base_offset + i;
+            if (offset >= PT_CONFIG_SIZE || ptdev->grp_map[offset])
+                continue;
+            ptdev->grp_map[offset] = reg_grp_entry;
+            /* 0 Hardwired registers never read the device */
+            if (reg_grp_entry->reg_grp->grp_type == GRP_TYPE_HARDWIRED)
+                ptdev->emu_map[offset] = 0xFF;
+        }
+
+        LIST_FOREACH(reg_entry, &reg_grp_entry->reg_tbl_head, entries)
+        {
+            reg = reg_entry->reg;
+            emu_mask = reg->emu_mask;
+            /* BAR reads use the sysfs value, never the device register */
+            if (reg->size == 4 && reg->u.dw.read == pt_bar_reg_read)
+                emu_mask = PT_BAR_ALLF;
+            /* without a read method the device value is returned */
+            if ((reg->size == 1 && !reg->u.b.read) ||
+                (reg->size == 2 && !reg->u.w.read) ||
+                (reg->size == 4 && !reg->u.dw.read))
+                emu_mask = 0;
+
+            for (i = 0; i < reg->size; i++)
+            {
+                offset = reg_grp_entry->base_offset + reg->offset + i;
+                if (offset >= PT_CONFIG_SIZE ||
+                    ptdev->grp_map[offset] != reg_grp_entry ||
+                    ptdev->reg_map[offset])
+                    continue;
+                ptdev->reg_map[offset] = reg_entry;
+                ptdev->emu_map[offset] = (emu_mask >> (i << 3)) & 0xFF;
+            }
+        }
+    }
+}
+
 /* initialize emulate register group */
 static int pt_config_init(struct pt_dev *ptdev)
 {
@@ -2269,6 +2443,8 @@ static int pt_config_init(struct pt_dev *ptdev)
         reg_grp_offset = 0;
     }
 
+    pt_config_map_init(ptdev);
+
 out:
     return err;
 }
@@ -3011,6 +3187,7 @@ static int pt_cmd_reg_write(struct pt_dev *ptdev,
     uint16_t throughable_mask = 0;
     uint16_t wr_value = *value;
     uint16_t emu_mask = reg->emu_mask;
+    uint16_t old_cmd = cfg_entry->data;
 
     if ( ptdev->is_virtfn )
         emu_mask |= PCI_COMMAND_MEMORY;
@@ -3040,9 +3217,19 @@ static int pt_cmd_reg_write(struct pt_dev *ptdev,
 
     *value = PT_MERGE_VALUE(*value, dev_value, throughable_mask);
 
-    /* mapping BAR */
+    /* sizing is over once decoding changes */
+    if ((old_cmd ^ wr_value) & (PCI_COMMAND_IO | PCI_COMMAND_MEMORY))
+    {
+        pt_bar_probe_commit(ptdev);
+        qemu_del_timer(ptdev->probe_timer);
+    }
+
+    /* Unmapping is immediate.  BAR writes made while decoding is off only
+     * move the region address, so the BARs are mapped once, at their final
+     * address, when decoding comes back on.
+     */
     pt_bar_mapping(ptdev, wr_value & PCI_COMMAND_IO,
-                          wr_value & PCI_COMMAND_MEMORY);
+                   wr_value & PCI_COMMAND_MEMORY);
 
     return 0;
 }
@@ -3056,6 +3243,8 @@ static int pt_bar_reg_write(struct pt_dev *ptdev,
     struct pt_reg_grp_tbl *reg_grp_entry = NULL;
     struct pt_reg_tbl *reg_entry = NULL;
     struct pt_region *base = NULL;
+    uint16_t decode;
+    int probe;
     PCIDevice *d = (PCIDevice *)&ptdev->dev;
     PCIIORegion *r;
     uint32_t writable_mask = 0;
@@ -3106,6 +3295,21 @@ static int pt_bar_reg_write(struct pt_dev *ptdev,
     writable_mask = bar_emu_mask & ~bar_ro_mask & valid_mask;
     cfg_entry->data = PT_MERGE_VALUE(*value, cfg_entry->data, writable_mask);
 
+    /* A sizing probe is normally followed by a write of the real address.
+     * Leave the region alone and commit once the address comes back, or
+     * unmap it from pt_bar_probe_commit() if it never does.
+     */
+    probe = (valid_mask == PT_BAR_ALLF) &&
+            ((*value | bar_ro_mask) == PT_BAR_ALLF);
+    base->probe_pending = probe;
+    if (probe)
+    {
+        base->probes_ignored++;
+        qemu_mod_timer(ptdev->probe_timer,
+                       qemu_get_clock(rt_clock) + PT_BAR_PROBE_MS);
+        goto exit;
+    }
+
     /* check whether we need to update the virtual region address or not */
     switch (ptdev->bases[index].bar_flag)
     {
@@ -3184,15 +3388,13 @@ exit:
     throughable_mask = ~bar_emu_mask & valid_mask;
     *value = PT_MERGE_VALUE(*value, dev_value, throughable_mask);
 
+    if (probe)
+        return 0;
+
     /* After BAR reg update, we need to remap BAR*/
-    reg_grp_entry = pt_find_reg_grp(ptdev, PCI_COMMAND);
-    if (reg_grp_entry)
-    {
-        reg_entry = pt_find_reg(reg_grp_entry, PCI_COMMAND);
-        if (reg_entry)
-            pt_bar_mapping_one(ptdev, index, reg_entry->data & PCI_COMMAND_IO,
-                               reg_entry->data & PCI_COMMAND_MEMORY);
-    }
+    decode = pt_bar_decode(ptdev);
+    pt_bar_mapping_one(ptdev, index, decode & PCI_COMMAND_IO,
+                       decode & PCI_COMMAND_MEMORY);
 
     return 0;
 }
@@ -3203,9 +3405,8 @@ static int pt_exp_rom_bar_reg_write(struct pt_dev *ptdev,
         uint32_t *value, uint32_t dev_value, uint32_t valid_mask)
 {
     struct pt_reg_info_tbl *reg = cfg_entry->reg;
-    struct pt_reg_grp_tbl *reg_grp_entry = NULL;
-    struct pt_reg_tbl *reg_entry = NULL;
     struct pt_region *base = NULL;
+    uint16_t decode;
     PCIDevice *d = (PCIDevice *)&ptdev->dev;
     PCIIORegion *r;
     uint32_t writable_mask = 0;
@@ -3228,24 +3429,30 @@ static int pt_exp_rom_bar_reg_write(struct pt_dev *ptdev,
     writable_mask = ~bar_ro_mask & valid_mask;
     cfg_entry->data = PT_MERGE_VALUE(*value, cfg_entry->data, writable_mask);
 
-    /* update the corresponding virtual region address */
-    r->addr = cfg_entry->data;
-
     /* create value for writing to I/O device register */
     throughable_mask = ~bar_emu_mask & valid_mask;
     *value = PT_MERGE_VALUE(*value, dev_value, throughable_mask);
 
-    /* After BAR reg update, we need to remap BAR*/
-    reg_grp_entry = pt_find_reg_grp(ptdev, PCI_COMMAND);
-    if (reg_grp_entry)
+    /* sizing probe, wait for the real address (see pt_bar_reg_write) */
+    base->probe_pending = (valid_mask == PT_BAR_ALLF) &&
+        ((cfg_entry->data | bar_ro_mask | PCI_ROM_ADDRESS_ENABLE) ==
+         PT_BAR_ALLF);
+    if (base->probe_pending)
     {
-        reg_entry = pt_find_reg(reg_grp_entry, PCI_COMMAND);
-        if (reg_entry)
-            pt_bar_mapping_one(ptdev, PCI_ROM_SLOT,
-                               reg_entry->data & PCI_COMMAND_IO,
-                               reg_entry->data & PCI_COMMAND_MEMORY);
+        base->probes_ignored++;
+        qemu_mod_timer(ptdev->probe_timer,
+                       qemu_get_clock(rt_clock) + PT_BAR_PROBE_MS);
+        return 0;
     }
 
+    /* update the corresponding virtual region address */
+    r->addr = cfg_entry->data;
+
+    /* After BAR reg update, we need to remap BAR*/
+    decode = pt_bar_decode(ptdev);
+    pt_bar_mapping_one(ptdev, PCI_ROM_SLOT, decode & PCI_COMMAND_IO,
+                       decode & PCI_COMMAND_MEMORY);
+
     return 0;
 }
 
@@ -4035,6 +4242,44 @@ int power_off_php_slot(int php_slot)
     return unregister_real_device(php_slot);
 }
 
+void pt_info(void)
+{
+    struct pt_dev *ptdev;
+    struct pt_region *base;
+    int slot, i;
+
+    for (slot = 0; slot < NR_PCI_DEV; slot++)
+    {
+        ptdev = dpci_infos.php_devs[slot].pt_dev;
+        if (!dpci_infos.php_devs[slot].valid || !ptdev)
+            continue;
+
+        term_printf("%02x:%02x.%x -> slot %d:\n",
+                    dpci_infos.php_devs[slot].r_bus,
+                    dpci_infos.php_devs[slot].r_dev,
+                    dpci_infos.php_devs[slot].r_func, slot);
+        term_printf("  config reads: %" PRIu64 " emulated, %" PRIu64
+                    " from device\n",
+                    ptdev->cfg_emu_reads, ptdev->cfg_dev_reads);
+        term_printf("  config writes: %" PRIu64 " to device\n",
+                    ptdev->cfg_dev_writes);
+        if (ptdev->msix)
+            term_printf("  msix updates: %" PRIu64 " hypercalls, %" PRIu64
+                        " rebinds skipped\n",
+                        ptdev->msix->hypercalls,
+                        ptdev->msix->rebinds_skipped);
+        for (i = 0; i < PCI_NUM_REGIONS; i++)
+        {
+            base = &ptdev->bases[i];
+            if (!base->remaps && !base->probes_ignored)
+                continue;
+            term_printf("  region %d: %u remaps in %" PRIu64 "us, "
+                        "%u sizing probes ignored\n", i, base->remaps,
+                        base->remap_us, base->probes_ignored);
+        }
+    }
+}
+
 int pt_init(PCIBus *e_bus, const char *direct_pci)
 {
     int seg, b, d, f, s, status = -1;
@@ -126,11 +126,13 @@
 #define PT_FLAG_TRANSITING 0x0001
 
 #define PT_INVALID_REG          0xFFFFFFFF      /* invalid register value */
+#define PT_CONFIG_SIZE          0x100           /* emulated config space size */
 #define PT_BAR_ALLF             0xFFFFFFFF      /* BAR ALLF value */
 #define PT_BAR_MEM_RO_MASK      0x0000000F      /* BAR ReadOnly mask(Memory) */
 #define PT_BAR_MEM_EMU_MASK     0xFFFFFFF0      /* BAR emul mask(Memory) */
 #define PT_BAR_IO_RO_MASK       0x00000003      /* BAR ReadOnly mask(I/O) */
 #define PT_BAR_IO_EMU_MASK      0xFFFFFFFC      /* BAR emul mask(I/O) */
+#define PT_BAR_PROBE_MS         100             /* wait for the address after sizing */
 enum {
     PT_BAR_FLAG_MEM = 0,                        /* Memory type BAR */
     PT_BAR_FLAG_IO,                             /* I/O type BAR */
@@ -165,6 +167,12 @@ struct pt_region {
         uint64_t pio_base;
         uint64_t u;
     } access;
+    /* remap statistics */
+    uint32_t remaps;
+    uint32_t probes_ignored;
+    uint64_t remap_us;
+    /* all ones written, see pt_bar_probe_commit() */
+    int probe_pending;
 };
 
 struct pt_msi_info {
@@ -179,6 +187,9 @@ struct pt_msi_info {
 struct msix_entry_info {
     int pirq;          /* -1 means unmapped */
     int flags;         /* flags indicting whether MSI ADDR or DATA is updated */
+    int pending;       /* unmask deferred until the end of the write burst */
+    int bound_gvec;    /* vector last bound to pirq, -1 means none */
+    uint32_t bound_gflags;
     uint32_t io_mem[4];
 };
 
@@ -190,8 +201,18 @@ struct pt_msix_info {
     uint64_t table_base;
     uint32_t table_off;
     uint64_t mmio_base_addr;
+    uint32_t mmio_size;   /* table plus the PBA if it shares the last page */
     int mmio_index;
     void *phys_iomem_base;
+    uint32_t pba_off;     /* PBA offset from the start of the table */
+    uint32_t pba_size;
+    void *phys_pba_base;  /* read-only mapping of the physical PBA */
+    uint32_t pba_map_size;
+    QEMUBH *bh;           /* flushes deferred entry updates */
+    int burst_writes;
+    int burst_hypercalls;
+    uint64_t hypercalls;
+    uint64_t rebinds_skipped;
     struct msix_entry_info msix_entry[0];
 };
 
@@ -226,6 +247,16 @@ struct pt_dev {
     unsigned power_mgmt:1;
     struct pt_pm_info *pm_state;                /* PM virtualization */
     unsigned is_virtfn:1;
+    /* expires sizing probes, see pt_bar_probe_commit() */
+    QEMUTimer *probe_timer;
+    /* per offset emul reg lookup, built by pt_config_init() */
+    struct pt_reg_grp_tbl *grp_map[PT_CONFIG_SIZE];
+    struct pt_reg_tbl *reg_map[PT_CONFIG_SIZE];
+    uint8_t emu_map[PT_CONFIG_SIZE];            /* bits not read from device */
+    /* config space access statistics */
+    uint64_t cfg_emu_reads;                     /* served without device read */
+    uint64_t cfg_dev_reads;                     /* read from the device */
+    uint64_t cfg_dev_writes;                    /* written to the device */
 };
 
 /* Used for formatting PCI BDF into cf8 format */
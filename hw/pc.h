@@ -119,6 +119,7 @@ PCIBus *i440fx_init(PCIDevice **pi440fx_state, qemu_irq *pic);
 void i440fx_set_smm(PCIDevice *d, int val);
 int piix3_init(PCIBus *bus, int devfn);
 void i440fx_init_memory_mappings(PCIDevice *d);
+void i440fx_intx_info(void);
 
 extern PCIDevice *piix4_dev;
 int piix4_init(PCIBus *bus, int devfn);
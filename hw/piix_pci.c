@@ -25,6 +25,7 @@
 #include "hw.h"
 #include "pc.h"
 #include "pci.h"
+#include "console.h"
 
 
 static void i440fx_set_irq(qemu_irq *pic, int irq_num, int level);
@@ -68,6 +69,14 @@ static target_phys_addr_t isa_page_descs[384 / 4];
 static uint8_t smm_enabled;
 static int pci_irq_levels[4];
 
+/* one line per slot and pin, see pci_slot_get_pirq() */
+#define PCI_INTX_LINES 128
+
+/* Last INTx level handed to Xen, -1 until the first change */
+static int8_t pci_intx_level[PCI_INTX_LINES];
+static uint64_t pci_intx_hypercalls[PCI_INTX_LINES];
+static uint64_t pci_intx_suppressed[PCI_INTX_LINES];
+
 #ifndef CONFIG_DM
 
 static void update_pam(PCIDevice *d, uint32_t start, uint32_t end, int r)
@@ -193,7 +202,9 @@ PCIBus *i440fx_init(PCIDevice **pi440fx_state, qemu_irq *pic)
     I440FXState *s;
 
     s = qemu_mallocz(sizeof(I440FXState));
-    b = pci_register_bus(i440fx_set_irq, pci_slot_get_pirq, NULL, 0, 128);
+    b = pci_register_bus(i440fx_set_irq, pci_slot_get_pirq, NULL, 0,
+                         PCI_INTX_LINES);
+    memset(pci_intx_level, -1, sizeof(pci_intx_level));
     s->bus = b;
 
     register_ioport_write(0xcf8, 4, 4, i440fx_addr_writel, s);
@@ -414,6 +425,30 @@ static void piix3_write_config(PCIDevice *d,
 
 static void i440fx_set_irq(qemu_irq *pic, int irq_num, int level)
 {
+    level = !!level;
+
+    /* Xen latches the line, so only transitions need a hypercall */
+    if (pci_intx_level[irq_num] == level) {
+        pci_intx_suppressed[irq_num]++;
+        return;
+    }
+    pci_intx_level[irq_num] = level;
+    pci_intx_hypercalls[irq_num]++;
+
     xc_hvm_set_pci_intx_level(xc_handle, domid, 0, 0, irq_num >> 2,
                               irq_num & 3, level);
 }
+
+void i440fx_intx_info(void)
+{
+    int i;
+
+    term_printf("PCI INTx level hypercalls suppressed\n");
+    for (i = 0; i < PCI_INTX_LINES; i++) {
+        if (!pci_intx_hypercalls[i] && !pci_intx_suppressed[i])
+            continue;
+        term_printf("  %02x.%c %5d %10" PRIu64 " %10" PRIu64 "\n",
+                    i >> 2, 'A' + (i & 3), pci_intx_level[i],
+                    pci_intx_hypercalls[i], pci_intx_suppressed[i]);
+    }
+}
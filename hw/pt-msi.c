@@ -293,9 +293,19 @@ static int pt_msix_update_one(struct pt_dev *dev, int entry_nr)
     if ( !entry->flags )
         return 0;
 
+    /* Rewritten with the values that are already bound, nothing to do */
+    if ( entry->pirq != -1 && entry->bound_gvec == gvec &&
+         entry->bound_gflags == gflags )
+    {
+        dev->msix->rebinds_skipped++;
+        entry->flags = 0;
+        return 0;
+    }
+
     /* Check if this entry is already mapped */
     if ( entry->pirq == -1 )
     {
+        dev->msix->burst_hypercalls++;
         ret = xc_physdev_map_pirq_msi(xc_handle, domid, AUTO_ASSIGN, &pirq,
                                 dev->pci_dev->dev << 3 | dev->pci_dev->func,
                                 dev->pci_dev->bus, entry_nr,
@@ -311,6 +321,7 @@ static int pt_msix_update_one(struct pt_dev *dev, int entry_nr)
     PT_LOG("Update msix entry %x with pirq %x gvec %x\n",
             entry_nr, pirq, gvec);
 
+    dev->msix->burst_hypercalls++;
     ret = xc_domain_update_msi_irq(xc_handle, domid, gvec, pirq, gflags,
                                    dev->msix->mmio_base_addr);
     if ( ret )
@@ -320,9 +331,12 @@ static int pt_msix_update_one(struct pt_dev *dev, int entry_nr)
         if (xc_physdev_unmap_pirq(xc_handle, domid, entry->pirq))
             PT_LOG("Error: Unmapping of MSI-X failed.\n");
         entry->pirq = -1;
+        entry->bound_gvec = -1;
         return ret;
     }
 
+    entry->bound_gvec = gvec;
+    entry->bound_gflags = gflags;
     entry->flags = 0;
 
     return 0;
@@ -338,9 +352,43 @@ int pt_msix_update(struct pt_dev *dev)
         pt_msix_update_one(dev, i);
     }
 
+    msix->hypercalls += msix->burst_hypercalls;
+    msix->burst_hypercalls = 0;
+
     return 0;
 }
 
+/*
+ * Runs once the current batch of guest accesses has been handled and
+ * applies the unmasks deferred by pci_msix_writel(), so that an entry
+ * reprogrammed several times in a burst is only rebound once.
+ */
+static void pt_msix_flush(void *opaque)
+{
+    struct pt_dev *dev = (struct pt_dev *)opaque;
+    struct pt_msix_info *msix = dev->msix;
+    struct msix_entry_info *entry;
+    int i;
+
+    for ( i = 0; i < msix->total_entries; i++ )
+    {
+        entry = &msix->msix_entry[i];
+        if ( !entry->pending )
+            continue;
+
+        entry->pending = 0;
+        if ( msix->enabled )
+            pt_msix_update_one(dev, i);
+        mask_physical_msix_entry(dev, i, 0);
+    }
+
+    PT_LOG("MSI-X table burst: %d writes, %d hypercalls\n",
+           msix->burst_writes, msix->burst_hypercalls);
+    msix->hypercalls += msix->burst_hypercalls;
+    msix->burst_hypercalls = 0;
+    msix->burst_writes = 0;
+}
+
 void pt_msix_disable(struct pt_dev *dev)
 {
     PCIDevice *d = &dev->dev;
@@ -351,11 +399,19 @@ void pt_msix_disable(struct pt_dev *dev)
     struct msix_entry_info *entry = NULL;
 
     msix_set_enable(dev, 0);
+    qemu_bh_cancel(dev->msix->bh);
 
     for ( i = 0; i < dev->msix->total_entries; i++ )
     {
         entry = &dev->msix->msix_entry[i];
 
+        /* keep the physical mask in sync with what the guest wrote */
+        if (entry->pending)
+        {
+            entry->pending = 0;
+            mask_physical_msix_entry(dev, i, 0);
+        }
+
         if (entry->pirq == -1)
             continue;
 
@@ -383,6 +439,7 @@ void pt_msix_disable(struct pt_dev *dev)
         }
         /* clear msi-x info */
         entry->pirq = -1;
+        entry->bound_gvec = -1;
         entry->flags = 0;
     }
 }
@@ -404,6 +461,7 @@ int pt_msix_update_remap(struct pt_dev *dev, int bar_index)
                                           PT_IRQ_TYPE_MSI, 0, 0, 0, 0);
             if ( ret )
                 PT_LOG("Error: unbind MSI-X entry %d failed\n", entry->pirq);
+            entry->bound_gvec = -1;
             entry->flags = 1;
         }
     }
@@ -436,6 +494,9 @@ static void pci_msix_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
     }
 
     entry_nr = (addr - msix->mmio_base_addr) / 16;
+    /* the PBA is read-only, drop writes that land on it */
+    if ( entry_nr >= msix->total_entries )
+        return;
     entry = &msix->msix_entry[entry_nr];
     offset = ((addr - msix->mmio_base_addr) % 16) / 4;
 
@@ -446,22 +507,31 @@ static void pci_msix_writel(void *opaque, target_phys_addr_t addr, uint32_t val)
     phys_off = dev->msix->phys_iomem_base + 16 * entry_nr + 12;
     vec_ctrl = *(uint32_t *)phys_off;
 
-    if ( offset != 3 && msix->enabled && !(vec_ctrl & 0x1) )
+    if ( offset != 3 && msix->enabled &&
+         (!(vec_ctrl & 0x1) || entry->pending) )
     {
         PT_LOG("Error: Can't update msix entry %d since MSI-X is already \
                 function.\n", entry_nr);
         return;
     }
 
+    msix->burst_writes++;
     if ( offset != 3 && entry->io_mem[offset] != val )
         entry->flags = 1;
     entry->io_mem[offset] = val;
 
     if ( offset == 3 )
     {
-        if ( msix->enabled && !(val & 0x1) )
-            pt_msix_update_one(dev, entry_nr);
-        mask_physical_msix_entry(dev, entry_nr, entry->io_mem[3] & 0x1);
+        if ( msix->enabled && !(val & 0x1) && entry->flags )
+        {
+            /* rebind and unmask once the burst is over */
+            entry->pending = 1;
+            qemu_bh_schedule(msix->bh);
+            return;
+        }
+        entry->pending = 0;
+        if ( (vec_ctrl & 0x1) != (val & 0x1) )
+            mask_physical_msix_entry(dev, entry_nr, val & 0x1);
     }
 }
 
@@ -491,8 +561,18 @@ static uint32_t pci_msix_readl(void *opaque, target_phys_addr_t addr)
         return 0;
     }
 
-    entry_nr = (addr - msix->mmio_base_addr) / 16;
-    offset = ((addr - msix->mmio_base_addr) % 16) / 4;
+    offset = addr - msix->mmio_base_addr;
+    if ( offset >= msix->total_entries * 16 )
+    {
+        /* PBA sharing a page with the table, read it from the device */
+        if ( msix->phys_pba_base && offset >= msix->pba_off &&
+             offset < msix->pba_off + msix->pba_size )
+            return *(uint32_t *)(msix->phys_pba_base + offset - msix->pba_off);
+        return 0;
+    }
+
+    entry_nr = offset / 16;
+    offset = (offset % 16) / 4;
 
     return msix->msix_entry[entry_nr].io_mem[offset];
 }
@@ -526,7 +606,7 @@ int remove_msix_mapping(struct pt_dev *dev, int bar_index)
                                 + dev->msix->table_off;
 
     cpu_register_physical_memory(dev->msix->mmio_base_addr,
-                                 dev->msix->total_entries * 16,
+                                 dev->msix->mmio_size,
                                  dev->msix->mmio_index);
 
     return xc_domain_memory_mapping(xc_handle, domid,
@@ -543,8 +623,10 @@ int pt_msix_init(struct pt_dev *dev, int pos)
     uint8_t id;
     uint16_t control;
     int i, total_entries, table_off, bar_index;
+    uint32_t pba, table_end;
     struct pci_dev *pd = dev->pci_dev;
     int fd;
+    void *map;
 
     id = pci_read_byte(pd, pos + PCI_CAP_LIST_ID);
 
@@ -569,7 +651,10 @@ int pt_msix_init(struct pt_dev *dev, int pos)
                          + total_entries*sizeof(struct msix_entry_info));
     dev->msix->total_entries = total_entries;
     for ( i = 0; i < total_entries; i++ )
+    {
         dev->msix->msix_entry[i].pirq = -1;
+        dev->msix->msix_entry[i].bound_gvec = -1;
+    }
 
     dev->msix->mmio_index =
         cpu_register_io_memory(0, pci_msix_read, pci_msix_write, dev);
@@ -581,6 +666,24 @@ int pt_msix_init(struct pt_dev *dev, int pos)
     PT_LOG("get MSI-X table bar base %llx\n",
            (unsigned long long)dev->msix->table_base);
 
+    /*
+     * The guest pages holding the table are trapped, so a PBA that shares
+     * the last of them is no longer directly mapped.  Cover it with the
+     * MSI-X mmio region and forward reads to the device.
+     */
+    dev->msix->mmio_size = total_entries * 16;
+    table_end = (table_off + total_entries * 16 + XC_PAGE_SIZE - 1)
+                & XC_PAGE_MASK;
+    pba = pci_read_long(pd, pos + PCI_MSIX_PBA);
+    if ( (pba & PCI_MSIX_BIR) == bar_index &&
+         (pba & ~PCI_MSIX_BIR) >= table_off + total_entries * 16 &&
+         (pba & ~PCI_MSIX_BIR) < table_end )
+    {
+        dev->msix->mmio_size = table_end - table_off;
+        dev->msix->pba_off = (pba & ~PCI_MSIX_BIR) - table_off;
+        dev->msix->pba_size = ((total_entries + 63) / 64) * 8;
+    }
+
     fd = open("/dev/mem", O_RDWR);
     if ( fd == -1 )
     {
@@ -596,8 +699,27 @@ int pt_msix_init(struct pt_dev *dev, int pos)
         close(fd);
         goto error_out;
     }
+
+    if ( dev->msix->pba_size )
+    {
+        uint64_t pba_addr = dev->msix->table_base + table_off
+                            + dev->msix->pba_off;
+
+        dev->msix->pba_map_size = ((pba_addr & ~XC_PAGE_MASK)
+                                   + dev->msix->pba_size + XC_PAGE_SIZE - 1)
+                                  & XC_PAGE_MASK;
+        map = mmap(0, dev->msix->pba_map_size, PROT_READ,
+                   MAP_SHARED | MAP_LOCKED, fd, pba_addr & XC_PAGE_MASK);
+        if ( map == MAP_FAILED )
+            PT_LOG("Error: Can't map physical MSI-X PBA: %s\n",
+                   strerror(errno));
+        else
+            dev->msix->phys_pba_base = map + (pba_addr & ~XC_PAGE_MASK);
+    }
     close(fd);
 
+    dev->msix->bh = qemu_bh_new(pt_msix_flush, dev);
+
     PT_LOG("mapping physical MSI-X table to %lx\n",
            (unsigned long)dev->msix->phys_iomem_base);
     return 0;
@@ -618,5 +740,11 @@ void pt_msix_delete(struct pt_dev *dev)
         munmap(dev->msix->phys_iomem_base, dev->msix->total_entries * 16);
     }
 
+    if (dev->msix->phys_pba_base)
+        munmap((void *)((unsigned long)dev->msix->phys_pba_base
+                        & XC_PAGE_MASK), dev->msix->pba_map_size);
+
+    qemu_bh_delete(dev->msix->bh);
+
     free(dev->msix);
 }
@@ -419,6 +419,7 @@ static void usb_notify_datain_cb(USBHIDState *hs)
 {
     if (hs->datain)
         hs->datain(hs->datain_opaque);
+    usb_wakeup();
 }
 
 static void usb_pointer_event_clear(USBPointerEvent *e, int buttons) {
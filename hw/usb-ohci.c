@@ -50,6 +50,11 @@
 
 #define OHCI_MAX_PORTS 15
 
+/* A schedule that did no work for OHCI_IDLE_FRAMES frames in a row only
+   gets a frame boundary every OHCI_IDLE_PERIOD frames */
+#define OHCI_IDLE_FRAMES 128
+#define OHCI_IDLE_PERIOD 16
+
 static int64_t usb_frame_time;
 static int64_t usb_bit_time;
 
@@ -115,6 +120,10 @@ typedef struct {
     uint32_t async_td;
     int async_complete;
 
+    /* Idle schedule tracking */
+    USBController hc;
+    int idle_frames;
+
 } OHCIState;
 
 /* Host Controller Communications Area */
@@ -1052,11 +1061,25 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head, int completion)
     return active;
 }
 
-/* Generate a SOF event, and set a timer for EOF */
-static void ohci_sof(OHCIState *ohci)
+/* Number of frames that elapsed since the last SOF */
+static int64_t ohci_frames_elapsed(OHCIState *ohci, int64_t now)
+{
+    return (now - ohci->sof_time) / usb_frame_time;
+}
+
+/* Generate a SOF event, and set a timer for EOF.  'frames' is the number
+   of frames that ended at this boundary. */
+static void ohci_sof(OHCIState *ohci, int64_t frames)
 {
-    ohci->sof_time = qemu_get_clock(vm_clock);
-    qemu_mod_timer(ohci->eof_timer, ohci->sof_time + usb_frame_time);
+    int64_t now = qemu_get_clock(vm_clock);
+
+    if (ohci->hc.idle)
+        ohci->sof_time = MIN(ohci->sof_time + frames * usb_frame_time, now);
+    else
+        ohci->sof_time = now;
+    ohci->hc.idle = ohci->idle_frames >= OHCI_IDLE_FRAMES;
+    qemu_mod_timer(ohci->eof_timer, ohci->sof_time +
+                   (ohci->hc.idle ? OHCI_IDLE_PERIOD : 1) * usb_frame_time);
     ohci_set_interrupt(ohci, OHCI_INTR_SF);
 }
 
@@ -1086,15 +1109,29 @@ static void ohci_frame_boundary(void *opaque)
 {
     OHCIState *ohci = opaque;
     struct ohci_hcca hcca;
+    uint32_t old_done;
+    int64_t frames;
 
     cpu_physical_memory_rw(ohci->hcca, (uint8_t *)&hcca, sizeof(hcca), 0);
 
+    /* An idle schedule is serviced once for all the frames that elapsed
+       since the last boundary */
+    frames = 1;
+    if (ohci->hc.idle) {
+        frames = ohci_frames_elapsed(ohci, qemu_get_clock(vm_clock));
+        if (frames < 1)
+            frames = 1;
+    }
+    old_done = ohci->done;
+
     /* Process all the lists at the end of the frame */
     if (ohci->ctl & OHCI_CTL_PLE) {
-        int n;
+        int i, n;
 
-        n = ohci->frame_number & 0x1f;
-        ohci_service_ed_list(ohci, le32_to_cpu(hcca.intr[n]), 0);
+        for (i = 0; i < MIN(frames, 32); i++) {
+            n = (ohci->frame_number + i) & 0x1f;
+            ohci_service_ed_list(ohci, le32_to_cpu(hcca.intr[n]), 0);
+        }
     }
 
     /* Cancel all pending packets if either of the lists has been disabled.  */
@@ -1110,7 +1147,7 @@ static void ohci_frame_boundary(void *opaque)
     ohci->frt = ohci->fit;
 
     /* XXX: endianness */
-    ohci->frame_number = (ohci->frame_number + 1) & 0xffff;
+    ohci->frame_number = (ohci->frame_number + frames) & 0xffff;
     hcca.frame = cpu_to_le32(ohci->frame_number);
 
     if (ohci->done_count == 0 && !(ohci->intr_status & OHCI_INTR_WD)) {
@@ -1127,8 +1164,19 @@ static void ohci_frame_boundary(void *opaque)
     if (ohci->done_count != 7 && ohci->done_count != 0)
         ohci->done_count--;
 
+    /* Nothing retired, nothing queued on the control and bulk lists and
+       nobody waiting for SOF interrupts: the schedule is idle */
+    if (ohci->done != old_done || ohci->done_count != 7 || ohci->async_td ||
+        (ohci->status & (OHCI_STATUS_CLF | OHCI_STATUS_BLF)) ||
+        (ohci->intr & OHCI_INTR_SF)) {
+        ohci->idle_frames = 0;
+    } else if (ohci->idle_frames < OHCI_IDLE_FRAMES) {
+        ohci->idle_frames += frames;
+    }
+    usb_controller_frames(&ohci->hc, 1, frames - 1);
+
     /* Do SOF stuff here */
-    ohci_sof(ohci);
+    ohci_sof(ohci, frames);
 
     /* Writeback HCCA */
     cpu_physical_memory_rw(ohci->hcca, (uint8_t *)&hcca, sizeof(hcca), 1);
@@ -1151,7 +1199,7 @@ static int ohci_bus_start(OHCIState *ohci)
 
     dprintf("usb-ohci: %s: USB Operational\n", ohci->name);
 
-    ohci_sof(ohci);
+    ohci_sof(ohci, 1);
 
     return 1;
 }
@@ -1162,6 +1210,18 @@ static void ohci_bus_stop(OHCIState *ohci)
     if (ohci->eof_timer)
         qemu_del_timer(ohci->eof_timer);
     ohci->eof_timer = NULL;
+    ohci->idle_frames = 0;
+    ohci->hc.idle = 0;
+    ohci->hc.rate = 0;
+}
+
+/* Service an idle schedule right away instead of at the next idle period */
+static void ohci_wakeup(void *opaque)
+{
+    OHCIState *ohci = opaque;
+
+    if (ohci->hc.idle && ohci->eof_timer)
+        qemu_mod_timer(ohci->eof_timer, qemu_get_clock(vm_clock));
 }
 
 /* Sets a flag in a port status register but only set it if the port is
@@ -1265,6 +1325,8 @@ static uint32_t ohci_get_frame_remaining(OHCIState *ohci)
      * set already.
      */
     tks = qemu_get_clock(vm_clock) - ohci->sof_time;
+    if (ohci->hc.idle)
+        tks %= usb_frame_time;
 
     /* avoid muldiv if possible */
     if (tks >= usb_frame_time)
@@ -1430,6 +1492,9 @@ static uint32_t ohci_mem_read(void *ptr, target_phys_addr_t addr)
 
         case 15: /* HcFmNumber */
             retval = ohci->frame_number;
+            if (ohci->hc.idle)
+                retval = (retval + ohci_frames_elapsed(ohci,
+                          qemu_get_clock(vm_clock))) & 0xffff;
             break;
 
         case 16: /* HcPeriodicStart */
@@ -1495,6 +1560,9 @@ static void ohci_mem_write(void *ptr, target_phys_addr_t addr, uint32_t val)
         return;
     }
 
+    /* the timer runs after the write has taken effect */
+    ohci_wakeup(ohci);
+
     if (addr >= 0x54 && addr < 0x54 + ohci->num_ports * 4) {
         /* HcRhPortStatus */
         ohci_port_set_status(ohci, (addr - 0x54) >> 2, val);
@@ -1652,6 +1720,7 @@ static void usb_ohci_init(OHCIState *ohci, int num_ports, int devfn,
     }
 
     ohci->async_td = 0;
+    usb_register_controller(&ohci->hc, name, ohci_wakeup, ohci);
     qemu_register_reset(ohci_reset, ohci);
     ohci_reset(ohci);
 }
@@ -67,6 +67,11 @@
 
 #define FRAME_MAX_LOOPS  100
 
+/* A schedule that did no work for UHCI_IDLE_FRAMES frames in a row is only
+   walked every UHCI_IDLE_PERIOD frames until the guest or a device pokes it */
+#define UHCI_IDLE_FRAMES 128
+#define UHCI_IDLE_PERIOD 16
+
 #define NB_PORTS 2
 
 #ifdef DEBUG
@@ -138,6 +143,12 @@ typedef struct UHCIState {
     /* Active packets */
     UHCIAsync *async_pending;
     UHCIAsync *async_pool;
+
+    /* Idle schedule tracking */
+    USBController hc;
+    int64_t frame_time; /* vm_clock time at which frnum started */
+    int idle_frames; /* consecutive frames that did no work */
+    int frame_busy; /* the current walk changed the schedule */
 } UHCIState;
 
 typedef struct UHCI_TD {
@@ -337,6 +348,8 @@ static void uhci_reset(UHCIState *s)
     s->intr = 0;
     s->fl_base_addr = 0;
     s->sof_timing = 64;
+    s->idle_frames = 0;
+    s->hc.idle = 0;
 
     for(i = 0; i < NB_PORTS; i++) {
         port = &s->ports[i];
@@ -399,9 +412,27 @@ static int uhci_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_8s(f, &s->status2);
     qemu_get_timer(f, s->frame_timer);
 
+    s->idle_frames = 0;
+    s->hc.idle = 0;
+
     return 0;
 }
 
+/* Number of frames that elapsed since frnum started */
+static int64_t uhci_frames_elapsed(UHCIState *s, int64_t now)
+{
+    return (now - s->frame_time) / (ticks_per_sec / FRAME_TIMER_FREQ);
+}
+
+/* Walk an idle schedule right away instead of at the next idle period */
+static void uhci_wakeup(void *opaque)
+{
+    UHCIState *s = opaque;
+
+    if (s->hc.idle && (s->cmd & UHCI_CMD_RS))
+        qemu_mod_timer(s->frame_timer, qemu_get_clock(vm_clock));
+}
+
 static void uhci_ioport_writeb(void *opaque, uint32_t addr, uint32_t val)
 {
     UHCIState *s = opaque;
@@ -412,6 +443,7 @@ static void uhci_ioport_writeb(void *opaque, uint32_t addr, uint32_t val)
         s->sof_timing = val;
         break;
     }
+    uhci_wakeup(s);
 }
 
 static uint32_t uhci_ioport_readb(void *opaque, uint32_t addr)
@@ -509,6 +541,7 @@ static void uhci_ioport_writew(void *opaque, uint32_t addr, uint32_t val)
         }
         break;
     }
+    uhci_wakeup(s);
 }
 
 static uint32_t uhci_ioport_readw(void *opaque, uint32_t addr)
@@ -529,6 +562,9 @@ static uint32_t uhci_ioport_readw(void *opaque, uint32_t addr)
         break;
     case 0x06:
         val = s->frnum;
+        if (s->hc.idle)
+            val = (val + uhci_frames_elapsed(s, qemu_get_clock(vm_clock))) &
+                0x7ff;
         break;
     case 0x10 ... 0x1f:
         {
@@ -564,6 +600,7 @@ static void uhci_ioport_writel(void *opaque, uint32_t addr, uint32_t val)
         s->fl_base_addr = val & ~0xfff;
         break;
     }
+    uhci_wakeup(s);
 }
 
 static uint32_t uhci_ioport_readl(void *opaque, uint32_t addr)
@@ -853,6 +890,7 @@ static void uhci_async_complete(USBPacket *packet, void *opaque)
     async->done = 1;
 
     uhci_process_frame(s);
+    uhci_wakeup(s);
 }
 
 static int is_valid(uint32_t link)
@@ -897,14 +935,15 @@ static int qhdb_insert(QhDb *db, uint32_t addr)
     return 0;
 }
 
-static void uhci_process_frame(UHCIState *s)
+/* Walk the schedule of the current frame.  QHs already in qhdb are not
+   walked again, so several frames can be caught up in one pass. */
+static void uhci_walk_frame(UHCIState *s, QhDb *qhdb, uint32_t *int_mask)
 {
-    uint32_t frame_addr, link, old_td_ctrl, val, int_mask;
+    uint32_t frame_addr, link, old_td_ctrl, val;
     uint32_t curr_qh;
     int cnt, ret;
     UHCI_TD td;
     UHCI_QH qh;
-    QhDb qhdb;
 
     frame_addr = s->fl_base_addr + ((s->frnum & 0x3ff) << 2);
 
@@ -913,16 +952,13 @@ static void uhci_process_frame(UHCIState *s)
     cpu_physical_memory_read(frame_addr, (uint8_t *)&link, 4);
     le32_to_cpus(&link);
 
-    int_mask = 0;
     curr_qh  = 0;
 
-    qhdb_reset(&qhdb);
-
     for (cnt = FRAME_MAX_LOOPS; is_valid(link) && cnt; cnt--) {
         if (is_qh(link)) {
             /* QH */
 
-            if (qhdb_insert(&qhdb, link)) {
+            if (qhdb_insert(qhdb, link)) {
                 /*
                  * We're going in circles. Which is not a bug because
                  * HCD is allowed to do that as part of the BW management. 
@@ -964,7 +1000,9 @@ static void uhci_process_frame(UHCIState *s)
                 link, td.link, td.ctrl, td.token, curr_qh);
 
         old_td_ctrl = td.ctrl;
-        ret = uhci_handle_td(s, link, &td, &int_mask);
+        ret = uhci_handle_td(s, link, &td, int_mask);
+        if (ret != 1 || old_td_ctrl != td.ctrl)
+            s->frame_busy = 1;
         if (old_td_ctrl != td.ctrl) {
             /* update the status bits of the TD */
             val = cpu_to_le32(td.ctrl);
@@ -1013,6 +1051,15 @@ static void uhci_process_frame(UHCIState *s)
 
         /* go to the next entry */
     }
+}
+
+static void uhci_process_frame(UHCIState *s)
+{
+    uint32_t int_mask = 0;
+    QhDb qhdb;
+
+    qhdb_reset(&qhdb);
+    uhci_walk_frame(s, &qhdb, &int_mask);
 
     s->pending_int_mask = int_mask;
 }
@@ -1020,13 +1067,18 @@ static void uhci_process_frame(UHCIState *s)
 static void uhci_frame_timer(void *opaque)
 {
     UHCIState *s = opaque;
-    int64_t expire_time;
+    int64_t now, frames, walk;
+    uint32_t int_mask;
+    QhDb qhdb;
 
     if (!(s->cmd & UHCI_CMD_RS)) {
         /* Full stop */
         qemu_del_timer(s->frame_timer);
         /* set hchalted bit in status - UHCI11D 2.1.2 */
         s->status |= UHCI_STS_HCHALTED;
+        s->idle_frames = 0;
+        s->hc.idle = 0;
+        s->hc.rate = 0;
 
         dprintf("uhci: halted\n");
         return;
@@ -1039,21 +1091,56 @@ static void uhci_frame_timer(void *opaque)
         uhci_update_irq(s);
     }
 
-    /* Start new frame */
-    s->frnum = (s->frnum + 1) & 0x7ff;
-
-    dprintf("uhci: new frame #%u\n" , s->frnum);
+    /* Start new frame.  An idle schedule is walked once for all the
+       frames that elapsed since the last walk, interrupt QHs shared
+       between those frames are only looked at once. */
+    now = qemu_get_clock(vm_clock);
+    frames = 1;
+    if (s->hc.idle) {
+        frames = uhci_frames_elapsed(s, now);
+        if (frames < 1)
+            frames = 1;
+    }
+    walk = MIN(frames, 1024);
+    s->frnum = (s->frnum + frames - walk) & 0x7ff;
 
     uhci_async_validate_begin(s);
 
-    uhci_process_frame(s);
+    qhdb_reset(&qhdb);
+    int_mask = 0;
+    s->frame_busy = 0;
+    while (walk--) {
+        s->frnum = (s->frnum + 1) & 0x7ff;
+
+        dprintf("uhci: new frame #%u\n" , s->frnum);
+
+        if (qhdb.count >= UHCI_MAX_QUEUES / 2)
+            qhdb_reset(&qhdb);
+        uhci_walk_frame(s, &qhdb, &int_mask);
+    }
+    s->pending_int_mask = int_mask;
 
     uhci_async_validate_end(s);
 
+    usb_controller_frames(&s->hc, 1, frames - 1);
+
+    if (s->frame_busy || int_mask) {
+        s->idle_frames = 0;
+    } else if (s->idle_frames < UHCI_IDLE_FRAMES) {
+        s->idle_frames += frames;
+    }
+
     /* prepare the timer for the next frame */
-    expire_time = qemu_get_clock(vm_clock) +
-        (ticks_per_sec / FRAME_TIMER_FREQ);
-    qemu_mod_timer(s->frame_timer, expire_time);
+    if (s->hc.idle) {
+        s->frame_time = MIN(s->frame_time + frames *
+                            (ticks_per_sec / FRAME_TIMER_FREQ), now);
+    } else {
+        s->frame_time = now;
+    }
+    s->hc.idle = s->idle_frames >= UHCI_IDLE_FRAMES;
+    qemu_mod_timer(s->frame_timer, s->frame_time +
+                   (s->hc.idle ? UHCI_IDLE_PERIOD : 1) *
+                   (ticks_per_sec / FRAME_TIMER_FREQ));
 }
 
 static void uhci_map(PCIDevice *pci_dev, int region_num,
@@ -1092,6 +1179,7 @@ void usb_uhci_piix3_init(PCIBus *bus, int devfn)
         qemu_register_usb_port(&s->ports[i].port, s, i, uhci_attach);
     }
     s->frame_timer = qemu_new_timer(vm_clock, uhci_frame_timer, s);
+    usb_register_controller(&s->hc, "uhci", uhci_wakeup, s);
 
     uhci_reset(s);
 
@@ -1126,6 +1214,7 @@ void usb_uhci_piix4_init(PCIBus *bus, int devfn)
         qemu_register_usb_port(&s->ports[i].port, s, i, uhci_attach);
     }
     s->frame_timer = qemu_new_timer(vm_clock, uhci_frame_timer, s);
+    usb_register_controller(&s->hc, "uhci", uhci_wakeup, s);
 
     uhci_reset(s);
 
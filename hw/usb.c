@@ -24,6 +24,8 @@
  * THE SOFTWARE.
  */
 #include "qemu-common.h"
+#include "qemu-timer.h"
+#include "console.h"
 #include "usb.h"
 
 void usb_attach(USBPort *port, USBDevice *dev)
@@ -229,3 +231,62 @@ void usb_send_msg(USBDevice *dev, int msg)
 
     /* This _must_ be synchronous */
 }
+
+/**********************/
+/* host controller frame accounting */
+
+static USBController *usb_controllers;
+
+void usb_register_controller(USBController *hc, const char *name,
+                             void (*wakeup)(void *opaque), void *opaque)
+{
+    hc->name = name;
+    hc->wakeup = wakeup;
+    hc->opaque = opaque;
+    hc->rate_start = qemu_get_clock(vm_clock);
+    hc->next = usb_controllers;
+    usb_controllers = hc;
+}
+
+/* Account for one run of the frame timer */
+void usb_controller_frames(USBController *hc, int processed, int skipped)
+{
+    int64_t now, delta;
+
+    hc->frames_processed += processed;
+    hc->frames_skipped += skipped;
+    hc->rate_frames += processed;
+
+    now = qemu_get_clock(vm_clock);
+    delta = now - hc->rate_start;
+    if (delta >= ticks_per_sec) {
+        hc->rate = hc->rate_frames * ticks_per_sec / delta;
+        hc->rate_frames = 0;
+        hc->rate_start = now;
+    }
+}
+
+/* A device has data for the guest, restart idle schedules */
+void usb_wakeup(void)
+{
+    USBController *hc;
+
+    for (hc = usb_controllers; hc; hc = hc->next) {
+        if (hc->idle) {
+            hc->wakeups++;
+            hc->wakeup(hc->opaque);
+        }
+    }
+}
+
+void usb_controller_info(void)
+{
+    USBController *hc;
+
+    for (hc = usb_controllers; hc; hc = hc->next) {
+        term_printf("%s: %u frames/s%s, %" PRIu64 " processed, %" PRIu64
+                    " skipped, %" PRIu64 " wakeups\n",
+                    hc->name, hc->rate, hc->idle ? " (idle)" : "",
+                    hc->frames_processed, hc->frames_skipped, hc->wakeups);
+    }
+}
@@ -231,6 +231,30 @@ static inline void usb_cancel_packet(USBPacket * p)
     p->cancel_cb(p, p->cancel_opaque);
 }
 
+/* Host controller registered with the USB layer.  Controllers stop walking
+   their schedule every frame while it is idle; usb_wakeup() tells them a
+   device has something for the guest so they resume at once.  */
+typedef struct USBController USBController;
+struct USBController {
+    const char *name;
+    void (*wakeup)(void *opaque);
+    void *opaque;
+    int idle;                   /* schedule walked at the idle period */
+    uint64_t frames_processed;  /* frames whose schedule was walked */
+    uint64_t frames_skipped;    /* frames that elapsed without a walk */
+    uint64_t wakeups;           /* idle periods cut short by usb_wakeup */
+    int64_t rate_start;         /* start of the current rate window */
+    uint64_t rate_frames;       /* frames processed in the rate window */
+    unsigned int rate;          /* frames processed per second */
+    USBController *next;
+};
+
+void usb_register_controller(USBController *hc, const char *name,
+                             void (*wakeup)(void *opaque), void *opaque);
+void usb_controller_frames(USBController *hc, int processed, int skipped);
+void usb_wakeup(void);
+void usb_controller_info(void);
+
 int usb_device_add_dev(USBDevice *dev);
 int usb_device_del_addr(int bus_num, int addr);
 void usb_attach(USBPort *port, USBDevice *dev);
@@ -0,0 +1,157 @@
+/*
+ * Virtio Block Device: merging of the requests of one kick
+ *
+ * Included by virtio-blk.c, and by tests/test-virtio-merge.c and
+ * tests/bench-virtio-merge.c with a VirtIOBlockReq that only has the
+ * fields used here.  The includer defines VirtIOBlockReq,
+ * VIRTIO_BLK_QUEUE_SIZE and virtio_blk_submit().
+ *
+ * Copyright IBM, Corp. 2007
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_HW_VIRTIO_BLK_BATCH_H
+#define QEMU_HW_VIRTIO_BLK_BATCH_H
+
+/*
+ * Limits for requests merged from one kick.  With 4k requests, a full
+ * queue per kick (tests/bench-virtio-merge.c), going from 64 to 128
+ * sectors made cached reads and writes 13-19% faster and O_DIRECT 1-9%
+ * slower.  At 256 both got slower: too few requests are left to keep
+ * the aio threads busy.
+ */
+#define VIRTIO_BLK_MERGE_MAX_IOV     1024
+#define VIRTIO_BLK_MERGE_MAX_SECTORS 128
+
+static void virtio_blk_submit(VirtIOBlockReq *req, int nb_sectors);
+
+/* the reads and writes of a kick not submitted yet */
+typedef struct VirtIOBlockBatch
+{
+    VirtIOBlockReq *reads[VIRTIO_BLK_QUEUE_SIZE];
+    VirtIOBlockReq *writes[VIRTIO_BLK_QUEUE_SIZE];
+    int nb_reads;
+    int nb_writes;
+    int seq;
+    int max_sectors;
+} VirtIOBlockBatch;
+
+static void virtio_blk_batch_init(VirtIOBlockBatch *b)
+{
+    b->nb_reads = 0;
+    b->nb_writes = 0;
+    b->seq = 0;
+    b->max_sectors = VIRTIO_BLK_MERGE_MAX_SECTORS;
+}
+
+static int virtio_blk_batch_full(VirtIOBlockBatch *b)
+{
+    return b->nb_reads == VIRTIO_BLK_QUEUE_SIZE ||
+           b->nb_writes == VIRTIO_BLK_QUEUE_SIZE;
+}
+
+static int virtio_blk_compare_req(const void *a, const void *b)
+{
+    const VirtIOBlockReq *r1 = *(VirtIOBlockReq **)a;
+    const VirtIOBlockReq *r2 = *(VirtIOBlockReq **)b;
+
+    /* qsort is not stable, keep the guest's order for equal sectors */
+    if (r1->out->sector != r2->out->sector)
+        return r1->out->sector < r2->out->sector ? -1 : 1;
+    return r1->seq - r2->seq;
+}
+
+static int virtio_blk_overlaps(VirtIOBlockReq *req, VirtIOBlockReq **reqs,
+                               int nb)
+{
+    uint64_t start = req->out->sector;
+    uint64_t end = start + (req->size + 511) / 512;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        uint64_t s = reqs[i]->out->sector;
+        uint64_t e = s + (reqs[i]->size + 511) / 512;
+
+        if (start < e && s < end)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sort the requests by sector and submit them, merging runs of
+ * sector-contiguous requests into one.  The merged parts are chained to
+ * the first request of each run and share its I/O vector.
+ */
+static void virtio_blk_submit_batch(VirtIOBlockReq **reqs, int nb,
+                                    int max_sectors)
+{
+    VirtIOBlockReq *head, **tail;
+    int i, nb_sectors;
+
+    if (nb == 0)
+        return;
+    qsort(reqs, nb, sizeof(*reqs), virtio_blk_compare_req);
+
+    head = NULL;
+    tail = NULL;
+    nb_sectors = 0;
+    for (i = 0; i < nb; i++) {
+        VirtIOBlockReq *req = reqs[i];
+
+        if (head && ((head->size | req->size) & 511) == 0 &&
+            head->out->sector + nb_sectors == req->out->sector &&
+            nb_sectors + req->size / 512 <= max_sectors &&
+            head->qiov.niov + req->qiov.niov <= VIRTIO_BLK_MERGE_MAX_IOV) {
+            qemu_iovec_concat(&head->qiov, &req->qiov, 0, req->qiov.size);
+            nb_sectors += req->size / 512;
+            *tail = req;
+            tail = &req->merged;
+            continue;
+        }
+
+        if (head)
+            virtio_blk_submit(head, nb_sectors);
+        head = req;
+        tail = &req->merged;
+        nb_sectors = req->size / 512;
+    }
+    if (head)
+        virtio_blk_submit(head, nb_sectors);
+}
+
+/* Submit everything collected so far, writes first */
+static void virtio_blk_batch_submit(VirtIOBlockBatch *b)
+{
+    virtio_blk_submit_batch(b->writes, b->nb_writes, b->max_sectors);
+    virtio_blk_submit_batch(b->reads, b->nb_reads, b->max_sectors);
+    b->nb_writes = 0;
+    b->nb_reads = 0;
+}
+
+/* Add a mapped read or write, in the guest's order */
+static void virtio_blk_batch_add(VirtIOBlockBatch *b, VirtIOBlockReq *req)
+{
+    int is_write = req->out->type & VIRTIO_BLK_T_OUT;
+
+    req->seq = b->seq++;
+
+    /* sorting must not let a request overtake an earlier one that it
+       conflicts with, so submit everything collected so far */
+    if (virtio_blk_overlaps(req, b->writes, b->nb_writes) ||
+        (is_write && virtio_blk_overlaps(req, b->reads, b->nb_reads)))
+        virtio_blk_batch_submit(b);
+
+    if (is_write)
+        b->writes[b->nb_writes++] = req;
+    else
+        b->reads[b->nb_reads++] = req;
+}
+
+#endif
@@ -16,12 +16,18 @@
 #include "virtio-blk.h"
 #include "block_int.h"
 
+#define VIRTIO_BLK_QUEUE_SIZE 128
+
+struct VirtIOBlockReq;
+
 typedef struct VirtIOBlock
 {
     VirtIODevice vdev;
     BlockDriverState *bs;
     VirtQueue *vq;
     void *rq;
+    struct VirtIOBlockReq *free_reqs;
+    int nb_free_reqs;
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -36,10 +42,31 @@ typedef struct VirtIOBlockReq
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     size_t size;
-    uint8_t *buffer;
+    QEMUIOVector qiov;
     struct VirtIOBlockReq *next;
+    /* requests merged into this one, their data follows ours in qiov */
+    struct VirtIOBlockReq *merged;
+    /* position in the kick, breaks ties when sorting */
+    int seq;
 } VirtIOBlockReq;
 
+#include "virtio-blk-batch.h"
+
+static void virtio_blk_free_request(VirtIOBlockReq *req)
+{
+    VirtIOBlock *s = req->dev;
+
+    /* keep enough requests around for a full queue, iovec included */
+    if (s->nb_free_reqs < VIRTIO_BLK_QUEUE_SIZE) {
+        req->next = s->free_reqs;
+        s->free_reqs = req;
+        s->nb_free_reqs++;
+    } else {
+        qemu_iovec_destroy(&req->qiov);
+        qemu_free(req);
+    }
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
 {
     VirtIOBlock *s = req->dev;
@@ -48,8 +75,7 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     virtqueue_push(s->vq, &req->elem, req->size + sizeof(*req->in));
     virtio_notify(&s->vdev, s->vq);
 
-    qemu_free(req->buffer);
-    qemu_free(req);
+    virtio_blk_free_request(req);
 }
 
 static int virtio_blk_handle_write_error(VirtIOBlockReq *req, int error)
@@ -75,36 +101,44 @@ static int virtio_blk_handle_write_error(VirtIOBlockReq *req, int error)
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
+    VirtIOBlockReq *next;
 
-    /* Copy read data to the guest */
-    if (!ret && !(req->out->type & VIRTIO_BLK_T_OUT)) {
-        size_t offset = 0;
-        int i;
+    /* a merged request completes all of its parts */
+    for (; req != NULL; req = next) {
+        int status = VIRTIO_BLK_S_OK;
 
-        for (i = 0; i < req->elem.in_num - 1; i++) {
-            size_t len;
+        next = req->merged;
+        req->merged = NULL;
 
-            /* Be pretty defensive wrt malicious guests */
-            len = MIN(req->elem.in_sg[i].iov_len,
-                      req->size - offset);
-
-            memcpy(req->elem.in_sg[i].iov_base,
-                   req->buffer + offset,
-                   len);
-            offset += len;
+        if (ret && (req->out->type & VIRTIO_BLK_T_OUT)) {
+            if (virtio_blk_handle_write_error(req, -ret))
+                continue;
+        } else if (ret) {
+            status = VIRTIO_BLK_S_IOERR;
         }
-    } else if (ret && (req->out->type & VIRTIO_BLK_T_OUT)) {
-        if (virtio_blk_handle_write_error(req, -ret))
-            return;
-    }
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        virtio_blk_req_complete(req, status);
+    }
 }
 
 static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
 {
-    VirtIOBlockReq *req = qemu_mallocz(sizeof(*req));
-    req->dev = s;
+    VirtIOBlockReq *req = s->free_reqs;
+
+    if (req) {
+        s->free_reqs = req->next;
+        s->nb_free_reqs--;
+        qemu_iovec_reset(&req->qiov);
+        req->in = NULL;
+        req->out = NULL;
+        req->size = 0;
+        req->next = NULL;
+        req->merged = NULL;
+    } else {
+        req = qemu_mallocz(sizeof(*req));
+        req->dev = s;
+        qemu_iovec_init(&req->qiov, 4);
+    }
     return req;
 }
 
@@ -114,7 +148,7 @@ static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
 
     if (req != NULL) {
         if (!virtqueue_pop(s->vq, &req->elem)) {
-            qemu_free(req);
+            virtio_blk_free_request(req);
             return NULL;
         }
     }
@@ -122,38 +156,42 @@ static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
     return req;
 }
 
-static int virtio_blk_handle_write(VirtIOBlockReq *req)
+/* The guest's SG list is passed down as is, without copying the data */
+static void virtio_blk_map_request(VirtIOBlockReq *req)
 {
-    if (!req->buffer) {
-        size_t offset = 0;
-        int i;
+    int i;
 
+    qemu_iovec_reset(&req->qiov);
+    if (req->out->type & VIRTIO_BLK_T_OUT) {
         for (i = 1; i < req->elem.out_num; i++)
-            req->size += req->elem.out_sg[i].iov_len;
-
-        req->buffer = qemu_memalign(512, req->size);
-        if (req->buffer == NULL) {
-            qemu_free(req);
-            return -1;
-        }
-
-        /* We copy the data from the SG list to avoid splitting up the request.
-           This helps performance a lot until we can pass full sg lists as AIO
-           operations */
-        for (i = 1; i < req->elem.out_num; i++) {
-            size_t len;
-
-            len = MIN(req->elem.out_sg[i].iov_len,
-                    req->size - offset);
-            memcpy(req->buffer + offset,
-                    req->elem.out_sg[i].iov_base,
-                    len);
-            offset += len;
-        }
+            qemu_iovec_add(&req->qiov, req->elem.out_sg[i].iov_base,
+                           req->elem.out_sg[i].iov_len);
+    } else {
+        for (i = 0; i < req->elem.in_num - 1; i++)
+            qemu_iovec_add(&req->qiov, req->elem.in_sg[i].iov_base,
+                           req->elem.in_sg[i].iov_len);
     }
+    req->size = req->qiov.size;
+}
 
-    bdrv_aio_write(req->dev->bs, req->out->sector, req->buffer, req->size / 512,
-            virtio_blk_rw_complete, req);
+static void virtio_blk_submit(VirtIOBlockReq *req, int nb_sectors)
+{
+    BlockDriverAIOCB *acb;
+
+    if (req->out->type & VIRTIO_BLK_T_OUT)
+        acb = bdrv_aio_writev(req->dev->bs, req->out->sector, &req->qiov,
+                              nb_sectors, virtio_blk_rw_complete, req);
+    else
+        acb = bdrv_aio_readv(req->dev->bs, req->out->sector, &req->qiov,
+                             nb_sectors, virtio_blk_rw_complete, req);
+    if (!acb)
+        virtio_blk_rw_complete(req, -EIO);
+}
+
+static int virtio_blk_handle_write(VirtIOBlockReq *req)
+{
+    virtio_blk_map_request(req);
+    virtio_blk_submit(req, req->size / 512);
     return 0;
 }
 
@@ -161,10 +199,12 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
     VirtIOBlockReq *req;
+    VirtIOBlockBatch batch;
 
-    while ((req = virtio_blk_get_request(s))) {
-        int i;
-
+    virtio_blk_batch_init(&batch);
+    /* drain the whole kick first so that adjacent requests can be merged */
+    while (!virtio_blk_batch_full(&batch) &&
+           (req = virtio_blk_get_request(s))) {
         if (req->elem.out_num < 1 || req->elem.in_num < 1) {
             fprintf(stderr, "virtio-blk missing headers\n");
             exit(1);
@@ -185,27 +225,15 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             req->in->status = VIRTIO_BLK_S_UNSUPP;
             virtqueue_push(vq, &req->elem, len);
             virtio_notify(vdev, vq);
-            qemu_free(req);
-        } else if (req->out->type & VIRTIO_BLK_T_OUT) {
-            if (virtio_blk_handle_write(req) < 0)
-                break;
+            virtio_blk_free_request(req);
         } else {
-            for (i = 0; i < req->elem.in_num - 1; i++)
-                req->size += req->elem.in_sg[i].iov_len;
-
-            req->buffer = qemu_memalign(512, req->size);
-            if (req->buffer == NULL) {
-                qemu_free(req);
-                break;
-            }
-
-            bdrv_aio_read(s->bs, req->out->sector,
-                          req->buffer,
-                          req->size / 512,
-                          virtio_blk_rw_complete,
-                          req);
+            virtio_blk_map_request(req);
+            virtio_blk_batch_add(&batch, req);
         }
     }
+
+    virtio_blk_batch_submit(&batch);
+
     /*
      * FIXME: Want to check for completions before returning to guest mode,
      * so cached reads and writes are reported as quickly as possible. But
@@ -224,8 +252,9 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
     s->rq = NULL;
 
     while (req) {
+        VirtIOBlockReq *next = req->next;
         virtio_blk_handle_write(req);
-        req = req->next;
+        req = next;
     }
 }
 
@@ -318,7 +347,8 @@ void *virtio_blk_init(PCIBus *bus, BlockDriverState *bs)
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
     bdrv_set_geometry_hint(s->bs, cylinders, heads, secs);
 
-    s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+    s->vq = virtio_add_queue(&s->vdev, VIRTIO_BLK_QUEUE_SIZE,
+                             virtio_blk_handle_output);
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     register_savevm("virtio-blk", virtio_blk_id++, 2,
@@ -50,6 +50,8 @@ const char *xen_protocol;
 /* private */
 static TAILQ_HEAD(XenDeviceHead, XenDevice) xendevs = TAILQ_HEAD_INITIALIZER(xendevs);
 static int debug = 0;
+/* domain 0 path, looked up once instead of on every watch event */
+static char *dom0_path;
 
 /* ------------------------------------------------------------- */
 
@@ -176,7 +178,6 @@ static struct XenDevice *xen_be_get_xendev(const char *type, int dom, int dev,
                                            struct XenDevOps *ops)
 {
     struct XenDevice *xendev;
-    char *dom0;
 
     xendev = xen_be_find_xendev(type, dom, dev);
     if (xendev)
@@ -191,12 +192,10 @@ static struct XenDevice *xen_be_get_xendev(const char *type, int dom, int dev,
     xendev->dev   = dev;
     xendev->ops   = ops;
 
-    dom0 = xs_get_domain_path(xenstore, 0);
     snprintf(xendev->be, sizeof(xendev->be), "%s/backend/%s/%d/%d",
-	     dom0, xendev->type, xendev->dom, xendev->dev);
+	     dom0_path, xendev->type, xendev->dom, xendev->dev);
     snprintf(xendev->name, sizeof(xendev->name), "%s-%d",
 	     xendev->type, xendev->dev);
-    free(dom0);
 
     xendev->debug      = debug;
     xendev->local_port = -1;
@@ -496,14 +495,12 @@ static int xenstore_scan(const char *type, int dom, struct XenDevOps *ops)
 {
     struct XenDevice *xendev;
     char path[XEN_BUFSIZE], token[XEN_BUFSIZE];
-    char **dev = NULL, *dom0;
+    char **dev = NULL;
     unsigned int cdev, j;
 
     /* setup watch */
-    dom0 = xs_get_domain_path(xenstore, 0);
     snprintf(token, sizeof(token), "be:%p:%d:%p", type, dom, ops);
-    snprintf(path, sizeof(path), "%s/backend/%s/%d", dom0, type, dom);
-    free(dom0);
+    snprintf(path, sizeof(path), "%s/backend/%s/%d", dom0_path, type, dom);
     if (!xs_watch(xenstore, path, token)) {
 	fprintf(stderr, "xen be: watching backend path (%s) failed\n", path);
 	return -1;
@@ -527,12 +524,10 @@ static void xenstore_update_be(char *watch, char *type, int dom,
 			       struct XenDevOps *ops)
 {
     struct XenDevice *xendev;
-    char path[XEN_BUFSIZE], *dom0;
+    char path[XEN_BUFSIZE];
     unsigned int len, dev;
 
-    dom0 = xs_get_domain_path(xenstore, 0);
-    len = snprintf(path, sizeof(path), "%s/backend/%s/%d", dom0, type, dom);
-    free(dom0);
+    len = snprintf(path, sizeof(path), "%s/backend/%s/%d", dom0_path, type, dom);
     if (0 != strncmp(path, watch, len))
 	return;
     if (2 != sscanf(watch+len, "/%u/%255s", &dev, path)) {
@@ -618,6 +613,12 @@ int xen_be_init(void)
 	return -1;
     }
 
+    dom0_path = xs_get_domain_path(xenstore, 0);
+    if (!dom0_path) {
+	fprintf(stderr, "can't get domain 0 path from xenstored\n");
+	goto err;
+    }
+
     if (qemu_set_fd_handler(xs_fileno(xenstore), xenstore_update, NULL, NULL) < 0)
 	goto err;
 
@@ -632,6 +633,8 @@ err:
     qemu_set_fd_handler(xs_fileno(xenstore), NULL, NULL, NULL);
     xs_daemon_close(xenstore);
     xenstore = NULL;
+    free(dom0_path);
+    dom0_path = NULL;
 
     return -1;
 }
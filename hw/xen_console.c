@@ -37,17 +37,10 @@
 #include "sysemu.h"
 #include "qemu-char.h"
 #include "xen_backend.h"
+#include "xen_console_buf.h"
 
 #define dolog(val, fmt, ...) fprintf(stderr, fmt "\n", ## __VA_ARGS__)
 
-struct buffer {
-    uint8_t *data;
-    size_t consumed;
-    size_t size;
-    size_t capacity;
-    size_t max_capacity;
-};
-
 struct XenConsole {
     struct XenDevice  xendev;  /* must be first */
     struct buffer     buffer;
@@ -60,58 +53,8 @@ struct XenConsole {
 
 static void buffer_append(struct XenConsole *con)
 {
-    struct buffer *buffer = &con->buffer;
-    XENCONS_RING_IDX cons, prod, size;
-    struct xencons_interface *intf = con->sring;
-
-    cons = intf->out_cons;
-    prod = intf->out_prod;
-    xen_mb();
-
-    size = prod - cons;
-    if ((size == 0) || (size > sizeof(intf->out)))
-	return;
-
-    if ((buffer->capacity - buffer->size) < size) {
-	buffer->capacity += (size + 1024);
-	buffer->data = qemu_realloc(buffer->data, buffer->capacity);
-	if (buffer->data == NULL) {
-	    dolog(LOG_ERR, "Memory allocation failed");
-	    exit(ENOMEM);
-	}
-    }
-
-    while (cons != prod)
-	buffer->data[buffer->size++] = intf->out[
-	    MASK_XENCONS_IDX(cons++, intf->out)];
-
-    xen_mb();
-    intf->out_cons = cons;
-    xen_be_send_notify(&con->xendev);
-
-    if (buffer->max_capacity &&
-	buffer->size > buffer->max_capacity) {
-	/* Discard the middle of the data. */
-
-	size_t over = buffer->size - buffer->max_capacity;
-	uint8_t *maxpos = buffer->data + buffer->max_capacity;
-
-	memmove(maxpos - over, maxpos, over);
-	buffer->data = qemu_realloc(buffer->data, buffer->max_capacity);
-	buffer->size = buffer->capacity = buffer->max_capacity;
-
-	if (buffer->consumed > buffer->max_capacity - over)
-	    buffer->consumed = buffer->max_capacity - over;
-    }
-}
-
-static void buffer_advance(struct buffer *buffer, size_t len)
-{
-    buffer->consumed += len;
-    if (buffer->consumed == buffer->size) {
-	buffer->consumed = 0;
-	buffer->size = 0;
-    }
+    if (buffer_append_ring(&con->buffer, con->sring))
+	xen_be_send_notify(&con->xendev);
 }
 
 static int ring_free_bytes(struct XenConsole *con)
@@ -160,12 +103,14 @@ static void xencons_receive(void *opaque, const uint8_t *buf, int len)
 
 static void xencons_send(struct XenConsole *con)
 {
+    struct iovec iov[2];
     ssize_t len, size;
+    int iovcnt;
 
-    size = con->buffer.size - con->buffer.consumed;
+    size = con->buffer.size;
+    iovcnt = buffer_iov(&con->buffer, iov);
     if (con->chr)
-        len = qemu_chr_write(con->chr, con->buffer.data + con->buffer.consumed,
-                             size);
+        len = qemu_chr_writev(con->chr, iov, iovcnt);
     else
         len = size;
     if (len < 1) {
@@ -177,7 +122,8 @@ static void xencons_send(struct XenConsole *con)
 	buffer_advance(&con->buffer, len);
 	if (con->backlog && len == size) {
 	    con->backlog = 0;
-	    xen_be_printf(&con->xendev, 1, "backlog is gone\n");
+	    xen_be_printf(&con->xendev, 1, "backlog is gone, %" PRIu64
+			  " bytes dropped so far\n", con->buffer.dropped);
 	}
     }
 }
@@ -260,7 +206,7 @@ static void con_event(struct XenDevice *xendev)
     struct XenConsole *con = container_of(xendev, struct XenConsole, xendev);
 
     buffer_append(con);
-    if (con->buffer.size - con->buffer.consumed)
+    if (con->buffer.size)
 	xencons_send(con);
 }
 
@@ -0,0 +1,116 @@
+/*
+ *  Copyright (C) International Business Machines  Corp., 2005
+ *  Author(s): Anthony Liguori <aliguori@us.ibm.com>
+ *
+ *  Copyright (C) Red Hat 2007
+ *
+ *  Xen Console: the buffer between the output ring and the char device.
+ *  Included by xen_console.c, and by tests/bench-xen-console.c with a
+ *  fake shared ring.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; under version 2 of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef QEMU_HW_XEN_CONSOLE_BUF_H
+#define QEMU_HW_XEN_CONSOLE_BUF_H
+
+#include <sys/uio.h>
+#include <xen/io/console.h>
+
+/* Guest output is kept in a circular buffer until the char device takes
+   it.  When the buffer is full the oldest output is dropped. */
+#define XENCONS_BUFFER_SIZE (1024 * 1024) /* when no limit is configured */
+
+struct buffer {
+    uint8_t *data;
+    size_t head; /* oldest byte not yet written out */
+    size_t size; /* bytes not yet written out */
+    size_t capacity;
+    size_t max_capacity;
+    uint64_t dropped;
+};
+
+static void buffer_advance(struct buffer *buffer, size_t len)
+{
+    buffer->head = (buffer->head + len) % buffer->capacity;
+    buffer->size -= len;
+    if (buffer->size == 0)
+	buffer->head = 0;
+}
+
+/* Describe the pending output, at most two segments */
+static int buffer_iov(struct buffer *buffer, struct iovec *iov)
+{
+    size_t len = MIN(buffer->size, buffer->capacity - buffer->head);
+
+    iov[0].iov_base = buffer->data + buffer->head;
+    iov[0].iov_len = len;
+    if (len == buffer->size)
+	return 1;
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = buffer->size - len;
+    return 2;
+}
+
+/* Move the guest output from the ring into the buffer.  Returns non-zero
+   if the ring was consumed and the guest needs a notification. */
+static int buffer_append_ring(struct buffer *buffer,
+			      struct xencons_interface *intf)
+{
+    XENCONS_RING_IDX cons, prod, size;
+    size_t tail, len, over;
+
+    cons = intf->out_cons;
+    prod = intf->out_prod;
+    xen_mb();
+
+    size = prod - cons;
+    if ((size == 0) || (size > sizeof(intf->out)))
+	return 0;
+
+    if (!buffer->data) {
+	buffer->capacity = buffer->max_capacity ? buffer->max_capacity :
+	    XENCONS_BUFFER_SIZE;
+	buffer->data = qemu_malloc(buffer->capacity);
+    }
+
+    /* Make room by dropping the oldest output */
+    if (size > buffer->capacity) {
+	buffer->dropped += size - buffer->capacity;
+	cons += size - buffer->capacity;
+	size = buffer->capacity;
+    }
+    if (size > buffer->capacity - buffer->size) {
+	over = size - (buffer->capacity - buffer->size);
+	buffer_advance(buffer, over);
+	buffer->dropped += over;
+    }
+
+    /* Bulk copy, both the ring and the buffer may wrap */
+    while (cons != prod) {
+	tail = (buffer->head + buffer->size) % buffer->capacity;
+	len = MIN(prod - cons, buffer->capacity - tail);
+	len = MIN(len, sizeof(intf->out) - MASK_XENCONS_IDX(cons, intf->out));
+	memcpy(buffer->data + tail,
+	       intf->out + MASK_XENCONS_IDX(cons, intf->out), len);
+	buffer->size += len;
+	cons += len;
+    }
+
+    xen_mb();
+    intf->out_cons = cons;
+    return 1;
+}
+
+#endif /* QEMU_HW_XEN_CONSOLE_BUF_H */
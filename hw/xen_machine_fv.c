@@ -54,6 +54,7 @@ struct map_cache {
 struct map_cache_rev {
     uint8_t      *vaddr_req;
     unsigned long paddr_index;
+    target_phys_addr_t paddr_req;
     TAILQ_ENTRY(map_cache_rev) next;
 };
 
@@ -165,6 +166,7 @@ uint8_t *qemu_map_cache(target_phys_addr_t phys_addr, uint8_t lock)
         entry->lock++;
         reventry->vaddr_req = last_address_vaddr + address_offset;
         reventry->paddr_index = last_address_index;
+        reventry->paddr_req = phys_addr;
         TAILQ_INSERT_TAIL(&locked_entries, reventry, next);
     }
 
@@ -220,6 +222,20 @@ void qemu_invalidate_entry(uint8_t *buffer)
     qemu_free(entry);
 }
 
+/* Guest physical address of a buffer returned by a locked qemu_map_cache() */
+int qemu_map_cache_paddr(uint8_t *buffer, target_phys_addr_t *paddr)
+{
+    struct map_cache_rev *reventry;
+
+    TAILQ_FOREACH(reventry, &locked_entries, next) {
+        if (reventry->vaddr_req == buffer) {
+            *paddr = reventry->paddr_req;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 void qemu_invalidate_map_cache(void)
 {
     unsigned long i;
@@ -264,6 +280,12 @@ void qemu_invalidate_map_cache(void) {};
 
 void qemu_invalidate_entry(uint8_t *buffer) {};
 
+int qemu_map_cache_paddr(uint8_t *buffer, target_phys_addr_t *paddr)
+{
+	*paddr = buffer - phys_ram_base;
+	return 0;
+}
+
 #endif /* defined(MAPCACHE) */
 
 
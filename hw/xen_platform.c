@@ -30,8 +30,9 @@
 #include "qemu-xen.h"
 #include "net.h"
 #include "xen_platform.h"
+#include "qemu-timer.h"
+#include "console.h"
 
-#include <assert.h>
 #include <xenguest.h>
 
 static int drivers_blacklisted;
@@ -53,83 +54,133 @@ typedef struct PCIXenPlatformState
 /* We throttle access to dom0 syslog, to avoid DOS attacks.  This is
    modelled as a token bucket, with one token for every byte of log.
    The bucket size is 128KB (->1024 lines of 128 bytes each) and
-   refills at 256B/s.  It starts full.  The guest is blocked if no
-   tokens are available when it tries to generate a log message. */
+   refills at 256B/s.  It starts full.  Lines that find the bucket
+   empty are queued until enough tokens are back, and the vcpu that
+   wrote them waits for its ioreq until then; the rest of the device
+   model keeps running.  Lines that do not fit in the queue are
+   dropped. */
 #define BUCKET_MAX_SIZE (128*1024)
 #define BUCKET_FILL_RATE 256
+#define LOG_QUEUE_MAX 64
 
-static void throttle(unsigned count)
-{
-    static unsigned available;
-    static struct timespec last_refil;
-    static int started;
-    static int warned;
+static unsigned log_tokens;
+static int64_t log_refill_time;
+static QEMUTimer *log_timer;
+static char *log_queue[LOG_QUEUE_MAX];
+static int log_queue_head, log_queue_len;
+static unsigned log_queue_bytes;
+static uint64_t log_lines_written, log_lines_deferred, log_lines_dropped;
 
-    struct timespec waiting_for, now;
-    double delay;
-    struct timespec ts;
+static void log_refill(void)
+{
+    int64_t now = qemu_get_clock(rt_clock);
+    int64_t tokens;
 
-    if (throttling_disabled)
+    tokens = (now - log_refill_time) * BUCKET_FILL_RATE / 1000;
+    if (tokens <= 0)
         return;
+    if (log_tokens + tokens >= BUCKET_MAX_SIZE) {
+        log_tokens = BUCKET_MAX_SIZE;
+        log_refill_time = now;
+    } else {
+        /* keep the fraction of a token that has already accrued */
+        log_tokens += tokens;
+        log_refill_time += tokens * 1000 / BUCKET_FILL_RATE;
+    }
+}
+
+/* rt_clock time at which the bucket holds 'count' tokens */
+static int64_t log_tokens_ready(unsigned count)
+{
+    if (count <= log_tokens)
+        return qemu_get_clock(rt_clock);
+    return log_refill_time + ((count - log_tokens) * 1000 +
+                              BUCKET_FILL_RATE - 1) / BUCKET_FILL_RATE;
+}
 
-    if (!started) {
-        clock_gettime(CLOCK_MONOTONIC, &last_refil);
-        available = BUCKET_MAX_SIZE;
-        started = 1;
+static void log_write(const char *line)
+{
+    fprintf(logfile, "%s\n", line);
+    log_lines_written++;
+}
+
+static void log_queue_flush(void *opaque)
+{
+    char *line;
+    unsigned count;
+
+    log_refill();
+    while (log_queue_len) {
+        line = log_queue[log_queue_head];
+        count = strlen(line);
+        if (count > log_tokens)
+            break;
+        log_tokens -= count;
+        log_write(line);
+        qemu_free(line);
+        log_queue_head = (log_queue_head + 1) % LOG_QUEUE_MAX;
+        log_queue_len--;
+        log_queue_bytes -= count;
     }
 
-    if (count > BUCKET_MAX_SIZE) {
-        fprintf(logfile, "tried to get %d tokens, but bucket size is %d\n",
-                BUCKET_MAX_SIZE, count);
-        exit(1);
+    if (log_queue_len)
+        qemu_mod_timer(log_timer,
+                       log_tokens_ready(strlen(log_queue[log_queue_head])));
+}
+
+static void log_line(const char *line)
+{
+    unsigned count = strlen(line);
+    static int warned;
+
+    if (throttling_disabled) {
+        log_write(line);
+        return;
     }
 
-    if (available < count) {
-        /* The bucket is empty.  Refil it */
-
-        /* When will it be full enough to handle this request? */
-        delay = (double)(count - available) / BUCKET_FILL_RATE;
-        waiting_for = last_refil;
-        waiting_for.tv_sec += delay;
-        waiting_for.tv_nsec += (delay - (int)delay) * 1e9;
-        if (waiting_for.tv_nsec >= 1000000000) {
-            waiting_for.tv_nsec -= 1000000000;
-            waiting_for.tv_sec++;
-        }
+    if (!log_timer) {
+        log_timer = qemu_new_timer(rt_clock, log_queue_flush, NULL);
+        log_tokens = BUCKET_MAX_SIZE;
+        log_refill_time = qemu_get_clock(rt_clock);
+    }
 
-        /* How long do we have to wait? (might be negative) */
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        ts.tv_sec = waiting_for.tv_sec - now.tv_sec;
-        ts.tv_nsec = waiting_for.tv_nsec - now.tv_nsec;
-        if (ts.tv_nsec < 0) {
-            ts.tv_sec--;
-            ts.tv_nsec += 1000000000;
-        }
+    log_refill();
+    if (!log_queue_len && count <= log_tokens) {
+        log_tokens -= count;
+        log_write(line);
+        return;
+    }
 
-        /* Wait for it. */
-        if (ts.tv_sec > 0 ||
-            (ts.tv_sec == 0 && ts.tv_nsec > 0)) {
-            if (!warned) {
-                fprintf(logfile, "throttling guest access to syslog");
-                warned = 1;
-            }
-            while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
-                ;
-        }
+    if (log_queue_len == LOG_QUEUE_MAX) {
+        log_lines_dropped++;
+        return;
+    }
 
-        /* Refil */
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        delay = (now.tv_sec - last_refil.tv_sec) +
-            (now.tv_nsec - last_refil.tv_nsec) * 1.0e-9;
-        available += BUCKET_FILL_RATE * delay;
-        if (available > BUCKET_MAX_SIZE)
-            available = BUCKET_MAX_SIZE;
-        last_refil = now;
+    if (!warned) {
+        fprintf(logfile, "throttling guest access to syslog\n");
+        warned = 1;
     }
 
-    assert(available >= count);
+    log_queue[(log_queue_head + log_queue_len) % LOG_QUEUE_MAX] =
+        qemu_strdup(line);
+    log_queue_len++;
+    log_queue_bytes += count;
+    log_lines_deferred++;
 
-    available -= count;
+    /* Stall the writer until its line has gone out */
+    xen_ioreq_delay(log_tokens_ready(log_queue_bytes));
+    if (log_queue_len == 1)
+        qemu_mod_timer(log_timer, log_tokens_ready(count));
+}
+
+void xen_platform_log_info(void)
+{
+    term_printf("guest log: %" PRIu64 " lines written, %" PRIu64
+                " deferred, %" PRIu64 " dropped, %d queued\n",
+                log_lines_written, log_lines_deferred, log_lines_dropped,
+                log_queue_len);
+    if (!throttling_disabled)
+        term_printf("tokens: %u of %u\n", log_tokens, BUCKET_MAX_SIZE);
 }
 
 #define UNPLUG_ALL_IDE_DISKS 1
@@ -214,8 +265,7 @@ static void platform_fixed_ioport_write1(void *opaque, uint32_t addr, uint32_t v
         if (val == '\n' || log_buffer_off == sizeof(log_buffer) - 1) {
             /* Flush buffer */
             log_buffer[log_buffer_off] = 0;
-            throttle(log_buffer_off);
-            fprintf(logfile, "%s\n", log_buffer);
+            log_line(log_buffer);
             log_buffer_off = 0;
             break;
         }
@@ -318,8 +368,7 @@ static void xen_platform_ioport_writeb(void *opaque, uint32_t addr, uint32_t val
             if (val == '\n' || log_buffer_off == sizeof(log_buffer) - 1) {
                 /* Flush buffer */
                 log_buffer[log_buffer_off] = 0;
-                throttle(log_buffer_off);
-                fprintf(logfile, "%s\n", log_buffer);
+                log_line(log_buffer);
                 log_buffer_off = 0;
                 break;
             }
@@ -49,6 +49,8 @@
 #include "sysemu.h"
 #include "console.h"
 #include "qemu-char.h"
+#include "qemu-timer.h"
+#include "qemu-xen.h"
 #include "xen_backend.h"
 
 #ifndef BTN_LEFT
@@ -73,6 +75,9 @@ struct XenInput {
 
 #define UP_QUEUE 8
 
+/* Longest refresh period is the client's one shifted by this much */
+#define REFRESH_IDLE_SHIFT_MAX 2
+
 struct XenFB {
     struct common     c;
     size_t            fb_len;
@@ -92,8 +97,24 @@ struct XenFB {
     } up_rects[UP_QUEUE];
     int               up_count;
     int               up_fullscreen;
+    int               idle_shift;   /* refresh period backoff while idle */
+
+    /* 8 bit guest pixels converted to the display format */
+    uint32_t          lut8[256];
+    int               lut8_bits;
+
+    /* statistics */
+    uint64_t          frames;
+    uint64_t          fullscreen_frames;
+    uint64_t          rects_queued;
+    uint64_t          rects_merged;
+    int64_t           copy_time;
+    int64_t           copy_time_max;
+    LIST_ENTRY(XenFB) list;
 };
 
+static LIST_HEAD(, XenFB) xenfbs = LIST_HEAD_INITIALIZER(xenfbs);
+
 /* -------------------------------------------------------------------- */
 
 static int common_bind(struct common *c)
@@ -552,39 +573,53 @@ static int xenfb_configure_fb(struct XenFB *xenfb, size_t fb_len_lim,
     return 0;
 }
 
+/* Convert one pixel between two rgb layouts, preserving the MSB */
+#define PIXEL(spix,RSB,GSB,BSB,RDB,GDB,BDB)				\
+    (((((spix) << (32 - (RSB + GSB + BSB))) & ((~0U) << (32 - RSB))	\
+       & ((~0U) << (32 - RDB))) >> (32 - (RDB + GDB + BDB))) |		\
+     ((((spix) << (32 - (GSB + BSB))) & ((~0U) << (32 - GSB))		\
+       & ((~0U) << (32 - GDB))) >> (32 - (GDB + BDB))) |		\
+     ((((spix) << (32 - BSB)) & ((~0U) << (32 - BSB))			\
+       & ((~0U) << (32 - BDB))) >> (32 - BDB)))
+
 /* A convenient function for munging pixels between different depths */
 #define BLT(SRC_T,DST_T,RSB,GSB,BSB,RDB,GDB,BDB)                        \
-    for (line = y ; line < (y+h) ; line++) {				\
-	SRC_T *src = (SRC_T *)(xenfb->pixels				\
-			       + xenfb->offset				\
-			       + (line * xenfb->row_stride)		\
-			       + (x * xenfb->depth / 8));		\
-	DST_T *dst = (DST_T *)(ds_get_data(xenfb->c.ds)				\
-			       + (line * ds_get_linesize(xenfb->c.ds))		\
-			       + (x * ds_get_bytes_per_pixel(xenfb->c.ds)));		\
+    for (line = 0; line < h; line++) {					\
+	const uint8_t *src = src_line;					\
+	DST_T *dst = (DST_T *)dst_line;					\
 	int col;							\
-	const int RSS = 32 - (RSB + GSB + BSB);				\
-	const int GSS = 32 - (GSB + BSB);				\
-	const int BSS = 32 - (BSB);					\
-	const uint32_t RSM = (~0U) << (32 - RSB);			\
-	const uint32_t GSM = (~0U) << (32 - GSB);			\
-	const uint32_t BSM = (~0U) << (32 - BSB);			\
-	const int RDS = 32 - (RDB + GDB + BDB);				\
-	const int GDS = 32 - (GDB + BDB);				\
-	const int BDS = 32 - (BDB);					\
-	const uint32_t RDM = (~0U) << (32 - RDB);			\
-	const uint32_t GDM = (~0U) << (32 - GDB);			\
-	const uint32_t BDM = (~0U) << (32 - BDB);			\
-	for (col = x ; col < (x+w) ; col++) {				\
-	    uint32_t spix = *src;					\
-	    *dst = (((spix << RSS) & RSM & RDM) >> RDS) |		\
-		(((spix << GSS) & GSM & GDM) >> GDS) |			\
-		(((spix << BSS) & BSM & BDM) >> BDS);			\
-	    src = (SRC_T *) ((unsigned long) src + xenfb->depth / 8);	\
-	    dst = (DST_T *) ((unsigned long) dst + ds_get_bytes_per_pixel(xenfb->c.ds)); \
+	for (col = 0; col < w; col++) {					\
+	    uint32_t spix = *(const SRC_T *)src;			\
+	    dst[col] = PIXEL(spix, RSB, GSB, BSB, RDB, GDB, BDB);	\
+	    src += src_bpp;						\
 	}								\
+	src_line += xenfb->row_stride;					\
+	dst_line += dst_linesize;					\
+    }
+
+/* 8 bit guest pixels go through a lookup table instead */
+#define BLT_LUT8(DST_T)							\
+    for (line = 0; line < h; line++) {					\
+	DST_T *dst = (DST_T *)dst_line;					\
+	int col;							\
+	for (col = 0; col < w; col++)					\
+	    dst[col] = xenfb->lut8[src_line[col]];			\
+	src_line += xenfb->row_stride;					\
+	dst_line += dst_linesize;					\
     }
 
+static void xenfb_build_lut8(struct XenFB *xenfb, int bits)
+{
+    uint32_t spix;
+
+    for (spix = 0; spix < 256; spix++) {
+	if (bits == 16)
+	    xenfb->lut8[spix] = PIXEL(spix, 3, 3, 2,   5, 6, 5);
+	else
+	    xenfb->lut8[spix] = PIXEL(spix, 3, 3, 2,   8, 8, 8);
+    }
+    xenfb->lut8_bits = bits;
+}
 
 /* This copies data from the guest framebuffer region, into QEMU's copy
  * NB. QEMU's copy is stored in the pixel format of a) the local X
@@ -596,11 +631,19 @@ static void xenfb_guest_copy(struct XenFB *xenfb, int x, int y, int w, int h)
     int line;
 
     if (!is_buffer_shared(xenfb->c.ds->surface)) {
-	if (xenfb->depth == ds_get_bits_per_pixel(xenfb->c.ds)) { /* Perfect match can use fast path */
-	    for (line = y ; line < (y+h) ; line++) {
-		memcpy(ds_get_data(xenfb->c.ds) + (line * ds_get_linesize(xenfb->c.ds)) + (x * ds_get_bytes_per_pixel(xenfb->c.ds)),
-		       xenfb->pixels + xenfb->offset + (line * xenfb->row_stride) + (x * xenfb->depth / 8),
-		       w * xenfb->depth / 8);
+	const int src_bpp = xenfb->depth / 8;
+	const int dst_bits = ds_get_bits_per_pixel(xenfb->c.ds);
+	const int dst_linesize = ds_get_linesize(xenfb->c.ds);
+	const uint8_t *src_line = xenfb->pixels + xenfb->offset
+	    + y * xenfb->row_stride + x * src_bpp;
+	uint8_t *dst_line = ds_get_data(xenfb->c.ds) + y * dst_linesize
+	    + x * ds_get_bytes_per_pixel(xenfb->c.ds);
+
+	if (xenfb->depth == dst_bits) { /* Perfect match can use fast path */
+	    for (line = 0; line < h; line++) {
+		memcpy(dst_line, src_line, w * src_bpp);
+		src_line += xenfb->row_stride;
+		dst_line += dst_linesize;
 	    }
 	} else { /* Mismatch requires slow pixel munging */
 	    /* 8 bit == r:3 g:3 b:2 */
@@ -608,23 +651,27 @@ static void xenfb_guest_copy(struct XenFB *xenfb, int x, int y, int w, int h)
 	    /* 24 bit == r:8 g:8 b:8 */
 	    /* 32 bit == r:8 g:8 b:8 (padding:8) */
 	    if (xenfb->depth == 8) {
-		if (ds_get_bits_per_pixel(xenfb->c.ds) == 16) {
-		    BLT(uint8_t, uint16_t,   3, 3, 2,   5, 6, 5);
-		} else if (ds_get_bits_per_pixel(xenfb->c.ds) == 32) {
-		    BLT(uint8_t, uint32_t,   3, 3, 2,   8, 8, 8);
+		if (dst_bits == 16 || dst_bits == 32) {
+		    if (xenfb->lut8_bits != dst_bits)
+			xenfb_build_lut8(xenfb, dst_bits);
+		    if (dst_bits == 16) {
+			BLT_LUT8(uint16_t);
+		    } else {
+			BLT_LUT8(uint32_t);
+		    }
 		}
 	    } else if (xenfb->depth == 16) {
-		if (ds_get_bits_per_pixel(xenfb->c.ds) == 8) {
+		if (dst_bits == 8) {
 		    BLT(uint16_t, uint8_t,   5, 6, 5,   3, 3, 2);
-		} else if (ds_get_bits_per_pixel(xenfb->c.ds) == 32) {
+		} else if (dst_bits == 32) {
 		    BLT(uint16_t, uint32_t,  5, 6, 5,   8, 8, 8);
 		}
 	    } else if (xenfb->depth == 24 || xenfb->depth == 32) {
-		if (ds_get_bits_per_pixel(xenfb->c.ds) == 8) {
+		if (dst_bits == 8) {
 		    BLT(uint32_t, uint8_t,   8, 8, 8,   3, 3, 2);
-		} else if (ds_get_bits_per_pixel(xenfb->c.ds) == 16) {
+		} else if (dst_bits == 16) {
 		    BLT(uint32_t, uint16_t,  8, 8, 8,   5, 6, 5);
-		} else if (ds_get_bits_per_pixel(xenfb->c.ds) == 32) {
+		} else if (dst_bits == 32) {
 		    BLT(uint32_t, uint32_t,  8, 8, 8,   8, 8, 8);
 		}
 	    }
@@ -633,6 +680,57 @@ static void xenfb_guest_copy(struct XenFB *xenfb, int x, int y, int w, int h)
     dpy_update(xenfb->c.ds, x, y, w, h);
 }
 
+/*
+ * Queue an update rectangle for the next xenfb_update().  A rectangle
+ * that overlaps or touches a queued one is merged with it when the
+ * bounding box costs no extra pixels.  Once the queue is full, new
+ * rectangles go into whichever queued one grows the least.
+ */
+static void xenfb_queue_rect(struct XenFB *xenfb, int x, int y, int w, int h)
+{
+    int i, best = -1, best_waste = 0;
+    int ux, uy, uw, uh;
+
+    xenfb->rects_queued++;
+    for (i = 0; i < xenfb->up_count; i++) {
+	int waste;
+
+	ux = MIN(x, xenfb->up_rects[i].x);
+	uy = MIN(y, xenfb->up_rects[i].y);
+	uw = MAX(x + w, xenfb->up_rects[i].x + xenfb->up_rects[i].w) - ux;
+	uh = MAX(y + h, xenfb->up_rects[i].y + xenfb->up_rects[i].h) - uy;
+	waste = uw * uh - w * h - xenfb->up_rects[i].w * xenfb->up_rects[i].h;
+	if (best < 0 || waste < best_waste) {
+	    best = i;
+	    best_waste = waste;
+	}
+    }
+
+    if (best < 0 || (best_waste > 0 && xenfb->up_count < UP_QUEUE)) {
+	xenfb->up_rects[xenfb->up_count].x = x;
+	xenfb->up_rects[xenfb->up_count].y = y;
+	xenfb->up_rects[xenfb->up_count].w = w;
+	xenfb->up_rects[xenfb->up_count].h = h;
+	xenfb->up_count++;
+	return;
+    }
+
+    xenfb->rects_merged++;
+    ux = MIN(x, xenfb->up_rects[best].x);
+    uy = MIN(y, xenfb->up_rects[best].y);
+    uw = MAX(x + w, xenfb->up_rects[best].x + xenfb->up_rects[best].w) - ux;
+    uh = MAX(y + h, xenfb->up_rects[best].y + xenfb->up_rects[best].h) - uy;
+    if (uw == xenfb->width && uh > xenfb->height / 2) {
+	/* same as the scroll detector below */
+	xenfb->up_fullscreen = 1;
+	return;
+    }
+    xenfb->up_rects[best].x = ux;
+    xenfb->up_rects[best].y = uy;
+    xenfb->up_rects[best].w = uw;
+    xenfb->up_rects[best].h = uh;
+}
+
 #ifdef XENFB_TYPE_REFRESH_PERIOD
 static int xenfb_queue_full(struct XenFB *xenfb)
 {
@@ -687,6 +785,7 @@ static void xenfb_update(void *opaque)
     struct XenFB *xenfb = opaque;
     int i;
     struct DisplayChangeListener *l;
+    int64_t copy_start;
 
     if (!xenfb->width || !xenfb->height)
         return;
@@ -711,8 +810,19 @@ static void xenfb_update(void *opaque)
                     period = l->gui_timer_interval;
             }
         }
-        if (idle)
+        if (idle) {
             period = XENFB_NO_REFRESH;
+        } else {
+            /*
+             * Back off while the frontend has nothing to report and
+             * return to the client's rate as soon as updates show up.
+             */
+            if (xenfb->up_count || xenfb->up_fullscreen)
+                xenfb->idle_shift = 0;
+            else if (xenfb->idle_shift < REFRESH_IDLE_SHIFT_MAX)
+                xenfb->idle_shift++;
+            period <<= xenfb->idle_shift;
+        }
 
 	if (xenfb->refresh_period != period) {
 	    xenfb_send_refresh_period(xenfb, period);
@@ -754,9 +864,11 @@ static void xenfb_update(void *opaque)
     }
 
     /* run queued updates */
+    copy_start = qemu_get_clock(vm_clock);
     if (xenfb->up_fullscreen) {
 	xen_be_printf(&xenfb->c.xendev, 3, "update: fullscreen\n");
 	xenfb_guest_copy(xenfb, 0, 0, xenfb->width, xenfb->height);
+	xenfb->fullscreen_frames++;
     } else if (xenfb->up_count) {
 	xen_be_printf(&xenfb->c.xendev, 3, "update: %d rects\n", xenfb->up_count);
 	for (i = 0; i < xenfb->up_count; i++)
@@ -768,10 +880,37 @@ static void xenfb_update(void *opaque)
     } else {
 	xen_be_printf(&xenfb->c.xendev, 3, "update: nothing\n");
     }
+    if (xenfb->up_fullscreen || xenfb->up_count) {
+	int64_t delta = qemu_get_clock(vm_clock) - copy_start;
+
+	xenfb->frames++;
+	xenfb->copy_time += delta;
+	if (delta > xenfb->copy_time_max)
+	    xenfb->copy_time_max = delta;
+    }
     xenfb->up_count = 0;
     xenfb->up_fullscreen = 0;
 }
 
+void xenfb_info(void)
+{
+    struct XenFB *xenfb;
+
+    LIST_FOREACH(xenfb, &xenfbs, list) {
+	term_printf("%s: %dx%dx%d refresh %d ms%s\n",
+		    xenfb->c.xendev.name, xenfb->width, xenfb->height,
+		    xenfb->depth, xenfb->refresh_period,
+		    xenfb->idle_shift ? " (idle)" : "");
+	term_printf("  frames %" PRIu64 " (%" PRIu64 " fullscreen)"
+		    " rects %" PRIu64 " (%" PRIu64 " merged)\n",
+		    xenfb->frames, xenfb->fullscreen_frames,
+		    xenfb->rects_queued, xenfb->rects_merged);
+	term_printf("  copy time avg %" PRId64 " us max %" PRId64 " us\n",
+		    xenfb->frames ? xenfb->copy_time / xenfb->frames / 1000 : 0,
+		    xenfb->copy_time_max / 1000);
+    }
+}
+
 /* QEMU display state changed, so refresh the framebuffer copy */
 static void xenfb_invalidate(void *opaque)
 {
@@ -794,8 +933,6 @@ static void xenfb_handle_events(struct XenFB *xenfb)
 
 	switch (event->type) {
 	case XENFB_TYPE_UPDATE:
-	    if (xenfb->up_count == UP_QUEUE)
-		xenfb->up_fullscreen = 1;
 	    if (xenfb->up_fullscreen)
 		break;
 	    x = MAX(event->update.x, 0);
@@ -818,11 +955,7 @@ static void xenfb_handle_events(struct XenFB *xenfb)
 		 * don't bother keeping track of the rectangles then */
 		xenfb->up_fullscreen = 1;
 	    } else {
-		xenfb->up_rects[xenfb->up_count].x = x;
-		xenfb->up_rects[xenfb->up_count].y = y;
-		xenfb->up_rects[xenfb->up_count].w = w;
-		xenfb->up_rects[xenfb->up_count].h = h;
-		xenfb->up_count++;
+		xenfb_queue_rect(xenfb, x, y, w, h);
 	    }
 	    break;
 #ifdef XENFB_TYPE_RESIZE
@@ -849,6 +982,7 @@ static int fb_init(struct XenDevice *xendev)
     struct XenFB *fb = container_of(xendev, struct XenFB, c.xendev);
 
     fb->refresh_period = -1;
+    LIST_INSERT_HEAD(&xenfbs, fb, list);
 
 #ifdef XENFB_TYPE_RESIZE
     xenstore_write_be_int(xendev, "feature-resize", 1);
@@ -909,6 +1043,14 @@ static void fb_disconnect(struct XenDevice *xendev)
     fb->bug_trigger    = 0;
 }
 
+static int fb_free(struct XenDevice *xendev)
+{
+    struct XenFB *fb = container_of(xendev, struct XenFB, c.xendev);
+
+    LIST_REMOVE(fb, list);
+    return 0;
+}
+
 static void fb_frontend_changed(struct XenDevice *xendev, const char *node)
 {
     struct XenFB *fb = container_of(xendev, struct XenFB, c.xendev);
@@ -951,6 +1093,7 @@ struct XenDevOps xen_framebuffer_ops = {
     .connect    = fb_connect,
     .disconnect = fb_disconnect,
     .event      = fb_event,
+    .free       = fb_free,
     .frontend_changed = fb_frontend_changed,
 };
 
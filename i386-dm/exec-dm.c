@@ -456,6 +456,116 @@ void unregister_iomem(target_phys_addr_t start)
 unsigned long *logdirty_bitmap;
 unsigned long logdirty_bitmap_size;
 
+#ifdef CONFIG_STUBDOM
+/*
+ * Every xc_hvm_modified_memory() is a hypercall, so collect the ranges
+ * dirtied while handling one batch of events and report them together
+ * from a bottom half.  Adjacent and overlapping ranges are merged.
+ */
+#define LOGDIRTY_PENDING_MAX 64
+
+static struct {
+    unsigned long first_pfn;
+    unsigned long nr;
+} logdirty_pending[LOGDIRTY_PENDING_MAX];
+static int logdirty_nr_pending;
+static QEMUBH *logdirty_bh;
+
+void cpu_physical_memory_flush_dirty(void)
+{
+    int i;
+
+    if (logdirty_bitmap != NULL)
+        for (i = 0; i < logdirty_nr_pending; i++)
+            xc_hvm_modified_memory(xc_handle, domid,
+                                   logdirty_pending[i].first_pfn,
+                                   logdirty_pending[i].nr);
+    logdirty_nr_pending = 0;
+}
+
+static void logdirty_bh_cb(void *opaque)
+{
+    cpu_physical_memory_flush_dirty();
+}
+
+static void logdirty_add(unsigned long first_pfn, unsigned long nr)
+{
+    int i;
+
+    for (i = 0; i < logdirty_nr_pending; i++) {
+        unsigned long start = logdirty_pending[i].first_pfn;
+        unsigned long end = start + logdirty_pending[i].nr;
+
+        if (first_pfn <= end && first_pfn + nr >= start) {
+            if (first_pfn < start)
+                start = first_pfn;
+            if (first_pfn + nr > end)
+                end = first_pfn + nr;
+            logdirty_pending[i].first_pfn = start;
+            logdirty_pending[i].nr = end - start;
+            return;
+        }
+    }
+
+    if (logdirty_nr_pending == LOGDIRTY_PENDING_MAX)
+        cpu_physical_memory_flush_dirty();
+    logdirty_pending[logdirty_nr_pending].first_pfn = first_pfn;
+    logdirty_pending[logdirty_nr_pending].nr = nr;
+    logdirty_nr_pending++;
+
+    if (!logdirty_bh)
+        logdirty_bh = qemu_bh_new(logdirty_bh_cb, NULL);
+    qemu_bh_schedule(logdirty_bh);
+}
+#else
+void cpu_physical_memory_flush_dirty(void)
+{
+}
+#endif
+
+/* Record that the device model wrote [addr, addr + len) of guest memory,
+ * so that a concurrent live migration sends those pages again. */
+void cpu_physical_memory_set_dirty_range(target_phys_addr_t addr,
+                                         target_phys_addr_t len)
+{
+    unsigned long pfn, end;
+
+    if (logdirty_bitmap == NULL || len == 0)
+        return;
+
+    pfn = addr >> TARGET_PAGE_BITS;
+    end = (addr + len + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS;
+
+#ifdef CONFIG_STUBDOM
+    logdirty_add(pfn, end - pfn);
+#else
+    if (end > logdirty_bitmap_size * 8) {
+        fprintf(logfile, "dirtying pfn %lx >= bitmap size %lx\n",
+                end - 1, logdirty_bitmap_size * 8);
+        if (pfn >= logdirty_bitmap_size * 8)
+            return;
+        end = logdirty_bitmap_size * 8;
+    }
+
+    /* leading partial word */
+    while (pfn < end && (pfn % HOST_LONG_BITS) != 0) {
+        logdirty_bitmap[pfn / HOST_LONG_BITS] |= 1UL << pfn % HOST_LONG_BITS;
+        pfn++;
+    }
+    /* whole words */
+    if (end - pfn >= HOST_LONG_BITS) {
+        memset(&logdirty_bitmap[pfn / HOST_LONG_BITS], 0xff,
+               (end - pfn) / HOST_LONG_BITS * sizeof(unsigned long));
+        pfn += (end - pfn) & ~(HOST_LONG_BITS - 1);
+    }
+    /* trailing partial word */
+    while (pfn < end) {
+        logdirty_bitmap[pfn / HOST_LONG_BITS] |= 1UL << pfn % HOST_LONG_BITS;
+        pfn++;
+    }
+#endif
+}
+
 /*
  * Replace the standard byte memcpy with a word memcpy for appropriately sized
  * memory copy operations.  Some users (USB-UHCI) can not tolerate the possible
@@ -526,6 +636,7 @@ void cpu_physical_memory_rw(target_phys_addr_t _addr, uint8_t *buf,
     int l, io_index;
     uint8_t *ptr;
     uint32_t val;
+    target_phys_addr_t dirty_addr = 0, dirty_len = 0;
 
     mapcache_lock();
 
@@ -557,19 +668,13 @@ void cpu_physical_memory_rw(target_phys_addr_t _addr, uint8_t *buf,
             } else if ((ptr = phys_ram_addr(addr)) != NULL) {
                 /* Writing to RAM */
                 memcpy_words(ptr, buf, l);
-#ifndef CONFIG_STUBDOM
-                if (logdirty_bitmap != NULL) {
-                    /* Record that we have dirtied this frame */
-                    unsigned long pfn = addr >> TARGET_PAGE_BITS;
-                    if (pfn / 8 >= logdirty_bitmap_size) {
-                        fprintf(logfile, "dirtying pfn %lx >= bitmap "
-                                "size %lx\n", pfn, logdirty_bitmap_size * 8);
-                    } else {
-                        logdirty_bitmap[pfn / HOST_LONG_BITS]
-                            |= 1UL << pfn % HOST_LONG_BITS;
-                    }
+                /* Dirty contiguous runs of RAM in one go */
+                if (dirty_addr + dirty_len != addr) {
+                    cpu_physical_memory_set_dirty_range(dirty_addr, dirty_len);
+                    dirty_addr = addr;
+                    dirty_len = 0;
                 }
-#endif
+                dirty_len += l;
 #ifdef __ia64__
                 sync_icache(ptr, l);
 #endif 
@@ -605,12 +710,7 @@ void cpu_physical_memory_rw(target_phys_addr_t _addr, uint8_t *buf,
         addr += l;
     }
 
-#ifdef CONFIG_STUBDOM
-    if (logdirty_bitmap != NULL)
-        xc_hvm_modified_memory(xc_handle, domid, _addr >> TARGET_PAGE_BITS,
-                ((_addr + _len + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS)
-                    - (_addr >> TARGET_PAGE_BITS));
-#endif
+    cpu_physical_memory_set_dirty_range(dirty_addr, dirty_len);
 
     mapcache_unlock();
 }
@@ -732,7 +832,6 @@ void dump_exec_info(FILE *f,
 void monitor_disas(CPUState *env,
                    target_ulong pc, int nb_insn, int is_physical, int flags) {
 }
-void irq_info(void) { }
 void pic_info(void) { }
 
 
@@ -815,6 +914,10 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
 void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
                                int is_write, target_phys_addr_t access_len)
 {
+    target_phys_addr_t addr;
+
+    if (is_write && access_len && qemu_map_cache_paddr(buffer, &addr) == 0)
+        cpu_physical_memory_set_dirty_range(addr, access_len);
     qemu_invalidate_entry(buffer);
     cpu_notify_map_clients();
 }
@@ -58,6 +58,7 @@
 #include "console.h"
 #include "qemu-timer.h"
 #include "sysemu.h"
+#include "block.h"
 #include "qemu-xen.h"
 
 //#define DEBUG_MMU
@@ -109,6 +110,14 @@ int send_vcpu = 0;
 #define NR_CPUS 32
 evtchn_port_t ioreq_local_port[NR_CPUS];
 
+/* Responses held back with xen_ioreq_delay(), one per vcpu */
+static ioreq_t *delayed_ioreq[NR_CPUS];
+static QEMUTimer *delayed_ioreq_timer[NR_CPUS];
+static int ioreq_delayable;
+static int64_t ioreq_delay_expire;
+/* set while the state is being saved, nothing may be held back then */
+static int ioreq_delay_disabled;
+
 CPUX86State *cpu_x86_init(const char *cpu_model)
 {
     CPUX86State *env;
@@ -499,6 +508,55 @@ static void handle_buffered_io(void *opaque)
 		   qemu_get_clock(rt_clock));
 }
 
+/* Hold back the response to the ioreq being handled until rt_clock
+   reaches 'expire'.  Only the vcpu that issued it waits.  Returns 0 if
+   the request cannot be delayed (buffered I/O). */
+int xen_ioreq_delay(int64_t expire)
+{
+    if (!ioreq_delayable)
+        return 0;
+    if (expire > ioreq_delay_expire)
+        ioreq_delay_expire = expire;
+    return 1;
+}
+
+static void cpu_ioreq_respond(int vcpu, ioreq_t *req)
+{
+    req->state = STATE_IORESP_READY;
+    xc_evtchn_notify(xce_handle, ioreq_local_port[vcpu]);
+}
+
+static void cpu_ioreq_delayed(void *opaque)
+{
+    int vcpu = (long)opaque;
+
+    if (delayed_ioreq[vcpu]) {
+        cpu_ioreq_respond(vcpu, delayed_ioreq[vcpu]);
+        delayed_ioreq[vcpu] = NULL;
+    }
+}
+
+static void cpu_ioreq_flush_delayed(void)
+{
+    int i;
+
+    for (i = 0; i < vcpus; i++) {
+        if (delayed_ioreq_timer[i])
+            qemu_del_timer(delayed_ioreq_timer[i]);
+        cpu_ioreq_delayed((void *)(long)i);
+    }
+}
+
+static int cpu_ioreq_delayed_pending(void)
+{
+    int i;
+
+    for (i = 0; i < vcpus; i++)
+        if (delayed_ioreq[i])
+            return 1;
+    return 0;
+}
+
 static void cpu_handle_ioreq(void *opaque)
 {
     extern int shutdown_requested;
@@ -507,7 +565,10 @@ static void cpu_handle_ioreq(void *opaque)
 
     __handle_buffered_iopage(env);
     if (req) {
+        ioreq_delay_expire = 0;
+        ioreq_delayable = !ioreq_delay_disabled;
         __handle_ioreq(env, req);
+        ioreq_delayable = 0;
 
         if (req->state != STATE_IOREQ_INPROCESS) {
             fprintf(logfile, "Badness in I/O request ... not in service?!: "
@@ -530,6 +591,7 @@ static void cpu_handle_ioreq(void *opaque)
         if (vm_running) {
             if (qemu_shutdown_requested()) {
 		fprintf(logfile, "shutdown requested in cpu_handle_ioreq\n");
+		bdrv_flush_all();
 		destroy_hvm_domain();
 	    }
 	    if (qemu_reset_requested()) {
@@ -538,8 +600,17 @@ static void cpu_handle_ioreq(void *opaque)
 	    }
 	}
 
-        req->state = STATE_IORESP_READY;
-        xc_evtchn_notify(xce_handle, ioreq_local_port[send_vcpu]);
+        if (ioreq_delay_expire) {
+            if (!delayed_ioreq_timer[send_vcpu])
+                delayed_ioreq_timer[send_vcpu] =
+                    qemu_new_timer(rt_clock, cpu_ioreq_delayed,
+                                   (void *)(long)send_vcpu);
+            delayed_ioreq[send_vcpu] = req;
+            qemu_mod_timer(delayed_ioreq_timer[send_vcpu], ioreq_delay_expire);
+            return;
+        }
+
+        cpu_ioreq_respond(send_vcpu, req);
     }
 }
 
@@ -567,15 +638,21 @@ int main_loop(void)
 
     while (1) {
         while (!(vm_running && xen_pause_requested))
-            /* Wait up to 10 msec. */
-            main_loop_wait(10);
+            /* Sleep until the next timer deadline or I/O event. */
+            main_loop_wait(qemu_calculate_timeout());
 
         fprintf(logfile, "device model saving state\n");
 
-        /* Pull all outstanding ioreqs through the system */
+        /* Pull all outstanding ioreqs through the system.  Responses
+           are no longer held back, so none can be pending in the saved
+           state, whether delayed earlier or during the wait below. */
+        ioreq_delay_disabled = 1;
         handle_buffered_pio();
         handle_buffered_io(env);
+        cpu_ioreq_flush_delayed();
         main_loop_wait(1); /* For the select() on events */
+        assert(!cpu_ioreq_delayed_pending());
+        cpu_physical_memory_flush_dirty();
 
         /* Save the device state */
         asprintf(&qemu_file, "/var/lib/xen/qemu-save.%d", domid);
@@ -592,6 +669,7 @@ int main_loop(void)
                 xenstore_process_event(NULL);
         }
 
+        ioreq_delay_disabled = 0;
         xenstore_record_dm_state("running");
     }
 
@@ -25,11 +25,29 @@
 
 #include "hw.h"
 #include "pc.h"
+#include "console.h"
 
 #include <xen/hvm/ioreq.h>
 #include <stdio.h>
 
+#define ISA_NUM_IRQS 16
+
+/* Last level handed to Xen for each line, -1 until the first change */
+static int8_t isa_irq_level[ISA_NUM_IRQS];
+static uint64_t isa_irq_hypercalls[ISA_NUM_IRQS];
+static uint64_t isa_irq_suppressed[ISA_NUM_IRQS];
+
 static void i8259_set_irq(void *opaque, int irq, int level) {
+    level = !!level;
+
+    /* Xen latches the line, so only transitions need a hypercall */
+    if (isa_irq_level[irq] == level) {
+        isa_irq_suppressed[irq]++;
+        return;
+    }
+    isa_irq_level[irq] = level;
+    isa_irq_hypercalls[irq]++;
+
     xc_hvm_set_isa_irq_level(xc_handle, domid, irq, level);
 }
 
@@ -38,15 +56,26 @@ qemu_irq *i8259_init(qemu_irq parent_irq)
       * hw/pc.c:pic_irq_request
       */
 {
-    return qemu_allocate_irqs(i8259_set_irq, 0, 16);
+    memset(isa_irq_level, -1, sizeof(isa_irq_level));
+    return qemu_allocate_irqs(i8259_set_irq, 0, ISA_NUM_IRQS);
 }
 
-#if 0
 void irq_info(void)
 {
-    term_printf("irq statistics not supported with Xen.\n");
+    int i;
+
+    term_printf("ISA IRQ level hypercalls suppressed\n");
+    for (i = 0; i < ISA_NUM_IRQS; i++) {
+        if (!isa_irq_hypercalls[i] && !isa_irq_suppressed[i])
+            continue;
+        term_printf("%7d %5d %10" PRIu64 " %10" PRIu64 "\n", i,
+                    isa_irq_level[i], isa_irq_hypercalls[i],
+                    isa_irq_suppressed[i]);
+    }
+    i440fx_intx_info();
 }
 
+#if 0
 void pic_info(void)
 {
     term_printf("pic_info not supported with Xen .\n");
@@ -0,0 +1,305 @@
+/*
+ * File descriptor handlers of the main loop
+ *
+ * Copyright (c) 2003-2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu_socket.h"
+
+#if defined(__linux__) && !defined(CONFIG_STUBDOM)
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
+typedef struct IOHandlerRecord {
+    int fd;
+    IOCanRWHandler *fd_read_poll;
+    IOHandler *fd_read;
+    IOHandler *fd_write;
+    int deleted;
+    void *opaque;
+    struct IOHandlerRecord *next;
+#ifdef USE_EPOLL
+    uint32_t events;            /* events registered with io_epoll_fd */
+    int polled;                 /* on the first_polled_io_handler list */
+    struct IOHandlerRecord *poll_next;
+#endif
+} IOHandlerRecord;
+
+static IOHandlerRecord *first_io_handler;
+static int io_handlers_deleted;
+
+#ifdef USE_EPOLL
+/* Handlers stay registered with epoll between iterations, so an idle
+   iteration costs nothing per fd.  Only handlers with an fd_read_poll
+   callback are visited every time, and their registration is changed
+   only when the callback's answer changes.  select() is used instead
+   when epoll is unavailable, when it refuses one of the fds (regular
+   files) or while slirp needs its fd_sets. */
+static int io_epoll_fd = -1;
+static int io_epoll_disabled;
+static IOHandlerRecord *first_polled_io_handler;
+
+static void io_epoll_disable(void)
+{
+    close(io_epoll_fd);
+    io_epoll_fd = -1;
+    io_epoll_disabled = 1;
+}
+
+/* Bring the epoll registration of ioh in line with its handlers.  With
+   force, the registration is renewed even if the events are unchanged:
+   the fd may have been closed and reopened under the same number since
+   it was registered, and epoll drops closed fds by itself. */
+static void io_handler_update(IOHandlerRecord *ioh, int readable, int force)
+{
+    struct epoll_event ev;
+    uint32_t events = 0;
+    int op;
+
+    if (!ioh->deleted) {
+        if (ioh->fd_read && readable)
+            events |= EPOLLIN;
+        if (ioh->fd_write)
+            events |= EPOLLOUT;
+    }
+    if (io_epoll_fd < 0 || (events == ioh->events && !force))
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ioh;
+    if (!events) {
+        /* fails harmlessly if the fd is already closed */
+        if (ioh->events)
+            epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, ioh->fd, &ev);
+        ioh->events = 0;
+        return;
+    }
+
+    /* Our idea of the registration is only a guess after a close: try
+       the other operation when epoll disagrees with it. */
+    op = ioh->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(io_epoll_fd, op, ioh->fd, &ev) < 0) {
+        if (errno == ENOENT)
+            op = EPOLL_CTL_ADD;
+        else if (errno == EEXIST)
+            op = EPOLL_CTL_MOD;
+        else
+            op = -1;
+        if (op < 0 || epoll_ctl(io_epoll_fd, op, ioh->fd, &ev) < 0) {
+            io_epoll_disable();
+            return;
+        }
+    }
+    ioh->events = events;
+}
+
+static void io_handler_set_polled(IOHandlerRecord *ioh, int polled)
+{
+    IOHandlerRecord **pioh;
+
+    if (ioh->polled == polled)
+        return;
+    if (polled) {
+        ioh->poll_next = first_polled_io_handler;
+        first_polled_io_handler = ioh;
+    } else {
+        for (pioh = &first_polled_io_handler; *pioh != ioh;
+             pioh = &(*pioh)->poll_next)
+            ;
+        *pioh = ioh->poll_next;
+    }
+    ioh->polled = polled;
+}
+
+static void io_epoll_init(void)
+{
+    IOHandlerRecord *ioh;
+
+    io_epoll_fd = epoll_create(64);
+    if (io_epoll_fd < 0) {
+        io_epoll_disabled = 1;
+        return;
+    }
+    for (ioh = first_io_handler; ioh != NULL && io_epoll_fd >= 0;
+         ioh = ioh->next)
+        io_handler_update(ioh, !ioh->fd_read_poll, 1);
+}
+#endif
+
+/* XXX: fd_read_poll should be suppressed, but an API change is
+   necessary in the character devices to suppress fd_can_read(). */
+int qemu_set_fd_handler2(int fd,
+                         IOCanRWHandler *fd_read_poll,
+                         IOHandler *fd_read,
+                         IOHandler *fd_write,
+                         void *opaque)
+{
+    IOHandlerRecord **pioh, *ioh;
+
+    if (!fd_read && !fd_write) {
+        pioh = &first_io_handler;
+        for(;;) {
+            ioh = *pioh;
+            if (ioh == NULL)
+                break;
+            if (ioh->fd == fd) {
+                ioh->deleted = 1;
+                io_handlers_deleted++;
+#ifdef USE_EPOLL
+                io_handler_update(ioh, 0, 0);
+                io_handler_set_polled(ioh, 0);
+#endif
+                break;
+            }
+            pioh = &ioh->next;
+        }
+    } else {
+        for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+            if (ioh->fd == fd)
+                goto found;
+        }
+        ioh = qemu_mallocz(sizeof(IOHandlerRecord));
+        ioh->next = first_io_handler;
+        first_io_handler = ioh;
+    found:
+        ioh->fd = fd;
+        ioh->fd_read_poll = fd_read_poll;
+        ioh->fd_read = fd_read;
+        ioh->fd_write = fd_write;
+        ioh->opaque = opaque;
+        ioh->deleted = 0;
+#ifdef USE_EPOLL
+        /* polled handlers are armed for reading by qemu_iohandler_epoll() */
+        io_handler_set_polled(ioh, fd_read_poll != NULL);
+        io_handler_update(ioh, fd_read_poll ? ioh->events & EPOLLIN : 1, 1);
+#endif
+    }
+    return 0;
+}
+
+int qemu_set_fd_handler(int fd,
+                        IOHandler *fd_read,
+                        IOHandler *fd_write,
+                        void *opaque)
+{
+    return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
+}
+
+/* free the records of removed handlers, none is being run */
+static void qemu_iohandler_reap(void)
+{
+    IOHandlerRecord **pioh, *ioh;
+
+    if (!io_handlers_deleted)
+        return;
+    pioh = &first_io_handler;
+    while (*pioh) {
+        ioh = *pioh;
+        if (ioh->deleted) {
+            *pioh = ioh->next;
+            qemu_free(ioh);
+        } else
+            pioh = &ioh->next;
+    }
+    io_handlers_deleted = 0;
+}
+
+#ifdef USE_EPOLL
+#define IO_EPOLL_EVENTS 64
+
+int qemu_iohandler_epoll(int timeout)
+{
+    struct epoll_event events[IO_EPOLL_EVENTS];
+    IOHandlerRecord *ioh;
+    int i, ret;
+
+    if (io_epoll_fd < 0 && !io_epoll_disabled)
+        io_epoll_init();
+    for (ioh = first_polled_io_handler; ioh != NULL; ioh = ioh->poll_next)
+        io_handler_update(ioh, ioh->fd_read_poll(ioh->opaque) != 0, 0);
+    if (io_epoll_fd < 0)
+        return -1;
+
+    ret = epoll_wait(io_epoll_fd, events, IO_EPOLL_EVENTS, timeout);
+    for (i = 0; i < ret; i++) {
+        ioh = events[i].data.ptr;
+        /* records are only freed below, so ioh is still valid here */
+        if (!ioh->deleted && ioh->fd_read &&
+            (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            ioh->fd_read(ioh->opaque);
+        }
+        if (!ioh->deleted && ioh->fd_write &&
+            (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+            ioh->fd_write(ioh->opaque);
+        }
+    }
+    qemu_iohandler_reap();
+
+    return ret > 0;
+}
+#else
+int qemu_iohandler_epoll(int timeout)
+{
+    return -1;
+}
+#endif
+
+void qemu_iohandler_fill(int *pnfds, fd_set *rfds, fd_set *wfds)
+{
+    IOHandlerRecord *ioh;
+
+    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+        if (ioh->deleted)
+            continue;
+        if (ioh->fd_read &&
+            (!ioh->fd_read_poll ||
+             ioh->fd_read_poll(ioh->opaque) != 0)) {
+            FD_SET(ioh->fd, rfds);
+            if (ioh->fd > *pnfds)
+                *pnfds = ioh->fd;
+        }
+        if (ioh->fd_write) {
+            FD_SET(ioh->fd, wfds);
+            if (ioh->fd > *pnfds)
+                *pnfds = ioh->fd;
+        }
+    }
+}
+
+void qemu_iohandler_poll(fd_set *rfds, fd_set *wfds, int ret)
+{
+    IOHandlerRecord *ioh;
+
+    if (ret > 0) {
+        for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, rfds)) {
+                ioh->fd_read(ioh->opaque);
+            }
+            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, wfds)) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+    }
+    qemu_iohandler_reap();
+}
@@ -39,6 +39,9 @@
 #include "qemu-timer.h"
 #include "migration.h"
 #include "kvm.h"
+#ifdef CONFIG_DM
+#include "qemu-xen.h"
+#endif
 
 //#define DEBUG
 //#define DEBUG_COMPLETION
@@ -214,18 +217,60 @@ static void do_help(const char *name)
     help_cmd(name);
 }
 
-static void do_commit(const char *device)
+static void do_commit(int detach, const char *device)
+{
+    int i, all_devices, ret;
+    BlockDriverState *bs;
+
+    all_devices = !strcmp(device, "all");
+    for (i = 0; i < nb_drives; i++) {
+            bs = drives_table[i].bdrv;
+            if (!all_devices && strcmp(bdrv_get_device_name(bs), device))
+                continue;
+            if (detach)
+                ret = bdrv_commit_start(bs);
+            else
+                ret = bdrv_commit(bs);
+            /* "all" skips drives without a backing file */
+            if (ret < 0 && !(all_devices && ret == -ENOTSUP))
+                term_printf("%s: commit failed: %s\n",
+                            bdrv_get_device_name(bs), strerror(-ret));
+    }
+}
+
+static void do_commit_cancel(const char *device)
 {
     int i, all_devices;
+    BlockDriverState *bs;
 
     all_devices = !strcmp(device, "all");
     for (i = 0; i < nb_drives; i++) {
-            if (all_devices ||
-                !strcmp(bdrv_get_device_name(drives_table[i].bdrv), device))
-                bdrv_commit(drives_table[i].bdrv);
+            bs = drives_table[i].bdrv;
+            if (all_devices || !strcmp(bdrv_get_device_name(bs), device))
+                bdrv_commit_cancel(bs);
     }
 }
 
+static void do_commit_set_speed(const char *value)
+{
+    double d;
+    char *ptr;
+
+    d = strtod(value, &ptr);
+    switch (*ptr) {
+    case 'G': case 'g':
+        d *= 1024;
+    case 'M': case 'm':
+        d *= 1024;
+    case 'K': case 'k':
+        d *= 1024;
+    default:
+        break;
+    }
+
+    bdrv_commit_set_speed((int64_t)d);
+}
+
 static void do_info(const char *item)
 {
     const term_cmd_t *cmd;
@@ -282,6 +327,16 @@ static void do_info_blockstats(void)
     bdrv_info_stats();
 }
 
+static void do_info_blocklatency(void)
+{
+    bdrv_info_latency();
+}
+
+static void do_info_commit(void)
+{
+    bdrv_info_commit();
+}
+
 /* get the current CPU defined by the user */
 static int mon_set_cpu(int cpu_index)
 {
@@ -1477,8 +1532,12 @@ static void do_info_balloon(void)
 static const term_cmd_t term_cmds[] = {
     { "help|?", "s?", do_help,
       "[cmd]", "show the help" },
-    { "commit", "s", do_commit,
-      "device|all", "commit changes to the disk images (if -snapshot is used) or backing files" },
+    { "commit", "-ds", do_commit,
+      "[-d] device|all", "commit changes to the disk images (if -snapshot is used) or backing files (using -d to commit in the background)" },
+    { "commit_cancel", "s", do_commit_cancel,
+      "device|all", "cancel background commits" },
+    { "commit_set_speed", "s", do_commit_set_speed,
+      "value", "set maximum speed (in bytes) for background commits" },
     { "info", "s?", do_info,
       "subcommand", "show various information about the system state" },
     { "q|quit", "", do_quit,
@@ -1598,6 +1657,10 @@ static const term_cmd_t info_cmds[] = {
       "", "show the block devices" },
     { "blockstats", "", do_info_blockstats,
       "", "show block device statistics" },
+    { "blocklatency", "", do_info_blocklatency,
+      "", "show block device latency histograms" },
+    { "commit", "", do_info_commit,
+      "", "show the progress of background commits" },
     { "registers", "", do_info_registers,
       "", "show the cpu registers" },
     { "cpus", "", do_info_cpus,
@@ -1630,6 +1693,8 @@ static const term_cmd_t info_cmds[] = {
       "", "show guest USB devices", },
     { "usbhost", "", usb_host_info,
       "", "show host USB devices", },
+    { "usbhc", "", usb_controller_info,
+      "", "show USB host controller frame statistics", },
     { "profile", "", do_info_profile,
       "", "show profiling information", },
     { "capture", "", do_info_capture,
@@ -1652,6 +1717,8 @@ static const term_cmd_t info_cmds[] = {
     { "cpustats", "", do_info_cpu_stats,
       "", "show CPU statistics", },
 #endif
+    { "wakeups", "", do_info_wakeups,
+      "", "show main loop wakeup statistics", },
 #if defined(CONFIG_SLIRP)
     { "slirp", "", do_info_slirp,
       "", "show SLIRP statistics", },
@@ -1659,6 +1726,16 @@ static const term_cmd_t info_cmds[] = {
     { "migrate", "", do_info_migrate, "", "show migration status" },
     { "balloon", "", do_info_balloon,
       "", "show balloon information" },
+#ifdef CONFIG_DM
+    { "xenlog", "", xen_platform_log_info,
+      "", "show guest log throttling statistics" },
+    { "xenfb", "", xenfb_info,
+      "", "show PV framebuffer update statistics" },
+#endif
+#ifdef CONFIG_PASSTHROUGH
+    { "pt", "", pt_info,
+      "", "show passthrough device statistics" },
+#endif
     { NULL, NULL, },
 };
 
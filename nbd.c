@@ -52,8 +52,6 @@
 
 /* This is all part of the "official" NBD API */
 
-#define NBD_REQUEST_MAGIC       0x25609513
-#define NBD_REPLY_MAGIC         0x67446698
 
 #define NBD_SET_SOCK            _IO(0xab, 0)
 #define NBD_SET_BLKSIZE         _IO(0xab, 1)
@@ -298,19 +296,10 @@ int nbd_negotiate(int csock, off_t size)
 	return 0;
 }
 
-int nbd_receive_negotiate(int csock, off_t *size, size_t *blocksize)
+int nbd_decode_negotiate(const uint8_t *buf, off_t *size, size_t *blocksize)
 {
-	char buf[8 + 8 + 8 + 128];
 	uint64_t magic;
 
-	TRACE("Receiving negotation.");
-
-	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-		LOG("read failed");
-		errno = EINVAL;
-		return -1;
-	}
-
 	magic = be64_to_cpup((uint64_t*)(buf + 8));
 	*size = be64_to_cpup((uint64_t*)(buf + 16));
 	*blocksize = 1024;
@@ -343,6 +332,21 @@ int nbd_receive_negotiate(int csock, off_t *size, size_t *blocksize)
         return 0;
 }
 
+int nbd_receive_negotiate(int csock, off_t *size, size_t *blocksize)
+{
+	uint8_t buf[NBD_NEGOTIATE_SIZE];
+
+	TRACE("Receiving negotation.");
+
+	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+		LOG("read failed");
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nbd_decode_negotiate(buf, size, blocksize);
+}
+
 #ifndef _WIN32
 int nbd_init(int fd, int csock, off_t size, size_t blocksize)
 {
@@ -437,15 +441,20 @@ int nbd_client(int fd, int csock)
 }
 #endif
 
-int nbd_send_request(int csock, struct nbd_request *request)
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request)
 {
-	uint8_t buf[4 + 4 + 8 + 8 + 4];
-
 	cpu_to_be32w((uint32_t*)buf, NBD_REQUEST_MAGIC);
 	cpu_to_be32w((uint32_t*)(buf + 4), request->type);
 	cpu_to_be64w((uint64_t*)(buf + 8), request->handle);
 	cpu_to_be64w((uint64_t*)(buf + 16), request->from);
 	cpu_to_be32w((uint32_t*)(buf + 24), request->len);
+}
+
+int nbd_send_request(int csock, struct nbd_request *request)
+{
+	uint8_t buf[NBD_REQUEST_SIZE];
+
+	nbd_encode_request(buf, request);
 
 	TRACE("Sending request to client");
 
@@ -495,19 +504,10 @@ static int nbd_receive_request(int csock, struct nbd_request *request)
 	return 0;
 }
 
-int nbd_receive_reply(int csock, struct nbd_reply *reply)
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply)
 {
-	uint8_t buf[4 + 4 + 8];
 	uint32_t magic;
 
-	memset(buf, 0xAA, sizeof(buf));
-
-	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-		LOG("read failed");
-		errno = EINVAL;
-		return -1;
-	}
-
 	/* Reply
 	   [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
 	   [ 4 ..  7]    error   (0 == no error)
@@ -530,6 +530,21 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
 	return 0;
 }
 
+int nbd_receive_reply(int csock, struct nbd_reply *reply)
+{
+	uint8_t buf[NBD_REPLY_SIZE];
+
+	memset(buf, 0xAA, sizeof(buf));
+
+	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+		LOG("read failed");
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nbd_decode_reply(buf, reply);
+}
+
 static int nbd_send_reply(int csock, struct nbd_reply *reply)
 {
 	uint8_t buf[4 + 4 + 8];
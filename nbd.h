@@ -26,6 +26,15 @@
 #include <qemu-common.h>
 #include "block_int.h"
 
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_REPLY_MAGIC         0x67446698
+
+/* size of the request and reply headers on the wire */
+#define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
+#define NBD_REPLY_SIZE          (4 + 4 + 8)
+/* size of the greeting the server sends when a client connects */
+#define NBD_NEGOTIATE_SIZE      (8 + 8 + 8 + 128)
+
 struct nbd_request {
     uint32_t type;
     uint64_t handle;
@@ -51,8 +60,11 @@ int unix_socket_outgoing(const char *path);
 int unix_socket_incoming(const char *path);
 
 int nbd_negotiate(int csock, off_t size);
+int nbd_decode_negotiate(const uint8_t *buf, off_t *size, size_t *blocksize);
 int nbd_receive_negotiate(int csock, off_t *size, size_t *blocksize);
 int nbd_init(int fd, int csock, off_t size, size_t blocksize);
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request);
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply);
 int nbd_send_request(int csock, struct nbd_request *request);
 int nbd_receive_reply(int csock, struct nbd_reply *reply);
 int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
@@ -73,6 +73,14 @@ static void cond_signal(pthread_cond_t *cond)
     if (ret) die2(ret, "pthread_cond_signal");
 }
 
+static int64_t time_us(void)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
 static void thread_create(pthread_t *thread, pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg)
 {
@@ -80,6 +88,57 @@ static void thread_create(pthread_t *thread, pthread_attr_t *attr,
     if (ret) die2(ret, "pthread_create");
 }
 
+/*
+ * Transfer a whole iovec.  Short transfers are resumed where they
+ * stopped; a partly done element is finished with a plain pread/pwrite
+ * before going back to preadv/pwritev for the rest.
+ */
+static ssize_t aio_rw_vector(struct qemu_paiocb *aiocb)
+{
+    struct iovec *iov = aiocb->aio_iov;
+    int niov = aiocb->aio_niov;
+    size_t offset = 0, skip = 0;
+
+    while (niov > 0) {
+        ssize_t len;
+
+#ifdef HAVE_PREADV
+        if (skip == 0) {
+            if (aiocb->is_write)
+                len = pwritev(aiocb->aio_fildes, iov, niov,
+                              aiocb->aio_offset + offset);
+            else
+                len = preadv(aiocb->aio_fildes, iov, niov,
+                             aiocb->aio_offset + offset);
+        } else
+#endif
+        if (aiocb->is_write) {
+            len = pwrite(aiocb->aio_fildes, (char *)iov->iov_base + skip,
+                         iov->iov_len - skip, aiocb->aio_offset + offset);
+        } else {
+            len = pread(aiocb->aio_fildes, (char *)iov->iov_base + skip,
+                        iov->iov_len - skip, aiocb->aio_offset + offset);
+        }
+
+        if (len == -1 && errno == EINTR)
+            continue;
+        else if (len == -1)
+            return -errno;
+        else if (len == 0)
+            break;
+
+        offset += len;
+        skip += len;
+        while (niov > 0 && skip >= iov->iov_len) {
+            skip -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+    }
+
+    return offset;
+}
+
 static void *aio_thread(void *unused)
 {
     pid_t pid;
@@ -117,11 +176,17 @@ static void *aio_thread(void *unused)
 
         offset = 0;
         aiocb->active = 1;
+        aiocb->wait_us = time_us() - aiocb->submit_us;
+        if (aiocb->wait_us < 0)
+            aiocb->wait_us = 0;
 
         idle_threads--;
         mutex_unlock(&lock);
 
-        while (offset < aiocb->aio_nbytes) {
+        if (aiocb->aio_iov)
+            offset = aio_rw_vector(aiocb);
+
+        while (!aiocb->aio_iov && offset < aiocb->aio_nbytes) {
             ssize_t len;
 
             len = aiocb->function(aiocb->aio_fildes,
@@ -182,6 +247,8 @@ static int qemu_paio_submit(struct qemu_paiocb *aiocb, qemu_paio_function fn)
     aiocb->function = fn;
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    aiocb->wait_us = 0;
+    aiocb->submit_us = time_us();
     mutex_lock(&lock);
     if (idle_threads == 0 && cur_threads < max_threads)
         spawn_thread();
@@ -194,14 +261,28 @@ static int qemu_paio_submit(struct qemu_paiocb *aiocb, qemu_paio_function fn)
 
 int qemu_paio_read(struct qemu_paiocb *aiocb)
 {
+    aiocb->aio_iov = NULL;
     return qemu_paio_submit(aiocb, pread);
 }
 
 int qemu_paio_write(struct qemu_paiocb *aiocb)
 {
+    aiocb->aio_iov = NULL;
     return qemu_paio_submit(aiocb, (qemu_paio_function*)pwrite);
 }
 
+int qemu_paio_readv(struct qemu_paiocb *aiocb)
+{
+    aiocb->is_write = 0;
+    return qemu_paio_submit(aiocb, NULL);
+}
+
+int qemu_paio_writev(struct qemu_paiocb *aiocb)
+{
+    aiocb->is_write = 1;
+    return qemu_paio_submit(aiocb, NULL);
+}
+
 static ssize_t fsync_like_pwrite(int fd, void *buf,
                                  size_t count, off_t offset) {
     assert(count==1);
@@ -212,6 +293,7 @@ int qemu_paio_fsync(struct qemu_paiocb *aiocb)
 {
     assert(aiocb->aio_offset==0);
     assert(aiocb->aio_buf==0);
+    aiocb->aio_iov = NULL;
     aiocb->aio_nbytes = 1;
     return qemu_paio_submit(aiocb, fsync_like_pwrite);
 }
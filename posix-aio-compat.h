@@ -15,6 +15,7 @@
 #define QEMU_POSIX_AIO_COMPAT_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -31,15 +32,20 @@ struct qemu_paiocb
 {
     int aio_fildes;
     void *aio_buf;
+    struct iovec *aio_iov;      /* used instead of aio_buf by readv/writev */
+    int aio_niov;
     size_t aio_nbytes;
     int ev_signo;
     off_t aio_offset;
+    int64_t wait_us;            /* time queued before a thread picked it up */
 
     /* private */
     TAILQ_ENTRY(qemu_paiocb) node;
     qemu_paio_function *function;
+    int is_write;
     ssize_t ret;
     int active;
+    int64_t submit_us;
 };
 
 struct qemu_paioinit
@@ -52,6 +58,8 @@ struct qemu_paioinit
 int qemu_paio_init(struct qemu_paioinit *aioinit);
 int qemu_paio_read(struct qemu_paiocb *aiocb);
 int qemu_paio_write(struct qemu_paiocb *aiocb);
+int qemu_paio_readv(struct qemu_paiocb *aiocb);
+int qemu_paio_writev(struct qemu_paiocb *aiocb);
 int qemu_paio_error(struct qemu_paiocb *aiocb);
 int qemu_paio_fsync(struct qemu_paiocb *aiocb);
 ssize_t qemu_paio_return(struct qemu_paiocb *aiocb);
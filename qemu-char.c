@@ -144,6 +144,25 @@ int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+/* Returns the number of bytes written, stopping at the first short write */
+int qemu_chr_writev(CharDriverState *s, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, len = 0;
+
+    if (s->chr_writev)
+        return s->chr_writev(s, iov, iovcnt);
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0)
+            return len ? len : ret;
+        len += ret;
+        if (ret < iov[i].iov_len)
+            break;
+    }
+    return len;
+}
+
 int qemu_chr_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -484,6 +503,39 @@ int send_all(int fd, const void *buf, int len1)
 {
     return qemu_write(fd, buf, len1);
 }
+
+#ifndef CONFIG_STUBDOM
+/* send_all() for a vector of buffers, a single writev() in the common case */
+static int send_all_iov(int fd, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, len;
+    size_t off;
+
+    do {
+        len = writev(fd, iov, iovcnt);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0)
+        return -1;
+
+    /* finish a short write one buffer at a time */
+    off = len;
+    for (i = 0; i < iovcnt; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+        ret = send_all(fd, (uint8_t *)iov[i].iov_base + off,
+                       iov[i].iov_len - off);
+        if (ret <= 0)
+            break;
+        len += ret;
+        if (ret < iov[i].iov_len - off)
+            break;
+        off = 0;
+    }
+    return len;
+}
+#endif
 #endif /* !_WIN32 */
 
 #ifndef _WIN32
@@ -502,6 +554,15 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd_out, buf, len);
 }
 
+#ifndef CONFIG_STUBDOM
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    return send_all_iov(s->fd_out, iov, iovcnt);
+}
+#endif
+
 static int fd_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -576,6 +637,9 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     s->fd_out = fd_out;
     chr->opaque = s;
     chr->chr_write = fd_chr_write;
+#ifndef CONFIG_STUBDOM
+    chr->chr_writev = fd_chr_writev;
+#endif
     chr->chr_update_read_handler = fd_chr_update_read_handler;
     chr->chr_close = fd_chr_close;
 
@@ -806,6 +870,18 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd, buf, len);
 }
 
+static int pty_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        pty_chr_update_read_handler(chr);
+        return 0;
+    }
+    return send_all_iov(s->fd, iov, iovcnt);
+}
+
 static int pty_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -948,6 +1024,7 @@ static CharDriverState *qemu_chr_open_pty(void)
 
     chr->opaque = s;
     chr->chr_write = pty_chr_write;
+    chr->chr_writev = pty_chr_writev;
     chr->chr_update_read_handler = pty_chr_update_read_handler;
     chr->chr_close = pty_chr_close;
     chr->chr_getname = pty_chr_getname;
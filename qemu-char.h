@@ -45,6 +45,8 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     IOEventHandler *chr_event;
@@ -67,6 +69,7 @@ CharDriverState *qemu_chr_open(const char *label, const char *filename, void (*i
 void qemu_chr_close(CharDriverState *chr);
 void qemu_chr_printf(CharDriverState *s, const char *fmt, ...);
 int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len);
+int qemu_chr_writev(CharDriverState *s, const struct iovec *iov, int iovcnt);
 void qemu_chr_send_event(CharDriverState *s, int event);
 void qemu_chr_add_handlers(CharDriverState *s,
                            IOCanRWHandler *fd_can_read,
@@ -95,4 +98,12 @@ int qemu_set_fd_handler(int fd,
                         IOHandler *fd_write,
                         void *opaque);
 
+/* Wait up to timeout ms (forever if negative) for the handlers through
+   epoll and run the ready ones.  Returns whether any was ready, or -1
+   if epoll cannot be used and the caller must select() instead. */
+int qemu_iohandler_epoll(int timeout);
+/* Add the handlers' fds to sets for select(), then run the ready ones */
+void qemu_iohandler_fill(int *pnfds, fd_set *rfds, fd_set *wfds);
+void qemu_iohandler_poll(fd_set *rfds, fd_set *wfds, int ret);
+
 #endif
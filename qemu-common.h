@@ -206,6 +206,9 @@ void qemu_iovec_destroy(QEMUIOVector *qiov);
 void qemu_iovec_reset(QEMUIOVector *qiov);
 void qemu_iovec_to_buffer(QEMUIOVector *qiov, void *buf);
 void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count);
+void qemu_iovec_concat(QEMUIOVector *dst, QEMUIOVector *src,
+                       size_t soffset, size_t sbytes);
+void qemu_iovec_memset(QEMUIOVector *qiov, size_t offset, int c, size_t count);
 
 #endif /* dyngen-exec.h hack */
 
@@ -0,0 +1,77 @@
+/*
+ * Internals of the QEMU timers, shared by vl.c and qemu-timer.c
+ *
+ * Copyright (c) 2003-2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef QEMU_TIMER_INT_H
+#define QEMU_TIMER_INT_H
+
+#include <signal.h>
+#include "qemu-timer.h"
+
+#define QEMU_TIMER_REALTIME 0
+#define QEMU_TIMER_VIRTUAL  1
+
+struct QEMUClock {
+    int type;
+    /* XXX: add frequency */
+};
+
+struct QEMUTimer {
+    QEMUClock *clock;
+    int64_t expire_time;
+    uint64_t seq;       /* keeps timers with equal deadlines in FIFO order */
+    QEMUTimerCB *cb;
+    void *opaque;
+    int heap_pos;       /* index in the clock's heap plus one, 0 if idle */
+};
+
+/* Pending timers of one clock, kept as a binary min-heap on
+   (expire_time, seq) so that arming, re-arming and deleting a timer
+   are O(log n) and finding the next deadline is O(1). */
+typedef struct QEMUTimerHeap {
+    QEMUTimer **timers;
+    int count;
+    int size;
+    uint64_t seq;
+} QEMUTimerHeap;
+
+
+extern QEMUTimerHeap active_timers[2];
+
+/* Non-zero while a heap is being changed.  The alarm signal handler
+   must not look at the heaps then. */
+extern volatile sig_atomic_t qemu_timers_busy;
+
+static inline QEMUTimer *qemu_first_timer(int type)
+{
+    QEMUTimerHeap *h = &active_timers[type];
+
+    return h->count ? h->timers[0] : NULL;
+}
+
+QEMUClock *qemu_new_clock(int type);
+int qemu_run_timers(QEMUTimerHeap *h, int64_t current_time);
+
+/* Called when ts became the first timer of its clock (in vl.c) */
+void qemu_timer_first_changed(QEMUTimer *ts);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * QEMU timers
+ *
+ * Copyright (c) 2003-2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "qemu-common.h"
+#include "sysemu.h"
+#include "qemu-timer-int.h"
+
+QEMUClock *rt_clock;
+QEMUClock *vm_clock;
+
+QEMUTimerHeap active_timers[2];
+volatile sig_atomic_t qemu_timers_busy;
+
+/* Keeps the compiler from moving heap accesses out of the busy section */
+#define timers_barrier() asm volatile("" ::: "memory")
+
+static inline void timers_enter(void)
+{
+    qemu_timers_busy = 1;
+    timers_barrier();
+}
+
+static inline void timers_leave(void)
+{
+    timers_barrier();
+    qemu_timers_busy = 0;
+}
+
+static inline int qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+        (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static inline void timer_heap_set(QEMUTimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->timers[i] = ts;
+    ts->heap_pos = i + 1;
+}
+
+static void timer_heap_up(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+    int parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!qemu_timer_before(ts, h->timers[parent]))
+            break;
+        timer_heap_set(h, i, h->timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+static void timer_heap_down(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts = h->timers[i];
+    int child;
+
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count &&
+            qemu_timer_before(h->timers[child + 1], h->timers[child]))
+            child++;
+        if (!qemu_timer_before(h->timers[child], ts))
+            break;
+        timer_heap_set(h, i, h->timers[child]);
+        i = child;
+    }
+    timer_heap_set(h, i, ts);
+}
+
+/* restore the heap order after the key of the timer at i changed */
+static void timer_heap_fix(QEMUTimerHeap *h, int i)
+{
+    if (i > 0 && qemu_timer_before(h->timers[i], h->timers[(i - 1) / 2]))
+        timer_heap_up(h, i);
+    else
+        timer_heap_down(h, i);
+}
+
+static void timer_heap_insert(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    if (h->count == h->size) {
+        h->size = h->size ? h->size * 2 : 16;
+        h->timers = qemu_realloc(h->timers, h->size * sizeof(QEMUTimer *));
+    }
+    h->count++;
+    timer_heap_set(h, h->count - 1, ts);
+    timer_heap_up(h, h->count - 1);
+}
+
+static void timer_heap_remove(QEMUTimerHeap *h, QEMUTimer *ts)
+{
+    int i = ts->heap_pos - 1;
+    QEMUTimer *last;
+
+    ts->heap_pos = 0;
+    h->count--;
+    if (i == h->count)
+        return;
+    last = h->timers[h->count];
+    timer_heap_set(h, i, last);
+    timer_heap_fix(h, i);
+}
+
+QEMUClock *qemu_new_clock(int type)
+{
+    QEMUClock *clock;
+    clock = qemu_mallocz(sizeof(QEMUClock));
+    clock->type = type;
+    return clock;
+}
+
+QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+{
+    QEMUTimer *ts;
+
+    ts = qemu_mallocz(sizeof(QEMUTimer));
+    ts->clock = clock;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    return ts;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+    qemu_free(ts);
+}
+
+/* stop a timer, but do not dealloc it */
+void qemu_del_timer(QEMUTimer *ts)
+{
+    if (ts->heap_pos) {
+        timers_enter();
+        timer_heap_remove(&active_timers[ts->clock->type], ts);
+        timers_leave();
+    }
+}
+
+void qemu_advance_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    if (ts->expire_time > expire_time)
+       qemu_mod_timer(ts, expire_time);
+}
+
+/* modify the current timer so that it will be fired when current_time
+   >= expire_time. The corresponding callback will be called. */
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    QEMUTimerHeap *h = &active_timers[ts->clock->type];
+
+    timers_enter();
+    ts->expire_time = expire_time;
+    ts->seq = h->seq++;
+    if (ts->heap_pos) {
+        /* already pending: move it within the heap */
+        timer_heap_fix(h, ts->heap_pos - 1);
+    } else {
+        timer_heap_insert(h, ts);
+    }
+    timers_leave();
+
+    if (h->timers[0] == ts)
+        qemu_timer_first_changed(ts);
+}
+
+int qemu_timer_pending(QEMUTimer *ts)
+{
+    return ts->heap_pos != 0;
+}
+
+int qemu_run_timers(QEMUTimerHeap *h, int64_t current_time)
+{
+    QEMUTimer *ts;
+    int count = 0;
+
+    for(;;) {
+        ts = h->count ? h->timers[0] : NULL;
+        if (!ts || ts->expire_time > current_time)
+            break;
+        /* remove timer from the heap before calling the callback */
+        timers_enter();
+        timer_heap_remove(h, ts);
+        timers_leave();
+
+        /* run the callback (the timer list can be modified) */
+        ts->cb(ts->opaque);
+        count++;
+    }
+    return count;
+}
+
+
+/* Nanoseconds until the first virtual timer expires. */
+int64_t qemu_next_deadline(void)
+{
+    QEMUTimer *ts = qemu_first_timer(QEMU_TIMER_VIRTUAL);
+    int64_t delta;
+
+    if (ts) {
+        delta = ts->expire_time - qemu_get_clock(vm_clock);
+    } else {
+        /* To avoid problems with overflow limit this to 2^32.  */
+        delta = INT32_MAX;
+    }
+
+    if (delta < 0)
+        delta = 0;
+
+    return delta;
+}
+
+/* Milliseconds until the first active timer expires, -1 if there is none.
+   Virtual timers only count while the VM is running.  A deadline that
+   has passed gives 0: any negative value would block forever. */
+int qemu_calculate_timeout(void)
+{
+    int64_t delta = INT64_MAX, ns;
+    QEMUTimer *ts;
+
+    if (vm_running && qemu_first_timer(QEMU_TIMER_VIRTUAL)) {
+        /* round up, waking before the deadline only costs another loop */
+        ns = qemu_next_deadline();
+        delta = ns / 1000000 + (ns % 1000000 != 0);
+    }
+
+    ts = qemu_first_timer(QEMU_TIMER_REALTIME);
+    if (ts)
+        delta = MIN(delta, ts->expire_time - qemu_get_clock(rt_clock));
+
+    if (delta == INT64_MAX)
+        return -1;
+    if (delta < 0)
+        return 0;
+    return MIN(delta, INT32_MAX);
+}
@@ -25,6 +25,7 @@ void qemu_del_timer(QEMUTimer *ts);
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time);
 void qemu_advance_timer(QEMUTimer *ts, int64_t expire_time);
 int qemu_timer_pending(QEMUTimer *ts);
+int64_t qemu_next_deadline(void);
 
 extern int64_t ticks_per_sec;
 
@@ -83,3 +83,22 @@ int64_t qemu_get_clock(QEMUClock *clock)
     qemu_gettimeofday(&tv);
     return (tv.tv_sec * 1000000000LL + (tv.tv_usec * 1000)) / 1000000;
 }
+
+/* The tools have no main loop to run timers from.  Background block jobs
+   never run here, and the nbd client wakes its waiters from a thread */
+QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+{
+    return NULL;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+}
+
+void qemu_del_timer(QEMUTimer *ts)
+{
+}
+
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+}
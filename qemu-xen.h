@@ -29,14 +29,21 @@ extern int vga_ram_size;
 
 uint8_t *qemu_map_cache(target_phys_addr_t phys_addr, uint8_t lock);
 void     qemu_invalidate_entry(uint8_t *buffer);
+int      qemu_map_cache_paddr(uint8_t *buffer, target_phys_addr_t *paddr);
 void     qemu_invalidate_map_cache(void);
 
 #define mapcache_lock()   ((void)0)
 #define mapcache_unlock() ((void)0)
 
+/* exec-dm.c */
+void cpu_physical_memory_set_dirty_range(target_phys_addr_t addr,
+                                         target_phys_addr_t len);
+void cpu_physical_memory_flush_dirty(void);
+
 /* helper2.c */
 extern long time_offset;
 void timeoffset_get(void);
+int xen_ioreq_delay(int64_t expire);
 
 /* xen_platform.c */
 #ifndef QEMU_TOOL
@@ -45,6 +52,7 @@ void xen_vga_vram_map(uint64_t vram_addr, uint32_t size);
 void set_vram_mapping(void *opaque, unsigned long begin, unsigned long end);
 void unset_vram_mapping(void *opaque);
 #endif
+void xen_platform_log_info(void);
 
 void pci_unplug_netifs(void);
 void destroy_hvm_domain(void);
@@ -113,6 +121,9 @@ int xenstore_refresh_battery_status(void);
 int xenstore_pv_driver_build_blacklisted(uint16_t product_number,
                                          uint32_t build_nr);
 
+/* xenfb.c */
+void xenfb_info(void);
+
 /* xenfbfront.c */
 int xenfb_pv_display_init(DisplayState *ds);
 int xenfb_pv_display_vram(void *vram_start);
@@ -0,0 +1,259 @@
+/*
+ * QEMU shared memory display export
+ *
+ * Places the DisplaySurface in a named POSIX shared memory object so that
+ * viewers running on the same host can display or record the guest
+ * without going through a socket.  See shmdisplay.h for the layout.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "console.h"
+#include "shmdisplay.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define SHMDISPLAY_HEADER_SIZE \
+    ((sizeof(struct shmdisplay_header) + 4095) & ~4095)
+/* grow in large steps so that mode switches rarely force viewers to remap */
+#define SHMDISPLAY_GROW_ALIGN   (1 << 20)
+
+static char shm_name[64];
+static int shm_fd = -1;
+static struct shmdisplay_header *shm_hdr;
+static size_t shm_size;
+/* the surface whose pixels live in the shared object, if any */
+static DisplaySurface *shm_surface;
+
+static inline uint8_t *shm_fb(void)
+{
+    return (uint8_t *)shm_hdr + SHMDISPLAY_HEADER_SIZE;
+}
+
+static void shm_begin_update(void)
+{
+    shm_hdr->generation++;
+    __sync_synchronize();
+}
+
+static void shm_end_update(void)
+{
+    __sync_synchronize();
+    shm_hdr->generation++;
+}
+
+/* Must be called between shm_begin_update() and shm_end_update() */
+static void shm_display_map(size_t fb_size)
+{
+    size_t size = SHMDISPLAY_HEADER_SIZE + fb_size;
+    void *p;
+
+    if (shm_hdr && size <= shm_size)
+        return;
+
+    size = (size + SHMDISPLAY_GROW_ALIGN - 1) & ~(SHMDISPLAY_GROW_ALIGN - 1);
+    if (ftruncate(shm_fd, size) < 0) {
+        fprintf(stderr, "shmdisplay: cannot grow %s: %s\n",
+                shm_name, strerror(errno));
+        exit(1);
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "shmdisplay: cannot map %s: %s\n",
+                shm_name, strerror(errno));
+        exit(1);
+    }
+    if (shm_hdr)
+        munmap(shm_hdr, shm_size);
+    shm_hdr = p;
+    shm_size = size;
+    shm_hdr->map_size = size;
+    if (shm_surface)
+        shm_surface->data = shm_fb();
+}
+
+static void shm_display_push(int x, int y, int w, int h)
+{
+    struct shmdisplay_rect *r;
+    uint32_t prod = shm_hdr->prod;
+
+    r = &shm_hdr->ring[prod & (SHMDISPLAY_RING_SIZE - 1)];
+    r->x = x;
+    r->y = y;
+    r->w = w;
+    r->h = h;
+    __sync_synchronize(); /* publish the rectangle before the index */
+    shm_hdr->prod = prod + 1;
+}
+
+/* Copy a rectangle of a surface we do not own into the shared object */
+static void shm_display_copy(DisplaySurface *s, int x, int y, int w, int h)
+{
+    int bpp = s->pf.bytes_per_pixel;
+    uint8_t *src, *dst;
+
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (x + w > (int)shm_hdr->width)
+        w = shm_hdr->width - x;
+    if (y + h > (int)shm_hdr->height)
+        h = shm_hdr->height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    src = s->data + y * s->linesize + x * bpp;
+    dst = shm_fb() + y * shm_hdr->linesize + x * bpp;
+    for (; h > 0; h--) {
+        memcpy(dst, src, w * bpp);
+        src += s->linesize;
+        dst += shm_hdr->linesize;
+    }
+}
+
+static void shm_display_set_geometry(DisplaySurface *s)
+{
+    shm_begin_update();
+    if (s->pf.bytes_per_pixel == 0) {
+        /* text mode surfaces carry no pixels */
+        shm_hdr->width = shm_hdr->height = shm_hdr->linesize = 0;
+    } else {
+        shm_hdr->width = s->width;
+        shm_hdr->height = s->height;
+        if (s == shm_surface) {
+            shm_hdr->linesize = s->linesize;
+        } else {
+            shm_hdr->linesize = s->width * s->pf.bytes_per_pixel;
+            shm_display_map(shm_hdr->linesize * s->height);
+        }
+    }
+    shm_hdr->bits_per_pixel = s->pf.bits_per_pixel;
+    shm_hdr->depth = s->pf.depth;
+    shm_hdr->rmask = s->pf.rmask;
+    shm_hdr->gmask = s->pf.gmask;
+    shm_hdr->bmask = s->pf.bmask;
+    shm_hdr->big_endian = !!(s->flags & QEMU_BIG_ENDIAN_FLAG);
+    shm_end_update();
+}
+
+static void shm_display_update(DisplayState *ds, int x, int y, int w, int h)
+{
+    if (ds->surface != shm_surface)
+        shm_display_copy(ds->surface, x, y, w, h);
+    shm_display_push(x, y, w, h);
+}
+
+static void shm_display_resize(DisplayState *ds)
+{
+    shm_display_set_geometry(ds->surface);
+    shm_display_update(ds, 0, 0, ds_get_width(ds), ds_get_height(ds));
+}
+
+static void shm_display_setdata(DisplayState *ds)
+{
+    shm_display_update(ds, 0, 0, ds_get_width(ds), ds_get_height(ds));
+}
+
+static void shm_display_refresh(DisplayState *ds)
+{
+    vga_hw_update();
+}
+
+static DisplaySurface *shm_create_displaysurface(int width, int height)
+{
+    DisplaySurface *surface = qemu_mallocz(sizeof(DisplaySurface));
+
+    surface->width = width;
+    surface->height = height;
+    surface->linesize = width * 4;
+    surface->pf = qemu_default_pixelformat(32);
+#ifdef WORDS_BIGENDIAN
+    surface->flags = QEMU_ALLOCATED_FLAG | QEMU_BIG_ENDIAN_FLAG;
+#else
+    surface->flags = QEMU_ALLOCATED_FLAG;
+#endif
+
+    shm_begin_update();
+    shm_display_map(surface->linesize * height);
+    shm_end_update();
+    surface->data = shm_fb();
+    shm_surface = surface;
+    shm_display_set_geometry(surface);
+
+    return surface;
+}
+
+static void shm_free_displaysurface(DisplaySurface *surface)
+{
+    if (surface == NULL)
+        return;
+    /* pixels stay in the shared object, only the descriptor goes away */
+    if (surface == shm_surface)
+        shm_surface = NULL;
+    qemu_free(surface);
+}
+
+static DisplaySurface *shm_resize_displaysurface(DisplaySurface *surface,
+                                                 int width, int height)
+{
+    shm_free_displaysurface(surface);
+    return shm_create_displaysurface(width, height);
+}
+
+static void shm_display_cleanup(void)
+{
+    shm_unlink(shm_name);
+}
+
+int shm_display_init(DisplayState *ds, const char *name)
+{
+    DisplayChangeListener *dcl;
+    DisplayAllocator *da;
+
+    snprintf(shm_name, sizeof(shm_name), SHMDISPLAY_NAME_PREFIX "%s", name);
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (shm_fd < 0) {
+        fprintf(stderr, "shm_display_init: cannot create %s: %s\n",
+                shm_name, strerror(errno));
+        return -1;
+    }
+    atexit(shm_display_cleanup);
+
+    shm_display_map(0);
+    shm_hdr->magic = SHMDISPLAY_MAGIC;
+    shm_hdr->version = SHMDISPLAY_VERSION;
+    shm_hdr->data_offset = SHMDISPLAY_HEADER_SIZE;
+
+    dcl = qemu_mallocz(sizeof(DisplayChangeListener));
+    dcl->dpy_update = shm_display_update;
+    dcl->dpy_resize = shm_display_resize;
+    dcl->dpy_setdata = shm_display_setdata;
+    dcl->dpy_refresh = shm_display_refresh;
+    register_displaychangelistener(ds, dcl);
+
+    da = qemu_mallocz(sizeof(DisplayAllocator));
+    da->create_displaysurface = shm_create_displaysurface;
+    da->resize_displaysurface = shm_resize_displaysurface;
+    da->free_displaysurface = shm_free_displaysurface;
+    if (register_displayallocator(ds, da) == da) {
+        DisplaySurface *surf;
+        surf = shm_create_displaysurface(ds_get_width(ds), ds_get_height(ds));
+        defaultallocator_free_displaysurface(ds->surface);
+        ds->surface = surf;
+        dpy_resize(ds);
+    } else {
+        /* somebody else owns the pixels, copy dirty rectangles instead */
+        qemu_free(da);
+    }
+
+    return 0;
+}
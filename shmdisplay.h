@@ -0,0 +1,64 @@
+/*
+ * QEMU shared memory display export
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_SHMDISPLAY_H
+#define QEMU_SHMDISPLAY_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the POSIX shared memory object created by -shmdisplay.  The
+ * object is named "/qemu-display-<name>" and begins with the header below;
+ * the framebuffer starts at data_offset.  This header is shared with
+ * external viewers, so keep it free of qemu internal types.
+ *
+ * Geometry is protected by a sequence counter: qemu makes 'generation'
+ * odd while it changes width/height/format or grows the object, and even
+ * again once done.  A viewer reads 'generation', the geometry, then
+ * 'generation' again and retries if the two differ or are odd.  When the
+ * generation changes, map_size may have grown and the object must be
+ * remapped.
+ *
+ * Dirty rectangles are published through a single producer ring.  qemu
+ * writes ring[prod % SHMDISPLAY_RING_SIZE] and then increments prod.
+ * Consumers keep their own index and never write to the segment.  After
+ * copying an entry a consumer re-reads prod and discards the copy if the
+ * producer has lapped it; a consumer that falls more than
+ * SHMDISPLAY_RING_SIZE entries behind must treat the whole screen as
+ * dirty and resynchronise with cons = prod.
+ */
+
+#define SHMDISPLAY_MAGIC        0x51444d53 /* "SMDQ" */
+#define SHMDISPLAY_VERSION      1
+#define SHMDISPLAY_RING_SIZE    256 /* must be a power of two */
+#define SHMDISPLAY_NAME_PREFIX  "/qemu-display-"
+
+struct shmdisplay_rect {
+    int32_t x, y, w, h;
+};
+
+struct shmdisplay_header {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t generation;
+    uint32_t map_size;          /* size of the whole object in bytes */
+    uint32_t data_offset;       /* framebuffer offset from the header */
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t linesize;          /* bytes per line */
+    uint32_t bits_per_pixel;
+    uint32_t depth;
+    uint32_t rmask, gmask, bmask;
+    uint32_t big_endian;
+
+    volatile uint32_t prod;     /* free running producer index */
+    struct shmdisplay_rect ring[SHMDISPLAY_RING_SIZE];
+};
+
+#endif
@@ -51,6 +51,8 @@ int pci_emulation_add(char *config_text);
 void qemu_announce_self(void);
 
 void main_loop_wait(int timeout);
+int qemu_calculate_timeout(void);
+void do_info_wakeups(void);
 
 int qemu_savevm_state_begin(QEMUFile *f);
 int qemu_savevm_state_iterate(QEMUFile *f);
@@ -0,0 +1,156 @@
+/*
+ * Random read benchmark for the image formats: sync reads against aio
+ * reads with several requests in flight.
+ *
+ * usage: bench-block-aio [-n] [format...]     (default: raw vmdk vpc)
+ *
+ * -n reads with BDRV_O_NOCACHE.  Otherwise the image is in the host page
+ * cache and the numbers mostly show the cost of the aio machinery.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#define IMAGE_MB        64
+#define READ_SECTORS    8
+#define NB_READS        4000
+#define QUEUE_DEPTH     16
+
+static int in_flight;
+static int failed;
+static int open_flags;
+
+static void read_cb(void *opaque, int ret)
+{
+    if (ret < 0)
+        failed = ret;
+    in_flight--;
+}
+
+/* every sector starts with its own number */
+static void check_sectors(const char *fmt, const uint8_t *buf,
+                          int64_t sector_num, int nb_sectors)
+{
+    int i;
+
+    for (i = 0; i < nb_sectors; i++)
+        if (*(int64_t *)(buf + i * 512) != sector_num + i)
+            block_test_fail(fmt, "bad data in sector %" PRId64,
+                            sector_num + i);
+}
+
+static BlockDriverState *create_image(const char *fmt, const char *filename)
+{
+    BlockDriver *drv = bdrv_find_format(fmt);
+    BlockDriverState *bs;
+    uint8_t *buf;
+    int64_t i, j;
+
+    if (!drv)
+        block_test_fail(fmt, "unknown format");
+    if (bdrv_create(drv, filename, IMAGE_MB * 2048, NULL, 0) < 0)
+        block_test_fail(fmt, "cannot create %s", filename);
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, 0, drv) < 0)
+        block_test_fail(fmt, "cannot open %s", filename);
+
+    buf = qemu_memalign(512, 128 * 512);
+    for (i = 0; i < bs->total_sectors; i += 128) {
+        int n = MIN(128, bs->total_sectors - i);
+        for (j = 0; j < n; j++)
+            *(int64_t *)(buf + j * 512) = i + j;
+        if (bdrv_write(bs, i, buf, n) < 0)
+            block_test_fail(fmt, "write failed at %" PRId64, i);
+    }
+    qemu_vfree(buf);
+
+    bdrv_delete(bs);
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, open_flags, drv) < 0)
+        block_test_fail(fmt, "cannot reopen %s", filename);
+    return bs;
+}
+
+static void bench(const char *fmt)
+{
+    char *filename = block_test_tmpname(fmt);
+    BlockDriverState *bs = create_image(fmt, filename);
+    int64_t range = bs->total_sectors - READ_SECTORS;
+    int64_t sectors[QUEUE_DEPTH];
+    uint8_t *bufs[QUEUE_DEPTH];
+    int64_t start, sync_us, aio_us, t, sync_max = 0;
+    unsigned int seed;
+    int i, j;
+
+    for (i = 0; i < QUEUE_DEPTH; i++)
+        bufs[i] = qemu_memalign(512, READ_SECTORS * 512);
+
+    seed = 1;
+    start = block_test_now_us();
+    for (i = 0; i < NB_READS; i++) {
+        sectors[0] = rand_r(&seed) % range;
+        t = block_test_now_us();
+        if (bdrv_read(bs, sectors[0], bufs[0], READ_SECTORS) < 0)
+            block_test_fail(fmt, "sync read failed");
+        t = block_test_now_us() - t;
+        if (t > sync_max)
+            sync_max = t;
+        check_sectors(fmt, bufs[0], sectors[0], READ_SECTORS);
+    }
+    sync_us = block_test_now_us() - start;
+
+    seed = 1;
+    start = block_test_now_us();
+    for (i = 0; i < NB_READS; i += QUEUE_DEPTH) {
+        for (j = 0; j < QUEUE_DEPTH && i + j < NB_READS; j++) {
+            sectors[j] = rand_r(&seed) % range;
+            in_flight++;
+            if (!bdrv_aio_read(bs, sectors[j], bufs[j], READ_SECTORS,
+                               read_cb, NULL))
+                block_test_fail(fmt, "aio submission failed");
+        }
+        while (in_flight)
+            block_test_poll(-1);
+        if (failed)
+            block_test_fail(fmt, "aio read failed: %d", failed);
+        for (j = 0; j < QUEUE_DEPTH && i + j < NB_READS; j++)
+            check_sectors(fmt, bufs[j], sectors[j], READ_SECTORS);
+    }
+    aio_us = block_test_now_us() - start;
+
+    /* the longest sync read or aio handler is how long the main loop
+       would have been stuck */
+    printf("%-5s %d x %d KiB: sync %6.3fs (longest %6" PRId64 " us)"
+           "  aio qd%d %6.3fs (longest %6" PRId64 " us)\n",
+           fmt, NB_READS, READ_SECTORS / 2, sync_us / 1e6, sync_max,
+           QUEUE_DEPTH, aio_us / 1e6, block_test_max_handler_us);
+    block_test_max_handler_us = 0;
+
+    for (i = 0; i < QUEUE_DEPTH; i++)
+        qemu_vfree(bufs[i]);
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_free(filename);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *default_formats[] = { "raw", "vmdk", "vpc" };
+    int i = 1;
+
+    bdrv_init();
+    if (i < argc && !strcmp(argv[i], "-n")) {
+        open_flags = BDRV_O_NOCACHE;
+        i++;
+    }
+    if (i < argc) {
+        for (; i < argc; i++)
+            bench(argv[i]);
+    } else {
+        for (i = 0; i < ARRAY_SIZE(default_formats); i++)
+            bench(default_formats[i]);
+    }
+    return 0;
+}
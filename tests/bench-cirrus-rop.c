@@ -0,0 +1,140 @@
+/*
+ * Cirrus blitter raster operation benchmark
+ *
+ * Runs the cirrus_vga.c ROP kernels on a fake VRAM and reports MB/s for
+ * every ROP: screen to screen blits on the word-wide path and on the
+ * masked byte loop that blits wrapping around the address mask take, and
+ * solid fills at every depth.  For the source ROP the fill is also timed
+ * on the linear path that cirrus_bitblt_solidfill() takes.
+ *
+ * usage: bench-cirrus-rop
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+
+#include <sys/time.h>
+
+/* the part of CirrusVGAState that the raster operations use */
+#define CIRRUS_BLTBUFSIZE (2048 * 4)
+#define CIRRUS_BLTMODEEXT_COLOREXPINV      0x02
+
+struct CirrusVGAState;
+typedef void (*cirrus_bitblt_rop_t) (struct CirrusVGAState *s,
+                                     uint8_t * dst, const uint8_t * src,
+                                     int dstpitch, int srcpitch,
+                                     int bltwidth, int bltheight);
+typedef void (*cirrus_fill_t)(struct CirrusVGAState *s,
+                              uint8_t *dst, int dst_pitch, int width, int height);
+
+typedef struct CirrusVGAState {
+    uint8_t *vram_ptr;
+    unsigned int vram_size;
+    uint32_t cirrus_addr_mask;
+    uint8_t gr[256];
+    int cirrus_blt_pixelwidth;
+    uint32_t cirrus_blt_fgcol;
+    uint32_t cirrus_blt_bgcol;
+    uint32_t cirrus_blt_srcaddr;
+    uint8_t cirrus_blt_modeext;
+    uint8_t cirrus_bltbuf[CIRRUS_BLTBUFSIZE];
+} CirrusVGAState;
+
+#include "hw/cirrus_vga_blt.h"
+
+#define TEST            "cirrus-rop"
+#define VRAM_SIZE       (8 << 20)
+/* 4 MB of video memory seen through the address mask, as on a 5446 */
+#define ADDR_MASK       ((4 << 20) - 1)
+#define PITCH           4096
+#define WIDTH           2048            /* bytes */
+#define HEIGHT          256
+#define BENCH_US        50000
+
+/* in the order of the ROP tables */
+static const char *rop_names[16] = {
+    "0", "src_and_dst", NULL, "src_and_notdst",
+    "notdst", "src", "1", "notsrc_and_dst",
+    "src_xor_dst", "src_or_dst", "notsrc_or_notdst", "src_notxor_dst",
+    "src_or_notdst", "notsrc", "notsrc_or_dst", "notsrc_and_notdst",
+};
+
+static CirrusVGAState state;
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* MB/s of a WIDTH x HEIGHT blit from src to dst, both offsets in VRAM */
+static double bench_blt(cirrus_bitblt_rop_t rop, int dst, int src)
+{
+    CirrusVGAState *s = &state;
+    int64_t start = now_us(), us;
+    int n = 0;
+
+    do {
+        rop(s, s->vram_ptr + dst, s->vram_ptr + src, PITCH, PITCH,
+            WIDTH, HEIGHT);
+        n++;
+    } while ((us = now_us() - start) < BENCH_US);
+    return (double)n * WIDTH * HEIGHT / us;
+}
+
+static double bench_fill(cirrus_fill_t fill, int pw, int linear)
+{
+    CirrusVGAState *s = &state;
+    int64_t start = now_us(), us;
+    int n = 0;
+
+    s->cirrus_blt_pixelwidth = pw;
+    do {
+        if (linear)
+            cirrus_fill_src_linear(s, s->vram_ptr, PITCH, WIDTH, HEIGHT);
+        else
+            fill(s, s->vram_ptr, PITCH, WIDTH, HEIGHT);
+        n++;
+    } while ((us = now_us() - start) < BENCH_US);
+    return (double)n * WIDTH * HEIGHT / us;
+}
+
+int main(int argc, char **argv)
+{
+    CirrusVGAState *s = &state;
+    /* below the mask, and straddling it so that the blit wraps */
+    int linear = 0, wrapped = ADDR_MASK + 1 - HEIGHT / 2 * PITCH;
+    int rop, depth;
+
+    s->vram_ptr = qemu_memalign(4096, VRAM_SIZE);
+    s->vram_size = VRAM_SIZE;
+    s->cirrus_addr_mask = ADDR_MASK;
+    s->cirrus_blt_fgcol = 0x12345678;
+    memset(s->vram_ptr, 0x5a, VRAM_SIZE);
+
+    printf("%s: MB/s for %dx%d bytes, pitch %d\n", TEST, WIDTH, HEIGHT,
+           PITCH);
+    printf("%-18s %8s %8s %8s %8s %8s %8s\n", "rop", "blt", "blt-mask",
+           "fill8", "fill16", "fill24", "fill32");
+    for (rop = 0; rop < 16; rop++) {
+        if (!rop_names[rop])
+            continue;
+        printf("%-18s %8.0f %8.0f", rop_names[rop],
+               bench_blt(cirrus_fwd_rop[rop], linear + (2 << 20), linear),
+               bench_blt(cirrus_fwd_rop[rop], wrapped, wrapped - 2048));
+        for (depth = 0; depth < 4; depth++)
+            printf(" %8.0f", bench_fill(cirrus_fill[rop][depth], depth + 1, 0));
+        printf("\n");
+    }
+    printf("%-18s %8s %8s", "src, linear fill", "", "");
+    for (depth = 0; depth < 4; depth++)
+        printf(" %8.0f", bench_fill(NULL, depth + 1, 1));
+    printf("\n");
+
+    qemu_vfree(s->vram_ptr);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Random read benchmark for cloop images
+ *
+ * Writes its own cloop image: the header, the offset table and a zlib
+ * stream per block.  Then times 4 KiB bdrv_read()s, uniform over the
+ * image and with 90% of them in a 16 MB hot spot, for several sizes of
+ * the decompressed chunk cache, and a sequential pass of 64 KiB reads
+ * that read-ahead should keep ahead of.  Every read is checked.
+ *
+ * usage: bench-cloop [megabytes [reads]]     (default: 64 5000)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+#include "chunk-cache.h"
+
+#define TEST            "cloop"
+#define BLOCK_SIZE      (64 * 1024)
+#define READ_SECTORS    8
+#define HOT_MB          16
+
+/* the first 128 bytes of a cloop image, padded with zeroes */
+static const char cloop_magic[] =
+    "#!/bin/sh\n"
+    "#V2.0 Format\n"
+    "modprobe cloop file=$0 && mount -r -t iso9660 /dev/cloop $1\n";
+
+/* every sector starts with its own number, the rest is a pattern that
+   zlib can compress */
+static void fill_sector(uint8_t *buf, int64_t sector_num)
+{
+    int i;
+
+    *(int64_t *)buf = sector_num;
+    for (i = 8; i < 512; i++)
+        buf[i] = (sector_num * 31 + i / 16 + (i * i) % 7) & 0x7f;
+}
+
+static void check_sectors(const uint8_t *buf, int64_t sector_num,
+                          int nb_sectors)
+{
+    uint8_t ref[512];
+    int i;
+
+    for (i = 0; i < nb_sectors; i++) {
+        fill_sector(ref, sector_num + i);
+        if (memcmp(buf + i * 512, ref, 512))
+            block_test_fail(TEST, "bad data in sector %" PRId64,
+                            sector_num + i);
+    }
+}
+
+static void write_ok(int fd, const void *buf, size_t len, off_t offset)
+{
+    if (pwrite(fd, buf, len, offset) != len)
+        block_test_fail(TEST, "cannot write the image: %s", strerror(errno));
+}
+
+static void create_image(const char *filename, uint32_t n_blocks)
+{
+    uLongf len, max_len = compressBound(BLOCK_SIZE);
+    uint8_t header[136], *block, *zbuf;
+    uint64_t *offsets, offset;
+    uint32_t i, j;
+    int fd;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0)
+        block_test_fail(TEST, "cannot create %s: %s", filename,
+                        strerror(errno));
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, cloop_magic, strlen(cloop_magic));
+    *(uint32_t *)(header + 128) = cpu_to_be32(BLOCK_SIZE);
+    *(uint32_t *)(header + 132) = cpu_to_be32(n_blocks);
+    write_ok(fd, header, sizeof(header), 0);
+
+    /* n_blocks + 1 offsets, the last one is the end of the last block */
+    offsets = qemu_malloc((n_blocks + 1) * sizeof(uint64_t));
+    block = qemu_malloc(BLOCK_SIZE);
+    zbuf = qemu_malloc(max_len);
+    offset = sizeof(header) + (n_blocks + 1) * sizeof(uint64_t);
+    for (i = 0; i < n_blocks; i++) {
+        for (j = 0; j < BLOCK_SIZE / 512; j++)
+            fill_sector(block + j * 512, (int64_t)i * BLOCK_SIZE / 512 + j);
+        len = max_len;
+        if (compress(zbuf, &len, block, BLOCK_SIZE) != Z_OK)
+            block_test_fail(TEST, "cannot compress block %u", i);
+        write_ok(fd, zbuf, len, offset);
+        offsets[i] = cpu_to_be64(offset);
+        offset += len;
+    }
+    offsets[n_blocks] = cpu_to_be64(offset);
+    write_ok(fd, offsets, (n_blocks + 1) * sizeof(uint64_t), sizeof(header));
+
+    qemu_free(zbuf);
+    qemu_free(block);
+    qemu_free(offsets);
+    close(fd);
+}
+
+/* seconds for nb_reads reads, hot percent of them in the first HOT_MB */
+static double bench_random(BlockDriverState *bs, int nb_reads, int hot)
+{
+    int64_t range = bs->total_sectors - READ_SECTORS;
+    int64_t hot_range = MIN(HOT_MB * 2048, range);
+    int64_t sector_num, start;
+    uint8_t *buf = qemu_memalign(512, READ_SECTORS * 512);
+    unsigned int seed = 1;
+    int i;
+
+    start = block_test_now_us();
+    for (i = 0; i < nb_reads; i++) {
+        if (rand_r(&seed) % 100 < hot)
+            sector_num = rand_r(&seed) % hot_range;
+        else
+            sector_num = rand_r(&seed) % range;
+        if (bdrv_read(bs, sector_num, buf, READ_SECTORS) < 0)
+            block_test_fail(TEST, "read at %" PRId64 " failed", sector_num);
+        check_sectors(buf, sector_num, READ_SECTORS);
+    }
+    qemu_vfree(buf);
+    return (block_test_now_us() - start) / 1e6;
+}
+
+/* MB/s of a sequential pass */
+static double bench_sequential(BlockDriverState *bs)
+{
+    uint8_t *buf = qemu_memalign(512, BLOCK_SIZE);
+    int nb_sectors = BLOCK_SIZE / 512;
+    int64_t sector_num, start;
+
+    start = block_test_now_us();
+    for (sector_num = 0; sector_num < bs->total_sectors;
+         sector_num += nb_sectors) {
+        if (bdrv_read(bs, sector_num, buf, nb_sectors) < 0)
+            block_test_fail(TEST, "read at %" PRId64 " failed", sector_num);
+        check_sectors(buf, sector_num, nb_sectors);
+    }
+    qemu_vfree(buf);
+    return bs->total_sectors * 512.0 / (block_test_now_us() - start);
+}
+
+int main(int argc, char **argv)
+{
+    /* 1 KB leaves the minimum of two chunks */
+    static const int cache_kb[] = { 1, CHUNK_CACHE_DEFAULT_KB, 32768 };
+    int image_mb = argc > 1 ? atoi(argv[1]) : 64;
+    int nb_reads = argc > 2 ? atoi(argv[2]) : 5000;
+    char *filename = block_test_tmpname("cloop");
+    BlockDriverState *bs;
+    double uniform, hot, seq;
+    int i;
+
+    bdrv_init();
+    create_image(filename, image_mb * (1024 * 1024 / BLOCK_SIZE));
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, 0, bdrv_find_format("cloop")) < 0)
+        block_test_fail(TEST, "cannot open %s", filename);
+
+    printf("%s: %d MB image, %d KB blocks, %d reads of %d KB\n", TEST,
+           image_mb, BLOCK_SIZE / 1024, nb_reads, READ_SECTORS / 2);
+    for (i = 0; i < ARRAY_SIZE(cache_kb); i++) {
+        if (bdrv_set_chunk_cache(bs, cache_kb[i]) < 0)
+            block_test_fail(TEST, "cannot set the chunk cache size");
+        uniform = bench_random(bs, nb_reads, 0);
+        hot = bench_random(bs, nb_reads, 90);
+        seq = bench_sequential(bs);
+        printf("%s: cache %5d KB: uniform %6.3fs, 90%% in %d MB %6.3fs, "
+               "sequential %6.1f MB/s\n", TEST, cache_kb[i], uniform, HOT_MB,
+               hot, seq);
+    }
+
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_free(filename);
+    return 0;
+}
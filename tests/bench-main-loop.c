@@ -0,0 +1,163 @@
+/*
+ * Dispatch latency of the main loop's fd handlers
+ *
+ * Registers n eventfds as read handlers, then over and over makes a
+ * random one readable and runs one main loop iteration, once through
+ * epoll and once through select() the way main_loop_wait() does.  The
+ * time from the write to the handler grows with n for select(), which
+ * walks every handler on every iteration.
+ *
+ * Also checks that an fd closed and reopened under the same number is
+ * dispatched again once its handler is registered again.
+ *
+ * usage: bench-main-loop [iterations]     (default: 20000)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-char.h"
+
+#include <sys/eventfd.h>
+#include <sys/time.h>
+
+#define TEST            "main-loop"
+#define MAX_FDS         1000
+
+static int fds[MAX_FDS];
+static int64_t ran_us;
+static int ran;
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void __attribute__ ((format (printf, 1, 2))) fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", TEST);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void read_cb(void *opaque)
+{
+    int fd = *(int *)opaque;
+    uint64_t v;
+
+    if (read(fd, &v, sizeof(v)) != sizeof(v))
+        fail("read: %s", strerror(errno));
+    ran_us = now_us();
+    ran++;
+}
+
+static void dispatch(int use_epoll)
+{
+    fd_set rfds, wfds;
+    int nfds = -1, ret;
+
+    if (use_epoll) {
+        if (qemu_iohandler_epoll(1000) < 0)
+            fail("epoll is not available");
+        return;
+    }
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    qemu_iohandler_fill(&nfds, &rfds, &wfds);
+    ret = select(nfds + 1, &rfds, &wfds, NULL, NULL);
+    qemu_iohandler_poll(&rfds, &wfds, ret);
+}
+
+static void kick(int fd)
+{
+    uint64_t v = 1;
+
+    if (write(fd, &v, sizeof(v)) != sizeof(v))
+        fail("write: %s", strerror(errno));
+}
+
+static void bench(int nb_fds, int iterations, int use_epoll)
+{
+    int64_t start, total = 0, max = 0, lat;
+    unsigned int seed = 1;
+    int i;
+
+    for (i = 0; i < nb_fds; i++) {
+        fds[i] = eventfd(0, 0);
+        if (fds[i] < 0)
+            fail("eventfd: %s", strerror(errno));
+        qemu_set_fd_handler(fds[i], read_cb, NULL, &fds[i]);
+    }
+
+    for (i = 0; i < iterations; i++) {
+        ran = 0;
+        kick(fds[rand_r(&seed) % nb_fds]);
+        start = now_us();
+        dispatch(use_epoll);
+        if (ran != 1)
+            fail("the handler did not run");
+        lat = ran_us - start;
+        total += lat;
+        max = MAX(max, lat);
+    }
+    printf("%s: %4d fds, %-6s: %6.2f us average, %4" PRId64 " us max\n",
+           TEST, nb_fds, use_epoll ? "epoll" : "select",
+           (double)total / iterations, max);
+
+    for (i = 0; i < nb_fds; i++) {
+        qemu_set_fd_handler(fds[i], NULL, NULL, NULL);
+        close(fds[i]);
+    }
+    /* let the loop free the records */
+    qemu_iohandler_poll(NULL, NULL, 0);
+}
+
+/* closed without unregistering, so epoll dropped it behind our back */
+static void check_reopen(void)
+{
+    int fd = eventfd(0, 0);
+
+    fds[0] = fd;
+    qemu_set_fd_handler(fd, read_cb, NULL, &fds[0]);
+    ran = 0;
+    kick(fd);
+    dispatch(1);
+    if (ran != 1)
+        fail("the handler did not run");
+
+    close(fd);
+    if (eventfd(0, 0) != fd)
+        fail("the fd number was not reused");
+    qemu_set_fd_handler(fd, read_cb, NULL, &fds[0]);
+    ran = 0;
+    kick(fd);
+    dispatch(1);
+    if (ran != 1)
+        fail("a reopened fd is not dispatched");
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    close(fd);
+    printf("%s: reopened fd dispatched: ok\n", TEST);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 10, 100, 1000 };
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    int i;
+
+    check_reopen();
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        bench(sizes[i], iterations, 1);
+        bench(sizes[i], iterations, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Timer churn benchmark
+ *
+ * Keeps hundreds of rt_clock timers armed and re-arms or deletes random
+ * ones, the way device models do, then lets a fake clock run them all
+ * with callbacks that arm them again.  Meanwhile an interval timer
+ * signal looks at the first timer like host_alarm_handler() does, and
+ * checks that it never sees the heap half way through a change.
+ *
+ * usage: bench-timers [operations]     (default: 1000000)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer-int.h"
+
+#include <sys/time.h>
+
+#define TEST            "timers"
+#define MAX_TIMERS      1000
+#define SPREAD_MS       1000
+
+int vm_running;
+
+static QEMUTimer *timers[MAX_TIMERS];
+static int64_t fake_now;
+static int fired;
+static volatile int signals, torn;
+
+int64_t qemu_get_clock(QEMUClock *clock)
+{
+    return fake_now;
+}
+
+void qemu_timer_first_changed(QEMUTimer *ts)
+{
+}
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void alarm_handler(int sig)
+{
+    QEMUTimer *ts;
+
+    signals++;
+    if (qemu_timers_busy)
+        return;
+    ts = qemu_first_timer(QEMU_TIMER_REALTIME);
+    if (ts && ts->heap_pos != 1)
+        torn++;
+}
+
+static unsigned int seed = 1;
+
+static void timer_cb(void *opaque)
+{
+    QEMUTimer **ts = opaque;
+
+    fired++;
+    qemu_mod_timer(*ts, fake_now + 1 + rand_r(&seed) % SPREAD_MS);
+}
+
+static void bench(int nb_timers, int ops)
+{
+    int64_t start, churn_us, run_us;
+    int i;
+
+    fake_now = 0;
+    for (i = 0; i < nb_timers; i++) {
+        timers[i] = qemu_new_timer(rt_clock, timer_cb, &timers[i]);
+        qemu_mod_timer(timers[i], rand_r(&seed) % SPREAD_MS);
+    }
+
+    start = now_us();
+    for (i = 0; i < ops; i++) {
+        QEMUTimer *ts = timers[rand_r(&seed) % nb_timers];
+
+        if (rand_r(&seed) % 5 == 0)
+            qemu_del_timer(ts);
+        else
+            qemu_mod_timer(ts, rand_r(&seed) % SPREAD_MS);
+    }
+    churn_us = now_us() - start;
+
+    /* every callback arms its timer again, so the heap stays full */
+    fired = 0;
+    start = now_us();
+    while (fired < ops) {
+        fake_now++;
+        qemu_run_timers(&active_timers[QEMU_TIMER_REALTIME], fake_now);
+    }
+    run_us = now_us() - start;
+
+    printf("%s: %4d timers: %5.1f ns per mod/del, %5.1f ns per fired timer\n",
+           TEST, nb_timers, churn_us * 1000.0 / ops, run_us * 1000.0 / fired);
+
+    for (i = 0; i < nb_timers; i++) {
+        qemu_del_timer(timers[i]);
+        qemu_free_timer(timers[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 100, 500, 1000 };
+    int ops = argc > 1 ? atoi(argv[1]) : 1000000;
+    struct itimerval it;
+    int i;
+
+    rt_clock = qemu_new_clock(QEMU_TIMER_REALTIME);
+    vm_clock = qemu_new_clock(QEMU_TIMER_VIRTUAL);
+
+    signal(SIGALRM, alarm_handler);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 100;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++)
+        bench(sizes[i], ops);
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
+    if (torn) {
+        fprintf(stderr, "%s: the signal handler saw a torn heap %d times\n",
+                TEST, torn);
+        return 1;
+    }
+    printf("%s: %d signals, heap never seen torn: ok\n", TEST, signals);
+    return 0;
+}
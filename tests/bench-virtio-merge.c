@@ -0,0 +1,178 @@
+/*
+ * Benchmark for the request merging in virtio-blk.
+ *
+ * Feeds kicks of sequential 4k requests, a full queue at a time, through
+ * the batching code of virtio-blk and times a pass over the image for
+ * several merge limits.  A limit of 8 sectors submits every request on
+ * its own.
+ *
+ * usage: bench-virtio-merge [-n] [format...]    (default: raw qcow2)
+ *
+ * -n opens the image with BDRV_O_NOCACHE.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "virtio-blk-req.h"
+
+#define IMAGE_MB                64
+#define REQ_SECTORS             8
+#define KICK_REQS               VIRTIO_BLK_QUEUE_SIZE
+
+static BlockDriverState *bs;
+static const char *fmt;
+static int in_flight;
+static int submitted;
+static int failed;
+static int open_flags;
+
+static void rw_cb(void *opaque, int ret)
+{
+    VirtIOBlockReq *req = opaque, *next;
+
+    if (ret < 0)
+        failed = ret;
+    for (; req != NULL; req = next) {
+        next = req->merged;
+        req->merged = NULL;
+        req->done = 1;
+    }
+    in_flight--;
+}
+
+static void virtio_blk_submit(VirtIOBlockReq *req, int nb_sectors)
+{
+    BlockDriverAIOCB *acb;
+
+    in_flight++;
+    submitted++;
+    if (req->out->type & VIRTIO_BLK_T_OUT)
+        acb = bdrv_aio_writev(bs, req->out->sector, &req->qiov, nb_sectors,
+                              rw_cb, req);
+    else
+        acb = bdrv_aio_readv(bs, req->out->sector, &req->qiov, nb_sectors,
+                             rw_cb, req);
+    if (!acb)
+        block_test_fail(fmt, "aio submission failed");
+}
+
+/* one pass over the image, a kick of KICK_REQS requests at a time */
+static int64_t run(int is_write, int max_sectors, uint8_t *buf,
+                   int *nb_submitted)
+{
+    static VirtIOBlockReq reqs[KICK_REQS];
+    VirtIOBlockBatch batch;
+    int64_t nb_reqs = bs->total_sectors / REQ_SECTORS;
+    int64_t start, i;
+    int j, nb;
+
+    for (j = 0; j < KICK_REQS; j++) {
+        reqs[j].out = &reqs[j].hdr;
+        reqs[j].hdr.type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        qemu_iovec_init(&reqs[j].qiov, 1);
+    }
+
+    submitted = 0;
+    start = block_test_now_us();
+    for (i = 0; i < nb_reqs; i += nb) {
+        nb = MIN(KICK_REQS, nb_reqs - i);
+        virtio_blk_batch_init(&batch);
+        batch.max_sectors = max_sectors;
+        for (j = 0; j < nb; j++) {
+            VirtIOBlockReq *req = &reqs[j];
+
+            req->hdr.sector = (i + j) * REQ_SECTORS;
+            qemu_iovec_reset(&req->qiov);
+            qemu_iovec_add(&req->qiov, buf + req->hdr.sector * 512,
+                           REQ_SECTORS * 512);
+            req->size = req->qiov.size;
+            req->done = 0;
+            virtio_blk_batch_add(&batch, req);
+        }
+        virtio_blk_batch_submit(&batch);
+
+        while (in_flight)
+            block_test_poll(-1);
+        if (failed)
+            block_test_fail(fmt, "aio request failed: %d", failed);
+        for (j = 0; j < nb; j++) {
+            if (!reqs[j].done)
+                block_test_fail(fmt, "request %d not completed", j);
+        }
+    }
+
+    for (j = 0; j < KICK_REQS; j++)
+        qemu_iovec_destroy(&reqs[j].qiov);
+    *nb_submitted = submitted;
+    return block_test_now_us() - start;
+}
+
+static void bench(void)
+{
+    static const int limits[] = { REQ_SECTORS, 32, 64, 128, 256, 1024 };
+    BlockDriver *drv = bdrv_find_format(fmt);
+    char *filename = block_test_tmpname(fmt);
+    uint8_t *buf, *check;
+    int64_t us, i;
+    int l, is_write, nb;
+
+    if (!drv)
+        block_test_fail(fmt, "unknown format");
+    if (bdrv_create(drv, filename, IMAGE_MB * 2048, NULL, 0) < 0)
+        block_test_fail(fmt, "cannot create %s", filename);
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, open_flags, drv) < 0)
+        block_test_fail(fmt, "cannot open %s", filename);
+
+    buf = qemu_memalign(512, bs->total_sectors * 512);
+    check = qemu_memalign(512, bs->total_sectors * 512);
+    for (i = 0; i < bs->total_sectors; i++)
+        memset(buf + i * 512, i & 0xff, 512);
+
+    /* the first write pass allocates, time the overwrite */
+    run(1, REQ_SECTORS, buf, &nb);
+    for (is_write = 1; is_write >= 0; is_write--) {
+        for (l = 0; l < ARRAY_SIZE(limits); l++) {
+            if (!is_write)
+                memset(check, 0, bs->total_sectors * 512);
+            us = run(is_write, limits[l], is_write ? buf : check, &nb);
+            printf("%-5s %-5s limit %4d: %6d requests %7.3fs %7.1f MB/s\n",
+                   fmt, is_write ? "write" : "read", limits[l], nb,
+                   us / 1e6, bs->total_sectors * 512.0 / us);
+            if (!is_write &&
+                memcmp(buf, check, bs->total_sectors * 512))
+                block_test_fail(fmt, "read back wrong data");
+        }
+    }
+
+    qemu_vfree(buf);
+    qemu_vfree(check);
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_free(filename);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *default_formats[] = { "raw", "qcow2" };
+    int i = 1;
+
+    bdrv_init();
+    if (i < argc && !strcmp(argv[i], "-n")) {
+        open_flags = BDRV_O_NOCACHE;
+        i++;
+    }
+    if (i < argc) {
+        for (; i < argc; i++) {
+            fmt = argv[i];
+            bench();
+        }
+    } else {
+        for (i = 0; i < ARRAY_SIZE(default_formats); i++) {
+            fmt = default_formats[i];
+            bench();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Xen console output throughput benchmark
+ *
+ * Plays the guest on a fake xencons_interface: fills the output ring
+ * with lines of a given length and lets the backend's buffer code drain
+ * it, the way con_event() does.  With a reader the buffer goes out to
+ * /dev/null through writev(), like the fd and pty char devices.  Without
+ * one the buffer fills up and the oldest output is dropped; the buffer
+ * must then hold exactly the newest output of the guest.
+ *
+ * usage: bench-xen-console [megabytes]     (default: 256)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "hw/xen_console_buf.h"
+
+#define TEST            "xen-console"
+
+#define PERIOD          251
+
+static struct xencons_interface intf;
+static uint8_t guest_data[PERIOD + sizeof(intf.out)];
+static int null_fd;
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void __attribute__ ((format (printf, 1, 2))) fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", TEST);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+/* byte n of the guest output */
+static inline uint8_t pattern(uint64_t n)
+{
+    return n % PERIOD;
+}
+
+/* the guest writes as much of a line as fits in the ring */
+static int guest_write(uint64_t *written, uint64_t total, int line)
+{
+    XENCONS_RING_IDX prod = intf.out_prod;
+    const uint8_t *data = guest_data + *written % PERIOD;
+    int len = MIN(line, sizeof(intf.out) - (prod - intf.out_cons));
+    int chunk;
+
+    len = MIN(len, total - *written);
+    chunk = MIN(len, sizeof(intf.out) - MASK_XENCONS_IDX(prod, intf.out));
+    memcpy(intf.out + MASK_XENCONS_IDX(prod, intf.out), data, chunk);
+    memcpy(intf.out, data + chunk, len - chunk);
+    xen_mb();
+    intf.out_prod = prod + len;
+    *written += len;
+    return len;
+}
+
+/* MB/s of guest output through the buffer, with or without a reader */
+static double bench(struct buffer *buffer, uint64_t total, int line,
+                    int reader)
+{
+    struct iovec iov[2];
+    uint64_t written = 0;
+    int64_t start = now_us(), us;
+    int iovcnt;
+    ssize_t len;
+
+    while (written < total) {
+        while (guest_write(&written, total, line) == line)
+            ;
+        buffer_append_ring(buffer, &intf);
+        if (reader && buffer->size) {
+            iovcnt = buffer_iov(buffer, iov);
+            len = writev(null_fd, iov, iovcnt);
+            if (len < 1)
+                fail("writev: %s", strerror(errno));
+            buffer_advance(buffer, len);
+        }
+    }
+    us = now_us() - start;
+    return (double)total / us;
+}
+
+/* without a reader the buffer keeps the newest capacity bytes */
+static void check_backlog(struct buffer *buffer, uint64_t total)
+{
+    struct iovec iov[2];
+    uint64_t n = total - buffer->size;
+    int i, iovcnt;
+    size_t j;
+
+    if (buffer->size != buffer->capacity)
+        fail("backlog of %zu bytes in a %zu byte buffer", buffer->size,
+             buffer->capacity);
+    if (buffer->dropped != n)
+        fail("%" PRIu64 " bytes dropped, expected %" PRIu64,
+             buffer->dropped, n);
+    iovcnt = buffer_iov(buffer, iov);
+    for (i = 0; i < iovcnt; i++) {
+        for (j = 0; j < iov[i].iov_len; j++, n++) {
+            if (((uint8_t *)iov[i].iov_base)[j] != pattern(n))
+                fail("byte %" PRIu64 " of the output is wrong", n);
+        }
+    }
+}
+
+static void run(size_t limit, uint64_t total, int line)
+{
+    struct buffer buffer;
+    double with, without;
+
+    memset(&buffer, 0, sizeof(buffer));
+    memset(&intf, 0, sizeof(intf));
+    buffer.max_capacity = limit;
+    with = bench(&buffer, total, line, 1);
+    if (buffer.size || buffer.dropped)
+        fail("a reader left %zu bytes and dropped %" PRIu64, buffer.size,
+             buffer.dropped);
+    qemu_free(buffer.data);
+
+    memset(&buffer, 0, sizeof(buffer));
+    memset(&intf, 0, sizeof(intf));
+    buffer.max_capacity = limit;
+    without = bench(&buffer, total, line, 0);
+    check_backlog(&buffer, total);
+    qemu_free(buffer.data);
+
+    printf("%s: limit %7zu, %4d byte lines: %6.0f MB/s read, "
+           "%6.0f MB/s dropped: ok\n", TEST, limit ? limit : XENCONS_BUFFER_SIZE,
+           line, with, without);
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t limits[] = { 0, 64 * 1024 };
+    static const int lines[] = { 80, 2048 };
+    uint64_t total = (argc > 1 ? atoi(argv[1]) : 256) * 1024ULL * 1024;
+    int i, j;
+
+    for (i = 0; i < sizeof(guest_data); i++)
+        guest_data[i] = pattern(i);
+    null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0)
+        fail("/dev/null: %s", strerror(errno));
+
+    for (i = 0; i < ARRAY_SIZE(limits); i++)
+        for (j = 0; j < ARRAY_SIZE(lines); j++)
+            run(limits[i], total, lines[j]);
+    return 0;
+}
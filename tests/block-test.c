@@ -0,0 +1,359 @@
+/*
+ * Main loop for the block layer tests and benchmarks
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+#include "console.h"
+#include "sysemu.h"
+#include "qemu-char.h"
+#include "qemu-timer.h"
+
+#include <sys/time.h>
+
+/* only compared against, there is a single clock */
+static int rt_clock_dummy;
+QEMUClock *rt_clock = (QEMUClock *)&rt_clock_dummy;
+
+int64_t block_test_max_handler_us;
+
+struct QEMUBH {
+    QEMUBHFunc *cb;
+    void *opaque;
+    int scheduled;
+    int deleted;
+    struct QEMUBH *next;
+};
+
+struct QEMUTimer {
+    QEMUTimerCB *cb;
+    void *opaque;
+    int64_t expire_time;
+    struct QEMUTimer *next;     /* in active_timers, by expire_time */
+};
+
+typedef struct IOHandlerRecord {
+    int fd;
+    IOCanRWHandler *fd_read_poll;
+    IOHandler *fd_read;
+    IOHandler *fd_write;
+    void *opaque;
+    int deleted;
+    struct IOHandlerRecord *next;
+} IOHandlerRecord;
+
+static QEMUBH *first_bh;
+static QEMUTimer *active_timers;
+static IOHandlerRecord *first_io_handler;
+
+int64_t block_test_now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void handler_done(int64_t start)
+{
+    int64_t us = block_test_now_us() - start;
+
+    if (us > block_test_max_handler_us)
+        block_test_max_handler_us = us;
+}
+
+char *block_test_tmpname(const char *tag)
+{
+    static int seq;
+    const char *dir = getenv("TMPDIR");
+    char *name;
+
+    if (!dir)
+        dir = "/tmp";
+    name = qemu_malloc(strlen(dir) + strlen(tag) + 64);
+    sprintf(name, "%s/qemu-%s-%d-%d", dir, tag, (int)getpid(), seq++);
+    unlink(name);
+    return name;
+}
+
+void block_test_fail(const char *test, const char *fmt, ...)
+{
+    va_list ap;
+
+    printf("%s: FAILED: ", test);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    exit(1);
+}
+
+void block_test_fill(uint8_t *buf, int64_t sector_num, uint64_t seq)
+{
+    uint64_t *p = (uint64_t *)buf;
+    int i;
+
+    p[0] = sector_num;
+    p[1] = seq;
+    for (i = 2; i < 512 / 8; i++)
+        p[i] = sector_num * 1000003ULL + seq * 7919ULL + i;
+}
+
+int block_test_overlaps_live(BlockTestWrite *ws, int nb,
+                             int64_t sector_num, int nb_sectors)
+{
+    int i;
+
+    for (i = 0; i < nb; i++)
+        if (ws[i].live && sector_num < ws[i].sector_num + ws[i].nb_sectors &&
+            ws[i].sector_num < sector_num + nb_sectors)
+            return 1;
+    return 0;
+}
+
+void qemu_service_io(void)
+{
+}
+
+void term_printf(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void term_print_filename(const char *filename)
+{
+    printf("%s", filename);
+}
+
+/* bottom halves */
+
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    QEMUBH *bh = qemu_mallocz(sizeof(*bh));
+
+    bh->cb = cb;
+    bh->opaque = opaque;
+    bh->next = first_bh;
+    first_bh = bh;
+    return bh;
+}
+
+int qemu_bh_poll(void)
+{
+    QEMUBH *bh, **pbh;
+    int64_t start;
+    int ret = 0;
+
+    for (bh = first_bh; bh; bh = bh->next) {
+        if (!bh->deleted && bh->scheduled) {
+            bh->scheduled = 0;
+            ret = 1;
+            start = block_test_now_us();
+            bh->cb(bh->opaque);
+            handler_done(start);
+        }
+    }
+
+    pbh = &first_bh;
+    while (*pbh) {
+        bh = *pbh;
+        if (bh->deleted) {
+            *pbh = bh->next;
+            qemu_free(bh);
+        } else {
+            pbh = &bh->next;
+        }
+    }
+    return ret;
+}
+
+void qemu_bh_schedule(QEMUBH *bh)
+{
+    bh->scheduled = 1;
+}
+
+void qemu_bh_cancel(QEMUBH *bh)
+{
+    bh->scheduled = 0;
+}
+
+void qemu_bh_delete(QEMUBH *bh)
+{
+    bh->scheduled = 0;
+    bh->deleted = 1;
+}
+
+/* rt_clock timers, in ms */
+
+int64_t qemu_get_clock(QEMUClock *clock)
+{
+    return block_test_now_us() / 1000;
+}
+
+QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
+{
+    QEMUTimer *ts = qemu_mallocz(sizeof(*ts));
+
+    ts->cb = cb;
+    ts->opaque = opaque;
+    return ts;
+}
+
+void qemu_free_timer(QEMUTimer *ts)
+{
+    qemu_free(ts);
+}
+
+void qemu_del_timer(QEMUTimer *ts)
+{
+    QEMUTimer **pt;
+
+    for (pt = &active_timers; *pt; pt = &(*pt)->next) {
+        if (*pt == ts) {
+            *pt = ts->next;
+            break;
+        }
+    }
+}
+
+void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
+{
+    QEMUTimer **pt;
+
+    qemu_del_timer(ts);
+    for (pt = &active_timers; *pt; pt = &(*pt)->next)
+        if ((*pt)->expire_time > expire_time)
+            break;
+    ts->expire_time = expire_time;
+    ts->next = *pt;
+    *pt = ts;
+}
+
+static void run_timers(void)
+{
+    QEMUTimer *ts;
+    int64_t start;
+
+    while ((ts = active_timers) &&
+           ts->expire_time <= qemu_get_clock(rt_clock)) {
+        active_timers = ts->next;
+        start = block_test_now_us();
+        ts->cb(ts->opaque);
+        handler_done(start);
+    }
+}
+
+/* fd handlers */
+
+int qemu_set_fd_handler2(int fd,
+                         IOCanRWHandler *fd_read_poll,
+                         IOHandler *fd_read,
+                         IOHandler *fd_write,
+                         void *opaque)
+{
+    IOHandlerRecord *ioh;
+
+    for (ioh = first_io_handler; ioh; ioh = ioh->next)
+        if (ioh->fd == fd && !ioh->deleted)
+            break;
+
+    if (!fd_read && !fd_write) {
+        if (ioh)
+            ioh->deleted = 1;
+        return 0;
+    }
+    if (!ioh) {
+        ioh = qemu_mallocz(sizeof(*ioh));
+        ioh->fd = fd;
+        ioh->next = first_io_handler;
+        first_io_handler = ioh;
+    }
+    ioh->fd_read_poll = fd_read_poll;
+    ioh->fd_read = fd_read;
+    ioh->fd_write = fd_write;
+    ioh->opaque = opaque;
+    return 0;
+}
+
+void block_test_poll(int timeout_ms)
+{
+    IOHandlerRecord *ioh, **pioh;
+    fd_set rfds, wfds;
+    struct timeval tv, *tvp = NULL;
+    int64_t start, delta;
+    int nfds = -1, ret;
+
+    if (qemu_bh_poll())
+        timeout_ms = 0;
+    run_timers();
+    if (active_timers) {
+        delta = active_timers->expire_time - qemu_get_clock(rt_clock);
+        if (delta < 0)
+            delta = 0;
+        if (timeout_ms < 0 || delta < timeout_ms)
+            timeout_ms = delta;
+    }
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (ioh = first_io_handler; ioh; ioh = ioh->next) {
+        if (ioh->deleted)
+            continue;
+        if (ioh->fd_read &&
+            (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque)))
+            FD_SET(ioh->fd, &rfds);
+        if (ioh->fd_write)
+            FD_SET(ioh->fd, &wfds);
+        if (ioh->fd > nfds)
+            nfds = ioh->fd;
+    }
+
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+    ret = select(nfds + 1, &rfds, &wfds, NULL, tvp);
+    if (ret > 0) {
+        for (ioh = first_io_handler; ioh; ioh = ioh->next) {
+            if (!ioh->deleted && ioh->fd_read &&
+                FD_ISSET(ioh->fd, &rfds)) {
+                start = block_test_now_us();
+                ioh->fd_read(ioh->opaque);
+                handler_done(start);
+            }
+            if (!ioh->deleted && ioh->fd_write &&
+                FD_ISSET(ioh->fd, &wfds)) {
+                start = block_test_now_us();
+                ioh->fd_write(ioh->opaque);
+                handler_done(start);
+            }
+        }
+    }
+
+    pioh = &first_io_handler;
+    while (*pioh) {
+        ioh = *pioh;
+        if (ioh->deleted) {
+            *pioh = ioh->next;
+            qemu_free(ioh);
+        } else {
+            pioh = &ioh->next;
+        }
+    }
+
+    run_timers();
+    qemu_bh_poll();
+}
+
+void block_test_wait(int *done)
+{
+    while (!*done)
+        block_test_poll(-1);
+}
@@ -0,0 +1,55 @@
+/*
+ * Main loop for the block layer tests and benchmarks
+ *
+ * These programs link the block objects the way qemu-img does, but use
+ * block-test.o instead of qemu-tool.o, so bottom halves, rt_clock timers
+ * and fd handlers run from an event loop as they do in qemu.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_TEST_H
+#define BLOCK_TEST_H
+
+#include "qemu-common.h"
+#include "block_int.h"
+
+/* Run pending bottom halves, expired timers and ready fd handlers.
+   Sleeps up to timeout_ms when there is nothing to do, forever if
+   timeout_ms is negative.  */
+void block_test_poll(int timeout_ms);
+
+/* Run the loop until *done becomes non-zero */
+void block_test_wait(int *done);
+
+/* Longest single bottom half, timer or fd handler run so far, in us */
+extern int64_t block_test_max_handler_us;
+
+int64_t block_test_now_us(void);
+
+/* A fresh file name in $TMPDIR (or /tmp); the caller unlinks it */
+char *block_test_tmpname(const char *tag);
+
+/* Report a failed check and exit */
+void block_test_fail(const char *test, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/* A guest write of the write stress tests */
+typedef struct BlockTestWrite {
+    int64_t sector_num;
+    int nb_sectors;
+    uint64_t seq;               /* write number */
+    uint8_t *buf;
+    int live;                   /* submitted and not completed yet */
+} BlockTestWrite;
+
+/* Fill a sector with its number, the write number, then a pattern
+   depending on both */
+void block_test_fill(uint8_t *buf, int64_t sector_num, uint64_t seq);
+
+/* Whether a live write among the nb in ws overlaps the given sectors */
+int block_test_overlaps_live(BlockTestWrite *ws, int nb,
+                             int64_t sector_num, int nb_sectors);
+
+#endif
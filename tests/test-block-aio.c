@@ -0,0 +1,136 @@
+/*
+ * aio read test for the image formats
+ *
+ * Reads unallocated, allocated and mixed ranges of a partly written
+ * image through bdrv_aio_read() and checks the data, and that no request
+ * completes before bdrv_aio_read() has returned it: callers such as
+ * dma_bdrv_io() store the returned AIOCB.
+ *
+ * usage: test-block-aio [format...]     (default: qcow2 vmdk vpc)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#define TEST            "block-aio"
+#define IMAGE_SECTORS   (16 * 2048)
+/* larger than the cluster, grain and block sizes of all the formats */
+#define AREA_SECTORS    8192
+#define READ_SECTORS    256
+
+static int submitting;
+static int done;
+static int result;
+
+static void read_cb(void *opaque, int ret)
+{
+    const char *fmt = opaque;
+
+    if (submitting)
+        block_test_fail(fmt, "read completed before bdrv_aio_read() returned");
+    result = ret;
+    done = 1;
+}
+
+static void fill(uint8_t *buf, int64_t sector_num, int nb_sectors)
+{
+    int i;
+
+    for (i = 0; i < nb_sectors; i++)
+        memset(buf + i * 512, ((sector_num + i) & 0x7f) + 1, 512);
+}
+
+/* every other area written, the rest reads as zeroes */
+static int written(int64_t sector_num)
+{
+    return (sector_num / AREA_SECTORS) % 2;
+}
+
+static void check_read(const char *fmt, BlockDriverState *bs,
+                       int64_t sector_num, uint8_t *buf, uint8_t *ref)
+{
+    BlockDriverAIOCB *acb;
+    int i;
+
+    memset(buf, 0xaa, READ_SECTORS * 512);
+    done = 0;
+    submitting = 1;
+    acb = bdrv_aio_read(bs, sector_num, buf, READ_SECTORS, read_cb,
+                        (void *)fmt);
+    submitting = 0;
+    if (!acb)
+        block_test_fail(fmt, "aio submission failed");
+    block_test_wait(&done);
+    if (result < 0)
+        block_test_fail(fmt, "read at %" PRId64 " failed: %d", sector_num,
+                        result);
+
+    for (i = 0; i < READ_SECTORS; i++) {
+        if (written(sector_num + i))
+            fill(ref + i * 512, sector_num + i, 1);
+        else
+            memset(ref + i * 512, 0, 512);
+    }
+    if (memcmp(buf, ref, READ_SECTORS * 512))
+        block_test_fail(fmt, "read at %" PRId64 " returned bad data",
+                        sector_num);
+}
+
+static void test(const char *fmt)
+{
+    BlockDriver *drv = bdrv_find_format(fmt);
+    char *filename = block_test_tmpname(fmt);
+    BlockDriverState *bs;
+    uint8_t *buf, *ref;
+    int64_t i;
+
+    if (!drv)
+        block_test_fail(fmt, "unknown format");
+    if (bdrv_create(drv, filename, IMAGE_SECTORS, NULL, 0) < 0)
+        block_test_fail(fmt, "cannot create %s", filename);
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, BDRV_O_RDWR, drv) < 0)
+        block_test_fail(fmt, "cannot open %s", filename);
+
+    buf = qemu_memalign(512, READ_SECTORS * 512);
+    ref = qemu_memalign(512, READ_SECTORS * 512);
+    for (i = 0; i < IMAGE_SECTORS; i += READ_SECTORS) {
+        if (!written(i))
+            continue;
+        fill(buf, i, READ_SECTORS);
+        if (bdrv_write(bs, i, buf, READ_SECTORS) < 0)
+            block_test_fail(fmt, "write at %" PRId64 " failed", i);
+    }
+
+    /* unallocated, allocated, and across the boundaries both ways */
+    check_read(fmt, bs, 0, buf, ref);
+    check_read(fmt, bs, AREA_SECTORS, buf, ref);
+    check_read(fmt, bs, AREA_SECTORS - READ_SECTORS / 2, buf, ref);
+    check_read(fmt, bs, 2 * AREA_SECTORS - READ_SECTORS / 2, buf, ref);
+    check_read(fmt, bs, IMAGE_SECTORS - READ_SECTORS, buf, ref);
+
+    qemu_vfree(buf);
+    qemu_vfree(ref);
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_free(filename);
+    printf("%s: %s ok\n", TEST, fmt);
+}
+
+int main(int argc, char **argv)
+{
+    static const char *default_formats[] = { "qcow2", "vmdk", "vpc" };
+    int i;
+
+    bdrv_init();
+    if (argc > 1) {
+        for (i = 1; i < argc; i++)
+            test(argv[i]);
+    } else {
+        for (i = 0; i < ARRAY_SIZE(default_formats); i++)
+            test(default_formats[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Backing chain lookup test
+ *
+ * Looks up every sector of a fresh qcow overlay over a raw base, so that
+ * the overlay's allocation map caches all of it as unallocated, then
+ * writes to the overlay through bdrv_write(), bdrv_aio_write() and
+ * bdrv_pwrite().  After each write bdrv_chain_owner() must agree with the
+ * driver about which image holds each sector around the write, and
+ * bdrv_read_chain() and bdrv_read() must return the new data.
+ *
+ * usage: test-block-chain
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#define TEST            "block-chain"
+#define IMAGE_SECTORS   4096
+/* around a write, more than an allocation map chunk either side */
+#define MARGIN          256
+
+static uint8_t *ref;            /* what the guest should see */
+static uint8_t *buf;
+
+/* owner and data of every sector in [sector_num, sector_num + nb_sectors) */
+static void check(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
+                  const char *what)
+{
+    BlockDriverState *owner;
+    int64_t i;
+    int n, allocated;
+
+    sector_num = MAX(sector_num, 0);
+    nb_sectors = MIN(nb_sectors, IMAGE_SECTORS - sector_num);
+    for (i = sector_num; i < sector_num + nb_sectors; i++) {
+        owner = bdrv_chain_owner(bs, i, 1, &n);
+        allocated = bs->drv->bdrv_is_allocated(bs, i, 1, &n);
+        if (owner != (allocated ? bs : bs->backing_hd))
+            block_test_fail(TEST, "%s: sector %" PRId64 " is looked up in"
+                            " the %s", what, i,
+                            owner == bs ? "overlay" : "base");
+    }
+
+    if (bdrv_read_chain(bs, sector_num, buf, nb_sectors) < 0)
+        block_test_fail(TEST, "%s: chain read failed", what);
+    if (memcmp(buf, ref + sector_num * 512, nb_sectors * 512))
+        block_test_fail(TEST, "%s: chain read returned old data", what);
+    if (bdrv_read(bs, sector_num, buf, nb_sectors) < 0)
+        block_test_fail(TEST, "%s: read failed", what);
+    if (memcmp(buf, ref + sector_num * 512, nb_sectors * 512))
+        block_test_fail(TEST, "%s: read returned old data", what);
+    printf("%s: %s ok\n", TEST, what);
+}
+
+static void write_cb(void *opaque, int ret)
+{
+    int *done = opaque;
+
+    *done = ret < 0 ? ret : 1;
+}
+
+int main(int argc, char **argv)
+{
+    char *base = block_test_tmpname("raw");
+    char *overlay = block_test_tmpname("qcow");
+    BlockDriverState *bs;
+    int done;
+
+    bdrv_init();
+    ref = qemu_memalign(512, IMAGE_SECTORS * 512);
+    buf = qemu_memalign(512, IMAGE_SECTORS * 512);
+
+    if (bdrv_create(bdrv_find_format("raw"), base, IMAGE_SECTORS,
+                    NULL, 0) < 0 ||
+        bdrv_create(bdrv_find_format("qcow"), overlay, IMAGE_SECTORS,
+                    base, 0) < 0)
+        block_test_fail(TEST, "cannot create the images");
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, base, BDRV_O_RDWR, bdrv_find_format("raw")) < 0)
+        block_test_fail(TEST, "cannot open %s", base);
+    memset(ref, 1, IMAGE_SECTORS * 512);
+    if (bdrv_write(bs, 0, ref, IMAGE_SECTORS) < 0)
+        block_test_fail(TEST, "cannot write %s", base);
+    bdrv_delete(bs);
+
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, overlay, BDRV_O_RDWR, bdrv_find_format("qcow")) < 0)
+        block_test_fail(TEST, "cannot open %s", overlay);
+    check(bs, 0, IMAGE_SECTORS, "empty overlay");
+
+    /* a whole cluster, then a single sector in the middle of one */
+    memset(ref + 512 * 512, 2, 8 * 512);
+    if (bdrv_write(bs, 512, ref + 512 * 512, 8) < 0)
+        block_test_fail(TEST, "write failed");
+    check(bs, 512 - MARGIN, 8 + 2 * MARGIN, "bdrv_write");
+
+    memset(ref + 1029 * 512, 3, 512);
+    if (bdrv_write(bs, 1029, ref + 1029 * 512, 1) < 0)
+        block_test_fail(TEST, "write failed");
+    check(bs, 1029 - MARGIN, 1 + 2 * MARGIN, "bdrv_write of one sector");
+
+    memset(ref + 2048 * 512, 4, 64 * 512);
+    done = 0;
+    if (!bdrv_aio_write(bs, 2048, ref + 2048 * 512, 64, write_cb, &done))
+        block_test_fail(TEST, "aio write not submitted");
+    block_test_wait(&done);
+    if (done < 0)
+        block_test_fail(TEST, "aio write failed: %d", done);
+    check(bs, 2048 - MARGIN, 64 + 2 * MARGIN, "bdrv_aio_write");
+
+    memset(ref + 3000 * 512 + 100, 5, 1000);
+    if (bdrv_pwrite(bs, 3000 * 512 + 100, ref + 3000 * 512 + 100,
+                    1000) != 1000)
+        block_test_fail(TEST, "pwrite failed");
+    check(bs, 3000 - MARGIN, 3 + 2 * MARGIN, "bdrv_pwrite");
+
+    check(bs, 0, IMAGE_SECTORS, "whole image");
+
+    qemu_vfree(ref);
+    qemu_vfree(buf);
+    bdrv_delete(bs);
+    unlink(overlay);
+    unlink(base);
+    qemu_free(overlay);
+    qemu_free(base);
+    printf("%s: ok\n", TEST);
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Live commit test
+ *
+ * Commits a qcow overlay into its raw backing file in the background
+ * while the guest keeps writing to it, rate limited so that the job
+ * needs several passes.  Afterwards the backing file must hold exactly
+ * what the guest sees and the overlay must be empty.  A cancelled job
+ * must leave what the guest sees alone.
+ *
+ * usage: test-block-commit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#define TEST            "block-commit"
+#define IMAGE_SECTORS   (32 * 2048)
+#define CHUNK_SECTORS   128
+#define QUEUE_DEPTH     4
+#define MAX_SECTORS     64
+#define SPEED           (16 << 20)
+
+static char *base;
+static char *overlay;
+static uint64_t model[IMAGE_SECTORS];   /* write number in each sector */
+static uint64_t seq;
+static unsigned int seed = 1;
+static int failed;
+
+static void write_sync(BlockDriverState *bs, int64_t sector_num,
+                       int nb_sectors)
+{
+    uint8_t *buf = qemu_memalign(512, nb_sectors * 512);
+    int i;
+
+    seq++;
+    for (i = 0; i < nb_sectors; i++) {
+        block_test_fill(buf + i * 512, sector_num + i, seq);
+        model[sector_num + i] = seq;
+    }
+    if (bdrv_write(bs, sector_num, buf, nb_sectors) < 0)
+        block_test_fail(TEST, "write at %" PRId64 " failed", sector_num);
+    qemu_vfree(buf);
+}
+
+static void check(const char *what, BlockDriverState *bs)
+{
+    uint8_t *buf = qemu_memalign(512, CHUNK_SECTORS * 512);
+    uint8_t ref[512];
+    int64_t i;
+    int j;
+
+    for (i = 0; i < IMAGE_SECTORS; i += CHUNK_SECTORS) {
+        if (bdrv_read(bs, i, buf, CHUNK_SECTORS) < 0)
+            block_test_fail(TEST, "%s: read at %" PRId64 " failed", what, i);
+        for (j = 0; j < CHUNK_SECTORS; j++) {
+            block_test_fill(ref, i + j, model[i + j]);
+            if (memcmp(buf + j * 512, ref, 512))
+                block_test_fail(TEST, "%s: sector %" PRId64 " does not hold"
+                                " write %" PRIu64, what, i + j,
+                                model[i + j]);
+        }
+    }
+    qemu_vfree(buf);
+}
+
+static BlockDriverState *open_image(const char *filename, const char *fmt)
+{
+    BlockDriverState *bs = bdrv_new("");
+
+    if (bdrv_open2(bs, filename, BDRV_O_RDWR, bdrv_find_format(fmt)) < 0)
+        block_test_fail(TEST, "cannot open %s", filename);
+    return bs;
+}
+
+/* a raw base written all over, and an overlay with some chunks written */
+static BlockDriverState *create_images(void)
+{
+    BlockDriverState *bs;
+    int64_t i;
+
+    unlink(base);
+    unlink(overlay);
+    memset(model, 0, sizeof(model));
+    if (bdrv_create(bdrv_find_format("raw"), base, IMAGE_SECTORS,
+                    NULL, 0) < 0 ||
+        bdrv_create(bdrv_find_format("qcow"), overlay, IMAGE_SECTORS,
+                    base, 0) < 0)
+        block_test_fail(TEST, "cannot create the images");
+
+    bs = open_image(base, "raw");
+    for (i = 0; i < IMAGE_SECTORS; i += 1024)
+        write_sync(bs, i, 1024);
+    bdrv_delete(bs);
+
+    bs = open_image(overlay, "qcow");
+    for (i = 0; i < IMAGE_SECTORS; i += CHUNK_SECTORS)
+        if (rand_r(&seed) % 10 < 3)
+            write_sync(bs, i, CHUNK_SECTORS);
+    return bs;
+}
+
+static void write_cb(void *opaque, int ret)
+{
+    BlockTestWrite *w = opaque;
+
+    if (ret < 0)
+        failed = ret;
+    w->live = 0;
+}
+
+/* Keep QUEUE_DEPTH guest writes in flight until the job stops or
+   until cancel_ms have passed, if not 0, and cancel it then. */
+static int run_guest(BlockDriverState *bs, int cancel_ms)
+{
+    BlockTestWrite ws[QUEUE_DEPTH];
+    int64_t end = block_test_now_us() + cancel_ms * 1000;
+    int i, j, nb_writes = 0;
+
+    memset(ws, 0, sizeof(ws));
+    for (i = 0; i < QUEUE_DEPTH; i++)
+        ws[i].buf = qemu_memalign(512, MAX_SECTORS * 512);
+
+    while (bdrv_commit_status(bs) == -EINPROGRESS) {
+        if (cancel_ms && block_test_now_us() >= end) {
+            if (bdrv_commit_cancel(bs) < 0)
+                block_test_fail(TEST, "cannot cancel the job");
+            cancel_ms = 0;
+        }
+        for (i = 0; i < QUEUE_DEPTH; i++) {
+            BlockTestWrite *w = &ws[i];
+
+            if (w->live)
+                continue;
+            do {
+                w->nb_sectors = 1 + rand_r(&seed) % MAX_SECTORS;
+                w->sector_num = rand_r(&seed) %
+                                (IMAGE_SECTORS - w->nb_sectors);
+            } while (block_test_overlaps_live(ws, QUEUE_DEPTH, w->sector_num,
+                                              w->nb_sectors));
+            seq++;
+            for (j = 0; j < w->nb_sectors; j++) {
+                block_test_fill(w->buf + j * 512, w->sector_num + j, seq);
+                model[w->sector_num + j] = seq;
+            }
+            w->live = 1;
+            nb_writes++;
+            if (!bdrv_aio_write(bs, w->sector_num, w->buf, w->nb_sectors,
+                                write_cb, w))
+                block_test_fail(TEST, "aio submission failed");
+        }
+        block_test_poll(1);
+    }
+
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        while (ws[i].live)
+            block_test_poll(-1);
+        qemu_vfree(ws[i].buf);
+    }
+    if (failed)
+        block_test_fail(TEST, "guest write failed: %d", failed);
+    return nb_writes;
+}
+
+static void test_live_commit(void)
+{
+    BlockDriverState *bs = create_images();
+    int64_t i;
+    int nb_writes, n, ret;
+
+    bdrv_commit_set_speed(SPEED);
+    if (bdrv_commit_start(bs) < 0)
+        block_test_fail(TEST, "cannot start the job");
+    nb_writes = run_guest(bs, 0);
+    ret = bdrv_commit_status(bs);
+    if (ret < 0)
+        block_test_fail(TEST, "commit failed: %d", ret);
+
+    check("overlay after commit", bs);
+    for (i = 0; i < IMAGE_SECTORS; i += n)
+        if (bdrv_is_allocated(bs, i, IMAGE_SECTORS - i, &n) || n <= 0)
+            block_test_fail(TEST, "the overlay was not emptied");
+    bdrv_delete(bs);
+
+    bs = open_image(base, "raw");
+    check("base after commit", bs);
+    bdrv_delete(bs);
+    printf("%s: live commit with %d guest writes: ok\n", TEST, nb_writes);
+}
+
+static void test_cancel(void)
+{
+    BlockDriverState *bs = create_images();
+    int nb_writes, ret;
+
+    bdrv_commit_set_speed(SPEED);
+    if (bdrv_commit_start(bs) < 0)
+        block_test_fail(TEST, "cannot start the job");
+    nb_writes = run_guest(bs, 100);
+    ret = bdrv_commit_status(bs);
+    if (ret != -ECANCELED)
+        block_test_fail(TEST, "cancelled job ended with %d", ret);
+    check("overlay after cancel", bs);
+    bdrv_delete(bs);
+    printf("%s: cancel with %d guest writes: ok\n", TEST, nb_writes);
+}
+
+static void cleanup(void)
+{
+    unlink(base);
+    unlink(overlay);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    base = block_test_tmpname("commit-base");
+    overlay = block_test_tmpname("commit-overlay");
+    atexit(cleanup);
+
+    test_live_commit();
+    test_cancel();
+    printf("%s: ok\n", TEST);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Read-ahead consistency test
+ *
+ * Reads a raw image sequentially until read-ahead kicks in, then writes
+ * inside the prefetched windows, once after a window was loaded and once
+ * while it is most likely still loading, and reads the data back.  Reads
+ * must always see the last write.  A change made to the file behind the
+ * block layer's back shows that the reads are really served from the
+ * prefetched windows.
+ *
+ * usage: test-block-readahead
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#define TEST            "block-readahead"
+#define IMAGE_SECTORS   2048
+/* 64 sector windows */
+#define READAHEAD_KB    256
+#define READ_SECTORS    8
+
+static uint8_t model[IMAGE_SECTORS];    /* byte value of each sector */
+static uint8_t *buf;
+
+static void done_cb(void *opaque, int ret)
+{
+    int *done = opaque;
+
+    *done = ret < 0 ? ret : 1;
+}
+
+static void wait_done(int *done, const char *what, int64_t sector_num)
+{
+    block_test_wait(done);
+    if (*done < 0)
+        block_test_fail(TEST, "%s at %" PRId64 " failed: %d", what,
+                        sector_num, *done);
+}
+
+static void submit_read(BlockDriverState *bs, int64_t sector_num,
+                        int nb_sectors, int *done)
+{
+    memset(buf, 0xff, nb_sectors * 512);
+    *done = 0;
+    if (!bdrv_aio_read(bs, sector_num, buf, nb_sectors, done_cb, done))
+        block_test_fail(TEST, "read at %" PRId64 " not submitted",
+                        sector_num);
+}
+
+static void check_read(BlockDriverState *bs, int64_t sector_num,
+                       int nb_sectors, const char *why)
+{
+    uint8_t ref[512];
+    int done, i;
+
+    submit_read(bs, sector_num, nb_sectors, &done);
+    wait_done(&done, "read", sector_num);
+    for (i = 0; i < nb_sectors; i++) {
+        memset(ref, model[sector_num + i], 512);
+        if (memcmp(buf + i * 512, ref, 512))
+            block_test_fail(TEST, "sector %" PRId64 " does not hold %d %s",
+                            sector_num + i, model[sector_num + i], why);
+    }
+}
+
+static void submit_write(BlockDriverState *bs, uint8_t *wbuf,
+                         int64_t sector_num, int nb_sectors, uint8_t val,
+                         int *done)
+{
+    memset(wbuf, val, nb_sectors * 512);
+    memset(model + sector_num, val, nb_sectors);
+    *done = 0;
+    if (!bdrv_aio_write(bs, sector_num, wbuf, nb_sectors, done_cb, done))
+        block_test_fail(TEST, "write at %" PRId64 " not submitted",
+                        sector_num);
+}
+
+/* two sequential reads from sector_num, the next one starts prefetching */
+static int64_t start_stream(BlockDriverState *bs, int64_t sector_num)
+{
+    int i;
+
+    for (i = 0; i < 2; i++, sector_num += READ_SECTORS)
+        check_read(bs, sector_num, READ_SECTORS, "on a sequential read");
+    return sector_num;
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = block_test_tmpname("raw");
+    BlockDriverState *bs;
+    uint8_t *wbuf, sector[512];
+    int64_t next;
+    int fd, rdone, wdone;
+
+    bdrv_init();
+    if (bdrv_create(bdrv_find_format("raw"), filename, IMAGE_SECTORS,
+                    NULL, 0) < 0)
+        block_test_fail(TEST, "cannot create %s", filename);
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, BDRV_O_RDWR, bdrv_find_format("raw")) < 0)
+        block_test_fail(TEST, "cannot open %s", filename);
+    if (bdrv_set_readahead(bs, READAHEAD_KB) < 0)
+        block_test_fail(TEST, "cannot turn read-ahead on");
+    fd = open(filename, O_RDWR);
+    if (fd < 0)
+        block_test_fail(TEST, "cannot open %s: %s", filename,
+                        strerror(errno));
+
+    buf = qemu_memalign(512, 64 * 512);
+    wbuf = qemu_memalign(512, 64 * 512);
+    memset(buf, 1, 64 * 512);
+    memset(model, 1, sizeof(model));
+    for (next = 0; next < IMAGE_SECTORS; next += 64)
+        if (bdrv_write(bs, next, buf, 64) < 0)
+            block_test_fail(TEST, "write at %" PRId64 " failed", next);
+
+    /* a loaded window: the read after the one that starts it waits for it */
+    next = start_stream(bs, 0);
+    check_read(bs, next, READ_SECTORS, "on a sequential read");
+    next += READ_SECTORS;
+    check_read(bs, next, READ_SECTORS, "from the prefetched window");
+    memset(sector, 9, 512);
+    if (pwrite(fd, sector, 512, (next + 8) * 512) != 512)
+        block_test_fail(TEST, "cannot change %s", filename);
+    check_read(bs, next + 8, 1, "from the prefetched window");
+    model[next + 8] = 9;
+
+    submit_write(bs, wbuf, next + 16, READ_SECTORS, 2, &wdone);
+    wait_done(&wdone, "write", next + 16);
+    check_read(bs, next + 16, READ_SECTORS, "after a write to its window");
+    check_read(bs, next, 64, "after a write to a loaded window");
+    printf("%s: write to a loaded window ok\n", TEST);
+
+    /* a window still loading: write right after the read that starts it */
+    next = start_stream(bs, 1024);
+    submit_read(bs, next, READ_SECTORS, &rdone);
+    next += READ_SECTORS;
+    submit_write(bs, wbuf, next + 16, READ_SECTORS, 3, &wdone);
+    wait_done(&rdone, "read", next - READ_SECTORS);
+    wait_done(&wdone, "write", next + 16);
+    check_read(bs, next + 16, READ_SECTORS, "after a write to its window");
+    check_read(bs, next, 64, "after a write to a loading window");
+    printf("%s: write to a loading window ok\n", TEST);
+
+    close(fd);
+    qemu_vfree(buf);
+    qemu_vfree(wbuf);
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_free(filename);
+    printf("%s: ok\n", TEST);
+    return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * NBD client reconnection test
+ *
+ * Runs qemu-nbd on a unix socket, kills it with requests in flight and
+ * checks that the requests complete correctly once it is back, that the
+ * client gives up when it does not come back, and that no fd handler or
+ * timer ever blocks the loop while the server is away.  A synchronous
+ * read, which waits where no timer runs, must also survive a restart.
+ *
+ * usage: test-nbd-reconnect [path to qemu-nbd]    (default: $QEMU_NBD)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TEST            "nbd-reconnect"
+#define IMAGE_SECTORS   (8 * 2048)
+#define REQ_SECTORS     64
+/* far below the reconnect delays, which start at 100 ms */
+#define MAX_HANDLER_US  50000
+
+static const char *qemu_nbd;
+static char *image;
+static char *sockpath;
+static pid_t server = -1;
+
+static int done;
+static int result;
+
+static void cb(void *opaque, int ret)
+{
+    result = ret;
+    done = 1;
+}
+
+static void stop_server(void)
+{
+    if (server > 0) {
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+        server = -1;
+    }
+}
+
+static void cleanup(void)
+{
+    stop_server();
+    unlink(sockpath);
+    unlink(image);
+}
+
+/* start qemu-nbd after delay_ms, wait for it if there is no delay */
+static void start_server_after(int delay_ms)
+{
+    struct stat st;
+    int i;
+
+    unlink(sockpath);
+    server = fork();
+    if (server < 0)
+        block_test_fail(TEST, "fork: %s", strerror(errno));
+    if (server == 0) {
+        usleep(delay_ms * 1000);
+        execl(qemu_nbd, qemu_nbd, "-t", "-k", sockpath, image, NULL);
+        fprintf(stderr, "%s: %s\n", qemu_nbd, strerror(errno));
+        _exit(1);
+    }
+    if (delay_ms)
+        return;
+    for (i = 0; i < 500 && stat(sockpath, &st) < 0; i++)
+        usleep(10000);
+    if (i == 500)
+        block_test_fail(TEST, "%s did not start", qemu_nbd);
+}
+
+static void start_server(void)
+{
+    start_server_after(0);
+}
+
+static void fill(uint8_t *buf, int64_t sector_num, int nb_sectors, int tag)
+{
+    int i;
+
+    for (i = 0; i < nb_sectors; i++)
+        memset(buf + i * 512, (sector_num + i + tag) & 0xff, 512);
+}
+
+/* read the image behind the server's back */
+static void check_image(int64_t sector_num, int nb_sectors, int tag)
+{
+    BlockDriverState *bs = bdrv_new("");
+    uint8_t *buf = qemu_malloc(nb_sectors * 512);
+    uint8_t *ref = qemu_malloc(nb_sectors * 512);
+
+    if (bdrv_open2(bs, image, 0, bdrv_find_format("qcow2")) < 0 ||
+        bdrv_read(bs, sector_num, buf, nb_sectors) < 0)
+        block_test_fail(TEST, "cannot read %s", image);
+    bdrv_delete(bs);
+    fill(ref, sector_num, nb_sectors, tag);
+    if (memcmp(buf, ref, nb_sectors * 512))
+        block_test_fail(TEST, "write at %" PRId64 " did not reach the image",
+                        sector_num);
+    qemu_free(buf);
+    qemu_free(ref);
+}
+
+static void rw(BlockDriverState *bs, int is_write, int64_t sector_num,
+               uint8_t *buf)
+{
+    BlockDriverAIOCB *acb;
+
+    done = 0;
+    if (is_write)
+        acb = bdrv_aio_write(bs, sector_num, buf, REQ_SECTORS, cb, NULL);
+    else
+        acb = bdrv_aio_read(bs, sector_num, buf, REQ_SECTORS, cb, NULL);
+    if (!acb)
+        block_test_fail(TEST, "aio submission failed");
+}
+
+/* poll for ms milliseconds, nothing must complete meanwhile */
+static void idle(int ms)
+{
+    int64_t end = block_test_now_us() + ms * 1000;
+
+    while (block_test_now_us() < end) {
+        block_test_poll(10);
+        if (done)
+            block_test_fail(TEST, "request completed without a server");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    BlockDriverState *bs;
+    uint8_t *buf, *ref;
+    char *filename;
+    int i;
+
+    qemu_nbd = argc > 1 ? argv[1] : getenv("QEMU_NBD");
+    if (!qemu_nbd)
+        qemu_nbd = "./qemu-nbd";
+    signal(SIGPIPE, SIG_IGN);
+    bdrv_init();
+
+    image = block_test_tmpname("nbd-image");
+    sockpath = block_test_tmpname("nbd-sock");
+    atexit(cleanup);
+
+    buf = qemu_memalign(512, REQ_SECTORS * 512);
+    ref = qemu_memalign(512, REQ_SECTORS * 512);
+    /* qemu-nbd has no format option, and raw images are never probed */
+    bs = bdrv_new("");
+    if (bdrv_create(bdrv_find_format("qcow2"), image, IMAGE_SECTORS,
+                    NULL, 0) < 0 ||
+        bdrv_open2(bs, image, 0, bdrv_find_format("qcow2")) < 0)
+        block_test_fail(TEST, "cannot create %s", image);
+    for (i = 0; i < IMAGE_SECTORS; i += REQ_SECTORS) {
+        fill(buf, i, REQ_SECTORS, 0);
+        if (bdrv_write(bs, i, buf, REQ_SECTORS) < 0)
+            block_test_fail(TEST, "cannot write %s", image);
+    }
+    bdrv_delete(bs);
+
+    start_server();
+    filename = qemu_malloc(strlen(sockpath) + 16);
+    sprintf(filename, "nbd:unix:%s", sockpath);
+    bs = bdrv_new("");
+    if (bdrv_open(bs, filename, 0) < 0)
+        block_test_fail(TEST, "cannot open %s", filename);
+
+    /* the server goes away with a write and then a read outstanding */
+    stop_server();
+    fill(buf, 128, REQ_SECTORS, 1);
+    rw(bs, 1, 128, buf);
+    block_test_wait(&done);
+    if (result != -EIO)
+        block_test_fail(TEST, "write without a server returned %d", result);
+
+    fill(buf, 256, REQ_SECTORS, 1);
+    rw(bs, 1, 256, buf);
+    idle(150);
+    start_server();
+    block_test_wait(&done);
+    if (result < 0)
+        block_test_fail(TEST, "write across a restart failed: %d", result);
+    check_image(256, REQ_SECTORS, 1);
+
+    stop_server();
+    rw(bs, 0, 256, buf);
+    idle(250);
+    start_server();
+    block_test_wait(&done);
+    if (result < 0)
+        block_test_fail(TEST, "read across a restart failed: %d", result);
+    fill(ref, 256, REQ_SECTORS, 1);
+    if (memcmp(buf, ref, REQ_SECTORS * 512))
+        block_test_fail(TEST, "read across a restart returned bad data");
+
+#ifdef CONFIG_AIO
+    /* bdrv_read() waits in qemu_aio_wait(), the retry timer never runs.
+       Without threads to wake it, it retries at once and fails here. */
+    stop_server();
+    start_server_after(250);
+    memset(buf, 0, REQ_SECTORS * 512);
+    if (bdrv_read(bs, 256, buf, REQ_SECTORS) < 0)
+        block_test_fail(TEST, "synchronous read across a restart failed");
+    if (memcmp(buf, ref, REQ_SECTORS * 512))
+        block_test_fail(TEST, "synchronous read across a restart returned"
+                        " bad data");
+#endif
+
+    /* after giving up, the next request connects again */
+    rw(bs, 0, 0, buf);
+    block_test_wait(&done);
+    fill(ref, 0, REQ_SECTORS, 0);
+    if (result < 0 || memcmp(buf, ref, REQ_SECTORS * 512))
+        block_test_fail(TEST, "read after giving up failed: %d", result);
+
+    if (block_test_max_handler_us > MAX_HANDLER_US)
+        block_test_fail(TEST, "the loop was blocked for %" PRId64 " us",
+                        block_test_max_handler_us);
+
+    bdrv_delete(bs);
+    qemu_free(filename);
+    qemu_vfree(buf);
+    qemu_vfree(ref);
+    printf("%s: ok (longest handler %" PRId64 " us)\n", TEST,
+           block_test_max_handler_us);
+    return 0;
+}
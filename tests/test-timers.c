@@ -0,0 +1,167 @@
+/*
+ * Main loop timeout test
+ *
+ * Arms one timer at a time and idles the way the device model's main
+ * loop does: wait for qemu_calculate_timeout() ms, then run the timers.
+ * No wakeup may come before the timer is due, the timer must not fire
+ * late, and a deadline that has already passed must not make the loop
+ * block.
+ *
+ * usage: test-timers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "sysemu.h"
+#include "qemu-timer-int.h"
+
+#include <sys/time.h>
+
+#define TEST            "timers"
+/* how late a timer may fire on a loaded machine */
+#define LATE_MS         20
+
+int vm_running;
+
+static int fired;
+
+static int64_t now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* rt_clock in ms, vm_clock in ns, both from the host clock */
+int64_t qemu_get_clock(QEMUClock *clock)
+{
+    if (clock == rt_clock)
+        return now_us() / 1000;
+    return now_us() * 1000;
+}
+
+void qemu_timer_first_changed(QEMUTimer *ts)
+{
+}
+
+static void __attribute__ ((format (printf, 1, 2))) fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: ", TEST);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+static void timer_cb(void *opaque)
+{
+    fired++;
+}
+
+static void run_timers(void)
+{
+    if (vm_running)
+        qemu_run_timers(&active_timers[QEMU_TIMER_VIRTUAL],
+                        qemu_get_clock(vm_clock));
+    qemu_run_timers(&active_timers[QEMU_TIMER_REALTIME],
+                    qemu_get_clock(rt_clock));
+}
+
+/* one main loop iteration without fds, like main_loop_wait() */
+static void idle(int timeout)
+{
+    struct timeval tv;
+
+    if (qemu_iohandler_epoll(timeout) < 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        select(0, NULL, NULL, NULL, &tv);
+    }
+    run_timers();
+}
+
+static void check_idle(QEMUClock *clock, int delay_ms)
+{
+    QEMUTimer *ts = qemu_new_timer(clock, timer_cb, NULL);
+    int64_t start = now_us(), late_us;
+    int timeout, wakeups = 0;
+
+    qemu_mod_timer(ts, clock == rt_clock ? start / 1000 + delay_ms :
+                                           (start + delay_ms * 1000) * 1000);
+    fired = 0;
+    while (!fired) {
+        timeout = qemu_calculate_timeout();
+        if (timeout < 0)
+            fail("no timeout with a timer armed");
+        if (timeout > delay_ms)
+            fail("timeout %d ms for a timer due in %d ms", timeout, delay_ms);
+        idle(timeout);
+        wakeups++;
+    }
+    late_us = now_us() - start - delay_ms * 1000;
+    if (wakeups > 1)
+        fail("%s timer in %d ms: %d wakeups, %d early",
+             clock == rt_clock ? "rt" : "vm", delay_ms, wakeups, wakeups - 1);
+    if (late_us > LATE_MS * 1000)
+        fail("%s timer in %d ms fired %" PRId64 " us late",
+             clock == rt_clock ? "rt" : "vm", delay_ms, late_us);
+    printf("%s: %s timer in %3d ms: one wakeup, %5" PRId64 " us late: ok\n",
+           TEST, clock == rt_clock ? "rt" : "vm", delay_ms, late_us);
+    qemu_free_timer(ts);
+}
+
+static void check_passed(QEMUClock *clock)
+{
+    QEMUTimer *ts = qemu_new_timer(clock, timer_cb, NULL);
+    int timeout;
+
+    qemu_mod_timer(ts, qemu_get_clock(clock) - (clock == rt_clock ? 100 :
+                                                100 * 1000000LL));
+    timeout = qemu_calculate_timeout();
+    if (timeout != 0)
+        fail("timeout %d ms for a %s timer that is overdue", timeout,
+             clock == rt_clock ? "rt" : "vm");
+    fired = 0;
+    idle(timeout);
+    if (!fired)
+        fail("an overdue timer did not fire");
+    qemu_free_timer(ts);
+}
+
+int main(int argc, char **argv)
+{
+    static const int delays[] = { 1, 7, 50, 130 };
+    QEMUTimer *ts;
+    int i;
+
+    rt_clock = qemu_new_clock(QEMU_TIMER_REALTIME);
+    vm_clock = qemu_new_clock(QEMU_TIMER_VIRTUAL);
+
+    if (qemu_calculate_timeout() != -1)
+        fail("a timeout without any timer armed");
+
+    /* virtual timers only count while the VM runs */
+    ts = qemu_new_timer(vm_clock, timer_cb, NULL);
+    qemu_mod_timer(ts, qemu_get_clock(vm_clock) + 1000000);
+    if (qemu_calculate_timeout() != -1)
+        fail("a timeout for a virtual timer of a stopped VM");
+    qemu_del_timer(ts);
+    qemu_free_timer(ts);
+    vm_running = 1;
+
+    for (i = 0; i < ARRAY_SIZE(delays); i++) {
+        check_idle(rt_clock, delays[i]);
+        check_idle(vm_clock, delays[i]);
+    }
+    check_passed(rt_clock);
+    check_passed(vm_clock);
+    printf("%s: ok\n", TEST);
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * virtio-blk request merging test
+ *
+ * Feeds kicks of requests through the batching code of virtio-blk and
+ * runs every submission against a raw image, one at a time.  Adjacent
+ * requests must be merged within the limits, every request must be
+ * completed exactly once, and a request must never overtake an earlier
+ * one that it overlaps: reads see the writes queued before them and the
+ * last write to a sector wins.
+ *
+ * usage: test-virtio-merge
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "virtio-blk-req.h"
+
+#define TEST            "virtio-merge"
+#define IMAGE_SECTORS   1024
+#define MAX_REQS        64
+
+static BlockDriverState *bs;
+static uint8_t model[IMAGE_SECTORS];    /* byte value of each sector */
+
+static VirtIOBlockReq reqs[MAX_REQS];
+static int nb_reqs;
+
+/* what was submitted, in order */
+static struct {
+    int is_write;
+    int64_t sector_num;
+    int nb_sectors;
+} subs[MAX_REQS];
+static int nb_subs;
+
+static void rw_cb(void *opaque, int ret)
+{
+    int *done = opaque;
+
+    *done = ret < 0 ? ret : 1;
+}
+
+/* runs each submission to the end, so the submission order is the
+   order in which the image sees the requests */
+static void virtio_blk_submit(VirtIOBlockReq *req, int nb_sectors)
+{
+    int is_write = req->out->type & VIRTIO_BLK_T_OUT;
+    BlockDriverAIOCB *acb;
+    VirtIOBlockReq *next;
+    int done = 0;
+
+    subs[nb_subs].is_write = is_write;
+    subs[nb_subs].sector_num = req->out->sector;
+    subs[nb_subs].nb_sectors = nb_sectors;
+    nb_subs++;
+
+    if (req->qiov.size != nb_sectors * 512)
+        block_test_fail(TEST, "%d sectors submitted with %zu bytes",
+                        nb_sectors, req->qiov.size);
+    if (is_write)
+        acb = bdrv_aio_writev(bs, req->out->sector, &req->qiov, nb_sectors,
+                              rw_cb, &done);
+    else
+        acb = bdrv_aio_readv(bs, req->out->sector, &req->qiov, nb_sectors,
+                             rw_cb, &done);
+    if (!acb)
+        block_test_fail(TEST, "aio submission failed");
+    block_test_wait(&done);
+    if (done < 0)
+        block_test_fail(TEST, "aio request failed: %d", done);
+
+    for (; req != NULL; req = next) {
+        next = req->merged;
+        req->merged = NULL;
+        req->done++;
+    }
+}
+
+/* a guest request, as virtio_blk_map_request() leaves it */
+static VirtIOBlockReq *new_req(int type, int64_t sector_num, int nb_sectors,
+                               uint8_t val)
+{
+    VirtIOBlockReq *req = &reqs[nb_reqs++];
+
+    req->hdr.type = type;
+    req->hdr.sector = sector_num;
+    req->out = &req->hdr;
+    req->data = qemu_memalign(512, nb_sectors * 512);
+    memset(req->data, type & VIRTIO_BLK_T_OUT ? val : 0xff,
+           nb_sectors * 512);
+    qemu_iovec_init(&req->qiov, 1);
+    qemu_iovec_add(&req->qiov, req->data, nb_sectors * 512);
+    req->size = req->qiov.size;
+    req->merged = NULL;
+    req->done = 0;
+    return req;
+}
+
+static void add_write(VirtIOBlockBatch *b, int64_t sector_num,
+                      int nb_sectors, uint8_t val)
+{
+    virtio_blk_batch_add(b, new_req(VIRTIO_BLK_T_OUT, sector_num, nb_sectors,
+                                    val));
+    memset(model + sector_num, val, nb_sectors);
+}
+
+/* a read queued now must see what the model holds now */
+static VirtIOBlockReq *add_read(VirtIOBlockBatch *b, int64_t sector_num,
+                                int nb_sectors, uint8_t *expected)
+{
+    VirtIOBlockReq *req = new_req(VIRTIO_BLK_T_IN, sector_num, nb_sectors, 0);
+
+    memcpy(expected, model + sector_num, nb_sectors);
+    virtio_blk_batch_add(b, req);
+    return req;
+}
+
+static void check_read(VirtIOBlockReq *req, const uint8_t *expected)
+{
+    int i, nb_sectors = req->size / 512;
+    uint8_t ref[512];
+
+    for (i = 0; i < nb_sectors; i++) {
+        memset(ref, expected[i], 512);
+        if (memcmp(req->data + i * 512, ref, 512))
+            block_test_fail(TEST, "read of sector %" PRId64 " (request %d)"
+                            " does not see %d", req->out->sector + i,
+                            req->seq, expected[i]);
+    }
+}
+
+static void check_image(void)
+{
+    uint8_t *buf = qemu_memalign(512, IMAGE_SECTORS * 512), ref[512];
+    int i;
+
+    if (bdrv_read(bs, 0, buf, IMAGE_SECTORS) < 0)
+        block_test_fail(TEST, "cannot read the image");
+    for (i = 0; i < IMAGE_SECTORS; i++) {
+        memset(ref, model[i], 512);
+        if (memcmp(buf + i * 512, ref, 512))
+            block_test_fail(TEST, "sector %d does not hold %d", i, model[i]);
+    }
+    qemu_vfree(buf);
+}
+
+/* every request completed once, nb_subs submissions in all */
+static void finish_kick(const char *what, int expected_subs)
+{
+    int i;
+
+    for (i = 0; i < nb_reqs; i++) {
+        if (reqs[i].done != 1)
+            block_test_fail(TEST, "%s: request %d completed %d times", what,
+                            reqs[i].seq, reqs[i].done);
+    }
+    if (nb_subs != expected_subs)
+        block_test_fail(TEST, "%s: %d submissions, expected %d", what,
+                        nb_subs, expected_subs);
+    check_image();
+
+    for (i = 0; i < nb_reqs; i++) {
+        qemu_iovec_destroy(&reqs[i].qiov);
+        qemu_vfree(reqs[i].data);
+    }
+    nb_reqs = 0;
+    nb_subs = 0;
+    printf("%s: %s ok\n", TEST, what);
+}
+
+/* 32 adjacent requests of 8 sectors in a scrambled order */
+static void check_merge(int is_write)
+{
+    static uint8_t expected[32][8];
+    VirtIOBlockReq *rd[32];
+    VirtIOBlockBatch batch;
+    int i, j;
+
+    virtio_blk_batch_init(&batch);
+    for (i = 0; i < 32; i++) {
+        j = i * 7 % 32;
+        if (is_write)
+            add_write(&batch, 256 + j * 8, 8, 10 + j);
+        else
+            rd[j] = add_read(&batch, 256 + j * 8, 8, expected[j]);
+    }
+    virtio_blk_batch_submit(&batch);
+
+    for (i = 0; i < nb_subs; i++) {
+        if (subs[i].sector_num != 256 + i * VIRTIO_BLK_MERGE_MAX_SECTORS ||
+            subs[i].nb_sectors != VIRTIO_BLK_MERGE_MAX_SECTORS)
+            block_test_fail(TEST, "submission %d: %d sectors at %" PRId64,
+                            i, subs[i].nb_sectors, subs[i].sector_num);
+    }
+    if (!is_write) {
+        for (i = 0; i < 32; i++)
+            check_read(rd[i], expected[i]);
+    }
+    finish_kick(is_write ? "merged writes" : "merged reads",
+                32 * 8 / VIRTIO_BLK_MERGE_MAX_SECTORS);
+}
+
+/* overlapping requests in one kick run in the guest's order */
+static void check_overlap(void)
+{
+    static uint8_t expected[4][16];
+    VirtIOBlockReq *rd[4];
+    VirtIOBlockBatch batch;
+    int i;
+
+    virtio_blk_batch_init(&batch);
+    add_write(&batch, 8, 8, 2);
+    /* sorted by sector this one would go first */
+    add_write(&batch, 0, 16, 3);
+    rd[0] = add_read(&batch, 0, 16, expected[0]);
+    /* must not reach the image before the read above */
+    add_write(&batch, 4, 4, 4);
+    rd[1] = add_read(&batch, 0, 16, expected[1]);
+    rd[2] = add_read(&batch, 100, 8, expected[2]);
+    /* overlaps nothing, so these still merge with the earlier ones */
+    add_write(&batch, 16, 8, 5);
+    rd[3] = add_read(&batch, 108, 8, expected[3]);
+    virtio_blk_batch_submit(&batch);
+
+    for (i = 0; i < 4; i++)
+        check_read(rd[i], expected[i]);
+    /* one submission per conflict, the last two reads merged */
+    finish_kick("overlapping requests", 7);
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = block_test_tmpname("raw");
+
+    bdrv_init();
+    if (bdrv_create(bdrv_find_format("raw"), filename, IMAGE_SECTORS,
+                    NULL, 0) < 0)
+        block_test_fail(TEST, "cannot create %s", filename);
+    bs = bdrv_new("");
+    if (bdrv_open2(bs, filename, BDRV_O_RDWR, bdrv_find_format("raw")) < 0)
+        block_test_fail(TEST, "cannot open %s", filename);
+
+    check_merge(1);
+    check_merge(0);
+    check_overlap();
+
+    bdrv_delete(bs);
+    unlink(filename);
+    qemu_free(filename);
+    printf("%s: ok\n", TEST);
+    return 0;
+}
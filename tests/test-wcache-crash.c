@@ -0,0 +1,329 @@
+/*
+ * Write-back cache crash consistency test
+ *
+ * A child process writes to a raw image through the write-back cache,
+ * with several requests in flight and a flush now and then, and logs
+ * every write it submits, every completion and every flush.  It is
+ * killed with SIGKILL at a random point.  The image must then hold, in
+ * every sector, either zeroes or a whole sector of a write that was
+ * submitted there, and nothing older than the writes that completed
+ * before the last flush that completed was submitted.
+ *
+ * A write to an otherwise idle drive must also reach the image on its
+ * own, within two write-back epochs.
+ *
+ * usage: test-wcache-crash [rounds]    (default: 10)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "block-test.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#define TEST            "wcache-crash"
+#define IMAGE_SECTORS   (16 * 2048)
+#define CACHE_KB        512
+#define QUEUE_DEPTH     8
+#define MAX_SECTORS     32
+/* one write in LARGE_ONE bypasses the cache, being over a quarter of it */
+#define LARGE_ONE       50
+#define LARGE_SECTORS   600
+/* two epochs of the cache, and some slack */
+#define IDLE_MS         12000
+
+enum {
+    LOG_WRITE,                  /* submitted */
+    LOG_DONE,                   /* completed */
+    LOG_FLUSH,                  /* flush submitted */
+    LOG_FLUSHED,                /* flush completed */
+};
+
+typedef struct LogRecord {
+    uint32_t type;
+    uint32_t nb_sectors;
+    uint64_t seq;               /* write or flush number */
+    int64_t sector_num;
+} LogRecord;
+
+static char *image;
+static char *logname;
+static int logfd;
+
+static void log_record(int type, uint64_t seq, int64_t sector_num,
+                       int nb_sectors)
+{
+    LogRecord r;
+
+    r.type = type;
+    r.nb_sectors = nb_sectors;
+    r.seq = seq;
+    r.sector_num = sector_num;
+    if (write(logfd, &r, sizeof(r)) != sizeof(r))
+        _exit(2);
+}
+
+static void write_cb(void *opaque, int ret)
+{
+    BlockTestWrite *w = opaque;
+
+    if (ret < 0)
+        _exit(2);
+    log_record(LOG_DONE, w->seq, w->sector_num, w->nb_sectors);
+    w->live = 0;
+}
+
+static int flush_pending;
+
+static void flush_cb(void *opaque, int ret)
+{
+    if (ret < 0)
+        _exit(2);
+    log_record(LOG_FLUSHED, (unsigned long)opaque, 0, 0);
+    flush_pending = 0;
+}
+
+/* never returns, the parent kills it */
+static void writer(unsigned int seed)
+{
+    BlockDriverState *bs = bdrv_new("");
+    BlockTestWrite ws[QUEUE_DEPTH];
+    uint64_t seq = 0, flushes = 0;
+    int i, j;
+
+    if (bdrv_open2(bs, image, BDRV_O_RDWR, bdrv_find_format("raw")) < 0 ||
+        bdrv_set_writecache(bs, CACHE_KB) < 0)
+        _exit(2);
+    memset(ws, 0, sizeof(ws));
+
+    for (;;) {
+        for (i = 0; i < QUEUE_DEPTH; i++) {
+            BlockTestWrite *w = &ws[i];
+            int n = rand_r(&seed) % LARGE_ONE ? 1 + rand_r(&seed) % MAX_SECTORS
+                                              : LARGE_SECTORS;
+            int64_t s;
+
+            if (w->live)
+                continue;
+            /* half of the writes go to a small area, so that they overlap
+               data that is still cached */
+            do {
+                if (rand_r(&seed) % 2)
+                    s = rand_r(&seed) % (2048 - MIN(n, 1024));
+                else
+                    s = rand_r(&seed) % (IMAGE_SECTORS - n);
+            } while (block_test_overlaps_live(ws, QUEUE_DEPTH, s, n));
+
+            w->sector_num = s;
+            w->nb_sectors = n;
+            w->seq = ++seq;
+            qemu_vfree(w->buf);
+            w->buf = qemu_memalign(512, n * 512);
+            for (j = 0; j < n; j++)
+                block_test_fill(w->buf + j * 512, s + j, w->seq);
+            log_record(LOG_WRITE, w->seq, s, n);
+            w->live = 1;
+            if (!bdrv_aio_write(bs, s, w->buf, n, write_cb, w))
+                _exit(2);
+        }
+        if (!flush_pending && rand_r(&seed) % 10 == 0) {
+            flush_pending = 1;
+            log_record(LOG_FLUSH, ++flushes, 0, 0);
+            if (!bdrv_aio_flush(bs, flush_cb, (void *)(unsigned long)flushes))
+                _exit(2);
+        }
+        block_test_poll(0);
+    }
+}
+
+static void idle_cb(void *opaque, int ret)
+{
+    BlockTestWrite *w = opaque;
+
+    if (ret < 0)
+        block_test_fail(TEST, "idle write failed: %d", ret);
+    w->live = 0;
+}
+
+/* nothing uses the drive after the write, the cache must age by itself */
+static void test_idle(void)
+{
+    BlockDriverState *bs = bdrv_new("");
+    uint8_t *buf = qemu_memalign(512, 512);
+    uint8_t ref[512];
+    int64_t start, end;
+    BlockTestWrite w;
+    int done = 0, fd;
+
+    unlink(image);
+    if (bdrv_create(bdrv_find_format("raw"), image, IMAGE_SECTORS,
+                    NULL, 0) < 0 ||
+        bdrv_open2(bs, image, BDRV_O_RDWR, bdrv_find_format("raw")) < 0 ||
+        bdrv_set_writecache(bs, CACHE_KB) < 0)
+        block_test_fail(TEST, "cannot set up %s", image);
+    fd = open(image, O_RDONLY);
+    if (fd < 0)
+        block_test_fail(TEST, "cannot open %s", image);
+
+    block_test_fill(ref, 100, 1);
+    memcpy(buf, ref, 512);
+    w.live = 1;
+    if (!bdrv_aio_write(bs, 100, buf, 1, idle_cb, &w))
+        block_test_fail(TEST, "aio submission failed");
+    while (w.live)
+        block_test_poll(-1);
+
+    start = block_test_now_us();
+    end = start + IDLE_MS * 1000LL;
+    while (!done && block_test_now_us() < end) {
+        block_test_poll(100);
+        done = pread(fd, buf, 512, 100 * 512) == 512 && !memcmp(buf, ref, 512);
+    }
+    if (!done)
+        block_test_fail(TEST, "idle write not written back after %d ms",
+                        IDLE_MS);
+    printf("%s: idle write written back after %" PRId64 " ms\n", TEST,
+           (block_test_now_us() - start) / 1000);
+
+    close(fd);
+    bdrv_delete(bs);
+    qemu_vfree(buf);
+}
+
+static LogRecord *read_log(int *nb_records)
+{
+    struct stat st;
+    LogRecord *log;
+    int fd = open(logname, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+        block_test_fail(TEST, "cannot open %s", logname);
+    log = qemu_malloc(st.st_size + 1);
+    if (read(fd, log, st.st_size) != st.st_size)
+        block_test_fail(TEST, "cannot read %s", logname);
+    close(fd);
+    *nb_records = st.st_size / sizeof(LogRecord);
+    return log;
+}
+
+static void check(int round)
+{
+    BlockDriverState *bs = bdrv_new("");
+    LogRecord *log, *r, **writes;
+    uint64_t *expect, last_flush = 0, nb_writes = 0, seq;
+    int64_t i, newer = 0;
+    int nb_records, guaranteed, k;
+    uint8_t *buf, *ref;
+
+    log = read_log(&nb_records);
+    for (k = 0; k < nb_records; k++) {
+        if (log[k].type == LOG_FLUSHED)
+            last_flush = log[k].seq;
+        if (log[k].type == LOG_WRITE)
+            nb_writes = log[k].seq;
+    }
+
+    /* the writes that completed before the last completed flush was
+       submitted must be on disk, unless overwritten by a later one */
+    writes = qemu_mallocz((nb_writes + 1) * sizeof(*writes));
+    expect = qemu_mallocz(IMAGE_SECTORS * sizeof(*expect));
+    guaranteed = last_flush != 0;
+    for (k = 0; k < nb_records; k++) {
+        r = &log[k];
+        if (r->type == LOG_WRITE)
+            writes[r->seq] = r;
+        else if (r->type == LOG_FLUSH && r->seq == last_flush)
+            guaranteed = 0;
+        else if (r->type == LOG_DONE && guaranteed)
+            for (i = r->sector_num; i < r->sector_num + r->nb_sectors; i++)
+                expect[i] = MAX(expect[i], r->seq);
+    }
+
+    if (bdrv_open2(bs, image, 0, bdrv_find_format("raw")) < 0)
+        block_test_fail(TEST, "cannot open %s", image);
+    buf = qemu_memalign(512, 512);
+    ref = qemu_memalign(512, 512);
+    for (i = 0; i < IMAGE_SECTORS; i++) {
+        if (bdrv_read(bs, i, buf, 1) < 0)
+            block_test_fail(TEST, "cannot read %s", image);
+        seq = ((uint64_t *)buf)[1];
+        if (seq == 0) {
+            memset(ref, 0, 512);
+        } else {
+            r = seq <= nb_writes ? writes[seq] : NULL;
+            if (!r || i < r->sector_num || i >= r->sector_num + r->nb_sectors)
+                block_test_fail(TEST, "round %d: sector %" PRId64
+                                " holds a write that was never submitted there",
+                                round, i);
+            block_test_fill(ref, i, seq);
+        }
+        if (memcmp(buf, ref, 512))
+            block_test_fail(TEST, "round %d: sector %" PRId64 " is torn",
+                            round, i);
+        if (seq < expect[i])
+            block_test_fail(TEST, "round %d: sector %" PRId64 " holds write %"
+                            PRIu64 ", flushed write %" PRIu64 " was lost",
+                            round, i, seq, expect[i]);
+        if (seq > expect[i])
+            newer++;
+    }
+    printf("%s: round %d: %" PRIu64 " writes, %" PRIu64 " flushes,"
+           " %" PRId64 " sectors newer than the last flush\n",
+           TEST, round, nb_writes, last_flush, newer);
+
+    bdrv_delete(bs);
+    qemu_vfree(buf);
+    qemu_vfree(ref);
+    qemu_free(expect);
+    qemu_free(writes);
+    qemu_free(log);
+}
+
+static void cleanup(void)
+{
+    unlink(image);
+    unlink(logname);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+    unsigned int seed = getpid();
+    int round, status;
+    pid_t pid;
+
+    bdrv_init();
+    image = block_test_tmpname("wcache-image");
+    logname = block_test_tmpname("wcache-log");
+    atexit(cleanup);
+
+    test_idle();
+    for (round = 0; round < rounds; round++) {
+        unlink(image);
+        if (bdrv_create(bdrv_find_format("raw"), image, IMAGE_SECTORS,
+                        NULL, 0) < 0)
+            block_test_fail(TEST, "cannot create %s", image);
+        logfd = open(logname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (logfd < 0)
+            block_test_fail(TEST, "cannot create %s", logname);
+
+        pid = fork();
+        if (pid < 0)
+            block_test_fail(TEST, "fork: %s", strerror(errno));
+        if (pid == 0)
+            writer(seed + round);
+        close(logfd);
+
+        usleep(50000 + rand_r(&seed) % 250000);
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        if (!WIFSIGNALED(status))
+            block_test_fail(TEST, "round %d: the writer failed", round);
+
+        check(round);
+    }
+    printf("%s: ok\n", TEST);
+    return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * The part of virtio-blk that hw/virtio-blk-batch.h needs, for the merge
+ * test and benchmark.  hw/virtio-blk.h itself pulls in the PCI and
+ * virtqueue code of the device model.
+ *
+ * The includer defines virtio_blk_submit(), which must complete the
+ * request and every request chained to it through merged.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef VIRTIO_BLK_REQ_H
+#define VIRTIO_BLK_REQ_H
+
+#include "block-test.h"
+
+/* from hw/virtio-blk.h and hw/virtio-blk.c */
+#define VIRTIO_BLK_QUEUE_SIZE   128
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+
+struct virtio_blk_outhdr
+{
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+};
+
+typedef struct VirtIOBlockReq
+{
+    struct virtio_blk_outhdr *out;
+    size_t size;
+    QEMUIOVector qiov;
+    struct VirtIOBlockReq *merged;
+    int seq;
+    /* what the device model keeps in the guest's buffers */
+    struct virtio_blk_outhdr hdr;
+    uint8_t *data;
+    int done;
+} VirtIOBlockReq;
+
+#include "hw/virtio-blk-batch.h"
+
+#endif
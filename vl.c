@@ -35,6 +35,7 @@
 #include "sysemu.h"
 #include "gdbstub.h"
 #include "qemu-timer.h"
+#include "qemu-timer-int.h"
 #include "qemu-char.h"
 #include "cache-utils.h"
 #include "block.h"
@@ -237,6 +238,9 @@ int rtc_td_hack = 0;
 int usb_enabled = 0;
 int smp_cpus = 1;
 const char *vnc_display;
+#ifndef _WIN32
+static const char *shm_display;
+#endif
 int acpi_enabled = 1;
 int no_hpet = 0;
 int fd_bootchk = 1;
@@ -871,22 +875,6 @@ void cpu_disable_ticks(void)
 /***********************************************************/
 /* timers */
 
-#define QEMU_TIMER_REALTIME 0
-#define QEMU_TIMER_VIRTUAL  1
-
-struct QEMUClock {
-    int type;
-    /* XXX: add frequency */
-};
-
-struct QEMUTimer {
-    QEMUClock *clock;
-    int64_t expire_time;
-    QEMUTimerCB *cb;
-    void *opaque;
-    struct QEMUTimer *next;
-};
-
 struct qemu_alarm_timer {
     char const *name;
     unsigned int flags;
@@ -1103,105 +1091,16 @@ next:
     }
 }
 
-QEMUClock *rt_clock;
-QEMUClock *vm_clock;
-
-static QEMUTimer *active_timers[2];
-
-static QEMUClock *qemu_new_clock(int type)
-{
-    QEMUClock *clock;
-    clock = qemu_mallocz(sizeof(QEMUClock));
-    clock->type = type;
-    return clock;
-}
-
-QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
-{
-    QEMUTimer *ts;
-
-    ts = qemu_mallocz(sizeof(QEMUTimer));
-    ts->clock = clock;
-    ts->cb = cb;
-    ts->opaque = opaque;
-    return ts;
-}
-
-void qemu_free_timer(QEMUTimer *ts)
-{
-    qemu_free(ts);
-}
-
-/* stop a timer, but do not dealloc it */
-void qemu_del_timer(QEMUTimer *ts)
+void qemu_timer_first_changed(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
-    }
-}
-
-void qemu_advance_timer(QEMUTimer *ts, int64_t expire_time)
-{
-    if (ts->expire_time > expire_time)
-       qemu_mod_timer(ts, expire_time);
-}
-
-/* modify the current timer so that it will be fired when current_time
-   >= expire_time. The corresponding callback will be called. */
-void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
-{
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
-
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time)
-            break;
-        pt = &t->next;
-    }
-    ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
-
     /* Rearm if necessary  */
-    if (pt == &active_timers[ts->clock->type]) {
-        if ((alarm_timer->flags & ALARM_FLAG_EXPIRED) == 0) {
-            qemu_rearm_alarm_timer(alarm_timer);
-        }
-        /* Interrupt execution to force deadline recalculation.  */
-        if (use_icount && cpu_single_env) {
-            cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
-        }
+    if ((alarm_timer->flags & ALARM_FLAG_EXPIRED) == 0) {
+        qemu_rearm_alarm_timer(alarm_timer);
     }
-}
-
-int qemu_timer_pending(QEMUTimer *ts)
-{
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
+    /* Interrupt execution to force deadline recalculation.  */
+    if (use_icount && cpu_single_env) {
+        cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
     }
-    return 0;
 }
 
 static inline int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -1211,23 +1110,6 @@ static inline int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time
     return (timer_head->expire_time <= current_time);
 }
 
-static void qemu_run_timers(QEMUTimer **ptimer_head, int64_t current_time)
-{
-    QEMUTimer *ts;
-
-    for(;;) {
-        ts = *ptimer_head;
-        if (!ts || ts->expire_time > current_time)
-            break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
-
-        /* run the callback (the timer list can be modified) */
-        ts->cb(ts->opaque);
-    }
-}
-
 int64_t qemu_get_clock(QEMUClock *clock)
 {
     switch(clock->type) {
@@ -1360,11 +1242,14 @@ static void host_alarm_handler(int host_signum)
         last_clock = ti;
     }
 #endif
-    if (alarm_has_dynticks(alarm_timer) ||
+    /* The heaps may be half way through a change when the signal comes,
+       so only look at them when they are not.  Otherwise take the timers
+       as expired and let the main loop sort it out. */
+    if (alarm_has_dynticks(alarm_timer) || qemu_timers_busy ||
         (!use_icount &&
-            qemu_timer_expired(active_timers[QEMU_TIMER_VIRTUAL],
+            qemu_timer_expired(qemu_first_timer(QEMU_TIMER_VIRTUAL),
                                qemu_get_clock(vm_clock))) ||
-        qemu_timer_expired(active_timers[QEMU_TIMER_REALTIME],
+        qemu_timer_expired(qemu_first_timer(QEMU_TIMER_REALTIME),
                            qemu_get_clock(rt_clock))) {
         CPUState *env = next_cpu;
 
@@ -1390,24 +1275,6 @@ static void host_alarm_handler(int host_signum)
     }
 }
 
-static int64_t qemu_next_deadline(void)
-{
-    int64_t delta;
-
-    if (active_timers[QEMU_TIMER_VIRTUAL]) {
-        delta = active_timers[QEMU_TIMER_VIRTUAL]->expire_time -
-                     qemu_get_clock(vm_clock);
-    } else {
-        /* To avoid problems with overflow limit this to 2^32.  */
-        delta = INT32_MAX;
-    }
-
-    if (delta < 0)
-        delta = 0;
-
-    return delta;
-}
-
 #if defined(__linux__) || defined(_WIN32)
 static uint64_t qemu_next_deadline_dyntick(void)
 {
@@ -1419,8 +1286,8 @@ static uint64_t qemu_next_deadline_dyntick(void)
     else
         delta = (qemu_next_deadline() + 999) / 1000;
 
-    if (active_timers[QEMU_TIMER_REALTIME]) {
-        rtdelta = (active_timers[QEMU_TIMER_REALTIME]->expire_time -
+    if (qemu_first_timer(QEMU_TIMER_REALTIME)) {
+        rtdelta = (qemu_first_timer(QEMU_TIMER_REALTIME)->expire_time -
                  qemu_get_clock(rt_clock))*1000;
         if (rtdelta < delta)
             delta = rtdelta;
@@ -1599,8 +1466,8 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     int64_t nearest_delta_us = INT64_MAX;
     int64_t current_us;
 
-    if (!active_timers[QEMU_TIMER_REALTIME] &&
-                !active_timers[QEMU_TIMER_VIRTUAL])
+    if (!qemu_first_timer(QEMU_TIMER_REALTIME) &&
+                !qemu_first_timer(QEMU_TIMER_VIRTUAL))
         return;
 
     nearest_delta_us = qemu_next_deadline_dyntick();
@@ -1745,8 +1612,8 @@ static void win32_rearm_timer(struct qemu_alarm_timer *t)
     struct qemu_alarm_win32 *data = t->priv;
     uint64_t nearest_delta_us;
 
-    if (!active_timers[QEMU_TIMER_REALTIME] &&
-                !active_timers[QEMU_TIMER_VIRTUAL])
+    if (!qemu_first_timer(QEMU_TIMER_REALTIME) &&
+                !qemu_first_timer(QEMU_TIMER_VIRTUAL))
         return;
 
     nearest_delta_us = qemu_next_deadline_dyntick();
@@ -2324,13 +2191,15 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
     int index;
     int cache;
     int bdrv_flags, onerror;
+    int readahead, writecache, chunkcache;
     int drives_table_idx;
     char *str = arg->opt;
     static const char * const params[] = { "bus", "unit", "if", "index",
                                            "cyls", "heads", "secs", "trans",
                                            "media", "snapshot", "file",
                                            "cache", "format", "serial", "werror",
-                                           NULL };
+                                           "readahead", "writecache",
+                                           "chunkcache", NULL };
 
     if (check_params(buf, sizeof(buf), params, str) < 0) {
          fprintf(stderr, "qemu: unknown parameter '%s' in '%s'\n",
@@ -2498,6 +2367,42 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
         }
     }
 
+    readahead = 0;
+    if (get_param_value(buf, sizeof(buf), "readahead", str)) {
+        char *p;
+        readahead = strtol(buf, &p, 0);
+        if (*p != '\0' || readahead < 0) {
+            fprintf(stderr, "qemu: '%s' invalid readahead size\n", str);
+            return -1;
+        }
+    }
+
+    writecache = 0;
+    if (get_param_value(buf, sizeof(buf), "writecache", str)) {
+        char *p;
+        writecache = strtol(buf, &p, 0);
+        if (*p != '\0' || writecache < 0) {
+            fprintf(stderr, "qemu: '%s' invalid writecache size\n", str);
+            return -1;
+        }
+        /* the guest can only flush the cache through ide and scsi */
+        if (writecache && type != IF_IDE && type != IF_SCSI) {
+            fprintf(stderr, "qemu: '%s' writecache needs if=ide or if=scsi\n",
+                    str);
+            return -1;
+        }
+    }
+
+    chunkcache = 0;
+    if (get_param_value(buf, sizeof(buf), "chunkcache", str)) {
+        char *p;
+        chunkcache = strtol(buf, &p, 0);
+        if (*p != '\0' || chunkcache < 0) {
+            fprintf(stderr, "qemu: '%s' invalid chunkcache size\n", str);
+            return -1;
+        }
+    }
+
     if (get_param_value(buf, sizeof(buf), "format", str)) {
        if (strcmp(buf, "?") == 0) {
             fprintf(stderr, "qemu: Supported formats:");
@@ -2657,6 +2562,27 @@ int drive_init(struct drive_opt *arg, int snapshot, void *opaque)
                         file);
         return -1;
     }
+    if (readahead && bdrv_set_readahead(bdrv, readahead) < 0) {
+        fprintf(stderr, "qemu: readahead size %d KB is too small\n",
+                readahead);
+        return -1;
+    }
+    if (writecache) {
+        int ret = bdrv_set_writecache(bdrv, writecache);
+        if (ret == -ENOTSUP) {
+            fprintf(stderr, "qemu: '%s' does not support writecache\n",
+                    file);
+            return -1;
+        } else if (ret < 0) {
+            fprintf(stderr, "qemu: writecache size %d KB is too small\n",
+                    writecache);
+            return -1;
+        }
+    }
+    if (chunkcache && bdrv_set_chunk_cache(bdrv, chunkcache) < 0) {
+        fprintf(stderr, "qemu: '%s' does not support chunkcache\n", file);
+        return -1;
+    }
     if (bdrv_key_required(bdrv))
         autostart = 0;
     return drives_table_idx;
@@ -2942,74 +2868,6 @@ static void dumb_display_init(void)
     register_displaystate(ds);
 }
 
-/***********************************************************/
-/* I/O handling */
-
-#define MAX_IO_HANDLERS 64
-
-typedef struct IOHandlerRecord {
-    int fd;
-    IOCanRWHandler *fd_read_poll;
-    IOHandler *fd_read;
-    IOHandler *fd_write;
-    int deleted;
-    void *opaque;
-    /* temporary data */
-    struct pollfd *ufd;
-    struct IOHandlerRecord *next;
-} IOHandlerRecord;
-
-static IOHandlerRecord *first_io_handler;
-
-/* XXX: fd_read_poll should be suppressed, but an API change is
-   necessary in the character devices to suppress fd_can_read(). */
-int qemu_set_fd_handler2(int fd,
-                         IOCanRWHandler *fd_read_poll,
-                         IOHandler *fd_read,
-                         IOHandler *fd_write,
-                         void *opaque)
-{
-    IOHandlerRecord **pioh, *ioh;
-
-    if (!fd_read && !fd_write) {
-        pioh = &first_io_handler;
-        for(;;) {
-            ioh = *pioh;
-            if (ioh == NULL)
-                break;
-            if (ioh->fd == fd) {
-                ioh->deleted = 1;
-                break;
-            }
-            pioh = &ioh->next;
-        }
-    } else {
-        for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-            if (ioh->fd == fd)
-                goto found;
-        }
-        ioh = qemu_mallocz(sizeof(IOHandlerRecord));
-        ioh->next = first_io_handler;
-        first_io_handler = ioh;
-    found:
-        ioh->fd = fd;
-        ioh->fd_read_poll = fd_read_poll;
-        ioh->fd_read = fd_read;
-        ioh->fd_write = fd_write;
-        ioh->opaque = opaque;
-        ioh->deleted = 0;
-    }
-    return 0;
-}
-
-int qemu_set_fd_handler(int fd,
-                        IOHandler *fd_read,
-                        IOHandler *fd_write,
-                        void *opaque)
-{
-    return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
-}
-
 #ifdef _WIN32
 /***********************************************************/
 /* Polling handling */
@@ -3480,7 +3338,8 @@ static void qemu_bh_update_timeout(int *timeout)
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
                  * every 10ms */
-                *timeout = MIN(10, *timeout);
+                if (*timeout < 0 || *timeout > 10)
+                    *timeout = 10;
             } else {
                 /* non-idle bottom halves will be executed
                  * immediately */
@@ -3734,16 +3593,20 @@ static void host_main_loop_wait(int *timeout)
 }
 #endif
 
-void main_loop_wait(int timeout)
+/* main_loop_wait() statistics, see "info wakeups" */
+static uint64_t wakeups, wakeups_spurious;
+
+void do_info_wakeups(void)
+{
+    term_printf("wakeups: %" PRIu64 " total, %" PRIu64 " spurious\n",
+                wakeups, wakeups_spurious);
+}
+
+static int main_loop_select(int timeout)
 {
-    IOHandlerRecord *ioh;
     fd_set rfds, wfds, xfds;
     int ret, nfds;
-    struct timeval tv;
-
-    qemu_bh_update_timeout(&timeout);
-
-    host_main_loop_wait(&timeout);
+    struct timeval tv, *tvp;
 
     /* poll any events */
     /* XXX: separate device handlers from system ones */
@@ -3751,55 +3614,23 @@ void main_loop_wait(int timeout)
     FD_ZERO(&rfds);
     FD_ZERO(&wfds);
     FD_ZERO(&xfds);
-    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-        if (ioh->deleted)
-            continue;
-        if (ioh->fd_read &&
-            (!ioh->fd_read_poll ||
-             ioh->fd_read_poll(ioh->opaque) != 0)) {
-            FD_SET(ioh->fd, &rfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-        if (ioh->fd_write) {
-            FD_SET(ioh->fd, &wfds);
-            if (ioh->fd > nfds)
-                nfds = ioh->fd;
-        }
-    }
+    qemu_iohandler_fill(&nfds, &rfds, &wfds);
 
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout % 1000) * 1000;
+    if (timeout < 0) {
+        tvp = NULL;
+    } else {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
 
 #if defined(CONFIG_SLIRP)
     if (slirp_is_inited()) {
         slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
     }
 #endif
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
-    if (ret > 0) {
-        IOHandlerRecord **pioh;
-
-        for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
-            if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, &rfds)) {
-                ioh->fd_read(ioh->opaque);
-            }
-            if (!ioh->deleted && ioh->fd_write && FD_ISSET(ioh->fd, &wfds)) {
-                ioh->fd_write(ioh->opaque);
-            }
-        }
-
-	/* remove deleted IO handlers */
-	pioh = &first_io_handler;
-	while (*pioh) {
-            ioh = *pioh;
-            if (ioh->deleted) {
-                *pioh = ioh->next;
-                qemu_free(ioh);
-            } else
-                pioh = &ioh->next;
-        }
-    }
+    ret = select(nfds + 1, &rfds, &wfds, &xfds, tvp);
+    qemu_iohandler_poll(&rfds, &wfds, ret);
 #if defined(CONFIG_SLIRP)
     if (slirp_is_inited()) {
         if (ret < 0) {
@@ -3811,19 +3642,42 @@ void main_loop_wait(int timeout)
     }
 #endif
 
+    return ret > 0;
+}
+
+/* A negative timeout waits until an I/O handler becomes ready. */
+void main_loop_wait(int timeout)
+{
+    int work = -1;
+
+    qemu_bh_update_timeout(&timeout);
+
+    host_main_loop_wait(&timeout);
+
+#if defined(CONFIG_SLIRP)
+    if (!slirp_is_inited())
+#endif
+        work = qemu_iohandler_epoll(timeout);
+    /* select() fallback, also taken if epoll gave up on an fd above */
+    if (work < 0)
+        work = main_loop_select(timeout);
+
     /* vm time timers */
     if (vm_running && likely(!(cur_cpu->singlestep_enabled & SSTEP_NOTIMER)))
-        qemu_run_timers(&active_timers[QEMU_TIMER_VIRTUAL],
-                        qemu_get_clock(vm_clock));
+        work += qemu_run_timers(&active_timers[QEMU_TIMER_VIRTUAL],
+                                qemu_get_clock(vm_clock));
 
     /* real time timers */
-    qemu_run_timers(&active_timers[QEMU_TIMER_REALTIME],
-                    qemu_get_clock(rt_clock));
+    work += qemu_run_timers(&active_timers[QEMU_TIMER_REALTIME],
+                            qemu_get_clock(rt_clock));
 
     /* Check bottom-halves last in case any of the earlier events triggered
        them.  */
-    qemu_bh_poll();
+    work += qemu_bh_poll();
 
+    wakeups++;
+    if (!work)
+        wakeups_spurious++;
 }
 
 #ifndef CONFIG_DM
@@ -4004,6 +3858,7 @@ static void help(int exitcode)
 	   "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
            "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
            "       [,cache=writethrough|writeback|none][,format=f][,serial=s]\n"
+           "       [,readahead=kb][,writecache=kb][,chunkcache=kb]\n"
 	   "                use 'file' as a drive image\n"
            "-mtdblock file  use 'file' as on-board Flash memory image\n"
            "-sd file        use 'file' as SecureDigital card image\n"
@@ -4180,6 +4035,11 @@ static void help(int exitcode)
 	   "-direct-pci s   specify pci passthrough, with configuration string s\n"
            "-pciemulation       name:vendorid:deviceid:command:status:revision:classcode:headertype:subvendorid:subsystemid:interruputline:interruputpin\n"
            "-vncunused      bind the VNC server to an unused port\n"
+#ifndef _WIN32
+           "-shmdisplay name\n"
+           "                export the display in shared memory object\n"
+           "                '/qemu-display-name' for local viewers\n"
+#endif
            "-std-vga        alias for -vga std\n"
 	   "\n"
            "During emulation, the following keys are useful:\n"
@@ -4271,6 +4131,7 @@ enum {
     QEMU_OPTION_direct_pci,
     QEMU_OPTION_pci_emulation,
     QEMU_OPTION_vncunused,
+    QEMU_OPTION_shmdisplay,
     QEMU_OPTION_videoram,
     QEMU_OPTION_std_vga,
     QEMU_OPTION_domid,
@@ -4449,6 +4310,9 @@ static const QEMUOption qemu_options[] = {
     { "direct_pci", HAS_ARG, QEMU_OPTION_direct_pci },
     { "pciemulation", HAS_ARG, QEMU_OPTION_pci_emulation },
     { "vncunused", 0, QEMU_OPTION_vncunused },
+#ifndef _WIN32
+    { "shmdisplay", HAS_ARG, QEMU_OPTION_shmdisplay },
+#endif
     { "vcpus", HAS_ARG, QEMU_OPTION_vcpus },
 #if defined(CONFIG_XEN) && !defined(CONFIG_DM)
     { "xen-domid", HAS_ARG, QEMU_OPTION_xen_domid },
@@ -5296,6 +5160,11 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_vncunused:
                 vncunused = 1;
                 break;
+#ifndef _WIN32
+            case QEMU_OPTION_shmdisplay:
+                shm_display = optarg;
+                break;
+#endif
 #if defined(CONFIG_XEN) && !defined(CONFIG_DM)
             case QEMU_OPTION_xen_domid:
                 xen_domid = domid = atoi(optarg);
@@ -5886,6 +5755,12 @@ int main(int argc, char **argv, char **envp)
             } else
 #endif
             {
+#ifndef _WIN32
+                /* register first so that the surface is allocated in the
+                   shared object rather than copied into it */
+                if (shm_display != NULL && shm_display_init(ds, shm_display) < 0)
+                    exit(1);
+#endif
                 if (vnc_display != NULL || vncunused != 0) {
 		    int vnc_display_port;
 		    char password[20];
@@ -5913,6 +5788,8 @@ int main(int argc, char **argv, char **envp)
         if (dcl->dpy_refresh != NULL) {
             ds->gui_timer = qemu_new_timer(rt_clock, gui_update, ds);
             qemu_mod_timer(ds->gui_timer, qemu_get_clock(rt_clock));
+            /* gui_update refreshes every listener */
+            break;
         }
         dcl = dcl->next;
     }
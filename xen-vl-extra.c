@@ -37,6 +37,8 @@ void do_savevm(const char *name)
     
     /* ??? Should this occur after vm_stop?  */
     qemu_aio_flush();
+    /* the restored guest must not depend on our write-back caches */
+    bdrv_flush_all();
 
     saved_vm_running = vm_running;
     vm_stop(0);
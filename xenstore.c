@@ -19,6 +19,7 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <assert.h>
 
@@ -37,6 +38,24 @@ static QEMUTimer *insert_timer = NULL;
 #define UWAIT_MAX (30*1000000) /* thirty seconds */
 #define UWAIT     (100000)     /* 1/10th second  */
 
+/* Startup is dominated by xenstore round trips, log where the time goes */
+static int64_t xenstore_time_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void xenstore_time_phase(const char *phase, int64_t *start)
+{
+    int64_t now = xenstore_time_us();
+
+    fprintf(logfile, "xenstore: %s took %" PRId64 " us\n",
+            phase, now - *start);
+    *start = now;
+}
+
 static int pasprintf(char **buf, const char *fmt, ...)
 {
     va_list ap;
@@ -146,6 +165,16 @@ static int drive_name_to_index(const char *name) {
     return ret;
 }
 
+/* The backend domain does not change, so only ask xenstored for it once */
+static const char *xenstore_backend_dompath(void)
+{
+    static char *backend_dompath;
+
+    if (!backend_dompath)
+        backend_dompath = xs_get_domain_path(xsh, domid_backend);
+    return backend_dompath;
+}
+
 static void xenstore_get_backend_path(char **backend, const char *devtype,
 				      const char *frontend_dompath,
 				      int frontend_domid,
@@ -156,7 +185,7 @@ static void xenstore_get_backend_path(char **backend, const char *devtype,
      */
     char *bpath=0;
     char *frontend_path=0;
-    char *backend_dompath=0;
+    const char *backend_dompath;
     char *expected_backend=0;
     char *frontend_backend_path=0;
     char *backend_frontend_path=0;
@@ -188,7 +217,7 @@ static void xenstore_get_backend_path(char **backend, const char *devtype,
      * by this frontend, since the frontend's /backend xenstore node
      * is writeable by the untrustworthy guest. */
 
-    backend_dompath = xs_get_domain_path(xsh, domid_backend);
+    backend_dompath = xenstore_backend_dompath();
     if (!backend_dompath) goto out;
     
     const char *expected_devtypes[3];
@@ -240,7 +269,6 @@ static void xenstore_get_backend_path(char **backend, const char *devtype,
  out:
     free(bpath);
     free(frontend_path);
-    free(backend_dompath);
     free(expected_backend);
     free(frontend_backend_path);
     free(backend_frontend_path);
@@ -317,6 +345,10 @@ void xenstore_parse_domain_config(int hvm_domid)
     unsigned int len, num, hd_index, pci_devid = 0;
     BlockDriverState *bs;
     BlockDriver *format;
+    /* backend path and device name of each vbd, shared by both passes */
+    char **vbd_bpath = NULL, **vbd_dev = NULL;
+    unsigned int nr_vbds = 0;
+    int64_t start, phase;
 
     /* paths controlled by untrustworthy guest, and values read from them */
     char *danger_path;
@@ -326,6 +358,8 @@ void xenstore_parse_domain_config(int hvm_domid)
     for(i = 0; i < MAX_DRIVES + 1; i++)
         media_filename[i] = NULL;
 
+    start = phase = xenstore_time_us();
+
     xenstore_get_guest_uuid();
 
     xsh = xs_daemon_open();
@@ -347,37 +381,33 @@ void xenstore_parse_domain_config(int hvm_domid)
     if (e_danger == NULL)
         num = 0;
 
+    nr_vbds = num;
+    vbd_bpath = qemu_mallocz(nr_vbds * sizeof(char *));
+    vbd_dev = qemu_mallocz(nr_vbds * sizeof(char *));
+
     for (i = 0; i < num; i++) {
         /* read the backend path */
-        xenstore_get_backend_path(&bpath, "vbd", danger_path, hvm_domid,
-				  e_danger[i]);
-        if (bpath == NULL)
+        xenstore_get_backend_path(&vbd_bpath[i], "vbd", danger_path,
+                                  hvm_domid, e_danger[i]);
+        if (vbd_bpath[i] == NULL)
             continue;    
         /* read the name of the device */
-        if (pasprintf(&buf, "%s/dev", bpath) == -1)
+        if (pasprintf(&buf, "%s/dev", vbd_bpath[i]) == -1)
             continue;
-        free(dev);
-        dev = xs_read(xsh, XBT_NULL, buf, &len);
-        if (dev == NULL)
+        vbd_dev[i] = xs_read(xsh, XBT_NULL, buf, &len);
+        if (vbd_dev[i] == NULL)
             continue;
-        if (!strncmp(dev, "hd", 2)) {
+        if (!strncmp(vbd_dev[i], "hd", 2))
             any_hdN = 1;
-            break;
-        }
     }
+    xenstore_time_phase("vbd lookup", &phase);
         
     for (i = 0; i < num; i++) {
 	format = NULL; /* don't know what the format is yet */
-        /* read the backend path */
-        xenstore_get_backend_path(&bpath, "vbd", danger_path, hvm_domid, e_danger[i]);
-        if (bpath == NULL)
-            continue;
-        /* read the name of the device */
-        if (pasprintf(&buf, "%s/dev", bpath) == -1)
-            continue;
-        free(dev);
-        dev = xs_read(xsh, XBT_NULL, buf, &len);
-        if (dev == NULL)
+        /* backend path and device name were read by the first pass */
+        bpath = vbd_bpath[i];
+        dev = vbd_dev[i];
+        if (bpath == NULL || dev == NULL)
             continue;
 	if (nb_drives >= MAX_DRIVES) {
 	    fprintf(stderr, "qemu: too many drives, skipping `%s'\n", dev);
@@ -504,11 +534,44 @@ void xenstore_parse_domain_config(int hvm_domid)
                 fprintf(stderr, "qemu: could not open vbd '%s' or hard disk image '%s' (drv '%s' format '%s')\n", buf, params, drv ? drv : "?", format ? format->format_name : "0");
         }
 
+        /* optional read-ahead cache size in KB, set by the toolstack */
+        if (pasprintf(&buf, "%s/readahead", bpath) != -1) {
+            char *readahead = xs_read(xsh, XBT_NULL, buf, &len);
+            if (readahead) {
+                if (bdrv_set_readahead(bs, atoi(readahead)) < 0)
+                    fprintf(stderr, "qemu: invalid readahead size '%s' for vbd '%s'\n", readahead, buf);
+                free(readahead);
+            }
+        }
+
+        /* optional write-back cache size in KB, set by the toolstack */
+        if (pasprintf(&buf, "%s/writecache", bpath) != -1) {
+            char *writecache = xs_read(xsh, XBT_NULL, buf, &len);
+            if (writecache) {
+                if (bdrv_set_writecache(bs, atoi(writecache)) < 0)
+                    fprintf(stderr, "qemu: cannot use writecache size '%s' for vbd '%s'\n", writecache, buf);
+                free(writecache);
+            }
+        }
+
+        /* optional decompressed chunk cache size in KB, for cloop and dmg */
+        if (pasprintf(&buf, "%s/chunkcache", bpath) != -1) {
+            char *chunkcache = xs_read(xsh, XBT_NULL, buf, &len);
+            if (chunkcache) {
+                if (bdrv_set_chunk_cache(bs, atoi(chunkcache)) < 0)
+                    fprintf(stderr, "qemu: cannot use chunkcache size '%s' for vbd '%s'\n", chunkcache, buf);
+                free(chunkcache);
+            }
+        }
+
 	drives_table[nb_drives].bdrv = bs;
 	drives_table[nb_drives].used = 1;
 	nb_drives++;
 
     }
+    /* both are owned by vbd_bpath and vbd_dev */
+    bpath = dev = NULL;
+    xenstore_time_phase("vbd open", &phase);
 
 #ifdef CONFIG_STUBDOM
     if (pasprintf(&danger_buf, "%s/device/vkbd", danger_path) == -1)
@@ -538,6 +601,7 @@ void xenstore_parse_domain_config(int hvm_domid)
             xenfb_connect_vfb(danger_buf);
         }
     }
+    xenstore_time_phase("vkbd/vfb connect", &phase);
 #endif
 
 
@@ -646,6 +710,16 @@ void xenstore_parse_domain_config(int hvm_domid)
     }
 
  out:
+    xenstore_time_phase("watches and pci", &phase);
+    fprintf(logfile, "xenstore: domain config parsed in %" PRId64 " us\n",
+            phase - start);
+
+    for (i = 0; i < nr_vbds; i++) {
+        free(vbd_bpath[i]);
+        free(vbd_dev[i]);
+    }
+    qemu_free(vbd_bpath);
+    qemu_free(vbd_dev);
     free(danger_type);
     free(params);
     free(dev);